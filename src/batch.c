@@ -0,0 +1,413 @@
+#define _GNU_SOURCE // for environ
+#include "batch.h"
+#include "bench.h"
+#include "cgroup.h"
+#include "container.h"
+#include "ipc.h"
+#include "logging.h"
+#include "util.h"
+#include "networking/netns_pool.h"
+
+#include <sys/mman.h>
+
+// Longest manifest line, and most arguments on one
+#define BATCH_LINE_MAX 4096
+#define BATCH_ARGS_MAX 256
+
+// A command of the manifest, i.e. a line of it. `args` holds the line's
+// words, and image and argv point into it.
+struct batch_job
+{
+    int line;
+    char *image;
+    char **argv;
+    struct cgroup_limits limits;
+    char *args[BATCH_ARGS_MAX + 1];
+};
+
+// Shared by the workers, which take jobs in order from `next`
+struct batch_shared
+{
+    uint64_t next;
+    uint64_t failed;
+};
+
+struct batch_s
+{
+    struct batch_job *jobs;
+    size_t count;
+    struct batch_shared *shared;
+    int results_fd;
+    int null_fd; // the jobs' stdin
+};
+
+// A job's container, set up ahead of running it
+struct batch_run
+{
+    struct container_proc proc;
+    int64_t job;     // -1 once there are no jobs left
+    int ready;       // whether the container was set up
+    uint64_t setup_ns;
+};
+
+// Splits a line into words at spaces and tabs, in place. A word may be in
+// single or double quotes, so it can have spaces in it. Returns the number of
+// words, or -1 if there are too many or a quote isn't closed.
+static int split_words(char *line, char **words)
+{
+    int count = 0;
+    char *p = line;
+
+    for (;;)
+    {
+        while (*p == ' ' || *p == '\t')
+        {
+            p++;
+        }
+        if (*p == '\0' || *p == '\n')
+        {
+            break;
+        }
+        if (count == BATCH_ARGS_MAX)
+        {
+            return -1;
+        }
+
+        char quote = (*p == '"' || *p == '\'') ? *p++ : '\0';
+        words[count++] = p;
+        while (*p != '\0' && *p != '\n' && (quote ? *p != quote : (*p != ' ' && *p != '\t')))
+        {
+            p++;
+        }
+        if (quote != '\0' && *p != quote)
+        {
+            return -1;
+        }
+        if (*p == '\0')
+        {
+            break;
+        }
+        *p++ = '\0';
+    }
+
+    words[count] = NULL;
+    return count;
+}
+
+// Parses a manifest line, i.e. "--memory 64m busybox /bin/echo hi", which
+// takes the same options as `mocker run`. Prints why and returns -1 if it
+// isn't valid.
+static int parse_job(struct batch_job *job, char *line, const char *manifest)
+{
+    int count = split_words(line, job->args);
+    if (count == -1)
+    {
+        fprintf(stderr, "%s:%d: Too many words, or an unclosed quote\n", manifest, job->line);
+        return -1;
+    }
+
+    cgroup_limits_init(&job->limits);
+    int i = 0;
+    while (i < count && strncmp(job->args[i], "--", 2) == 0)
+    {
+        // i.e. --memory 64m or --memory=64m
+        char *flag = job->args[i++] + 2;
+        char *value = strchr(flag, '=');
+        if (value != NULL)
+        {
+            *value++ = '\0';
+        }
+        else if (i < count)
+        {
+            value = job->args[i++];
+        }
+
+        if (value == NULL || cgroup_parse_limit(&job->limits, flag, value) != 0)
+        {
+            fprintf(stderr, "%s:%d: Invalid option --%s\n", manifest, job->line, flag);
+            return -1;
+        }
+    }
+
+    if (count - i < 2 || cgroup_check_limits(&job->limits) != 0)
+    {
+        fprintf(stderr, "%s:%d: Expected [options] <image> <command> [args...]\n", manifest, job->line);
+        return -1;
+    }
+
+    // Only the daemon watches pressure
+    if (cgroup_watches_pressure(&job->limits))
+    {
+        fprintf(stderr, "%s:%d: --pressure-* and --on-pressure only work under the daemon\n", manifest,
+                job->line);
+        return -1;
+    }
+
+    job->image = job->args[i];
+    job->argv = &job->args[i + 1];
+    return 0;
+}
+
+// Reads the manifest: a job per line, with blank lines and lines starting
+// with # left out
+static struct batch_job *read_manifest(const char *manifest, size_t *count)
+{
+    char line[BATCH_LINE_MAX];
+    size_t capacity = 0;
+    struct batch_job *jobs = NULL;
+    int number = 0;
+
+    FILE *f = fopen(manifest, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", manifest, strerror(errno));
+        return NULL;
+    }
+
+    *count = 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        number++;
+
+        char *start = line + strspn(line, " \t");
+        if (*start == '\n' || *start == '\0' || *start == '#')
+        {
+            continue;
+        }
+
+        if (*count == capacity)
+        {
+            capacity = capacity > 0 ? capacity * 2 : 64;
+            struct batch_job *grown = realloc(jobs, capacity * sizeof(*jobs));
+            if (grown == NULL)
+            {
+                handle_error("realloc");
+            }
+            jobs = grown;
+        }
+
+        // the words point into the line, so each job keeps its own copy
+        struct batch_job *job = &jobs[*count];
+        char *copy = strdup(start);
+        job->line = number;
+        if (copy == NULL || parse_job(job, copy, manifest) != 0)
+        {
+            fclose(f);
+            return NULL;
+        }
+        (*count)++;
+    }
+
+    fclose(f);
+    if (*count == 0)
+    {
+        fprintf(stderr, "No jobs in %s\n", manifest);
+        return NULL;
+    }
+
+    return jobs;
+}
+
+// Takes the next job and sets up its container, with the job's limits
+static void prepare(struct batch_s *batch, struct batch_run *run)
+{
+    run->job = __atomic_fetch_add(&batch->shared->next, 1, __ATOMIC_RELAXED);
+    if ((size_t)run->job >= batch->count)
+    {
+        run->job = -1;
+        return;
+    }
+
+    struct batch_job *job = &batch->jobs[run->job];
+    uint64_t start = bench_now();
+    run->ready = container_start(&run->proc, job->image, &job->limits, NULL) == 0;
+    run->setup_ns = bench_now() - start;
+}
+
+// Appends the job's result to the results file, as one write so the
+// workers' lines don't mix, i.e.
+// {"job":3,"line":5,"id":"3f2a...","exit_code":0,"duration_us":1520,...}
+static void report(struct batch_s *batch, const struct batch_run *run, int status, uint64_t duration_ns,
+                   uint64_t memory_peak)
+{
+    const struct batch_job *job = &batch->jobs[run->job];
+    const struct rusage *rusage = &run->proc.rusage;
+    char line[512];
+    int len;
+
+    if (!run->ready || status == -1)
+    {
+        __atomic_fetch_add(&batch->shared->failed, 1, __ATOMIC_RELAXED);
+        len = snprintf(line, sizeof(line), "{\"job\":%lld,\"line\":%d,\"error\":\"%s\",\"setup_us\":%llu}\n",
+                       (long long)run->job, job->line, run->ready ? "exec failed" : "setup failed",
+                       (unsigned long long)(run->setup_ns / 1000));
+    }
+    else
+    {
+        // as a shell reports it, 128 plus the signal for a killed command
+        int exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        if (exit_code != 0)
+        {
+            __atomic_fetch_add(&batch->shared->failed, 1, __ATOMIC_RELAXED);
+        }
+
+        len = snprintf(line, sizeof(line),
+                       "{\"job\":%lld,\"line\":%d,\"id\":\"%s\",\"exit_code\":%d,\"duration_us\":%llu,"
+                       "\"setup_us\":%llu,\"memory_peak\":%llu,\"user_us\":%lld,\"system_us\":%lld}\n",
+                       (long long)run->job, job->line, run->proc.container.id, exit_code,
+                       (unsigned long long)(duration_ns / 1000), (unsigned long long)(run->setup_ns / 1000),
+                       (unsigned long long)memory_peak,
+                       (long long)rusage->ru_utime.tv_sec * 1000000 + rusage->ru_utime.tv_usec,
+                       (long long)rusage->ru_stime.tv_sec * 1000000 + rusage->ru_stime.tv_usec);
+    }
+
+    if (write(batch->results_fd, line, len) != len)
+    {
+        LOG("[BATCH] Failed to write the result of job %lld: %s\n", (long long)run->job, strerror(errno));
+    }
+}
+
+// Runs jobs until there are none left. The next job's container is set up
+// while the current one runs, so its root, cgroup and network are ready by
+// the time the current job exits, and this process never drops its NAT
+// reference in between.
+static void worker(struct batch_s *batch)
+{
+    struct batch_run runs[2];
+    struct batch_run *run = &runs[0];
+    struct batch_run *next = &runs[1];
+    const int stdio[IPC_MAX_FDS] = {batch->null_fd, STDOUT_FILENO, STDERR_FILENO};
+
+    prepare(batch, run);
+    while (run->job != -1)
+    {
+        const struct batch_job *job = &batch->jobs[run->job];
+        if (!run->ready)
+        {
+            report(batch, run, -1, 0, 0);
+            prepare(batch, run);
+            continue;
+        }
+
+        uint64_t start = bench_now();
+        int started = container_exec(&run->proc, job->argv, environ, stdio) == 0;
+        if (!started)
+        {
+            container_stop(&run->proc);
+        }
+
+        prepare(batch, next);
+
+        int status = -1;
+        uint64_t duration_ns = 0;
+        uint64_t memory_peak = 0;
+        siginfo_t info;
+        if (started)
+        {
+            // Wait for the exit without reaping, so the cgroup can still be
+            // read before `container_wait()` removes it
+            waitid(P_PID, run->proc.pid, &info, WEXITED | WNOWAIT);
+            duration_ns = bench_now() - start;
+            memory_peak = cgroup_memory_peak(run->proc.container.cgroup_fd);
+            status = container_wait(&run->proc);
+
+            // without memory.peak, the peak of the job's init
+            if (memory_peak == 0)
+            {
+                memory_peak = (uint64_t)run->proc.rusage.ru_maxrss * 1024;
+            }
+        }
+        report(batch, run, status, duration_ns, memory_peak);
+
+        struct batch_run *done = run;
+        run = next;
+        next = done;
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+// Runs every command of the manifest in a container of its own, on up to
+// `workers` at a time (0 for one per CPU we may use), and writes a line of
+// JSON per job to `output` ("-" for stdout) as each one finishes
+// i.e. mocker batch [--workers n] [--output file] <manifest>
+int run_batch(const char *manifest, int workers, const char *output)
+{
+    struct batch_s batch;
+
+    batch.jobs = read_manifest(manifest, &batch.count);
+    if (batch.jobs == NULL)
+    {
+        return -1;
+    }
+
+    if (workers <= 0)
+    {
+        workers = cgroup_cpu_count();
+    }
+    if ((size_t)workers > batch.count)
+    {
+        workers = batch.count;
+    }
+
+    batch.shared = mmap(NULL, sizeof(*batch.shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (batch.shared == MAP_FAILED)
+    {
+        handle_error("mmap");
+    }
+    memset(batch.shared, 0, sizeof(*batch.shared));
+
+    batch.results_fd = strcmp(output, "-") == 0
+                           ? dup(STDOUT_FILENO)
+                           : open(output, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    batch.null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (batch.results_fd == -1 || batch.null_fd == -1)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", output, strerror(errno));
+        return -1;
+    }
+
+    // Every worker has a job running and the next one set up, each in a
+    // pooled network namespace that goes back to the pool when it exits
+    int pool_target = netns_pool_reserve(2 * workers);
+    if (pool_target == -1)
+    {
+        LOG("[BATCH] Failed to fill the network namespace pool, containers get their own\n");
+    }
+
+    LOG("[BATCH] Running %zu jobs on %d workers\n", batch.count, workers);
+    uint64_t start = bench_now();
+    for (int i = 0; i < workers; i++)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            worker(&batch);
+        }
+        else if (pid == -1)
+        {
+            LOG("[BATCH] Failed to fork worker: %s\n", strerror(errno));
+        }
+    }
+
+    while (wait(NULL) != -1 || errno == EINTR)
+    {
+    }
+
+    double seconds = (double)(bench_now() - start) / 1e9;
+    uint64_t done = batch.shared->next < batch.count ? batch.shared->next : batch.count;
+    uint64_t failed = batch.shared->failed;
+    printf("%llu jobs (%llu failed) on %d workers in %.2f s, %.1f jobs/s\n", (unsigned long long)done,
+           (unsigned long long)failed, workers, seconds, seconds > 0 ? done / seconds : 0.0);
+
+    // the pool goes back to the size it was set to
+    if (pool_target != -1)
+    {
+        netns_pool_release(pool_target);
+    }
+
+    close(batch.results_fd);
+    close(batch.null_fd);
+    munmap(batch.shared, sizeof(*batch.shared));
+    return failed == 0 ? 0 : -1;
+}
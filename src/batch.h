@@ -0,0 +1,11 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include "common.h"
+
+// Where `mocker batch` writes a line of JSON per job, unless told otherwise
+#define BATCH_RESULTS "batch.jsonl"
+
+int run_batch(const char *manifest, int workers, const char *output);
+
+#endif
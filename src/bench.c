@@ -0,0 +1,206 @@
+#include "bench.h"
+#include "container.h"
+#include "logging.h"
+#include "util.h"
+
+#include <sys/mman.h>
+
+#define BENCH_CSV "bench.csv"
+#define BENCH_JSON "bench.json"
+
+// A phase a run didn't get to, i.e. cleanup after a failed setup
+#define UNRECORDED UINT64_MAX
+
+static const char *phase_names[PHASE_COUNT] = {
+    [PHASE_CLONE] = "clone",
+    [PHASE_CGROUP] = "setup_cgroup",
+    [PHASE_ROOTFS] = "mount_container_root",
+    [PHASE_CHILD_ROOTFS] = "setup_container_root",
+    [PHASE_NETWORK] = "setup_networking",
+    [PHASE_EXEC] = "execvp",
+    [PHASE_CLEANUP_NETWORK] = "cleanup_networking",
+    [PHASE_CLEANUP_ROOTFS] = "cleanup_container_root",
+    [PHASE_CLEANUP_CGROUP] = "cleanup_cgroup",
+    [PHASE_TOTAL] = "total",
+};
+
+uint64_t bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of an already sorted array, UNRECORDED if it's empty
+static uint64_t percentile(const uint64_t *sorted, int n, int p)
+{
+    if (n == 0)
+        return UNRECORDED;
+
+    int rank = (p * n + 99) / 100;
+    if (rank < 1)
+        rank = 1;
+    return sorted[rank - 1];
+}
+
+static double to_us(uint64_t ns)
+{
+    return (double)ns / 1000.0;
+}
+
+// Writes a duration in µs, or `missing` for one that wasn't recorded
+static void print_us(FILE *f, const char *format, uint64_t ns, const char *missing)
+{
+    if (ns == UNRECORDED)
+    {
+        fprintf(f, "%s", missing);
+    }
+    else
+    {
+        fprintf(f, format, to_us(ns));
+    }
+}
+
+static int write_csv(uint64_t *samples, int runs)
+{
+    FILE *f = fopen(BENCH_CSV, "w");
+    if (f == NULL)
+    {
+        LOG("[BENCH] Failed to open %s: %s\n", BENCH_CSV, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "run");
+    for (int p = 0; p < PHASE_COUNT; p++)
+    {
+        fprintf(f, ",%s_us", phase_names[p]);
+    }
+    fprintf(f, "\n");
+
+    for (int r = 0; r < runs; r++)
+    {
+        fprintf(f, "%d", r);
+        for (int p = 0; p < PHASE_COUNT; p++)
+        {
+            print_us(f, ",%.1f", samples[r * PHASE_COUNT + p], ",");
+        }
+        fprintf(f, "\n");
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static int write_json(uint64_t summary[PHASE_COUNT][4], int runs)
+{
+    FILE *f = fopen(BENCH_JSON, "w");
+    if (f == NULL)
+    {
+        LOG("[BENCH] Failed to open %s: %s\n", BENCH_JSON, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "{\n  \"runs\": %d,\n  \"unit\": \"us\",\n  \"phases\": {\n", runs);
+    for (int p = 0; p < PHASE_COUNT; p++)
+    {
+        fprintf(f, "    \"%s\": {", phase_names[p]);
+        print_us(f, "\"p50\": %.1f", summary[p][0], "\"p50\": null");
+        print_us(f, ", \"p95\": %.1f", summary[p][1], ", \"p95\": null");
+        print_us(f, ", \"p99\": %.1f", summary[p][2], ", \"p99\": null");
+        print_us(f, ", \"mean\": %.1f", summary[p][3], ", \"mean\": null");
+        fprintf(f, "}%s\n", p == PHASE_COUNT - 1 ? "" : ",");
+    }
+    fprintf(f, "  }\n}\n");
+
+    fclose(f);
+    return 0;
+}
+
+// Launches `runs` containers back to back and reports p50/p95/p99 latency for
+// every phase, both on stdout and as CSV (per run) and JSON (summary). A phase
+// a run didn't get to is left out of its statistics rather than counted as 0.
+int run_bench(int runs, const char *image, char **cmd)
+{
+    // The child records its own phases, so the timings must survive the clone
+    struct phase_timings *timings = mmap(NULL, sizeof(*timings), PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (timings == MAP_FAILED)
+    {
+        handle_error("mmap");
+    }
+
+    uint64_t *samples = malloc((size_t)runs * PHASE_COUNT * sizeof(uint64_t));
+    uint64_t *sorted = calloc(runs, sizeof(uint64_t));
+    if (samples == NULL || sorted == NULL)
+    {
+        handle_error("calloc");
+    }
+
+    for (int r = 0; r < runs; r++)
+    {
+        memset(timings, 0, sizeof(*timings));
+        int status = run_container(image, cmd, NULL, timings);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            LOG("[BENCH] Run %d: container did not exit cleanly (status %d)\n", r, status);
+        }
+
+        for (int p = 0; p < PHASE_COUNT; p++)
+        {
+            samples[r * PHASE_COUNT + p] = UNRECORDED;
+            if (timings->start[p] != 0 && timings->end[p] > timings->start[p])
+            {
+                samples[r * PHASE_COUNT + p] = timings->end[p] - timings->start[p];
+            }
+        }
+    }
+
+    // p50, p95, p99, mean
+    uint64_t summary[PHASE_COUNT][4];
+    printf("%-24s %12s %12s %12s %12s\n", "phase (us)", "p50", "p95", "p99", "mean");
+    for (int p = 0; p < PHASE_COUNT; p++)
+    {
+        uint64_t total = 0;
+        int recorded = 0;
+        for (int r = 0; r < runs; r++)
+        {
+            if (samples[r * PHASE_COUNT + p] != UNRECORDED)
+            {
+                sorted[recorded] = samples[r * PHASE_COUNT + p];
+                total += sorted[recorded++];
+            }
+        }
+        qsort(sorted, recorded, sizeof(uint64_t), compare_u64);
+
+        summary[p][0] = percentile(sorted, recorded, 50);
+        summary[p][1] = percentile(sorted, recorded, 95);
+        summary[p][2] = percentile(sorted, recorded, 99);
+        summary[p][3] = recorded > 0 ? total / recorded : UNRECORDED;
+
+        printf("%-24s", phase_names[p]);
+        for (int i = 0; i < 4; i++)
+        {
+            print_us(stdout, " %12.1f", summary[p][i], "            -");
+        }
+        printf("\n");
+    }
+
+    int ret = 0;
+    if (write_csv(samples, runs) != 0 || write_json(summary, runs) != 0)
+    {
+        fprintf(stderr, "Failed to write benchmark results\n");
+        ret = 1;
+    }
+
+    free(sorted);
+    free(samples);
+    munmap(timings, sizeof(*timings));
+    return ret;
+}
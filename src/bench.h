@@ -0,0 +1,48 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include "common.h"
+
+// Phases of a container's lifecycle that we time. The order matches the
+// order they run in `run_container()`.
+enum bench_phase
+{
+    PHASE_CLONE,
+    PHASE_CGROUP,
+    PHASE_ROOTFS,
+    PHASE_CHILD_ROOTFS,
+    PHASE_NETWORK,
+    PHASE_EXEC,
+    PHASE_CLEANUP_NETWORK,
+    PHASE_CLEANUP_ROOTFS,
+    PHASE_CLEANUP_CGROUP,
+    PHASE_TOTAL,
+    PHASE_COUNT,
+};
+
+// Start/end timestamps (CLOCK_MONOTONIC, ns) for each phase. Lives in a
+// shared mapping so the child can record the phases it runs itself.
+struct phase_timings
+{
+    uint64_t start[PHASE_COUNT];
+    uint64_t end[PHASE_COUNT];
+};
+
+#define BENCH_START(t, phase)                   \
+    do                                          \
+    {                                           \
+        if ((t) != NULL)                        \
+            (t)->start[(phase)] = bench_now();  \
+    } while (0)
+
+#define BENCH_END(t, phase)                     \
+    do                                          \
+    {                                           \
+        if ((t) != NULL)                        \
+            (t)->end[(phase)] = bench_now();    \
+    } while (0)
+
+uint64_t bench_now(void);
+int run_bench(int runs, const char *image, char **cmd);
+
+#endif
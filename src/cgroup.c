@@ -1,85 +1,1318 @@
+#define _GNU_SOURCE // for CPU_COUNT
 #include "cgroup.h"
+#include "container.h"
 #include "logging.h"
+#include "placement.h"
 
-#define MEMORY_LIMIT (1024 * 1024 * 1024)
-#define CPU_LIMIT 100000
+#include <sys/sysmacros.h>
 
-// private data structure
-struct cgroup_config_s
+// What a container gets without flags: 1 GiB of memory and one CPU's worth
+// of time. Either is left out when the containers share a budget for it, see
+// `setup_cgroup()`.
+#define MEMORY_LIMIT (1024ULL * 1024 * 1024)
+#define CPU_PERIOD 100000
+#define DEFAULT_MEMORY 0x1
+#define DEFAULT_CPU 0x2
+
+// Bounds the kernel puts on cpu.max and cpu.weight
+#define CPU_QUOTA_MIN 1000
+#define CPU_PERIOD_MIN 1000
+#define CPU_PERIOD_MAX 1000000
+#define CPU_WEIGHT_MIN 1
+#define CPU_WEIGHT_MAX 10000
+#define IO_WEIGHT_MIN 1
+#define IO_WEIGHT_MAX 10000
+
+// Bounds the kernel puts on PSI trigger windows, in µs, and the window we use
+// without --pressure-window
+#define PRESSURE_WINDOW_MIN 500000
+#define PRESSURE_WINDOW_MAX 10000000
+#define PRESSURE_WINDOW 1000000
+
+// How much `cgroup_raise_memory_high()` raises memory.high by, in percent
+#define MEMORY_HIGH_STEP 25
+
+// Huge page size without --hugepage-size, the smallest on x86
+#define HUGEPAGE_SIZE (2ULL * 1024 * 1024)
+
+// Largest CPU or memory node number in a cpuset list
+#define CPUSET_ID_MAX 65535
+
+// Largest number a limit other than "max" can be
+#define LIMIT_MAX (CGROUP_MAX - 1)
+
+enum limit_kind
 {
-    int memory_limit;
-    int cpu_limit;
-    pid_t child_pid;
-    const char *cgroup;
+    LIMIT_SIZE,   // bytes, with an optional k, m, g or t suffix, or "max"
+    LIMIT_COUNT,  // a number, or "max"
+    LIMIT_RANGE,  // a number between `min` and `max`
+    LIMIT_CPUSET, // a list of CPUs or memory nodes, i.e. 0-3,8
+    LIMIT_DEVICE, // a path on the disk to limit, or the disk's device node
+    LIMIT_NAME,   // a cgroup name of letters, digits, '-' and '_'
+    LIMIT_CHOICE, // one of the flag's `choices`, by index
 };
 
-// private global variable for cgroup config
-struct cgroup_config_s cgroup_config = {
-    .memory_limit = MEMORY_LIMIT,
-    .cpu_limit = CPU_LIMIT,
-    .child_pid = -1,
-    .cgroup = NULL,
+// The --on-pressure values, by enum pressure_action
+static const char *const pressure_actions[] = {
+    [PRESSURE_EVENT] = "event",
+    [PRESSURE_RAISE_HIGH] = "raise-memory-high",
+    [PRESSURE_FREEZE] = "freeze",
+    NULL,
 };
 
-int setup_cgroup(pid_t child_pid)
+// The --thp values, by enum thp_mode
+static const char *const thp_modes[] = {
+    [THP_SYSTEM] = "system",
+    [THP_NEVER] = "never",
+    [THP_MADVISE] = "madvise",
+    NULL,
+};
+
+// The --smt values, by enum smt_mode
+static const char *const smt_modes[] = {
+    [SMT_SHARED] = "shared",
+    [SMT_EXCLUSIVE] = "exclusive",
+    NULL,
+};
+
+// The `mocker run` flags, and the field of `struct cgroup_limits` they set
+static const struct limit_flag
 {
-    LOG("[CGROUP] Setting up cgroup\n");
-    cgroup_config.child_pid = child_pid;
-    cgroup_config.cgroup = "/sys/fs/cgroup/mocker";
-    FILE *f = NULL;
+    const char *flag;
+    enum limit_kind kind;
+    size_t offset;
+    uint64_t min;
+    uint64_t max;
+    const char *const *choices; // for LIMIT_CHOICE, NULL-terminated
+} limit_flags[] = {
+    {"cpu-quota", LIMIT_COUNT, offsetof(struct cgroup_limits, cpu_quota), CPU_QUOTA_MIN, LIMIT_MAX},
+    {"cpu-period", LIMIT_RANGE, offsetof(struct cgroup_limits, cpu_period), CPU_PERIOD_MIN, CPU_PERIOD_MAX},
+    {"cpu-weight", LIMIT_RANGE, offsetof(struct cgroup_limits, cpu_weight), CPU_WEIGHT_MIN, CPU_WEIGHT_MAX},
+    {"cpuset-cpus", LIMIT_CPUSET, offsetof(struct cgroup_limits, cpuset_cpus), 0, 0},
+    {"cpuset-mems", LIMIT_CPUSET, offsetof(struct cgroup_limits, cpuset_mems), 0, 0},
+    {"memory", LIMIT_SIZE, offsetof(struct cgroup_limits, memory_max), 1, LIMIT_MAX},
+    {"memory-high", LIMIT_SIZE, offsetof(struct cgroup_limits, memory_high), 1, LIMIT_MAX},
+    {"memory-swap", LIMIT_SIZE, offsetof(struct cgroup_limits, memory_swap_max), 0, LIMIT_MAX},
+    {"pids", LIMIT_COUNT, offsetof(struct cgroup_limits, pids_max), 1, LIMIT_MAX},
+    {"io-device", LIMIT_DEVICE, offsetof(struct cgroup_limits, io_major), 0, 0},
+    {"io-rbps", LIMIT_SIZE, offsetof(struct cgroup_limits, io_rbps), 1, LIMIT_MAX},
+    {"io-wbps", LIMIT_SIZE, offsetof(struct cgroup_limits, io_wbps), 1, LIMIT_MAX},
+    {"io-riops", LIMIT_COUNT, offsetof(struct cgroup_limits, io_riops), 1, LIMIT_MAX},
+    {"io-wiops", LIMIT_COUNT, offsetof(struct cgroup_limits, io_wiops), 1, LIMIT_MAX},
+    {"io-weight", LIMIT_RANGE, offsetof(struct cgroup_limits, io_weight), IO_WEIGHT_MIN, IO_WEIGHT_MAX},
+    {"io-latency", LIMIT_COUNT, offsetof(struct cgroup_limits, io_latency), 1, LIMIT_MAX},
+    {"tenant", LIMIT_NAME, offsetof(struct cgroup_limits, tenant), 0, 0},
+    {"pressure-cpu", LIMIT_RANGE, offsetof(struct cgroup_limits, pressure_cpu), 1, PRESSURE_WINDOW_MAX},
+    {"pressure-memory", LIMIT_RANGE, offsetof(struct cgroup_limits, pressure_memory), 1, PRESSURE_WINDOW_MAX},
+    {"pressure-io", LIMIT_RANGE, offsetof(struct cgroup_limits, pressure_io), 1, PRESSURE_WINDOW_MAX},
+    {"pressure-window", LIMIT_RANGE, offsetof(struct cgroup_limits, pressure_window), PRESSURE_WINDOW_MIN,
+     PRESSURE_WINDOW_MAX},
+    {"on-pressure", LIMIT_CHOICE, offsetof(struct cgroup_limits, pressure_action), 0, 0, pressure_actions},
+    {"hugepages", LIMIT_SIZE, offsetof(struct cgroup_limits, hugetlb_max), 0, LIMIT_MAX},
+    {"hugepage-size", LIMIT_SIZE, offsetof(struct cgroup_limits, hugetlb_page_size), 1, LIMIT_MAX},
+    {"thp", LIMIT_CHOICE, offsetof(struct cgroup_limits, thp), 0, 0, thp_modes},
+    {"place", LIMIT_RANGE, offsetof(struct cgroup_limits, place_cpus), 1, PLACEMENT_MAX_CPUS},
+    {"smt", LIMIT_CHOICE, offsetof(struct cgroup_limits, place_smt), 0, 0, smt_modes},
+};
 
-    LOG("[CGROUP] Creating cgroup\n");
-    if (mkdir(cgroup_config.cgroup, 0755) == -1)
+void cgroup_limits_init(struct cgroup_limits *limits)
+{
+    memset(limits, 0, sizeof(*limits));
+    limits->cpu_quota = CGROUP_UNSET;
+    limits->cpu_period = CGROUP_UNSET;
+    limits->cpu_weight = CGROUP_UNSET;
+    limits->memory_max = CGROUP_UNSET;
+    limits->memory_high = CGROUP_UNSET;
+    limits->memory_swap_max = CGROUP_UNSET;
+    limits->pids_max = CGROUP_UNSET;
+    limits->io_rbps = CGROUP_UNSET;
+    limits->io_wbps = CGROUP_UNSET;
+    limits->io_riops = CGROUP_UNSET;
+    limits->io_wiops = CGROUP_UNSET;
+    limits->io_weight = CGROUP_UNSET;
+    limits->io_latency = CGROUP_UNSET;
+    limits->pressure_cpu = CGROUP_UNSET;
+    limits->pressure_memory = CGROUP_UNSET;
+    limits->pressure_io = CGROUP_UNSET;
+    limits->pressure_window = PRESSURE_WINDOW;
+    limits->pressure_action = PRESSURE_EVENT;
+    limits->hugetlb_max = CGROUP_UNSET;
+    limits->hugetlb_page_size = HUGEPAGE_SIZE;
+    limits->thp = THP_SYSTEM;
+    limits->place_cpus = CGROUP_UNSET;
+    limits->place_smt = SMT_SHARED;
+}
+
+// Parses a decimal number, and with `suffixes` a k, m, g or t after it that
+// multiplies it by powers of 1024
+static int parse_number(const char *value, int suffixes, uint64_t *number)
+{
+    char *end;
+
+    // strtoull() would take "-1" as a huge number
+    if (*value < '0' || *value > '9')
+    {
+        return -1;
+    }
+
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    if (errno != 0)
     {
-        LOG("[CGROUP] Failed to create cgroup: %s\n", strerror(errno));
         return -1;
     }
 
-    LOG("[CGROUP] Memory limit: %d\n", cgroup_config.memory_limit);
-    LOG("[CGROUP] CPU limit: %d\n", cgroup_config.cpu_limit);
+    int shift = 0;
+    if (suffixes && *end != '\0' && end[1] == '\0')
+    {
+        const char *units = "kmgt";
+        const char *unit = strchr(units, *end | 0x20);
+        if (unit == NULL)
+        {
+            return -1;
+        }
+        shift = 10 * (unit - units + 1);
+        end++;
+    }
 
-    char cg_memory[256];
-    snprintf(cg_memory, sizeof(cg_memory), "%s/memory.max", cgroup_config.cgroup);
-    f = fopen(cg_memory, "w");
-    if (f == NULL)
+    if (*end != '\0' || (shift > 0 && n > (UINT64_MAX >> shift)))
     {
-        LOG("[CGROUP] Failed to open memory.max: %s\n", strerror(errno));
         return -1;
     }
 
-    fprintf(f, "%d", cgroup_config.memory_limit);
-    fclose(f);
+    *number = (uint64_t)n << shift;
+    return 0;
+}
 
-    char cg_cpu[256];
-    snprintf(cg_cpu, sizeof(cg_cpu), "%s/cpu.max", cgroup_config.cgroup);
-    f = fopen(cg_cpu, "w");
-    if (f == NULL)
+// Checks a cpuset list, i.e. comma separated numbers and ranges like 0-3,8
+static int valid_cpuset(const char *value)
+{
+    const char *p = value;
+
+    if (strlen(value) >= CGROUP_CPUSET_MAX)
+    {
+        return 0;
+    }
+
+    do
+    {
+        char *end;
+        if (*p < '0' || *p > '9')
+        {
+            return 0;
+        }
+
+        unsigned long first = strtoul(p, &end, 10);
+        unsigned long last = first;
+        if (*end == '-')
+        {
+            p = end + 1;
+            if (*p < '0' || *p > '9')
+            {
+                return 0;
+            }
+            last = strtoul(p, &end, 10);
+        }
+
+        if (first > last || last > CPUSET_ID_MAX || (*end != ',' && *end != '\0'))
+        {
+            return 0;
+        }
+        p = end;
+    } while (*p++ == ',');
+
+    return 1;
+}
+
+// Checks a tenant name, which names its cgroup under CGROUP_SLICE next to
+// the containers' mocker-<id> ones
+static int valid_name(const char *value)
+{
+    size_t len = strlen(value);
+
+    if (len == 0 || len >= CGROUP_TENANT_MAX || strncmp(value, "mocker-", 7) == 0)
+    {
+        return 0;
+    }
+
+    return strspn(value, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_") == len;
+}
+
+// Finds the disk that `path` is on, or that `path` is the device node of.
+// io.max and io.latency only take whole disks, so a partition becomes its
+// disk, i.e. 259:0 for nvme0n1 rather than 259:2 for nvme0n1p2.
+static int block_device(const char *path, uint32_t *major_out, uint32_t *minor_out)
+{
+    struct stat st;
+    char sys[64];
+    char file[96];
+    unsigned int disk_major, disk_minor;
+
+    if (stat(path, &st) == -1)
     {
-        LOG("[CGROUP] Failed to open cpu.max: %s\n", strerror(errno));
         return -1;
     }
-    fprintf(f, "%d", cgroup_config.cpu_limit);
-    fclose(f);
 
-    LOG("[CGROUP] Assigning child process to cgroup\n");
-    char cg_procs[256];
-    snprintf(cg_procs, sizeof(cg_procs), "%s/cgroup.procs", cgroup_config.cgroup);
-    f = fopen(cg_procs, "w");
+    dev_t dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+    snprintf(sys, sizeof(sys), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+
+    // i.e. tmpfs or overlayfs, which aren't on a block device
+    if (access(sys, F_OK) == -1)
+    {
+        errno = ENODEV;
+        return -1;
+    }
+
+    // a partition's directory sits in its disk's, i.e. cat /sys/dev/block/259:2/../dev
+    snprintf(file, sizeof(file), "%s/partition", sys);
+    snprintf(file, sizeof(file), access(file, F_OK) == 0 ? "%s/../dev" : "%s/dev", sys);
+
+    FILE *f = fopen(file, "r");
     if (f == NULL)
     {
-        LOG("[CGROUP] Failed to open cgroup.procs: %s\n", strerror(errno));
         return -1;
     }
-    fprintf(f, "%d", cgroup_config.child_pid);
+
+    int ret = fscanf(f, "%u:%u", &disk_major, &disk_minor) == 2 ? 0 : -1;
     fclose(f);
+    if (ret == -1)
+    {
+        errno = ENODEV;
+        return -1;
+    }
+
+    *major_out = disk_major;
+    *minor_out = disk_minor;
+    return 0;
+}
+
+// Sets the limit for the `mocker run` flag `flag`, i.e. "memory" for
+// --memory, from its value. Prints why and returns -1 if the value is invalid.
+int cgroup_parse_limit(struct cgroup_limits *limits, const char *flag, const char *value)
+{
+    for (size_t i = 0; i < sizeof(limit_flags) / sizeof(limit_flags[0]); i++)
+    {
+        const struct limit_flag *limit = &limit_flags[i];
+        if (strcmp(limit->flag, flag) != 0)
+        {
+            continue;
+        }
+
+        char *field = (char *)limits + limit->offset;
+        if (limit->kind == LIMIT_CPUSET)
+        {
+            if (!valid_cpuset(value))
+            {
+                fprintf(stderr, "Invalid value for --%s: %s (a list like 0-3,8)\n", flag, value);
+                return -1;
+            }
+            snprintf(field, CGROUP_CPUSET_MAX, "%s", value);
+            return 0;
+        }
+
+        if (limit->kind == LIMIT_NAME)
+        {
+            if (!valid_name(value))
+            {
+                fprintf(stderr, "Invalid value for --%s: %s (letters, digits, - and _, not mocker-...)\n",
+                        flag, value);
+                return -1;
+            }
+            snprintf(field, CGROUP_TENANT_MAX, "%s", value);
+            return 0;
+        }
+
+        if (limit->kind == LIMIT_CHOICE)
+        {
+            for (uint64_t choice = 0; limit->choices[choice] != NULL; choice++)
+            {
+                if (strcmp(value, limit->choices[choice]) == 0)
+                {
+                    memcpy(field, &choice, sizeof(choice));
+                    return 0;
+                }
+            }
+
+            // i.e. (event, raise-memory-high or freeze)
+            fprintf(stderr, "Invalid value for --%s: %s (", flag, value);
+            for (size_t choice = 0; limit->choices[choice] != NULL; choice++)
+            {
+                const char *sep = ", ";
+                if (limit->choices[choice + 1] == NULL)
+                {
+                    sep = ")\n";
+                }
+                else if (limit->choices[choice + 2] == NULL)
+                {
+                    sep = " or ";
+                }
+                fprintf(stderr, "%s%s", limit->choices[choice], sep);
+            }
+            return -1;
+        }
+
+        // resolved here, as `mocker run` sees the path
+        if (limit->kind == LIMIT_DEVICE)
+        {
+            if (block_device(value, &limits->io_major, &limits->io_minor) != 0)
+            {
+                fprintf(stderr, "Invalid value for --%s: %s (%s)\n", flag, value, strerror(errno));
+                return -1;
+            }
+            return 0;
+        }
+
+        uint64_t number;
+        if (limit->kind != LIMIT_RANGE && strcmp(value, "max") == 0)
+        {
+            number = CGROUP_MAX;
+        }
+        else if (parse_number(value, limit->kind == LIMIT_SIZE, &number) != 0 ||
+                 number < limit->min || number > limit->max)
+        {
+            if (limit->kind == LIMIT_RANGE)
+            {
+                fprintf(stderr, "Invalid value for --%s: %s (%llu to %llu)\n", flag, value,
+                        (unsigned long long)limit->min, (unsigned long long)limit->max);
+            }
+            else if (limit->kind == LIMIT_SIZE)
+            {
+                fprintf(stderr, "Invalid value for --%s: %s (a size like 512m, or max)\n", flag, value);
+            }
+            else
+            {
+                fprintf(stderr, "Invalid value for --%s: %s (at least %llu, or max)\n", flag, value,
+                        (unsigned long long)limit->min);
+            }
+            return -1;
+        }
+
+        memcpy(field, &number, sizeof(number));
+        return 0;
+    }
+
+    fprintf(stderr, "Unknown limit: --%s\n", flag);
+    return -1;
+}
+
+// Whether any --pressure-* or --on-pressure flag was given, which only the
+// daemon acts on
+int cgroup_watches_pressure(const struct cgroup_limits *limits)
+{
+    return limits->pressure_cpu != CGROUP_UNSET || limits->pressure_memory != CGROUP_UNSET ||
+           limits->pressure_io != CGROUP_UNSET || limits->pressure_window != PRESSURE_WINDOW ||
+           limits->pressure_action != PRESSURE_EVENT;
+}
+
+// Whether the limit for `limit` holds a value its flag could have set. Limits
+// from `mocker run` went through `cgroup_parse_limit()`, but the daemon and
+// the zygote get theirs over a socket.
+static int valid_limit(const struct cgroup_limits *limits, const struct limit_flag *limit)
+{
+    const char *field = (const char *)limits + limit->offset;
+    uint64_t number;
+
+    switch (limit->kind)
+    {
+    case LIMIT_CPUSET:
+        return field[0] == '\0' || valid_cpuset(field);
+    case LIMIT_NAME:
+        return field[0] == '\0' || valid_name(field);
+    case LIMIT_DEVICE:
+        return 1;
+    case LIMIT_CHOICE:
+        memcpy(&number, field, sizeof(number));
+        for (uint64_t choice = 0; limit->choices[choice] != NULL; choice++)
+        {
+            if (number == choice)
+            {
+                return 1;
+            }
+        }
+        return 0;
+    default:
+        memcpy(&number, field, sizeof(number));
+        if (number == CGROUP_UNSET || (number == CGROUP_MAX && limit->kind != LIMIT_RANGE))
+        {
+            return 1;
+        }
+        return number >= limit->min && number <= limit->max;
+    }
+}
+
+// Checks what depends on more than one flag, once they are all parsed, and
+// that each limit is one its flag could have set
+int cgroup_check_limits(const struct cgroup_limits *limits)
+{
+    const uint64_t thresholds[] = {limits->pressure_cpu, limits->pressure_memory, limits->pressure_io};
+
+    for (size_t i = 0; i < sizeof(limit_flags) / sizeof(limit_flags[0]); i++)
+    {
+        if (!valid_limit(limits, &limit_flags[i]))
+        {
+            fprintf(stderr, "Invalid value for --%s\n", limit_flags[i].flag);
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(thresholds) / sizeof(thresholds[0]); i++)
+    {
+        if (thresholds[i] != CGROUP_UNSET && thresholds[i] > limits->pressure_window)
+        {
+            fprintf(stderr, "A --pressure-* threshold can't be longer than the window (%llu us)\n",
+                    (unsigned long long)limits->pressure_window);
+            return -1;
+        }
+    }
+
+    if (limits->place_cpus != CGROUP_UNSET && (limits->cpuset_cpus[0] != '\0' || limits->cpuset_mems[0] != '\0'))
+    {
+        fprintf(stderr, "--place picks the container's cpuset itself, so it can't go with --cpuset-*\n");
+        return -1;
+    }
+
+    // i.e. /sys/kernel/mm/hugepages/hugepages-2048kB, for each size the CPU
+    // and kernel support
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/kernel/mm/hugepages/hugepages-%llukB",
+             (unsigned long long)(limits->hugetlb_page_size / 1024));
+    if (limits->hugetlb_max != CGROUP_UNSET && (limits->hugetlb_page_size % 1024 != 0 || access(path, F_OK) != 0))
+    {
+        fprintf(stderr, "Huge pages of --hugepage-size %llu aren't supported, see /sys/kernel/mm/hugepages\n",
+                (unsigned long long)limits->hugetlb_page_size);
+        return -1;
+    }
+
+    return 0;
+}
+
+// The size of the huge pages of the hugetlbfs to mount in the container, or
+// 0 for none
+uint64_t cgroup_hugetlbfs_page_size(const struct cgroup_limits *limits)
+{
+    return limits != NULL && limits->hugetlb_max != CGROUP_UNSET ? limits->hugetlb_page_size : 0;
+}
+
+// Writes `value` to the cgroup's file `name`, i.e. echo value > cgroup/name
+static int cgroup_write(int cgroup_fd, const char *name, const char *value)
+{
+    int fd = openat(cgroup_fd, name, O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    size_t len = strlen(value);
+    ssize_t ret = write(fd, value, len);
+    if (ret != (ssize_t)len)
+    {
+        fprintf(stderr, "Failed to write %s to %s: %s\n", value, name, strerror(errno));
+    }
+
+    close(fd);
+    return ret == (ssize_t)len ? 0 : -1;
+}
+
+static void format_limit(uint64_t value, char *buf, size_t size)
+{
+    if (value == CGROUP_MAX)
+    {
+        snprintf(buf, size, "max");
+    }
+    else
+    {
+        snprintf(buf, size, "%llu", (unsigned long long)value);
+    }
+}
+
+// Writes a limit unless it is unset
+static int write_limit(int cgroup_fd, const char *name, uint64_t value)
+{
+    char buf[32];
+
+    if (value == CGROUP_UNSET)
+    {
+        return 0;
+    }
+
+    format_limit(value, buf, sizeof(buf));
+    LOG("[CGROUP] %s: %s\n", name, buf);
+    return cgroup_write(cgroup_fd, name, buf);
+}
+
+// Reads the cgroup's file `name` into `buf`, NUL-terminated
+static int cgroup_read(int cgroup_fd, const char *name, char *buf, size_t size)
+{
+    int fd = openat(cgroup_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    ssize_t len = read(fd, buf, size - 1);
+    close(fd);
+    if (len == -1)
+    {
+        return -1;
+    }
+
+    buf[len] = '\0';
+    return 0;
+}
+
+// Whether the space separated `list` has `word` in it
+static int has_word(const char *list, const char *word)
+{
+    size_t len = strlen(word);
+
+    for (const char *p = strstr(list, word); p != NULL; p = strstr(p + 1, word))
+    {
+        if ((p == list || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\n' || p[len] == '\0'))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Whether we write to the files of the controller `name` for a container
+// with `limits`. cpu, memory, pids and io always (the stats read them), and
+// cpuset and hugetlb only when asked for.
+static int wants_controller(const struct cgroup_limits *limits, const char *name)
+{
+    if (strcmp(name, "cpuset") == 0)
+    {
+        return limits->cpuset_cpus[0] != '\0' || limits->cpuset_mems[0] != '\0' ||
+               limits->place_cpus != CGROUP_UNSET;
+    }
+
+    if (strcmp(name, "hugetlb") == 0)
+    {
+        return limits->hugetlb_max != CGROUP_UNSET;
+    }
+
+    return strcmp(name, "cpu") == 0 || strcmp(name, "memory") == 0 || strcmp(name, "pids") == 0 ||
+           strcmp(name, "io") == 0;
+}
+
+// Makes the interface files of the controllers we need for `limits` show up
+// in the cgroup's children, i.e. echo +memory > cgroup.subtree_control for
+// each one in cgroup.controllers that isn't enabled yet. Others are left
+// alone, as this runs on the host's root cgroup too. A controller the kernel
+// won't enable is left out, and writing its limits fails later if one is
+// asked for.
+static int enable_controllers(int cgroup_fd, const struct cgroup_limits *limits)
+{
+    char available[256];
+    char enabled[256];
+    char *save;
+
+    if (cgroup_read(cgroup_fd, "cgroup.controllers", available, sizeof(available)) != 0 ||
+        cgroup_read(cgroup_fd, "cgroup.subtree_control", enabled, sizeof(enabled)) != 0)
+    {
+        LOG("[CGROUP] Failed to read the cgroup's controllers: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (char *name = strtok_r(available, " \n", &save); name != NULL; name = strtok_r(NULL, " \n", &save))
+    {
+        char value[32];
+
+        if (has_word(enabled, name) || !wants_controller(limits, name))
+        {
+            continue;
+        }
+
+        snprintf(value, sizeof(value), "+%s", name);
+        int fd = openat(cgroup_fd, "cgroup.subtree_control", O_WRONLY | O_CLOEXEC);
+        if (fd == -1 || write(fd, value, strlen(value)) == -1)
+        {
+            LOG("[CGROUP] Failed to enable the %s controller: %s\n", name, strerror(errno));
+        }
+        if (fd != -1)
+        {
+            close(fd);
+        }
+    }
+
+    return 0;
+}
+
+// Which of memory.max and cpu.max the cgroup caps, as DEFAULT_MEMORY and
+// DEFAULT_CPU bits
+static int budgets(int cgroup_fd)
+{
+    char value[64];
+    int capped = 0;
+
+    if (cgroup_read(cgroup_fd, "memory.max", value, sizeof(value)) == 0 && strncmp(value, "max", 3) != 0)
+    {
+        capped |= DEFAULT_MEMORY;
+    }
+
+    // i.e. "max 100000" without a quota
+    if (cgroup_read(cgroup_fd, "cpu.max", value, sizeof(value)) == 0 && strncmp(value, "max ", 4) != 0)
+    {
+        capped |= DEFAULT_CPU;
+    }
+
+    return capped;
+}
+
+// Creates the cgroup `name` under `parent_fd` unless it exists, and opens it
+// with the controllers `limits` needs enabled for its children
+static int open_group(int parent_fd, const char *name, const struct cgroup_limits *limits)
+{
+    if (mkdirat(parent_fd, name, 0755) == -1 && errno != EEXIST)
+    {
+        LOG("[CGROUP] Failed to create cgroup %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        LOG("[CGROUP] Failed to open cgroup %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    if (enable_controllers(fd, limits) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Opens the cgroup containers go in, CGROUP_SLICE or the tenant's group
+// under it, creating it on first use. Only the controllers `limits` needs are
+// enabled on the way down. With `capped`, also finds which of memory and CPU
+// it or CGROUP_SLICE has a budget for.
+static int open_slice(const struct cgroup_limits *limits, int *capped)
+{
+    const char *tenant = limits->tenant;
+    int root_fd = open(CGROUP_ROOT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1 || enable_controllers(root_fd, limits) != 0)
+    {
+        if (root_fd != -1)
+        {
+            close(root_fd);
+        }
+        return -1;
+    }
+
+    int fd = open_group(root_fd, CGROUP_SLICE, limits);
+    close(root_fd);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    if (capped != NULL)
+    {
+        *capped = budgets(fd);
+    }
+
+    if (tenant[0] != '\0')
+    {
+        int tenant_fd = open_group(fd, tenant, limits);
+        close(fd);
+        fd = tenant_fd;
+        if (fd != -1 && capped != NULL)
+        {
+            *capped |= budgets(fd);
+        }
+    }
+
+    return fd;
+}
+
+// Appends " key=value" to an io.max or io.latency line, if the limit is set
+static void append_io_key(char *line, size_t size, const char *key, uint64_t value)
+{
+    char buf[32];
+    size_t len = strlen(line);
+
+    if (value != CGROUP_UNSET)
+    {
+        format_limit(value, buf, sizeof(buf));
+        snprintf(line + len, size - len, " %s=%s", key, buf);
+    }
+}
+
+// Writes the block I/O limits, i.e. "259:0 rbps=1048576 wiops=max" to
+// io.max, "default 50" to io.weight and "259:0 target=2000" to io.latency
+static int write_io_limits(int cgroup_fd, const struct cgroup_limits *limits)
+{
+    int throttled = limits->io_rbps != CGROUP_UNSET || limits->io_wbps != CGROUP_UNSET ||
+                    limits->io_riops != CGROUP_UNSET || limits->io_wiops != CGROUP_UNSET;
+    uint32_t disk_major = limits->io_major;
+    uint32_t disk_minor = limits->io_minor;
+    char line[128];
+
+    if (!throttled && limits->io_weight == CGROUP_UNSET && limits->io_latency == CGROUP_UNSET)
+    {
+        return 0;
+    }
+
+    // without --io-device, the disk the images are on
+    if ((throttled || limits->io_latency != CGROUP_UNSET) && disk_major == 0 && disk_minor == 0 &&
+        block_device(MOCKER_LIB_DIR, &disk_major, &disk_minor) != 0)
+    {
+        fprintf(stderr, "Failed to find the disk of %s: %s\n", MOCKER_LIB_DIR, strerror(errno));
+        return -1;
+    }
+
+    if (throttled)
+    {
+        snprintf(line, sizeof(line), "%u:%u", disk_major, disk_minor);
+        append_io_key(line, sizeof(line), "rbps", limits->io_rbps);
+        append_io_key(line, sizeof(line), "wbps", limits->io_wbps);
+        append_io_key(line, sizeof(line), "riops", limits->io_riops);
+        append_io_key(line, sizeof(line), "wiops", limits->io_wiops);
+        LOG("[CGROUP] io.max: %s\n", line);
+        if (cgroup_write(cgroup_fd, "io.max", line) != 0)
+        {
+            return -1;
+        }
+    }
+
+    if (limits->io_weight != CGROUP_UNSET)
+    {
+        snprintf(line, sizeof(line), "default %llu", (unsigned long long)limits->io_weight);
+        LOG("[CGROUP] io.weight: %s\n", line);
+        if (cgroup_write(cgroup_fd, "io.weight", line) != 0)
+        {
+            return -1;
+        }
+    }
+
+    if (limits->io_latency != CGROUP_UNSET)
+    {
+        snprintf(line, sizeof(line), "%u:%u", disk_major, disk_minor);
+        append_io_key(line, sizeof(line), "target", limits->io_latency);
+        LOG("[CGROUP] io.latency: %s\n", line);
+        if (cgroup_write(cgroup_fd, "io.latency", line) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Caps the huge pages the cgroup's tasks can fault in, i.e.
+// echo 1073741824 > hugetlb.2MB.max. The kernel only checks that limit on a
+// page fault and kills the task with SIGBUS over it, so the same limit on
+// hugetlb.2MB.rsvd.max (Linux 5.7+) makes an mmap() over it fail instead.
+static int write_hugetlb_limits(int fd, const struct cgroup_limits *limits)
+{
+    char name[64];
+    char size[24];
+    uint64_t page_size = limits->hugetlb_page_size;
+
+    if (limits->hugetlb_max == CGROUP_UNSET)
+    {
+        return 0;
+    }
+
+    // i.e. 2MB or 1GB, as the kernel names them
+    if (page_size % (1024 * 1024 * 1024) == 0)
+    {
+        snprintf(size, sizeof(size), "%lluGB", (unsigned long long)(page_size >> 30));
+    }
+    else if (page_size % (1024 * 1024) == 0)
+    {
+        snprintf(size, sizeof(size), "%lluMB", (unsigned long long)(page_size >> 20));
+    }
+    else
+    {
+        snprintf(size, sizeof(size), "%lluKB", (unsigned long long)(page_size >> 10));
+    }
+
+    snprintf(name, sizeof(name), "hugetlb.%s.max", size);
+    if (write_limit(fd, name, limits->hugetlb_max) != 0)
+    {
+        return -1;
+    }
+
+    snprintf(name, sizeof(name), "hugetlb.%s.rsvd.max", size);
+    if (faccessat(fd, name, F_OK, 0) != 0)
+    {
+        return 0;
+    }
+    return write_limit(fd, name, limits->hugetlb_max);
+}
+
+// Writes the limits that are set to the cgroup, and ours for memory.max and
+// cpu.max when they aren't and `defaults` has DEFAULT_MEMORY or DEFAULT_CPU
+static int write_limits(int fd, const struct cgroup_limits *limits, int defaults)
+{
+    char quota[32];
+    char value[64];
+
+    // i.e. "50000 100000" for half a CPU. Our default is one CPU whatever the
+    // period, and a placed container gets the CPUs it was placed on.
+    uint64_t period = limits->cpu_period != CGROUP_UNSET ? limits->cpu_period : CPU_PERIOD;
+    uint64_t cpus = limits->place_cpus != CGROUP_UNSET ? limits->place_cpus : 1;
+    if ((defaults & DEFAULT_CPU) || limits->cpu_quota != CGROUP_UNSET || limits->cpu_period != CGROUP_UNSET)
+    {
+        if (limits->cpu_quota != CGROUP_UNSET)
+        {
+            format_limit(limits->cpu_quota, quota, sizeof(quota));
+        }
+        else if (defaults & DEFAULT_CPU)
+        {
+            format_limit(period * cpus, quota, sizeof(quota));
+        }
+        // Only the period changes, i.e. under a CPU budget or for the slice,
+        // so the quota stays what it is ("max" for a new cgroup)
+        else if (cgroup_read(fd, "cpu.max", value, sizeof(value)) != 0 || sscanf(value, "%31s", quota) != 1)
+        {
+            snprintf(quota, sizeof(quota), "max");
+        }
+
+        snprintf(value, sizeof(value), "%s %llu", quota, (unsigned long long)period);
+        LOG("[CGROUP] cpu.max: %s\n", value);
+        if (cgroup_write(fd, "cpu.max", value) != 0)
+        {
+            return -1;
+        }
+    }
+
+    uint64_t memory_max =
+        limits->memory_max == CGROUP_UNSET && (defaults & DEFAULT_MEMORY) ? MEMORY_LIMIT : limits->memory_max;
+    if (write_limit(fd, "memory.max", memory_max) != 0 ||
+        write_limit(fd, "memory.high", limits->memory_high) != 0 ||
+        write_limit(fd, "memory.swap.max", limits->memory_swap_max) != 0 ||
+        write_limit(fd, "cpu.weight", limits->cpu_weight) != 0 ||
+        write_limit(fd, "pids.max", limits->pids_max) != 0)
+    {
+        return -1;
+    }
+
+    if (limits->cpuset_cpus[0] != '\0' && cgroup_write(fd, "cpuset.cpus", limits->cpuset_cpus) != 0)
+    {
+        return -1;
+    }
+
+    if (limits->cpuset_mems[0] != '\0' && cgroup_write(fd, "cpuset.mems", limits->cpuset_mems) != 0)
+    {
+        return -1;
+    }
+
+    if (write_io_limits(fd, limits) != 0)
+    {
+        return -1;
+    }
+
+    return write_hugetlb_limits(fd, limits);
+}
+
+// Puts the container on CPUs of its own, out of those its parent's cpuset
+// allows, i.e. echo 4-7 > cpuset.cpus; echo 1 > cpuset.mems
+static int place_container(struct container_s *container, int parent_fd, const struct cgroup_limits *limits)
+{
+    char cpus_allowed[4096] = "";
+    char mems_allowed[CGROUP_CPUSET_MAX] = "";
+    char cpus[CGROUP_CPUSET_MAX];
+    char mems[CGROUP_CPUSET_MAX];
+
+    // without the cpuset controller, any online CPU
+    cgroup_read(parent_fd, "cpuset.cpus.effective", cpus_allowed, sizeof(cpus_allowed));
+    cgroup_read(parent_fd, "cpuset.mems.effective", mems_allowed, sizeof(mems_allowed));
+
+    if (placement_assign(container, cpus_allowed, mems_allowed, limits->place_cpus,
+                         limits->place_smt == SMT_EXCLUSIVE, cpus, mems, sizeof(cpus)) != 0)
+    {
+        return -1;
+    }
+
+    LOG("[CGROUP] cpuset.cpus: %s, cpuset.mems: %s\n", cpus, mems);
+    if (cgroup_write(container->cgroup_fd, "cpuset.cpus", cpus) != 0 ||
+        (mems[0] != '\0' && cgroup_write(container->cgroup_fd, "cpuset.mems", mems) != 0))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Creates and configures the container's cgroup before there is a child to
+// put in it, and keeps it open in `container->cgroup_fd`. The child is
+// cloned straight into it, see `cgroup_attach()` for older kernels. Without
+// `limits` the container gets our defaults.
+//
+// The cgroup goes under CGROUP_SLICE, or under the tenant's group in it, so
+// the kernel holds all containers together to the budget set with
+// `cgroup_set_slice()`. Where there is a budget for memory or CPU, the
+// containers share it by weight instead of getting our default cap.
+int setup_cgroup(struct container_s *container, const struct cgroup_limits *limits)
+{
+    struct cgroup_limits defaults;
+    char name[32];
+    int capped;
+
+    if (limits == NULL)
+    {
+        cgroup_limits_init(&defaults);
+        limits = &defaults;
+    }
+
+    LOG("[CGROUP] Creating cgroup\n");
+    int parent_fd = open_slice(limits, &capped);
+    if (parent_fd == -1)
+    {
+        LOG("[CGROUP] Failed to set up %s/%s\n", CGROUP_ROOT, CGROUP_SLICE);
+        return -1;
+    }
+
+    snprintf(name, sizeof(name), "mocker-%s", container->id);
+    if (limits->tenant[0] != '\0')
+    {
+        snprintf(container->cgroup, sizeof(container->cgroup), "%s/%s/%s/%s", CGROUP_ROOT, CGROUP_SLICE,
+                 limits->tenant, name);
+    }
+
+    if (mkdirat(parent_fd, name, 0755) == -1)
+    {
+        LOG("[CGROUP] Failed to create cgroup: %s\n", strerror(errno));
+        close(parent_fd);
+        return -1;
+    }
+
+    container->cgroup_fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (container->cgroup_fd == -1)
+    {
+        LOG("[CGROUP] Failed to open cgroup: %s\n", strerror(errno));
+        close(parent_fd);
+        rmdir(container->cgroup);
+        return -1;
+    }
+
+    if (write_limits(container->cgroup_fd, limits, (DEFAULT_MEMORY | DEFAULT_CPU) & ~capped) != 0 ||
+        (limits->place_cpus != CGROUP_UNSET && place_container(container, parent_fd, limits) != 0))
+    {
+        close(parent_fd);
+        cleanup_cgroup(container);
+        return -1;
+    }
+    close(parent_fd);
 
     LOG("[CGROUP] Cgroup setup complete\n");
     return 0;
 }
 
-int cleanup_cgroup(void)
+// Changes the limits of a container that is already set up, i.e. a parked
+// one that is about to run a command. Unset limits stay as they are.
+int cgroup_set_limits(struct container_s *container, const struct cgroup_limits *limits)
+{
+    return write_limits(container->cgroup_fd, limits, 0);
+}
+
+// Sets the budget all containers share, on CGROUP_SLICE, or that of the
+// containers of `limits->tenant`, on its group. Unset limits stay as they are.
+// i.e. mocker slice [--tenant <name>] [options]
+int cgroup_set_slice(const struct cgroup_limits *limits)
+{
+    int fd = open_slice(limits, NULL);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Failed to set up %s/%s: %s\n", CGROUP_ROOT, CGROUP_SLICE, strerror(errno));
+        return -1;
+    }
+
+    int ret = write_limits(fd, limits, 0);
+    close(fd);
+    return ret;
+}
+
+// Moves the child into its cgroup, for when it couldn't be cloned into it
+int cgroup_attach(struct container_s *container, pid_t child_pid)
+{
+    char value[32];
+
+    LOG("[CGROUP] Assigning child process to cgroup\n");
+    snprintf(value, sizeof(value), "%d", child_pid);
+    return cgroup_write(container->cgroup_fd, "cgroup.procs", value);
+}
+
+int cleanup_cgroup(struct container_s *container)
 {
-    rmdir(cgroup_config.cgroup);
+    if (container->cgroup_fd != -1)
+    {
+        close(container->cgroup_fd);
+        container->cgroup_fd = -1;
+    }
+    rmdir(container->cgroup);
+    placement_release(container);
     LOG("[CGROUP] Cgroup cleaned up\n");
     return 0;
-}
\ No newline at end of file
+}
+
+// How many CPUs this process can keep busy: those it may run on, capped by
+// the cpu.max quota of its cgroup and of every cgroup above it. Always at
+// least 1.
+int cgroup_cpu_count(void)
+{
+    cpu_set_t set;
+    int cpus = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : 1;
+
+    // i.e. 0::/some/cgroup
+    char path[PATH_MAX] = "";
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (f != NULL)
+    {
+        if (fscanf(f, "0::%4095s", path) != 1)
+        {
+            path[0] = '\0';
+        }
+        fclose(f);
+    }
+
+    // the root has no cpu.max, so stop below it
+    while (path[0] == '/' && path[1] != '\0')
+    {
+        char file[PATH_MAX + 32];
+        long long quota, period;
+
+        // i.e. "max 100000" without a quota, or "<quota> <period>"
+        snprintf(file, sizeof(file), "%s%s/cpu.max", CGROUP_ROOT, path);
+        f = fopen(file, "r");
+        if (f != NULL)
+        {
+            if (fscanf(f, "%lld %lld", &quota, &period) == 2 && quota > 0 && period > 0)
+            {
+                long long limit = (quota + period - 1) / period;
+                if (limit < cpus)
+                {
+                    cpus = limit;
+                }
+            }
+            fclose(f);
+        }
+
+        *strrchr(path, '/') = '\0';
+    }
+
+    LOG("[CGROUP] Can use %d CPUs\n", cpus);
+    return cpus > 0 ? cpus : 1;
+}
+
+// Has the kernel tell us when the cgroup's tasks stall on `resource` ("cpu",
+// "memory" or "io") for more than `stall_us` within any `window_us`. Returns
+// the trigger, which polls with POLLPRI when that happens, at most once per
+// window. i.e. echo "some 100000 1000000" > memory.pressure, kept open.
+int cgroup_pressure_trigger(int cgroup_fd, const char *resource, uint64_t stall_us, uint64_t window_us)
+{
+    char name[32];
+    char trigger[64];
+
+    snprintf(name, sizeof(name), "%s.pressure", resource);
+    int fd = openat(cgroup_fd, name, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    int len = snprintf(trigger, sizeof(trigger), "some %llu %llu", (unsigned long long)stall_us,
+                       (unsigned long long)window_us);
+
+    // the trigger lives as long as the file stays open, and is written with
+    // its NUL
+    if (write(fd, trigger, len + 1) == -1)
+    {
+        fprintf(stderr, "Failed to write %s to %s: %s\n", trigger, name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    LOG("[CGROUP] %s trigger: %s\n", name, trigger);
+    return fd;
+}
+
+// Opens memory.events, which polls with POLLPRI whenever its counts change,
+// or returns -1 without the memory controller
+int cgroup_open_memory_events(int cgroup_fd)
+{
+    return openat(cgroup_fd, "memory.events", O_RDONLY | O_CLOEXEC);
+}
+
+// Reads memory.events, which also clears its POLLPRI
+int cgroup_memory_events(int events_fd, struct cgroup_memory_events *events)
+{
+    char buf[256];
+    char *line;
+    char *save;
+
+    ssize_t len = pread(events_fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0)
+    {
+        return -1;
+    }
+    buf[len] = '\0';
+
+    // i.e. "low 0\nhigh 12\nmax 3\noom 1\noom_kill 1\n"
+    memset(events, 0, sizeof(*events));
+    for (line = strtok_r(buf, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save))
+    {
+        unsigned long long count;
+        char key[32];
+
+        if (sscanf(line, "%31s %llu", key, &count) != 2)
+        {
+            continue;
+        }
+
+        if (strcmp(key, "high") == 0)
+        {
+            events->high = count;
+        }
+        else if (strcmp(key, "max") == 0)
+        {
+            events->max = count;
+        }
+        else if (strcmp(key, "oom") == 0)
+        {
+            events->oom = count;
+        }
+        else if (strcmp(key, "oom_kill") == 0)
+        {
+            events->oom_kill = count;
+        }
+    }
+
+    return 0;
+}
+
+// Freezes or thaws all of the cgroup's tasks, i.e. echo 1 > cgroup.freeze.
+// Frozen tasks use no CPU but keep all their memory, sockets and mounts.
+// Freezing takes effect as each task gets to the kernel's freeze point, which
+// cgroup.events tells, see `cgroup_open_events()`.
+int cgroup_freeze(int cgroup_fd, int frozen)
+{
+    return cgroup_write(cgroup_fd, "cgroup.freeze", frozen ? "1" : "0");
+}
+
+// Opens cgroup.events, which polls with POLLPRI whenever the cgroup's tasks
+// have all frozen or thawed
+int cgroup_open_events(int cgroup_fd)
+{
+    return openat(cgroup_fd, "cgroup.events", O_RDONLY | O_CLOEXEC);
+}
+
+// Whether the cgroup is frozen, going by the "frozen" line of cgroup.events,
+// or -1 if we can't tell. Reading it also clears its POLLPRI.
+int cgroup_events_frozen(int events_fd)
+{
+    char buf[128];
+
+    ssize_t len = pread(events_fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0)
+    {
+        return -1;
+    }
+    buf[len] = '\0';
+
+    // i.e. "populated 1\nfrozen 0\n"
+    const char *line = strstr(buf, "frozen ");
+    return line != NULL ? line[7] == '1' : -1;
+}
+
+int cgroup_is_frozen(int cgroup_fd)
+{
+    int fd = cgroup_open_events(cgroup_fd);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    int frozen = cgroup_events_frozen(fd);
+    close(fd);
+    return frozen;
+}
+
+// Kills every task in the cgroup at once, however many processes and forks
+// there are, i.e. echo 1 > cgroup.kill (Linux 5.14 and later). Frozen tasks
+// are killed as well.
+int cgroup_kill(int cgroup_fd)
+{
+    int fd = openat(cgroup_fd, "cgroup.kill", O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    int ret = write(fd, "1", 1) == 1 ? 0 : -1;
+    close(fd);
+    return ret;
+}
+
+// Raises memory.high by MEMORY_HIGH_STEP percent, to no more than memory.max,
+// and returns the new value in `high`. Fails if memory.high isn't set, or is
+// at memory.max already.
+int cgroup_raise_memory_high(int cgroup_fd, uint64_t *high)
+{
+    char value[32];
+    unsigned long long current, max = CGROUP_MAX;
+
+    if (cgroup_read(cgroup_fd, "memory.high", value, sizeof(value)) != 0 ||
+        sscanf(value, "%llu", &current) != 1)
+    {
+        return -1;
+    }
+
+    if (cgroup_read(cgroup_fd, "memory.max", value, sizeof(value)) == 0 && sscanf(value, "%llu", &max) != 1)
+    {
+        max = CGROUP_MAX;
+    }
+
+    uint64_t raised = current + current / 100 * MEMORY_HIGH_STEP;
+    if (raised > max)
+    {
+        raised = max;
+    }
+
+    if (raised <= current)
+    {
+        return -1;
+    }
+
+    *high = raised;
+    return write_limit(cgroup_fd, "memory.high", raised);
+}
+
+// The number of tasks the OOM killer killed in the cgroup, or 0 if we can't
+// tell
+uint64_t cgroup_oom_kills(int cgroup_fd)
+{
+    struct cgroup_memory_events events;
+
+    int fd = cgroup_open_memory_events(cgroup_fd);
+    if (fd == -1)
+    {
+        return 0;
+    }
+
+    int ret = cgroup_memory_events(fd, &events);
+    close(fd);
+    return ret == 0 ? events.oom_kill : 0;
+}
+
+// The most memory the cgroup's tasks used at once, from memory.peak (Linux
+// 5.19+), or 0 if the kernel doesn't keep it
+uint64_t cgroup_memory_peak(int cgroup_fd)
+{
+    char buf[32];
+
+    if (cgroup_read(cgroup_fd, "memory.peak", buf, sizeof(buf)) != 0)
+    {
+        return 0;
+    }
+
+    return strtoull(buf, NULL, 10);
+}
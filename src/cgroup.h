@@ -3,7 +3,107 @@
 
 #include "common.h"
 
-int setup_cgroup(pid_t child_pid);
-int cleanup_cgroup(void);
+// A limit left alone, i.e. the kernel's default, or ours for memory.max and
+// cpu.max, and one set to "max"
+#define CGROUP_UNSET UINT64_MAX
+#define CGROUP_MAX (UINT64_MAX - 1)
 
-#endif
\ No newline at end of file
+// Longest cpuset.cpus or cpuset.mems list we take, i.e. "0-3,8-11"
+#define CGROUP_CPUSET_MAX 256
+
+// Longest tenant name, plus its NUL
+#define CGROUP_TENANT_MAX 64
+
+// What the daemon does when a container's tasks stall on a resource for
+// longer than its --pressure-* threshold. It always reports it.
+enum pressure_action
+{
+    PRESSURE_EVENT,      // only report it
+    PRESSURE_RAISE_HIGH, // raise memory.high, so memory pressure eases off
+    PRESSURE_FREEZE,     // freeze the container's tasks
+};
+
+// Transparent huge pages for a container's processes, see `PR_SET_THP_DISABLE`
+enum thp_mode
+{
+    THP_SYSTEM,  // whatever /sys/kernel/mm/transparent_hugepage says
+    THP_NEVER,   // none, even where the process asks with madvise()
+    THP_MADVISE, // only where the process asks with madvise(), Linux 6.18+
+};
+
+// How --place treats SMT siblings
+enum smt_mode
+{
+    SMT_SHARED,    // a CPU is a thread, whose siblings other containers may get
+    SMT_EXCLUSIVE, // a CPU is a whole core, with all of its threads
+};
+
+// Resource limits of a container's cgroup, from the `mocker run` flags, or of
+// the cgroup all containers share, from the `mocker slice` flags
+struct cgroup_limits
+{
+    uint64_t cpu_quota;                  // cpu.max, in µs per period
+    uint64_t cpu_period;                 // cpu.max, in µs
+    uint64_t cpu_weight;                 // cpu.weight, 1 to 10000
+    uint64_t memory_max;                 // memory.max, in bytes
+    uint64_t memory_high;                // memory.high, in bytes
+    uint64_t memory_swap_max;            // memory.swap.max, in bytes
+    uint64_t pids_max;                   // pids.max
+    uint64_t io_rbps;                    // io.max, in bytes per second
+    uint64_t io_wbps;                    // io.max, in bytes per second
+    uint64_t io_riops;                   // io.max, in reads per second
+    uint64_t io_wiops;                   // io.max, in writes per second
+    uint64_t io_weight;                  // io.weight, 1 to 10000
+    uint64_t io_latency;                 // io.latency target, in µs
+    uint32_t io_major;                   // disk io.max and io.latency are for,
+    uint32_t io_minor;                   // 0:0 for the one under MOCKER_LIB_DIR
+    uint64_t pressure_cpu;               // cpu.pressure trigger, in µs stalled per window
+    uint64_t pressure_memory;            // memory.pressure trigger
+    uint64_t pressure_io;                // io.pressure trigger
+    uint64_t pressure_window;            // of the triggers, in µs
+    uint64_t pressure_action;            // enum pressure_action
+    uint64_t hugetlb_max;                // hugetlb.<size>.max, in bytes, and mount a hugetlbfs
+    uint64_t hugetlb_page_size;          // huge page size of the two, in bytes
+    uint64_t thp;                        // enum thp_mode
+    uint64_t place_cpus;                 // CPUs to put the container on, see `placement_assign()`
+    uint64_t place_smt;                  // enum smt_mode
+    char cpuset_cpus[CGROUP_CPUSET_MAX]; // cpuset.cpus, "" to leave alone
+    char cpuset_mems[CGROUP_CPUSET_MAX]; // cpuset.mems, "" to leave alone
+    char tenant[CGROUP_TENANT_MAX];      // group under CGROUP_SLICE, "" for none
+};
+
+// Counts from memory.events
+struct cgroup_memory_events
+{
+    uint64_t high;     // times memory.high was hit and tasks throttled
+    uint64_t max;      // times memory.max was hit
+    uint64_t oom;      // times allocations failed at memory.max
+    uint64_t oom_kill; // tasks the OOM killer killed
+};
+
+struct container_s;
+
+void cgroup_limits_init(struct cgroup_limits *limits);
+int cgroup_parse_limit(struct cgroup_limits *limits, const char *flag, const char *value);
+int cgroup_check_limits(const struct cgroup_limits *limits);
+int cgroup_watches_pressure(const struct cgroup_limits *limits);
+uint64_t cgroup_hugetlbfs_page_size(const struct cgroup_limits *limits);
+int setup_cgroup(struct container_s *container, const struct cgroup_limits *limits);
+int cgroup_set_limits(struct container_s *container, const struct cgroup_limits *limits);
+int cgroup_set_slice(const struct cgroup_limits *limits);
+int cgroup_attach(struct container_s *container, pid_t child_pid);
+int cleanup_cgroup(struct container_s *container);
+int cgroup_cpu_count(void);
+int cgroup_pressure_trigger(int cgroup_fd, const char *resource, uint64_t stall_us, uint64_t window_us);
+int cgroup_open_memory_events(int cgroup_fd);
+int cgroup_memory_events(int events_fd, struct cgroup_memory_events *events);
+int cgroup_freeze(int cgroup_fd, int frozen);
+int cgroup_open_events(int cgroup_fd);
+int cgroup_events_frozen(int events_fd);
+int cgroup_is_frozen(int cgroup_fd);
+int cgroup_kill(int cgroup_fd);
+int cgroup_raise_memory_high(int cgroup_fd, uint64_t *high);
+uint64_t cgroup_oom_kills(int cgroup_fd);
+uint64_t cgroup_memory_peak(int cgroup_fd);
+
+#endif
@@ -1,36 +1,116 @@
+#define _GNU_SOURCE // for setns and execvpe
 #include "child_process.h"
+#include "bench.h"
+#include "cgroup.h"
+#include "container.h"
 #include "file_system.h"
+#include "ipc.h"
 #include "common.h"
 #include "logging.h"
 #include "util.h"
 
+#include <sys/prctl.h>
+
+// Linux 6.18+, keeps huge pages where the process madvise()s for them
+#ifndef PR_THP_DISABLE_EXCEPT_ADVISED
+#define PR_THP_DISABLE_EXCEPT_ADVISED (1 << 1)
+#endif
+
+// Sets the container's transparent huge page policy, which its processes
+// inherit across fork and exec
+static int set_thp(uint64_t thp)
+{
+    switch (thp)
+    {
+    case THP_NEVER:
+        return prctl(PR_SET_THP_DISABLE, 1, 0, 0, 0);
+    case THP_MADVISE:
+        return prctl(PR_SET_THP_DISABLE, 1, PR_THP_DISABLE_EXCEPT_ADVISED, 0, 0);
+    default:
+        return 0;
+    }
+}
+
+// Runs in the container's child from clone() until exec. The parent may have
+// other threads, whose locks (malloc's, stdio's) the child can have copied
+// while held, so everything here is async-signal-safe: no malloc(), no stdio
+// but LOG(), which writes straight to the descriptor, and _exit() rather than
+// exit().
 int child_function(void *arg)
 {
     struct child_args *args = (struct child_args *)arg;
 
+    // Only keep our end of the sync socket, so we see EOF if the parent dies
+    close(args->parent_fd);
+
+    // Whoever started us (e.g. the daemon) may have blocked signals, which
+    // would otherwise stay blocked across exec
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    // Join the network namespace the parent took from the pool
+    if (args->container->netns_fd >= 0 && setns(args->container->netns_fd, CLONE_NEWNET) == -1)
+    {
+        handle_child_error("setns");
+    }
+
     LOG("Setting hostname...\n");
     sethostname("mocker", 6);
 
     LOG("Setting up container root...\n");
-    setup_container_root();
+    BENCH_START(args->timings, PHASE_CHILD_ROOTFS);
+    setup_container_root(args->container->root, cgroup_hugetlbfs_page_size(args->limits));
+    BENCH_END(args->timings, PHASE_CHILD_ROOTFS);
+
+    if (args->limits != NULL && set_thp(args->limits->thp) == -1)
+    {
+        handle_child_error("prctl PR_SET_THP_DISABLE");
+    }
+
+    // Let the parent know the root is ready
+    if (sync_send(args->sync_fd, SYNC_READY) != 0)
+    {
+        handle_child_error("sync_send");
+    }
 
     LOG("Changing root...\n");
-    if (chroot(CONTAINER_ROOT) == -1)
+    if (chroot(args->container->root) == -1)
     {
-        handle_error("chroot");
+        handle_child_error("chroot");
     }
 
     if (chdir("/") == -1)
     {
-        handle_error("chdir");
+        handle_child_error("chdir");
+    }
+
+    // Don't run anything until the parent has finished cgroup and network
+    // setup and tells us what to run
+    LOG("Waiting for parent...\n");
+    struct exec_request req;
+    if (ipc_recv_exec(args->sync_fd, &req) != 0)
+    {
+        LOG("Parent aborted container setup\n");
+        _exit(EXIT_FAILURE);
+    }
+
+    // Take over the stdio of whoever asked for the command. The received
+    // descriptors are close-on-exec, only the copies survive.
+    for (int i = 0; i < req.nfds; i++)
+    {
+        if (dup2(req.fds[i], i) == -1)
+        {
+            handle_child_error("dup2");
+        }
     }
 
-    char **argv = args->argv;
-    LOG("Attempting to execute: %s\n", argv[3]);
-    if (execvp(argv[3], &argv[3]) == -1)
+    LOG("Attempting to execute: %s\n", req.argv[0]);
+    BENCH_START(args->timings, PHASE_EXEC);
+    if (execvpe(req.argv[0], req.argv, req.envp) == -1)
     {
-        LOG("execvp failed: %s\n", strerror(errno));
-        handle_error("execvp");
+        LOG("execvp failed: %s\n", strerrordesc_np(errno));
+        handle_child_error("execvp");
     }
 
     return 0;
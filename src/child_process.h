@@ -1,9 +1,24 @@
 #ifndef _CHILD_PROCESS_
 #define _CHILD_PROCESS_
 
+struct cgroup_limits;
+struct container_s;
+struct phase_timings;
+
+// Messages exchanged over the sync socket between the parent and the child:
+//   child  -> parent: SYNC_READY once the container root is built
+//   parent -> child:  an IPC_EXEC request (see ipc.h) once cgroup and network
+//                     setup are done, with the command to run
+// The child's end is O_CLOEXEC, so the parent sees EOF once execvp succeeds.
+#define SYNC_READY 'R'
+
 struct child_args
 {
-    char **argv;
+    struct container_s *container;
+    int sync_fd;                   // child's end of the sync socket
+    int parent_fd;                 // parent's end, closed in the child
+    struct phase_timings *timings; // optional, shared with the parent
+    const struct cgroup_limits *limits; // NULL for our defaults
 };
 
 int child_function(void *arg);
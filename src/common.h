@@ -20,5 +20,9 @@
 #include <time.h>
 
 #define CONTAINER_ROOT "/tmp/mocker"
+#define MOCKER_RUN_DIR "/run/mocker"
+#define MOCKER_LIB_DIR "/var/lib/mocker"
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_SLICE "mocker.slice" // under CGROUP_ROOT, holds every container's cgroup
 
 #endif
\ No newline at end of file
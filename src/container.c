@@ -0,0 +1,429 @@
+#define _GNU_SOURCE
+#include "container.h"
+#include "bench.h"
+#include "cgroup.h"
+#include "child_process.h"
+#include "file_system.h"
+#include "ipc.h"
+#include "logging.h"
+#include "networking/netns_pool.h"
+#include "networking/networking.h"
+#include "util.h"
+
+#include <linux/sched.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+#define STACK_SIZE (1024 * 1024)
+// Define namespaces for isolation. The network namespace is only created when
+// there is none left in the pool for the child to join.
+#define CLONE_FLAGS (CLONE_NEWPID | CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWIPC)
+
+// Generates a fresh container ID and derives the container's paths and host
+// interface name from it
+int container_init(struct container_s *container)
+{
+    unsigned char bytes[CONTAINER_ID_LEN / 2];
+
+    memset(container, 0, sizeof(*container));
+    if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes))
+    {
+        LOG("[MAIN] Failed to generate container ID: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i < sizeof(bytes); i++)
+    {
+        snprintf(container->id + 2 * i, 3, "%02x", bytes[i]);
+    }
+
+    snprintf(container->state, sizeof(container->state), "%s/%s", CONTAINER_ROOT, container->id);
+    snprintf(container->root, sizeof(container->root), "%s/rootfs", container->state);
+    snprintf(container->cgroup, sizeof(container->cgroup), "%s/%s/mocker-%s", CGROUP_ROOT, CGROUP_SLICE,
+             container->id);
+    // interface names are limited to 15 characters
+    snprintf(container->veth_host, sizeof(container->veth_host), "veth%.8s", container->id);
+    container->cgroup_fd = -1;
+    container->ipam_slot = -1;
+    container->netns_fd = -1;
+    container->netns_lock_fd = -1;
+
+    LOG("[MAIN] Container ID: %s\n", container->id);
+    return 0;
+}
+
+// Releases a claimed network namespace that the container never used
+static void release_netns(struct container_s *container)
+{
+    if (container->netns_fd >= 0)
+    {
+        // closing the lease drops the lock, which hands the entry back
+        close(container->netns_fd);
+        close(container->netns_lock_fd);
+        container->netns_fd = -1;
+        container->netns_lock_fd = -1;
+    }
+}
+
+// Tears down a partially set up container. What failed already logged why,
+// so `msg` only says which step it was.
+static int abort_container(struct container_proc *proc, const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    // closing the sync socket makes the child bail out before execvp
+    close(proc->sync_fd);
+    kill(proc->pid, SIGKILL);
+    waitpid(proc->pid, NULL, 0);
+    release_netns(&proc->container);
+    cleanup_container_root(&proc->container);
+    cleanup_cgroup(&proc->container);
+    free(proc->stack);
+    return -1;
+}
+
+// Spawns the child straight into its cgroup, so it never runs outside of its
+// limits. Without a stack, clone3() gives the child a copy of ours. Unlike
+// fork(), the raw syscall doesn't reset the locks of malloc and stdio, which
+// another of our threads (the daemon's) may have held, so the child only
+// makes async-signal-safe calls until it execs, see `child_function()`.
+// Kernels before 5.7 can't clone into a cgroup, and get the child moved into
+// it right after clone().
+static pid_t spawn_child(struct container_proc *proc, int clone_flags, struct child_args *args)
+{
+    struct clone_args clone_args = {
+        .flags = clone_flags | CLONE_INTO_CGROUP,
+        .exit_signal = SIGCHLD,
+        .cgroup = proc->container.cgroup_fd,
+    };
+
+    pid_t pid = syscall(SYS_clone3, &clone_args, sizeof(clone_args));
+    if (pid == 0)
+    {
+        _exit(child_function(args));
+    }
+    if (pid != -1 || (errno != ENOSYS && errno != E2BIG && errno != EINVAL))
+    {
+        return pid;
+    }
+
+    LOG("[MAIN] clone3 failed (%s), falling back to clone\n", strerror(errno));
+    proc->stack = malloc(STACK_SIZE);
+    if (proc->stack == NULL)
+    {
+        return -1;
+    }
+
+    pid = clone(child_function, proc->stack + STACK_SIZE, clone_flags | SIGCHLD, args);
+    if (pid != -1 && cgroup_attach(&proc->container, pid) != 0)
+    {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    return pid;
+}
+
+// Clones the child into its cgroup (with `limits`, or our defaults if NULL)
+// and sets up its root (from `image`, see `mount_container_root()`) and
+// network. The child is left parked in its root, waiting for
+// `container_exec()` to tell it what to run. When `timings` is non-NULL it
+// must point to shared memory (see `run_bench()`), since the child records
+// some phases itself.
+int container_start(struct container_proc *proc, const char *image, const struct cgroup_limits *limits,
+                    struct phase_timings *timings)
+{
+    struct container_s *container = &proc->container;
+    if (container_init(container) != 0)
+    {
+        return -1;
+    }
+
+    // sync[0] is the parent's end, sync[1] the child's
+    int sync[2];
+    char msg;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sync) == -1)
+    {
+        perror("socketpair");
+        return -1;
+    }
+
+    // Setup child arguments
+    struct child_args args = {
+        .container = container,
+        .sync_fd = sync[1],
+        .parent_fd = sync[0],
+        .timings = timings,
+        .limits = limits,
+    };
+
+    proc->stack = NULL;
+    proc->timings = timings;
+
+    BENCH_START(timings, PHASE_TOTAL);
+
+    // The root is an overlay on the image's cached layers, so this is a
+    // couple of mounts rather than a copy
+    BENCH_START(timings, PHASE_ROOTFS);
+    if (mount_container_root(container, image) != 0)
+    {
+        fprintf(stderr, "Failed to mount the container root\n");
+        close(sync[0]);
+        close(sync[1]);
+        return -1;
+    }
+    BENCH_END(timings, PHASE_ROOTFS);
+
+    // The limits are in place before the child exists
+    BENCH_START(timings, PHASE_CGROUP);
+    if (setup_cgroup(container, limits) != 0)
+    {
+        perror("setup_cgroup");
+        cleanup_container_root(container);
+        close(sync[0]);
+        close(sync[1]);
+        return -1;
+    }
+    BENCH_END(timings, PHASE_CGROUP);
+
+    // Take a ready-made network namespace if there is one
+    int clone_flags = CLONE_FLAGS;
+    if (netns_pool_claim(container) != 0)
+    {
+        clone_flags |= CLONE_NEWNET;
+    }
+
+    // Create new process with namespaces
+    BENCH_START(timings, PHASE_CLONE);
+    proc->pid = spawn_child(proc, clone_flags, &args);
+    BENCH_END(timings, PHASE_CLONE);
+    if (proc->pid == -1)
+    {
+        perror("clone");
+        release_netns(container);
+        cleanup_container_root(container);
+        cleanup_cgroup(container);
+        close(sync[0]);
+        close(sync[1]);
+        free(proc->stack);
+        return -1;
+    }
+    close(sync[1]);
+    proc->sync_fd = sync[0];
+
+    // let the child finish its mounts before we touch its network
+    if (sync_recv(proc->sync_fd, &msg) != 0 || msg != SYNC_READY)
+    {
+        LOG("[MAIN] Warning: Child exited before the container root was ready\n");
+        return abort_container(proc, "Failed to set up the container root");
+    }
+
+    // Now setup networking
+    LOG("[MAIN] Setting up networking...\n");
+    BENCH_START(timings, PHASE_NETWORK);
+    if (setup_networking(container, proc->pid) != 0)
+    {
+        LOG("[MAIN] Warning: Failed to setup networking\n");
+        return abort_container(proc, "Failed to set up the container's network");
+    }
+    else
+    {
+        LOG("[MAIN] Network setup complete\n");
+    }
+    BENCH_END(timings, PHASE_NETWORK);
+
+    return 0;
+}
+
+// Hands the parked child the command to run, with its environment and stdio,
+// and waits until it has been exec'd
+int container_exec(struct container_proc *proc, char *const argv[], char *const envp[], const int fds[])
+{
+    char msg;
+
+    if (ipc_send_exec(proc->sync_fd, NULL, NULL, argv, envp, fds) != 0)
+    {
+        LOG("[MAIN] Failed to send command to container %s\n", proc->container.id);
+        return -1;
+    }
+
+    // Wait for the child's end of the socket to be closed on exec (or on
+    // exit, if execvp failed)
+    sync_recv(proc->sync_fd, &msg);
+    BENCH_END(proc->timings, PHASE_EXEC);
+    close(proc->sync_fd);
+    proc->sync_fd = -1;
+
+    // Replace the namespace we took, now that the container is running
+    if (proc->container.netns_fd >= 0)
+    {
+        netns_pool_refill();
+    }
+
+    return 0;
+}
+
+// Waits for the container to exit and detaches its root, which is all the
+// teardown there is to do for it. Returns the container's wait status, or -1
+// if it can't be waited for, in which case it is torn down all the same: this
+// runs in processes that supervise many containers (the daemon, batch
+// workers), which have to carry on.
+static int reap_container(struct container_proc *proc)
+{
+    struct phase_timings *timings = proc->timings;
+    int status;
+    pid_t ret;
+
+    do
+    {
+        ret = wait4(proc->pid, &status, 0, &proc->rusage);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1)
+    {
+        fprintf(stderr, "Failed to wait for container %s: %s\n", proc->container.id, strerror(errno));
+        memset(&proc->rusage, 0, sizeof(proc->rusage));
+        status = -1;
+    }
+
+    // A failure may be the OOM killer's doing, which only the cgroup knows
+    // about until it is removed
+    uint64_t oom_kills = status != 0 ? cgroup_oom_kills(proc->container.cgroup_fd) : 0;
+    if (oom_kills > 0)
+    {
+        fprintf(stderr, "The OOM killer killed %llu of container %s's processes (memory.max)\n",
+                (unsigned long long)oom_kills, proc->container.id);
+    }
+
+    BENCH_START(timings, PHASE_CLEANUP_ROOTFS);
+    cleanup_container_root(&proc->container);
+    BENCH_END(timings, PHASE_CLEANUP_ROOTFS);
+
+    free(proc->stack);
+    proc->stack = NULL;
+
+    // Report exit status
+    if (status == -1)
+    {
+        LOG("Container exited, but couldn't be waited for\n");
+    }
+    else if (WIFEXITED(status))
+    {
+        LOG("Container exited with status %d\n", WEXITSTATUS(status));
+    }
+    else if (WIFSIGNALED(status))
+    {
+        LOG("Container killed by signal %d\n", WTERMSIG(status));
+    }
+
+    return status;
+}
+
+// Removes the rest of an exited container: its veth pair, lease and NAT
+// reference (or its pooled namespace) and its cgroup
+static void release_container(struct container_proc *proc)
+{
+    struct phase_timings *timings = proc->timings;
+
+    BENCH_START(timings, PHASE_CLEANUP_NETWORK);
+    cleanup_networking(&proc->container);
+    BENCH_END(timings, PHASE_CLEANUP_NETWORK);
+
+    BENCH_START(timings, PHASE_CLEANUP_CGROUP);
+    cleanup_cgroup(&proc->container);
+    BENCH_END(timings, PHASE_CLEANUP_CGROUP);
+}
+
+// Waits for the container to exit, tears it down and returns its wait status
+int container_wait(struct container_proc *proc)
+{
+    int status = reap_container(proc);
+    release_container(proc);
+    BENCH_END(proc->timings, PHASE_TOTAL);
+    return status;
+}
+
+// Like `container_wait()`, but returns as soon as the container has exited
+// and hands the rest of the teardown to a detached reaper process. Only for
+// callers that don't set up more containers afterwards, since the reaper
+// drops this process's NAT reference on its behalf.
+int container_wait_async(struct container_proc *proc)
+{
+    int status = reap_container(proc);
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        LOG("[MAIN] Failed to fork reaper: %s\n", strerror(errno));
+        release_container(proc);
+        return status;
+    }
+
+    if (pid == 0)
+    {
+        // Fork again so the reaper is reparented to init instead of
+        // becoming our zombie
+        if (fork() == 0)
+        {
+            // Let go of our caller's terminal and pipes, so whoever reads
+            // our output sees EOF as soon as we exit. The descriptors of a
+            // pooled namespace stay open, recycling it needs them.
+            int null_fd = open("/dev/null", O_RDWR);
+            if (null_fd != -1)
+            {
+                dup2(null_fd, STDIN_FILENO);
+                dup2(null_fd, STDOUT_FILENO);
+                dup2(null_fd, STDERR_FILENO);
+                if (null_fd > STDERR_FILENO)
+                {
+                    close(null_fd);
+                }
+            }
+            setsid();
+            release_container(proc);
+            _exit(EXIT_SUCCESS);
+        }
+        _exit(EXIT_SUCCESS);
+    }
+
+    waitpid(pid, NULL, 0);
+
+    // the reaper has its own copy
+    close(proc->container.cgroup_fd);
+    proc->container.cgroup_fd = -1;
+    return status;
+}
+
+// Tears down a container that is still parked, i.e. was never given a command
+void container_stop(struct container_proc *proc)
+{
+    // closing the sync socket makes the child bail out before execvp
+    close(proc->sync_fd);
+    proc->sync_fd = -1;
+    if (proc->container.cgroup_fd == -1 || cgroup_kill(proc->container.cgroup_fd) == -1)
+    {
+        kill(proc->pid, SIGKILL);
+    }
+    container_wait(proc);
+}
+
+// Runs a single container to completion and returns its wait status. Unless
+// the phases are being timed, the container is torn down in the background.
+int run_container(const char *image, char **cmd, const struct cgroup_limits *limits, struct phase_timings *timings)
+{
+    struct container_proc proc;
+    const int stdio[IPC_MAX_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+
+    if (container_start(&proc, image, limits, timings) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    if (container_exec(&proc, cmd, environ, stdio) != 0)
+    {
+        container_stop(&proc);
+        handle_error("container_exec");
+    }
+
+    return timings != NULL ? container_wait(&proc) : container_wait_async(&proc);
+}
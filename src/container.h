@@ -0,0 +1,58 @@
+#ifndef _CONTAINER_H_
+#define _CONTAINER_H_
+
+#include "cgroup.h"
+#include "common.h"
+
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+
+// hex characters in a container ID
+#define CONTAINER_ID_LEN 12
+
+// Everything that has to be unique per container, so that any number of them
+// can run side by side without stepping on each other's paths or interfaces.
+struct container_s
+{
+    char id[CONTAINER_ID_LEN + 1];
+    char state[PATH_MAX];                 // CONTAINER_ROOT/<id>, a tmpfs
+    char root[PATH_MAX + 8];              // <state>/rootfs, an overlay
+    char cgroup[PATH_MAX];                // CGROUP_ROOT/CGROUP_SLICE/[<tenant>/]mocker-<id>
+    int cgroup_fd;                        // the cgroup's directory, or -1
+    int placed;                           // holds CPUs, see `placement_assign()`
+    char veth_host[IF_NAMESIZE];          // host end of the veth pair
+    char network[INET_ADDRSTRLEN + 3];    // subnet the addresses came from
+    char gateway[INET_ADDRSTRLEN];        // on the bridge
+    char container_ip[INET_ADDRSTRLEN];   // on the container end
+    int prefix_len;
+    int ipam_slot;                        // -1 until addresses are leased
+    pid_t ipam_owner;                     // process that leased them
+    char netns_id[CONTAINER_ID_LEN + 1];  // network namespace pool entry, if any
+    int netns_fd;                         // pooled namespace to join, or -1
+    int netns_lock_fd;                    // held while the pool entry is ours
+};
+
+struct phase_timings;
+
+// A container's child process and what the parent needs to drive it
+struct container_proc
+{
+    struct container_s container;
+    pid_t pid;
+    int sync_fd;                   // parent's end of the sync socket
+    char *stack;                   // only if clone3() isn't available
+    struct phase_timings *timings; // optional, see `container_start()`
+    struct rusage rusage;          // of the child, once it has exited
+};
+
+int container_init(struct container_s *container);
+int container_start(struct container_proc *proc, const char *image, const struct cgroup_limits *limits,
+                    struct phase_timings *timings);
+int container_exec(struct container_proc *proc, char *const argv[], char *const envp[], const int fds[]);
+int container_wait(struct container_proc *proc);
+int container_wait_async(struct container_proc *proc);
+void container_stop(struct container_proc *proc);
+int run_container(const char *image, char **cmd, const struct cgroup_limits *limits, struct phase_timings *timings);
+
+#endif
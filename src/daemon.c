@@ -0,0 +1,1370 @@
+#define _GNU_SOURCE
+#include "daemon.h"
+#include "container.h"
+#include "ipc.h"
+#include "logging.h"
+#include "stats.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <linux/sockios.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#define MAX_EVENTS 64
+
+// Text replies (`mocker list`) are built in one buffer
+#define REPLY_SIZE 65536
+
+// How long `mocker pause` and `mocker resume` wait for every task of the
+// container to get there, which normally takes microseconds
+#define FREEZE_TIMEOUT_MS 1000
+
+// What an epoll event is about
+enum watch_kind
+{
+    WATCH_LISTEN, // new connection on the daemon socket
+    WATCH_SIGNAL, // SIGINT or SIGTERM on the signalfd
+    WATCH_CLIENT, // request from a connected client
+    WATCH_EXIT,   // container exited, on its pidfd
+    WATCH_STATS,  // time to send a `mocker stats --interval` client samples, on a timerfd
+    WATCH_PRESSURE, // a container's PSI trigger fired or its memory.events changed
+    WATCH_LIFECYCLE, // the lifecycle thread is done with a container, on its pipe
+    WATCH_FREEZE,   // a container being paused or resumed got there, on its cgroup.events
+    WATCH_FREEZE_TIMEOUT, // it took too long, on a timerfd
+};
+
+struct watch
+{
+    enum watch_kind kind;
+    int fd;
+};
+
+// The struct that has `watch` as its `member`
+#define WATCH_OWNER(watch, type, member) ((type *)((char *)(watch) - offsetof(type, member)))
+
+// Which pressure watch is which
+enum pressure_source
+{
+    PRESSURE_CPU,
+    PRESSURE_MEMORY,
+    PRESSURE_IO,
+    PRESSURE_MEMORY_EVENTS,
+    PRESSURE_SOURCES,
+};
+
+static const char *const pressure_resources[] = {
+    [PRESSURE_CPU] = "cpu",
+    [PRESSURE_MEMORY] = "memory",
+    [PRESSURE_IO] = "io",
+};
+
+struct supervised;
+
+// Where a container is in its life. Setting it up and tearing it down happen
+// on the lifecycle thread, everything in between on the event loop.
+enum container_state
+{
+    CONTAINER_STARTING, // queued or being set up
+    CONTAINER_RUNNING,  // in `daemon->containers`
+    CONTAINER_EXITED,   // queued or being torn down
+};
+
+// A PSI trigger or memory.events of a container
+struct pressure_watch
+{
+    struct watch watch;           // kind WATCH_PRESSURE, fd -1 if not watched
+    struct supervised *container;
+    enum pressure_source source;
+};
+
+// A container supervised by the daemon
+struct supervised
+{
+    struct watch exit;          // kind WATCH_EXIT, on the pidfd
+    struct container_proc proc;
+    int client_fd;              // `mocker run` waiting for the exit status
+    time_t started;
+    char image[64];             // for `mocker list`
+    char command[256];          // for `mocker list`
+    struct stats_files stats;   // for `mocker stats`
+    struct pressure_watch pressure[PRESSURE_SOURCES];
+    struct cgroup_memory_events memory_events; // counts last seen
+    uint64_t pressure_window;   // in µs
+    enum pressure_action pressure_action;
+    enum container_state state;
+    struct exec_request req;    // the `mocker run` request, until the command runs
+    const char *error;          // why it failed to start, if it did
+    int status;                 // wait status, once torn down
+    struct stats_sample last;   // taken as it exited
+    struct supervised *queued;  // next in the lifecycle queue
+    struct supervised *next;
+};
+
+// A `mocker pause` or `mocker resume` waiting for every task of the
+// container to get there
+struct freeze_wait
+{
+    struct watch events; // kind WATCH_FREEZE, on cgroup.events
+    struct watch timer;  // kind WATCH_FREEZE_TIMEOUT
+    struct supervised *container;
+    int client_fd;       // -1 once it was answered
+    int frozen;          // what it waits for
+    struct timespec start;
+    struct freeze_wait *next;
+};
+
+// A connected client whose request is still coming in
+struct client
+{
+    struct watch watch; // kind WATCH_CLIENT
+    struct ipc_partial msg;
+};
+
+// Setting up a container (its root, cgroup and network) and tearing it down
+// take milliseconds, so that happens on a thread of its own while the event
+// loop keeps serving exits, stats and pressure. The thread takes containers
+// one at a time, as they share this process's NAT reference, and hands each
+// one back on a pipe when it's done with it.
+struct lifecycle
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct supervised *head; // oldest first
+    struct supervised **tail;
+    int stopping;
+    int running;             // whether the thread is there to take containers
+    struct watch done;       // kind WATCH_LIFECYCLE, the pipe's read end
+    int done_write;
+};
+
+// A `mocker stats --interval` client, sent samples on every tick of its
+// timer and the last sample of every container that exits
+struct stats_stream
+{
+    struct watch timer;         // kind WATCH_STATS, on the timerfd
+    int client_fd;
+    char id[CONTAINER_ID_LEN + 1]; // prefix of the containers to sample, "" for all
+    struct stats_stream *next;
+};
+
+struct daemon_s
+{
+    int epoll_fd;
+    struct watch listen;
+    struct watch signal;
+    struct supervised *containers;
+    struct stats_stream *streams;
+    struct freeze_wait *freezes;
+    struct lifecycle lifecycle;
+};
+
+static int pidfd_open(pid_t pid)
+{
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+static int pidfd_send_signal(int pidfd, int sig)
+{
+    return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
+
+static int watch_add_events(struct daemon_s *daemon, struct watch *watch, uint32_t events)
+{
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = watch,
+    };
+
+    return epoll_ctl(daemon->epoll_fd, EPOLL_CTL_ADD, watch->fd, &ev);
+}
+
+static int watch_add(struct daemon_s *daemon, struct watch *watch)
+{
+    return watch_add_events(daemon, watch, EPOLLIN);
+}
+
+static void reply(int fd, uint32_t type, const char *text)
+{
+    ipc_send(fd, type, text, strlen(text), NULL, 0);
+}
+
+// Finds a container by (a prefix of) its ID
+static struct supervised *find_container(struct daemon_s *daemon, const char *id)
+{
+    size_t len = strlen(id);
+    if (len == 0)
+    {
+        return NULL;
+    }
+
+    for (struct supervised *c = daemon->containers; c != NULL; c = c->next)
+    {
+        if (strncmp(c->proc.container.id, id, len) == 0)
+        {
+            return c;
+        }
+    }
+
+    return NULL;
+}
+
+static void close_pressure(struct supervised *c)
+{
+    for (int i = 0; i < PRESSURE_SOURCES; i++)
+    {
+        // closing it also removes it from the epoll set
+        if (c->pressure[i].watch.fd != -1)
+        {
+            close(c->pressure[i].watch.fd);
+            c->pressure[i].watch.fd = -1;
+        }
+    }
+}
+
+// Registers the PSI triggers the container asked for, and watches its
+// memory.events for OOMs, all in our epoll set
+static int watch_pressure(struct daemon_s *daemon, struct supervised *c, const struct cgroup_limits *limits)
+{
+    const uint64_t thresholds[] = {
+        [PRESSURE_CPU] = limits->pressure_cpu,
+        [PRESSURE_MEMORY] = limits->pressure_memory,
+        [PRESSURE_IO] = limits->pressure_io,
+    };
+    int cgroup_fd = c->proc.container.cgroup_fd;
+
+    c->pressure_window = limits->pressure_window;
+    c->pressure_action = limits->pressure_action;
+    for (int i = 0; i < PRESSURE_SOURCES; i++)
+    {
+        c->pressure[i].watch.kind = WATCH_PRESSURE;
+        c->pressure[i].watch.fd = -1;
+        c->pressure[i].container = c;
+        c->pressure[i].source = i;
+    }
+
+    for (int i = PRESSURE_CPU; i <= PRESSURE_IO; i++)
+    {
+        if (thresholds[i] == CGROUP_UNSET)
+        {
+            continue;
+        }
+
+        c->pressure[i].watch.fd = cgroup_pressure_trigger(cgroup_fd, pressure_resources[i], thresholds[i],
+                                                          limits->pressure_window);
+        if (c->pressure[i].watch.fd == -1 || watch_add_events(daemon, &c->pressure[i].watch, EPOLLPRI) != 0)
+        {
+            close_pressure(c);
+            return -1;
+        }
+    }
+
+    // without the memory controller, there's nothing to watch
+    struct pressure_watch *events = &c->pressure[PRESSURE_MEMORY_EVENTS];
+    events->watch.fd = cgroup_open_memory_events(cgroup_fd);
+    if (events->watch.fd != -1 && (cgroup_memory_events(events->watch.fd, &c->memory_events) != 0 ||
+                                   watch_add_events(daemon, &events->watch, EPOLLPRI) != 0))
+    {
+        close(events->watch.fd);
+        events->watch.fd = -1;
+    }
+
+    return 0;
+}
+
+static void close_stream(struct daemon_s *daemon, struct stats_stream *stream)
+{
+    for (struct stats_stream **p = &daemon->streams; *p != NULL; p = &(*p)->next)
+    {
+        if (*p == stream)
+        {
+            *p = stream->next;
+            break;
+        }
+    }
+
+    // closing the timerfd also removes it from the epoll set
+    close(stream->timer.fd);
+    close(stream->client_fd);
+    free(stream);
+}
+
+// Sends a `mocker stats --interval` client a message without blocking. A
+// client that stopped reading, i.e. is piped into a pager or suspended, fills
+// its socket and is dropped, rather than holding up the event loop.
+static void stream_send(struct daemon_s *daemon, struct stats_stream *stream, uint32_t type, const void *payload,
+                        size_t len)
+{
+    if (ipc_send(stream->client_fd, type, payload, len, NULL, 0) != 0)
+    {
+        LOG("[DAEMON] Dropping stats client: %s\n", strerror(errno));
+        close_stream(daemon, stream);
+    }
+}
+
+// Reports something that happened to a container, as a line of JSON on our
+// stdout and to every `mocker stats --interval` client watching it. `fields`
+// are more JSON members, each starting with a comma.
+static void emit_event(struct daemon_s *daemon, struct supervised *c, const char *event, const char *fields)
+{
+    char json[256];
+
+    snprintf(json, sizeof(json), "{\"id\":\"%s\",\"event\":\"%s\"%s}", c->proc.container.id, event, fields);
+    printf("%s\n", json);
+
+    for (struct stats_stream *s = daemon->streams, *next; s != NULL; s = next)
+    {
+        next = s->next;
+        if (strncmp(c->proc.container.id, s->id, strlen(s->id)) == 0)
+        {
+            stream_send(daemon, s, IPC_EVENT, json, strlen(json));
+        }
+    }
+}
+
+// A PSI trigger of the container fired, or its memory.events changed. The
+// first gets the container's --on-pressure action, the OOMs only reported.
+static void handle_pressure(struct daemon_s *daemon, struct pressure_watch *pressure)
+{
+    struct supervised *c = pressure->container;
+    int cgroup_fd = c->proc.container.cgroup_fd;
+    char fields[160];
+    uint64_t high;
+
+    if (pressure->source == PRESSURE_MEMORY_EVENTS)
+    {
+        struct cgroup_memory_events events;
+        if (cgroup_memory_events(pressure->watch.fd, &events) != 0)
+        {
+            return;
+        }
+
+        if (events.oom > c->memory_events.oom)
+        {
+            snprintf(fields, sizeof(fields), ",\"count\":%llu", (unsigned long long)events.oom);
+            emit_event(daemon, c, "oom", fields);
+        }
+
+        if (events.oom_kill > c->memory_events.oom_kill)
+        {
+            snprintf(fields, sizeof(fields), ",\"count\":%llu", (unsigned long long)events.oom_kill);
+            emit_event(daemon, c, "oom_kill", fields);
+        }
+
+        c->memory_events = events;
+        return;
+    }
+
+    int len = snprintf(fields, sizeof(fields), ",\"resource\":\"%s\",\"window_us\":%llu",
+                       pressure_resources[pressure->source], (unsigned long long)c->pressure_window);
+
+    switch (c->pressure_action)
+    {
+    case PRESSURE_EVENT:
+        break;
+    case PRESSURE_RAISE_HIGH:
+        // only memory.high eases memory pressure, and only if it is set
+        if (pressure->source == PRESSURE_MEMORY && cgroup_raise_memory_high(cgroup_fd, &high) == 0)
+        {
+            snprintf(fields + len, sizeof(fields) - len, ",\"memory_high\":%llu", (unsigned long long)high);
+        }
+        break;
+    case PRESSURE_FREEZE:
+        if (cgroup_freeze(cgroup_fd, 1) == 0)
+        {
+            snprintf(fields + len, sizeof(fields) - len, ",\"frozen\":true");
+        }
+        break;
+    }
+
+    LOG("[DAEMON] Container %s is under %s pressure\n", c->proc.container.id, pressure_resources[pressure->source]);
+    emit_event(daemon, c, "pressure", fields);
+}
+
+// Replies to a `mocker pause` or `mocker resume` client, with `error`, or
+// with how long the container took to get there. The wait is freed after the
+// current batch of events, which may still mention it.
+static void finish_freeze(struct daemon_s *daemon, struct freeze_wait *wait, const char *error)
+{
+    struct supervised *c = wait->container;
+    const char *done = wait->frozen ? "paused" : "resumed";
+    char text[128];
+    struct timespec end;
+
+    if (error != NULL)
+    {
+        snprintf(text, sizeof(text), "%s %s, %s\n", c->proc.container.id, done, error);
+    }
+    else
+    {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long usec = (end.tv_sec - wait->start.tv_sec) * 1000000 + (end.tv_nsec - wait->start.tv_nsec) / 1000;
+        LOG("[DAEMON] Container %s %s in %ldus\n", c->proc.container.id, done, usec);
+        emit_event(daemon, c, done, "");
+        snprintf(text, sizeof(text), "%s %s in %ldus\n", c->proc.container.id, done, usec);
+    }
+
+    reply(wait->client_fd, IPC_REPLY, text);
+    close(wait->client_fd);
+    wait->client_fd = -1;
+
+    // closing them also removes them from the epoll set
+    close(wait->events.fd);
+    if (wait->timer.fd != -1)
+    {
+        close(wait->timer.fd);
+    }
+}
+
+// The container's cgroup.events changed, or we look at it for the first time
+static void handle_freeze(struct daemon_s *daemon, struct freeze_wait *wait)
+{
+    if (wait->client_fd == -1)
+    {
+        return;
+    }
+
+    int state = cgroup_events_frozen(wait->events.fd);
+    if (state == wait->frozen)
+    {
+        finish_freeze(daemon, wait, NULL);
+    }
+    else if (state == -1)
+    {
+        finish_freeze(daemon, wait, "but it can't be told whether it got there");
+    }
+}
+
+// Waiting for a freeze took longer than FREEZE_TIMEOUT_MS
+static void handle_freeze_timeout(struct daemon_s *daemon, struct freeze_wait *wait)
+{
+    if (wait->client_fd != -1)
+    {
+        finish_freeze(daemon, wait, wait->frozen ? "still freezing" : "still thawing");
+    }
+}
+
+// The container exited while `mocker pause` or `mocker resume` waited for it
+static void cancel_freezes(struct daemon_s *daemon, struct supervised *c)
+{
+    for (struct freeze_wait *wait = daemon->freezes; wait != NULL; wait = wait->next)
+    {
+        if (wait->container == c && wait->client_fd != -1)
+        {
+            finish_freeze(daemon, wait, "but it exited");
+        }
+    }
+}
+
+// Frees the waits that are done, once no event of the batch mentions them
+static void reap_freezes(struct daemon_s *daemon)
+{
+    for (struct freeze_wait **p = &daemon->freezes; *p != NULL;)
+    {
+        struct freeze_wait *wait = *p;
+        if (wait->client_fd == -1)
+        {
+            *p = wait->next;
+            free(wait);
+        }
+        else
+        {
+            p = &wait->next;
+        }
+    }
+}
+
+// Kills every task of the container in one go with cgroup.kill, so nothing
+// its init forked lingers, or only its init where cgroup.kill isn't
+// available. The container's init is PID 1 in its namespace and ignores
+// signals it has no handler for, except SIGKILL. Its exit shows up on the
+// pidfd either way.
+static int kill_container(struct supervised *c)
+{
+    if (c->proc.container.cgroup_fd != -1 && cgroup_kill(c->proc.container.cgroup_fd) == 0)
+    {
+        return 0;
+    }
+
+    return pidfd_send_signal(c->exit.fd, SIGKILL);
+}
+
+// Tells the `mocker run` client the container won't run its command after all
+static void fail_run(struct supervised *c, const char *error)
+{
+    reply(c->client_fd, IPC_ERROR, error);
+    close(c->client_fd);
+    c->client_fd = -1;
+}
+
+// Sets up a container and runs its command, or tears it down once it exited.
+// Runs on the lifecycle thread.
+static void lifecycle_step(struct supervised *c)
+{
+    if (c->state == CONTAINER_EXITED)
+    {
+        // the child has already exited, so this only reaps it and cleans up
+        c->status = container_wait(&c->proc);
+        return;
+    }
+
+    if (container_start(&c->proc, c->req.image, &c->req.limits, NULL) != 0)
+    {
+        c->error = "Failed to start container";
+    }
+    else if (container_exec(&c->proc, c->req.argv, c->req.envp, c->req.fds) != 0)
+    {
+        container_stop(&c->proc);
+        c->error = "Failed to run command";
+    }
+}
+
+static void *lifecycle_thread(void *arg)
+{
+    struct lifecycle *lifecycle = arg;
+
+    pthread_mutex_lock(&lifecycle->lock);
+    for (;;)
+    {
+        while (lifecycle->head == NULL && !lifecycle->stopping)
+        {
+            pthread_cond_wait(&lifecycle->wake, &lifecycle->lock);
+        }
+
+        // what's queued still gets done when stopping
+        struct supervised *c = lifecycle->head;
+        if (c == NULL)
+        {
+            break;
+        }
+        lifecycle->head = c->queued;
+        if (lifecycle->head == NULL)
+        {
+            lifecycle->tail = &lifecycle->head;
+        }
+        pthread_mutex_unlock(&lifecycle->lock);
+
+        lifecycle_step(c);
+        if (write(lifecycle->done_write, &c, sizeof(c)) != sizeof(c))
+        {
+            LOG("[DAEMON] Failed to hand back container %s: %s\n", c->proc.container.id, strerror(errno));
+        }
+
+        pthread_mutex_lock(&lifecycle->lock);
+    }
+    pthread_mutex_unlock(&lifecycle->lock);
+    return NULL;
+}
+
+static void handle_exit(struct daemon_s *daemon, struct supervised *c);
+static void cancel_freezes(struct daemon_s *daemon, struct supervised *c);
+static void lifecycle_done(struct daemon_s *daemon, struct supervised *c);
+
+// Hands a container to the lifecycle thread, or sets it up or tears it down
+// right here once the thread is gone
+static void lifecycle_queue(struct daemon_s *daemon, struct supervised *c)
+{
+    struct lifecycle *lifecycle = &daemon->lifecycle;
+
+    if (!lifecycle->running)
+    {
+        lifecycle_step(c);
+        lifecycle_done(daemon, c);
+        return;
+    }
+
+    c->queued = NULL;
+    pthread_mutex_lock(&lifecycle->lock);
+    *lifecycle->tail = c;
+    lifecycle->tail = &c->queued;
+    pthread_cond_signal(&lifecycle->wake);
+    pthread_mutex_unlock(&lifecycle->lock);
+}
+
+static int lifecycle_start(struct daemon_s *daemon)
+{
+    struct lifecycle *lifecycle = &daemon->lifecycle;
+    int fds[2];
+
+    // only the read end is non-blocking, the thread may wait for room
+    if (pipe2(fds, O_CLOEXEC) == -1 || fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1)
+    {
+        return -1;
+    }
+
+    lifecycle->done.kind = WATCH_LIFECYCLE;
+    lifecycle->done.fd = fds[0];
+    lifecycle->done_write = fds[1];
+    lifecycle->head = NULL;
+    lifecycle->tail = &lifecycle->head;
+    lifecycle->stopping = 0;
+    pthread_mutex_init(&lifecycle->lock, NULL);
+    pthread_cond_init(&lifecycle->wake, NULL);
+    if (watch_add(daemon, &lifecycle->done) != 0)
+    {
+        return -1;
+    }
+
+    // Without the thread, containers are set up on the event loop
+    lifecycle->running = pthread_create(&lifecycle->thread, NULL, lifecycle_thread, lifecycle) == 0;
+    if (!lifecycle->running)
+    {
+        LOG("[DAEMON] Failed to start the lifecycle thread, setting up containers inline\n");
+    }
+
+    return 0;
+}
+
+// Lets the thread finish what's queued and waits for it
+static void lifecycle_stop(struct daemon_s *daemon)
+{
+    struct lifecycle *lifecycle = &daemon->lifecycle;
+
+    if (lifecycle->running)
+    {
+        pthread_mutex_lock(&lifecycle->lock);
+        lifecycle->stopping = 1;
+        pthread_cond_signal(&lifecycle->wake);
+        pthread_mutex_unlock(&lifecycle->lock);
+        pthread_join(lifecycle->thread, NULL);
+        lifecycle->running = 0;
+    }
+}
+
+// i.e. mocker run (through the daemon). The container is set up on the
+// lifecycle thread, and the client hears back once it exits.
+static void handle_run(struct daemon_s *daemon, int client_fd, struct exec_request *req)
+{
+    if (cgroup_check_limits(&req->limits) != 0)
+    {
+        reply(client_fd, IPC_ERROR, "Invalid limits");
+        close(client_fd);
+        exec_request_free(req);
+        return;
+    }
+
+    struct supervised *c = calloc(1, sizeof(*c));
+    if (c == NULL)
+    {
+        reply(client_fd, IPC_ERROR, "Out of memory");
+        close(client_fd);
+        exec_request_free(req);
+        return;
+    }
+
+    c->state = CONTAINER_STARTING;
+    c->req = *req;
+    c->client_fd = client_fd;
+    c->exit.fd = -1;
+    for (int i = 0; i < PRESSURE_SOURCES; i++)
+    {
+        c->pressure[i].watch.fd = -1;
+    }
+
+    lifecycle_queue(daemon, c);
+}
+
+// The lifecycle thread set up the container and ran its command, or failed to
+static void finish_start(struct daemon_s *daemon, struct supervised *c)
+{
+    if (c->error != NULL)
+    {
+        fail_run(c, c->error);
+        exec_request_free(&c->req);
+        free(c);
+        return;
+    }
+
+    c->state = CONTAINER_RUNNING;
+    c->started = time(NULL);
+    stats_open(&c->stats, c->proc.container.cgroup_fd);
+    snprintf(c->image, sizeof(c->image), "%s", c->req.image);
+    for (size_t i = 0, len = 0; c->req.argv[i] != NULL && len < sizeof(c->command) - 1; i++)
+    {
+        len += snprintf(c->command + len, sizeof(c->command) - len, "%s%s", i ? " " : "", c->req.argv[i]);
+    }
+
+    c->next = daemon->containers;
+    daemon->containers = c;
+
+    c->exit.kind = WATCH_EXIT;
+    c->exit.fd = pidfd_open(c->proc.pid);
+    if (c->exit.fd == -1 || watch_add(daemon, &c->exit) != 0)
+    {
+        // Without a pidfd we'd never notice the exit, so it goes right away
+        LOG("[DAEMON] Failed to watch container %s: %s\n", c->proc.container.id, strerror(errno));
+        fail_run(c, "Failed to watch the container");
+        if (c->proc.container.cgroup_fd == -1 || cgroup_kill(c->proc.container.cgroup_fd) == -1)
+        {
+            kill(c->proc.pid, SIGKILL);
+        }
+        exec_request_free(&c->req);
+        handle_exit(daemon, c);
+        return;
+    }
+
+    // its exit shows up on the pidfd, and is cleaned up from there
+    if (watch_pressure(daemon, c, &c->req.limits) != 0)
+    {
+        fail_run(c, "Failed to watch the container's pressure");
+        kill_container(c);
+    }
+
+    // the client's fds are duplicated into the container, so we can let go
+    // of ours. The client itself stays open until the container exits.
+    exec_request_free(&c->req);
+    LOG("[DAEMON] Started container %s (pid %d)\n", c->proc.container.id, c->proc.pid);
+}
+
+// The container's pidfd became readable, i.e. it exited. Takes its last
+// sample and hands it to the lifecycle thread to be torn down.
+static void handle_exit(struct daemon_s *daemon, struct supervised *c)
+{
+    for (struct supervised **p = &daemon->containers; *p != NULL; p = &(*p)->next)
+    {
+        if (*p == c)
+        {
+            *p = c->next;
+            break;
+        }
+    }
+
+    cancel_freezes(daemon, c);
+
+    // the last sample, before the cgroup goes away
+    stats_sample(&c->stats, c->proc.container.id, &c->last);
+    stats_close(&c->stats);
+    close_pressure(c);
+
+    // closing the pidfd also removes it from the epoll set
+    if (c->exit.fd != -1)
+    {
+        close(c->exit.fd);
+        c->exit.fd = -1;
+    }
+
+    c->state = CONTAINER_EXITED;
+    lifecycle_queue(daemon, c);
+}
+
+// The lifecycle thread tore down an exited container
+static void finish_exit(struct daemon_s *daemon, struct supervised *c)
+{
+    LOG("[DAEMON] Container %s exited (status %d)\n", c->proc.container.id, c->status);
+
+    c->last.exited = 1;
+    c->last.status = c->status;
+    c->last.rusage = c->proc.rusage;
+    for (struct stats_stream *s = daemon->streams, *next; s != NULL; s = next)
+    {
+        next = s->next;
+        if (strncmp(c->last.id, s->id, strlen(s->id)) == 0)
+        {
+            stream_send(daemon, s, IPC_SAMPLES, &c->last, sizeof(c->last));
+        }
+    }
+
+    if (c->client_fd != -1 && c->status == -1)
+    {
+        fail_run(c, "Failed to wait for the container to exit");
+    }
+    else if (c->client_fd != -1)
+    {
+        ipc_send(c->client_fd, IPC_STATUS, &c->status, sizeof(c->status), NULL, 0);
+        close(c->client_fd);
+    }
+    free(c);
+}
+
+static void lifecycle_done(struct daemon_s *daemon, struct supervised *c)
+{
+    if (c->state == CONTAINER_EXITED)
+    {
+        finish_exit(daemon, c);
+    }
+    else
+    {
+        finish_start(daemon, c);
+    }
+}
+
+// The lifecycle thread's pipe became readable
+static void handle_lifecycle(struct daemon_s *daemon)
+{
+    struct supervised *c;
+
+    while (read(daemon->lifecycle.done.fd, &c, sizeof(c)) == sizeof(c))
+    {
+        lifecycle_done(daemon, c);
+    }
+}
+
+// i.e. mocker stop <id>
+static void handle_stop(struct daemon_s *daemon, int client_fd, const char *id)
+{
+    char text[128];
+    struct supervised *c = find_container(daemon, id);
+    if (c == NULL)
+    {
+        snprintf(text, sizeof(text), "No such container: %s", id);
+        reply(client_fd, IPC_ERROR, text);
+        return;
+    }
+
+    if (kill_container(c) == -1)
+    {
+        snprintf(text, sizeof(text), "Failed to stop %s: %s", c->proc.container.id, strerror(errno));
+        reply(client_fd, IPC_ERROR, text);
+        return;
+    }
+
+    snprintf(text, sizeof(text), "%s\n", c->proc.container.id);
+    reply(client_fd, IPC_REPLY, text);
+}
+
+// Freezes or thaws a container, keeping its root, network and memory as they
+// are, so a paused container costs no CPU and resumes where it left off. The
+// client hears back once every task got there, see `handle_freeze()`.
+// Returns whether the wait took the client over.
+// i.e. mocker pause <id>, mocker resume <id>
+static int handle_pause(struct daemon_s *daemon, int client_fd, const char *id, int frozen)
+{
+    char text[128];
+    struct supervised *c = find_container(daemon, id);
+    if (c == NULL)
+    {
+        snprintf(text, sizeof(text), "No such container: %s", id);
+        reply(client_fd, IPC_ERROR, text);
+        return 0;
+    }
+
+    struct freeze_wait *wait = calloc(1, sizeof(*wait));
+    if (wait == NULL)
+    {
+        reply(client_fd, IPC_ERROR, "Out of memory");
+        return 0;
+    }
+
+    int cgroup_fd = c->proc.container.cgroup_fd;
+    clock_gettime(CLOCK_MONOTONIC, &wait->start);
+    if (cgroup_fd == -1 || cgroup_freeze(cgroup_fd, frozen) == -1 ||
+        (wait->events.fd = cgroup_open_events(cgroup_fd)) == -1)
+    {
+        snprintf(text, sizeof(text), "Failed to %s %s: %s", frozen ? "pause" : "resume", c->proc.container.id,
+                 cgroup_fd == -1 ? "no cgroup" : strerror(errno));
+        reply(client_fd, IPC_ERROR, text);
+        free(wait);
+        return 0;
+    }
+
+    // A task in the middle of a syscall freezes once it gets out of it. The
+    // freeze stays in effect if that takes longer than we wait.
+    struct itimerspec timeout = {
+        .it_value = {.tv_sec = FREEZE_TIMEOUT_MS / 1000, .tv_nsec = (FREEZE_TIMEOUT_MS % 1000) * 1000000},
+    };
+    wait->events.kind = WATCH_FREEZE;
+    wait->timer.kind = WATCH_FREEZE_TIMEOUT;
+    wait->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    wait->container = c;
+    wait->client_fd = client_fd;
+    wait->frozen = frozen;
+    wait->next = daemon->freezes;
+    daemon->freezes = wait;
+
+    if (wait->timer.fd == -1 || timerfd_settime(wait->timer.fd, 0, &timeout, NULL) == -1 ||
+        watch_add_events(daemon, &wait->events, EPOLLPRI) != 0 || watch_add(daemon, &wait->timer) != 0)
+    {
+        finish_freeze(daemon, wait, "Failed to wait for the container");
+        return 1;
+    }
+
+    // it may have got there already, before cgroup.events was watched
+    handle_freeze(daemon, wait);
+    return 1;
+}
+
+// i.e. mocker list
+static void handle_list(struct daemon_s *daemon, int client_fd)
+{
+    char *text = malloc(REPLY_SIZE);
+    size_t len = 0;
+    time_t now = time(NULL);
+
+    if (text == NULL)
+    {
+        reply(client_fd, IPC_ERROR, "Out of memory");
+        return;
+    }
+
+    len += snprintf(text, REPLY_SIZE, "%-12s  %-7s  %-15s  %-8s  %-7s  %-16s  %s\n", "ID", "PID", "IP", "UPTIME",
+                    "STATUS", "IMAGE", "COMMAND");
+    for (struct supervised *c = daemon->containers; c != NULL && len < REPLY_SIZE; c = c->next)
+    {
+        char uptime[32];
+        snprintf(uptime, sizeof(uptime), "%lds", (long)(now - c->started));
+        int frozen = c->proc.container.cgroup_fd != -1 ? cgroup_is_frozen(c->proc.container.cgroup_fd) : 0;
+        len += snprintf(text + len, REPLY_SIZE - len, "%-12s  %-7d  %-15s  %-8s  %-7s  %-16s  %s\n",
+                        c->proc.container.id, c->proc.pid, c->proc.container.container_ip,
+                        uptime, frozen == 1 ? "paused" : "running", c->image, c->command);
+    }
+
+    reply(client_fd, IPC_REPLY, text);
+    free(text);
+}
+
+// Samples every container whose ID starts with `id` and sends the samples
+// in one message. The files are open already, so this is a pread() per file
+// per container.
+static int send_samples(struct daemon_s *daemon, int client_fd, const char *id)
+{
+    size_t count = 0;
+    size_t n = 0;
+
+    for (struct supervised *c = daemon->containers; c != NULL; c = c->next)
+    {
+        count++;
+    }
+
+    // stay within what a client takes in one message
+    if (count > IPC_MAX_PAYLOAD / sizeof(struct stats_sample))
+    {
+        count = IPC_MAX_PAYLOAD / sizeof(struct stats_sample);
+    }
+
+    struct stats_sample *samples = malloc((count > 0 ? count : 1) * sizeof(*samples));
+    if (samples == NULL)
+    {
+        return -1;
+    }
+
+    for (struct supervised *c = daemon->containers; c != NULL && n < count; c = c->next)
+    {
+        if (strncmp(c->proc.container.id, id, strlen(id)) == 0)
+        {
+            stats_sample(&c->stats, c->proc.container.id, &samples[n++]);
+        }
+    }
+
+    int ret = ipc_send(client_fd, IPC_SAMPLES, samples, n * sizeof(*samples), NULL, 0);
+    free(samples);
+    return ret;
+}
+
+// i.e. mocker stats [id]
+static void handle_stats(struct daemon_s *daemon, int client_fd, const char *id)
+{
+    char text[128];
+
+    if (*id != '\0' && find_container(daemon, id) == NULL)
+    {
+        snprintf(text, sizeof(text), "No such container: %s", id);
+        reply(client_fd, IPC_ERROR, text);
+        return;
+    }
+
+    if (send_samples(daemon, client_fd, id) != 0)
+    {
+        reply(client_fd, IPC_ERROR, "Out of memory");
+    }
+}
+
+// i.e. mocker stats --interval <ms> [id]. The client stays connected, and is
+// dropped once sending to it fails. Returns whether the stream took it over.
+static int handle_watch(struct daemon_s *daemon, int client_fd, const char *payload)
+{
+    char *id;
+    long interval_ms = strtol(payload, &id, 10);
+
+    if (interval_ms < STATS_INTERVAL_MIN || (*id != ' ' && *id != '\0'))
+    {
+        reply(client_fd, IPC_ERROR, "Invalid interval");
+        return 0;
+    }
+    id += *id == ' ';
+
+    struct stats_stream *s = calloc(1, sizeof(*s));
+    if (s == NULL)
+    {
+        reply(client_fd, IPC_ERROR, "Out of memory");
+        return 0;
+    }
+
+    struct itimerspec timer = {
+        .it_interval = {.tv_sec = interval_ms / 1000, .tv_nsec = (interval_ms % 1000) * 1000000},
+    };
+    timer.it_value = timer.it_interval;
+
+    s->timer.kind = WATCH_STATS;
+    s->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (s->timer.fd == -1 || timerfd_settime(s->timer.fd, 0, &timer, NULL) == -1 ||
+        watch_add(daemon, &s->timer) != 0)
+    {
+        reply(client_fd, IPC_ERROR, "Failed to start the timer");
+        if (s->timer.fd != -1)
+        {
+            close(s->timer.fd);
+        }
+        free(s);
+        return 0;
+    }
+
+    s->client_fd = client_fd;
+    snprintf(s->id, sizeof(s->id), "%s", id);
+    s->next = daemon->streams;
+    daemon->streams = s;
+
+    // the first sample right away, so the client has a baseline
+    if (send_samples(daemon, client_fd, s->id) != 0)
+    {
+        close_stream(daemon, s);
+        return 1;
+    }
+
+    LOG("[DAEMON] Streaming stats every %ldms\n", interval_ms);
+    return 1;
+}
+
+// The timer of a `mocker stats --interval` client went off
+static void handle_tick(struct daemon_s *daemon, struct stats_stream *stream)
+{
+    uint64_t expirations;
+
+    int unread;
+
+    if (read(stream->timer.fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    {
+        return;
+    }
+
+    // A client that hasn't read the last samples yet skips this tick, so a
+    // slow one gets fewer samples instead of a growing backlog
+    if (ioctl(stream->client_fd, SIOCOUTQ, &unread) == 0 && unread > 0)
+    {
+        return;
+    }
+
+    if (send_samples(daemon, stream->client_fd, stream->id) != 0)
+    {
+        LOG("[DAEMON] Stats client went away\n");
+        close_stream(daemon, stream);
+    }
+}
+
+// Reads what has arrived of the client's request, and handles it once all of
+// it is in. Clients are non-blocking, so one that sends half a request, or
+// nothing, holds up no one else.
+static void handle_client(struct daemon_s *daemon, struct client *client)
+{
+    int client_fd = client->watch.fd;
+    struct exec_request req;
+
+    int ret = ipc_recv_partial(client_fd, &client->msg);
+    if (ret == 0)
+    {
+        return;
+    }
+
+    epoll_ctl(daemon->epoll_fd, EPOLL_CTL_DEL, client_fd, NULL);
+    if (ret == -1)
+    {
+        ipc_partial_free(&client->msg);
+        close(client_fd);
+        free(client);
+        return;
+    }
+
+    uint32_t type = client->msg.hdr.type;
+    char *payload = client->msg.payload;
+    size_t len = client->msg.hdr.len;
+    int nfds = client->msg.nfds;
+    int fds[IPC_MAX_FDS];
+    memcpy(fds, client->msg.fds, sizeof(fds));
+    free(client);
+
+    // exec requests carry fds and get parsed on their own
+    if (type == IPC_EXEC)
+    {
+        if (ipc_parse_exec(&req, type, payload, len, fds, nfds) != 0)
+        {
+            close(client_fd);
+            return;
+        }
+
+        handle_run(daemon, client_fd, &req);
+        return;
+    }
+
+    for (int i = 0; i < nfds; i++)
+    {
+        close(fds[i]);
+    }
+
+    switch (type)
+    {
+    case IPC_STOP:
+        handle_stop(daemon, client_fd, payload);
+        break;
+    case IPC_PAUSE:
+    case IPC_RESUME:
+        if (handle_pause(daemon, client_fd, payload, type == IPC_PAUSE))
+        {
+            free(payload);
+            return;
+        }
+        break;
+    case IPC_LIST:
+        handle_list(daemon, client_fd);
+        break;
+    case IPC_STATS:
+        handle_stats(daemon, client_fd, payload);
+        break;
+    case IPC_WATCH:
+        if (handle_watch(daemon, client_fd, payload))
+        {
+            free(payload);
+            return;
+        }
+        break;
+    default:
+        reply(client_fd, IPC_ERROR, "Unknown request");
+        break;
+    }
+
+    free(payload);
+    close(client_fd);
+}
+
+static void handle_connection(struct daemon_s *daemon)
+{
+    int client_fd = accept4(daemon->listen.fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (client_fd == -1)
+    {
+        return;
+    }
+
+    // Replies don't block either, so make room for the biggest one
+    int size = IPC_MAX_PAYLOAD + sizeof(struct ipc_hdr);
+    if (setsockopt(client_fd, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) == -1)
+    {
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+
+    struct client *client = calloc(1, sizeof(*client));
+    if (client == NULL)
+    {
+        close(client_fd);
+        return;
+    }
+
+    client->watch.kind = WATCH_CLIENT;
+    client->watch.fd = client_fd;
+    if (watch_add(daemon, &client->watch) != 0)
+    {
+        close(client_fd);
+        free(client);
+    }
+}
+
+// Kills every container and waits for them, so nothing is left behind.
+// Containers the lifecycle thread is still setting up are killed too.
+static void shutdown_containers(struct daemon_s *daemon)
+{
+    lifecycle_stop(daemon);
+    handle_lifecycle(daemon);
+    while (daemon->containers != NULL)
+    {
+        struct supervised *c = daemon->containers;
+        kill_container(c);
+        handle_exit(daemon, c);
+    }
+}
+
+// Supervises containers from a single event loop until SIGINT or SIGTERM.
+// Exits arrive on pidfds, signals on a signalfd and requests on the daemon
+// socket, so the loop never blocks in waitpid() or a signal handler.
+// i.e. mocker daemon
+int daemon_serve(void)
+{
+    struct daemon_s daemon = {
+        .listen = {.kind = WATCH_LISTEN},
+        .signal = {.kind = WATCH_SIGNAL},
+    };
+    struct epoll_event events[MAX_EVENTS];
+    sigset_t mask;
+    int running = 1;
+
+    // Signals are only delivered through the signalfd. Containers unblock
+    // them again before exec.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+    {
+        handle_error("sigprocmask");
+    }
+
+    daemon.signal.fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (daemon.signal.fd == -1)
+    {
+        handle_error("signalfd");
+    }
+
+    daemon.listen.fd = ipc_listen(DAEMON_SOCKET);
+    if (daemon.listen.fd == -1)
+    {
+        handle_error("ipc_listen");
+    }
+
+    daemon.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (daemon.epoll_fd == -1 ||
+        watch_add(&daemon, &daemon.listen) != 0 ||
+        watch_add(&daemon, &daemon.signal) != 0 ||
+        lifecycle_start(&daemon) != 0)
+    {
+        handle_error("epoll");
+    }
+
+    LOG("[DAEMON] Listening on %s\n", DAEMON_SOCKET);
+    while (running)
+    {
+        int n = epoll_wait(daemon.epoll_fd, events, MAX_EVENTS, -1);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            handle_error("epoll_wait");
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            struct watch *watch = events[i].data.ptr;
+            if (watch == NULL)
+            {
+                continue;
+            }
+
+            switch (watch->kind)
+            {
+            case WATCH_LISTEN:
+                handle_connection(&daemon);
+                break;
+            case WATCH_SIGNAL:
+            {
+                struct signalfd_siginfo info;
+                if (read(daemon.signal.fd, &info, sizeof(info)) == sizeof(info))
+                {
+                    LOG("[DAEMON] Received signal %u, shutting down\n", info.ssi_signo);
+                    running = 0;
+                }
+                break;
+            }
+            case WATCH_CLIENT:
+                handle_client(&daemon, (struct client *)watch);
+                break;
+            case WATCH_EXIT:
+                handle_exit(&daemon, (struct supervised *)watch);
+                // its pressure watches went with it, and may be in this batch too
+                for (int j = i + 1; j < n; j++)
+                {
+                    char *ptr = events[j].data.ptr;
+                    if (ptr >= (char *)watch && ptr < (char *)watch + sizeof(struct supervised))
+                    {
+                        events[j].data.ptr = NULL;
+                    }
+                }
+                break;
+            case WATCH_PRESSURE:
+                handle_pressure(&daemon, (struct pressure_watch *)watch);
+                break;
+            case WATCH_STATS:
+                handle_tick(&daemon, (struct stats_stream *)watch);
+                break;
+            case WATCH_LIFECYCLE:
+                handle_lifecycle(&daemon);
+                break;
+            case WATCH_FREEZE:
+                handle_freeze(&daemon, (struct freeze_wait *)watch);
+                break;
+            case WATCH_FREEZE_TIMEOUT:
+                handle_freeze_timeout(&daemon, WATCH_OWNER(watch, struct freeze_wait, timer));
+                break;
+            }
+        }
+
+        reap_freezes(&daemon);
+    }
+
+    unlink(DAEMON_SOCKET);
+    close(daemon.listen.fd);
+    shutdown_containers(&daemon);
+    reap_freezes(&daemon);
+    while (daemon.streams != NULL)
+    {
+        close_stream(&daemon, daemon.streams);
+    }
+    close(daemon.lifecycle.done.fd);
+    close(daemon.lifecycle.done_write);
+    close(daemon.signal.fd);
+    close(daemon.epoll_fd);
+    return 0;
+}
+
+// Runs the command in a container of `image` supervised by the daemon and
+// returns its wait status. Returns -1 if the daemon isn't running.
+int daemon_submit(const char *image, const struct cgroup_limits *limits, char **cmd)
+{
+    int sock = ipc_connect(DAEMON_SOCKET);
+    if (sock == -1)
+    {
+        return -1;
+    }
+
+    LOG("[DAEMON] Submitting %s to %s\n", cmd[0], DAEMON_SOCKET);
+    int status = ipc_run(sock, image, limits, cmd);
+    close(sock);
+    return status;
+}
+
+// Sends a request to the daemon and prints the reply
+// i.e. mocker stop|list|stats
+int daemon_request(uint32_t type, const char *arg)
+{
+    uint32_t reply_type;
+    char *payload;
+    size_t len;
+    int fds[IPC_MAX_FDS];
+    int nfds;
+
+    int sock = ipc_connect(DAEMON_SOCKET);
+    if (sock == -1)
+    {
+        fprintf(stderr, "mocker daemon is not running (no %s)\n", DAEMON_SOCKET);
+        return -1;
+    }
+
+    if (ipc_send(sock, type, arg, strlen(arg), NULL, 0) != 0 ||
+        ipc_recv(sock, &reply_type, &payload, &len, fds, &nfds) != 0)
+    {
+        fprintf(stderr, "Lost connection to mocker daemon\n");
+        close(sock);
+        return -1;
+    }
+    close(sock);
+
+    if (reply_type == IPC_ERROR)
+    {
+        fprintf(stderr, "%s\n", payload);
+        free(payload);
+        return -1;
+    }
+
+    fputs(payload, stdout);
+    free(payload);
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+#include "common.h"
+
+// Where `mocker daemon` listens for requests
+#define DAEMON_SOCKET MOCKER_RUN_DIR "/mocker.sock"
+
+struct cgroup_limits;
+
+int daemon_serve(void);
+int daemon_submit(const char *image, const struct cgroup_limits *limits, char **cmd);
+int daemon_request(uint32_t type, const char *arg);
+
+#endif
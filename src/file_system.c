@@ -1,131 +1,461 @@
+#define _GNU_SOURCE // for O_PATH
 #include "file_system.h"
 #include "common.h"
+#include "container.h"
 #include "logging.h"
 #include "util.h"
+#include "image/fsimage.h"
+#include "image/image.h"
 
+#include <stdbool.h>
+#include <sys/file.h>
 #include <sys/mount.h>
 #include <sys/syscall.h>
 #include <linux/fs.h>
+#include <linux/openat2.h>
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 
-void setup_container_root(void)
-{
-    LOG("Creating minimal mocker root at %s\n", CONTAINER_ROOT);
+// The read-only layer every container root is stacked on: busybox, its
+// symlinks and the directory skeleton. It's built once and then shared by
+// all containers, including busybox's pages in the page cache.
+#define BASE_ROOT MOCKER_LIB_DIR "/base"
+#define BASE_LOCK MOCKER_LIB_DIR "/base.lock"
+#define BASE_TMP MOCKER_LIB_DIR "/base.tmp"
+
+// Cap on what a container can write to its root, which lives in memory
+#define CONTAINER_STATE_SIZE "256m"
+
+// The kernel copies at most a page of mount options
+#define OVERLAY_OPTIONS_MAX 4096
 
-    // Create basic directory structure
+// Room for the lowerdir of an image with as many layers as we take, spelled
+// out as paths in the layer store
+#define LOWERDIR_MAX (IMAGE_MAX_LAYERS * (sizeof(IMAGE_LAYER_STORE) + IMAGE_DIGEST_MAX + 1))
+
+// Builds the base layer in BASE_TMP and renames it into place, so BASE_ROOT
+// only ever exists complete
+static int build_base_root(void)
+{
+    // Create basic directory structure. /etc/resolv.conf is a mount point.
     const char *dirs[] = {
-        CONTAINER_ROOT,
-        CONTAINER_ROOT "/bin",
-        CONTAINER_ROOT "/proc",
-        CONTAINER_ROOT "/sys",
-        CONTAINER_ROOT "/dev",
+        "/bin",
+        "/proc",
+        "/sys",
+        "/dev",
+        "/etc",
+        "/tmp",
         NULL,
     };
 
-    // Clean up any existing mocker root
-    char cmd[PATH_MAX];
-    snprintf(cmd, sizeof(cmd), "rm -rf %s", CONTAINER_ROOT);
-    system(cmd);
+    LOG("Building base root at %s\n", BASE_ROOT);
+
+    // left behind by a build that didn't finish
+    if (rm_rf(BASE_TMP) != 0 || mkdir(BASE_TMP, 0755) == -1)
+    {
+        LOG("Failed to create %s: %s\n", BASE_TMP, strerror(errno));
+        return -1;
+    }
 
-    // Create directories
     for (const char **dir = dirs; *dir != NULL; dir++)
     {
-        LOG("Creating directory %s\n", *dir);
-        if (mkdir(*dir, 0755) && errno != EEXIST)
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s", BASE_TMP, *dir);
+        LOG("Creating directory %s\n", path);
+        if (mkdir(path, 0755) && errno != EEXIST)
         {
-            LOG("Failed to create %s: %s\n", *dir, strerror(errno));
-            handle_error("mkdir");
+            LOG("Failed to create %s: %s\n", path, strerror(errno));
+            return -1;
         }
     }
 
-    snprintf(cmd, sizeof(cmd),
-             "cp /bin/busybox %s/bin/busybox && chmod +x %s/bin/busybox",
-             CONTAINER_ROOT, CONTAINER_ROOT);
-    if (system(cmd) != 0)
+    // i.e. cp /bin/busybox BASE_TMP/bin/busybox && chmod +x BASE_TMP/bin/busybox
+    if (copy_file("/bin/busybox", BASE_TMP "/bin/busybox", 0755) != 0)
+    {
+        fprintf(stderr, "Failed to setup busybox: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int fd = open(BASE_TMP "/etc/resolv.conf", O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
     {
-        fprintf(stderr, "Failed to setup busybox!\n");
-        exit(1);
+        LOG("Failed to create resolv.conf: %s\n", strerror(errno));
+        return -1;
     }
+    close(fd);
 
     // Create essential command symlinks
     LOG("Creating symlinks...\n");
     const char *commands[] = {"sh", "ls", "ps", "mount", "umount", "mkdir", "echo", "cat", "pwd", NULL};
 
-    // Change to the bin directory for creating symlinks
-    char old_pwd[PATH_MAX];
-    getcwd(old_pwd, sizeof(old_pwd));
-
-    char bin_path[PATH_MAX];
-    snprintf(bin_path, sizeof(bin_path), "%s/bin", CONTAINER_ROOT);
-    chdir(bin_path);
-
     for (const char **cmd_ptr = commands; *cmd_ptr != NULL; cmd_ptr++)
     {
-        if (symlink("busybox", *cmd_ptr) != 0 && errno != EEXIST)
+        char link_path[PATH_MAX];
+        snprintf(link_path, sizeof(link_path), "%s/bin/%s", BASE_TMP, *cmd_ptr);
+        if (symlink("busybox", link_path) != 0 && errno != EEXIST)
         {
             LOG("Warning: Failed to create symlink for %s: %s\n", *cmd_ptr,
                 strerror(errno));
         }
     }
 
-    chdir(old_pwd);
+    if (rename(BASE_TMP, BASE_ROOT) == -1)
+    {
+        LOG("Failed to move base root into place: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Makes sure the base layer exists, building it if this is the first run
+static int ensure_base_root(void)
+{
+    if (access(BASE_ROOT, F_OK) == 0)
+    {
+        return 0;
+    }
+
+    if (mkdir_p(MOCKER_LIB_DIR, 0755) != 0)
+    {
+        LOG("Failed to create %s: %s\n", MOCKER_LIB_DIR, strerror(errno));
+        return -1;
+    }
+
+    // Only one of several parallel first runs builds it
+    int lock_fd = open(BASE_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd == -1 || flock(lock_fd, LOCK_EX) == -1)
+    {
+        LOG("Failed to lock %s: %s\n", BASE_LOCK, strerror(errno));
+        if (lock_fd != -1)
+        {
+            close(lock_fd);
+        }
+        return -1;
+    }
+
+    int ret = 0;
+    if (access(BASE_ROOT, F_OK) != 0)
+    {
+        ret = build_base_root();
+    }
+
+    close(lock_fd);
+    return ret;
+}
+
+// Fills in the overlay lowerdir for `image`: an erofs or squashfs image
+// file, mounted if this is its first use, the layers of an OCI image layout,
+// unpacked if this is their first use, or else the busybox base
+static int image_lowerdir_for(const char *image, char *lowerdir, size_t size)
+{
+    if (fsimage_type(image) != NULL)
+    {
+        return fsimage_lowerdir(image, lowerdir, size);
+    }
+
+    if (image_is_layout(image))
+    {
+        struct image_s resolved;
+        if (image_open(image, &resolved) != 0)
+        {
+            return -1;
+        }
+        return image_lowerdir(&resolved, lowerdir, size);
+    }
+
+    if (ensure_base_root() != 0)
+    {
+        return -1;
+    }
+
+    snprintf(lowerdir, size, "%s", BASE_ROOT);
+    return 0;
+}
+
+static void close_all(const int *fds, int nfds)
+{
+    for (int i = 0; i < nfds; i++)
+    {
+        close(fds[i]);
+    }
+}
+
+// Refers to each of the lower layers through a descriptor, i.e.
+// /proc/self/fd/<fd>, for images with more layers than a page of options
+// takes spelled out. The descriptors only need to stay open until the
+// overlay is mounted.
+static int lowerdir_by_fd(char *lowerdir, size_t size, int *fds, int *nfds)
+{
+    char *save = NULL;
+    size_t len = 0;
+
+    char *dirs = strdup(lowerdir);
+    if (dirs == NULL)
+    {
+        return -1;
+    }
+
+    *nfds = 0;
+    for (char *dir = strtok_r(dirs, ":", &save); dir != NULL; dir = strtok_r(NULL, ":", &save))
+    {
+        int fd = *nfds < IMAGE_MAX_LAYERS ? open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC) : -1;
+        if (fd == -1)
+        {
+            LOG("Failed to open layer %s: %s\n", dir, strerror(errno));
+            close_all(fds, *nfds);
+            free(dirs);
+            return -1;
+        }
+        fds[(*nfds)++] = fd;
+
+        // never longer than the path it replaces
+        len += snprintf(lowerdir + len, size - len, "%s/proc/self/fd/%d", len > 0 ? ":" : "", fd);
+    }
+
+    free(dirs);
+    return 0;
+}
+
+// Mounts the container's root, in the parent before the child is cloned:
+//   state         a tmpfs of its own, holding everything the container writes
+//   state/upper   overlay upper dir
+//   state/work    overlay work dir
+//   state/rootfs  the overlay of upper on the image's layers, i.e. root
+int mount_container_root(struct container_s *container, const char *image)
+{
+    char path[PATH_MAX + 16];
+    char lowerdir[LOWERDIR_MAX];
+    char options[LOWERDIR_MAX + 2 * PATH_MAX];
+    int fds[IMAGE_MAX_LAYERS];
+    int nfds = 0;
+
+    if (image_lowerdir_for(image, lowerdir, sizeof(lowerdir)) != 0)
+    {
+        return -1;
+    }
+
+    // i.e. mount -t overlay overlay -o lowerdir=...,upperdir=...,workdir=... root
+    int len = snprintf(options, sizeof(options), "lowerdir=%s,upperdir=%s/upper,workdir=%s/work",
+                       lowerdir, container->state, container->state);
+    if (len >= OVERLAY_OPTIONS_MAX)
+    {
+        if (lowerdir_by_fd(lowerdir, sizeof(lowerdir), fds, &nfds) != 0)
+        {
+            return -1;
+        }
+
+        len = snprintf(options, sizeof(options), "lowerdir=%s,upperdir=%s/upper,workdir=%s/work",
+                       lowerdir, container->state, container->state);
+    }
+
+    if (len >= OVERLAY_OPTIONS_MAX)
+    {
+        fprintf(stderr, "Image %s has too many layers to mount\n", image);
+        close_all(fds, nfds);
+        return -1;
+    }
+
+    LOG("Mounting container root at %s\n", container->root);
+    if (mkdir_p(container->state, 0755) != 0)
+    {
+        LOG("Failed to create %s: %s\n", container->state, strerror(errno));
+        close_all(fds, nfds);
+        return -1;
+    }
+
+    // i.e. mount -t tmpfs -o size=CONTAINER_STATE_SIZE tmpfs state
+    if (mount("tmpfs", container->state, "tmpfs", MS_NOSUID | MS_NODEV,
+              "size=" CONTAINER_STATE_SIZE ",mode=0755") == -1)
+    {
+        LOG("Failed to mount tmpfs on %s: %s\n", container->state, strerror(errno));
+        rmdir(container->state);
+        close_all(fds, nfds);
+        return -1;
+    }
+
+    const char *dirs[] = {"upper", "work", "rootfs", NULL};
+    for (const char **dir = dirs; *dir != NULL; dir++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", container->state, *dir);
+        if (mkdir(path, 0755) == -1)
+        {
+            LOG("Failed to create %s: %s\n", path, strerror(errno));
+            goto fail;
+        }
+    }
+
+    if (mount("overlay", container->root, "overlay", 0, options) == -1)
+    {
+        LOG("Failed to mount overlay on %s: %s\n", container->root, strerror(errno));
+        goto fail;
+    }
+
+    close_all(fds, nfds);
+    return 0;
+
+fail:
+    umount2(container->state, MNT_DETACH);
+    rmdir(container->state);
+    close_all(fds, nfds);
+    return -1;
+}
+
+// Opens the mount point `target` in the root, creating it if the image
+// doesn't have one. It is resolved as if root were /, and replaced if it is a
+// symlink, so an image can't point our mounts at the host's files.
+static int open_mount_point(int root_fd, const char *target, int is_dir)
+{
+    struct open_how how = {
+        .flags = O_PATH | O_DIRECTORY | O_CLOEXEC,
+        .resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS,
+    };
+    char parent[PATH_MAX];
+
+    // i.e. /etc for /etc/resolv.conf
+    snprintf(parent, sizeof(parent), "%s", target);
+    char *name = strrchr(parent, '/');
+    *name++ = '\0';
+    const char *parent_path = parent[0] != '\0' ? parent : "/";
+
+    int parent_fd = syscall(SYS_openat2, root_fd, parent_path, &how, sizeof(how));
+    if (parent_fd == -1 && errno == ENOENT && mkdirat(root_fd, parent + 1, 0755) == 0)
+    {
+        parent_fd = syscall(SYS_openat2, root_fd, parent_path, &how, sizeof(how));
+    }
+    if (parent_fd == -1)
+    {
+        return -1;
+    }
 
-    // Mount essential filesystems
+    int fd = -1;
+    for (int attempt = 0; attempt < 2 && fd == -1; attempt++)
+    {
+        if (is_dir)
+        {
+            mkdirat(parent_fd, name, 0755);
+        }
+        else
+        {
+            int file_fd = openat(parent_fd, name, O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+            if (file_fd != -1)
+            {
+                close(file_fd);
+            }
+        }
+
+        // O_PATH opens a symlink itself rather than failing
+        struct stat st;
+        fd = openat(parent_fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+        if (fd != -1 && (fstat(fd, &st) == -1 || S_ISDIR(st.st_mode) != !!is_dir || S_ISLNK(st.st_mode)))
+        {
+            // a symlink, or a file where we need a directory
+            close(fd);
+            fd = -1;
+            unlinkat(parent_fd, name, 0);
+        }
+    }
+
+    close(parent_fd);
+    return fd;
+}
+
+// Runs in the child, in its own mount namespace, before it chroots into root.
+// With a `hugepage_size`, the container gets a hugetlbfs of pages that size
+// at /mnt/hugepages, which the cgroup's hugetlb limit applies to. It isn't
+// under /dev, as that is the host's devtmpfs and creating a mount point there
+// would create it on the host.
+void setup_container_root(const char *root, uint64_t hugepage_size)
+{
+    char hugetlbfs[32];
+    snprintf(hugetlbfs, sizeof(hugetlbfs), "pagesize=%llu", (unsigned long long)hugepage_size);
+
+    // Keep the mounts below to ourselves, rather than propagating them back
+    // to the host through shared mounts
+    if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) == -1)
+    {
+        handle_child_error("mount private");
+    }
+
+    // Mount essential filesystems. Entries that are `skip`ped don't apply to
+    // this container; a `required` one failing fails the container.
     const struct
     {
         const char *source;
         const char *target;
         const char *type;
         unsigned long flags;
+        const char *data;
+        bool skip;
+        bool required;
     } mounts[] = {
-        {"proc", CONTAINER_ROOT "/proc", "proc", 0},
-        {"sysfs", CONTAINER_ROOT "/sys", "sysfs", 0},
-        {"devtmpfs", CONTAINER_ROOT "/dev", "devtmpfs", 0},
-        {NULL, NULL, NULL, 0},
+        {"proc", "/proc", "proc", 0, NULL, false, false},
+        {"sysfs", "/sys", "sysfs", 0, NULL, false, false},
+        {"devtmpfs", "/dev", "devtmpfs", 0, NULL, false, false},
+        // the host's DNS configuration
+        {"/etc/resolv.conf", "/etc/resolv.conf", NULL, MS_BIND, NULL, false, false},
+        // --hugepages asked for it, so running without it would be wrong
+        {"hugetlbfs", "/mnt/hugepages", "hugetlbfs", MS_NOSUID | MS_NODEV, hugetlbfs,
+         hugepage_size == 0, true},
     };
 
-    for (int i = 0; mounts[i].source != NULL; i++)
+    int root_fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1)
     {
-        LOG("Mounting %s at %s\n", mounts[i].source, mounts[i].target);
-        if (mount(mounts[i].source, mounts[i].target, mounts[i].type,
-                  mounts[i].flags, NULL) == -1)
+        handle_child_error("open root");
+    }
+
+    for (size_t i = 0; i < sizeof(mounts) / sizeof(mounts[0]); i++)
+    {
+        if (mounts[i].skip)
         {
-            LOG("Warning: Could not mount %s: %s\n", mounts[i].target,
-                strerror(errno));
+            continue;
+        }
+
+        // mount through the descriptor, i.e. /proc/self/fd/<fd>
+        char target[64];
+        int fd = open_mount_point(root_fd, mounts[i].target, mounts[i].type != NULL);
+        snprintf(target, sizeof(target), "/proc/self/fd/%d", fd);
+        LOG("Mounting %s at %s%s\n", mounts[i].source, root, mounts[i].target);
+        if (fd == -1 || mount(mounts[i].source, target, mounts[i].type,
+                              mounts[i].flags, mounts[i].data) == -1)
+        {
+            if (mounts[i].required)
+            {
+                handle_child_error(mounts[i].target);
+            }
+
+            LOG("Warning: Could not mount %s%s: %s\n", root, mounts[i].target,
+                strerrordesc_np(errno));
+        }
+
+        if (fd != -1)
+        {
+            close(fd);
         }
     }
+
+    close(root_fd);
 }
 
-void cleanup_container_root(void)
+// The child's own mounts went away with its mount namespace, so all that's
+// left is the tmpfs and the overlay on it. Detaching the tmpfs takes the
+// overlay with it, and the kernel frees both once nothing uses them, so this
+// costs the same however much the container wrote.
+void cleanup_container_root(struct container_s *container)
 {
     LOG("Cleaning up mocker root...\n");
 
-    // Unmount special filesystems in reverse order
-    const char *mounts[] = {
-        CONTAINER_ROOT "/dev",
-        CONTAINER_ROOT "/sys",
-        CONTAINER_ROOT "/proc",
-        NULL,
-    };
-
-    for (const char **mount_point = mounts; *mount_point != NULL; mount_point++)
+    // i.e. umount -l state
+    if (umount2(container->state, MNT_DETACH) != 0)
     {
-        LOG("Unmounting %s...\n", *mount_point);
-        if (umount2(*mount_point, MNT_DETACH) != 0)
-        {
-            LOG("Warning: Failed to unmount %s: %s\n", *mount_point, strerror(errno));
-        }
+        LOG("Warning: Failed to unmount %s: %s\n", container->state, strerror(errno));
     }
 
-    // Remove entire mocker root with all contents
-    char cmd[PATH_MAX];
-    snprintf(cmd, sizeof(cmd), "rm -rf %s", CONTAINER_ROOT);
-    LOG("Removing mocker root directory...\n");
-    if (system(cmd) != 0)
+    if (rmdir(container->state) != 0)
     {
-        LOG("Warning: Failed to remove mocker root: %s\n", strerror(errno));
+        LOG("Warning: Failed to remove %s: %s\n", container->state, strerror(errno));
     }
-}
\ No newline at end of file
+}
@@ -1,7 +1,12 @@
 #ifndef _FILE_SYSTEM_H_
 #define _FILE_SYSTEM_H_
 
-void setup_container_root(void);
-void cleanup_container_root(void);
+#include <stdint.h>
 
-#endif
\ No newline at end of file
+struct container_s;
+
+int mount_container_root(struct container_s *container, const char *image);
+void setup_container_root(const char *root, uint64_t hugepage_size);
+void cleanup_container_root(struct container_s *container);
+
+#endif
@@ -0,0 +1,340 @@
+#include "fsimage.h"
+#include "../logging.h"
+#include "../util.h"
+
+#include <endian.h>
+#include <linux/loop.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+
+// erofs has its superblock 1 KiB into the image, squashfs at the start
+#define EROFS_MAGIC_OFFSET 1024
+#define EROFS_MAGIC 0xe0f5e1e2
+#define SQUASHFS_MAGIC 0x73717368
+
+// How often we look for a free loop device when others take it first
+#define LOOP_ATTEMPTS 8
+
+static const char *fs_type(int fd)
+{
+    uint32_t magic;
+
+    if (pread(fd, &magic, sizeof(magic), EROFS_MAGIC_OFFSET) == sizeof(magic) &&
+        le32toh(magic) == EROFS_MAGIC)
+    {
+        return "erofs";
+    }
+
+    if (pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) && le32toh(magic) == SQUASHFS_MAGIC)
+    {
+        return "squashfs";
+    }
+
+    return NULL;
+}
+
+// Which filesystem `ref` is an image of, going by its superblock, or NULL if
+// it isn't an erofs or squashfs image file
+const char *fsimage_type(const char *ref)
+{
+    struct stat st;
+
+    if (stat(ref, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        return NULL;
+    }
+
+    int fd = open(ref, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+
+    const char *type = fs_type(fd);
+    close(fd);
+    return type;
+}
+
+static void key_of(const struct stat *st, char *key, size_t size)
+{
+    unsigned long long mtime = st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+    snprintf(key, size, "%llx-%llx-%llx", (unsigned long long)st->st_dev,
+             (unsigned long long)st->st_ino, mtime);
+}
+
+// Names the image after the file rather than its path, so an image that is
+// rebuilt in place gets a mount of its own
+int fsimage_key(const char *ref, char *key, size_t size)
+{
+    struct stat st;
+
+    if (stat(ref, &st) == -1)
+    {
+        return -1;
+    }
+
+    key_of(&st, key, size);
+    return 0;
+}
+
+// Backs the loop device with the image, read-only, and has it detach itself
+// once nothing uses it. Direct I/O keeps the image's data out of the page
+// cache, which holds it once already for the filesystem on top.
+static int configure_loop(int loop_fd, int image_fd)
+{
+    struct loop_config config = {
+        .fd = image_fd,
+        .info = {
+            .lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR | LO_FLAGS_DIRECT_IO,
+        },
+    };
+
+    // i.e. losetup --read-only --direct-io=on --find image
+    if (ioctl(loop_fd, LOOP_CONFIGURE, &config) == 0)
+    {
+        return 0;
+    }
+
+    if (errno != EINVAL)
+    {
+        return -1;
+    }
+
+    // not all backing filesystems do direct I/O
+    config.info.lo_flags &= ~LO_FLAGS_DIRECT_IO;
+    if (ioctl(loop_fd, LOOP_CONFIGURE, &config) == 0)
+    {
+        return 0;
+    }
+    if (errno != EINVAL)
+    {
+        return -1;
+    }
+
+    // LOOP_CONFIGURE is new in Linux 5.8, before it takes two calls. The
+    // device is read-only as it's open read-only.
+    if (ioctl(loop_fd, LOOP_SET_FD, image_fd) == -1)
+    {
+        return -1;
+    }
+
+    if (ioctl(loop_fd, LOOP_SET_STATUS64, &config.info) == -1)
+    {
+        ioctl(loop_fd, LOOP_CLR_FD, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Attaches the image to a free loop device and returns the device, open.
+// The device gets an open file of its own, since it keeps it as long as it
+// is attached, along with any lock on it.
+static int attach_loop(const char *ref, char *device, size_t size)
+{
+    int image_fd = open(ref, O_RDONLY | O_CLOEXEC);
+    int control_fd = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+    if (image_fd == -1 || control_fd == -1)
+    {
+        LOG("[FSIMAGE] Failed to open %s or /dev/loop-control: %s\n", ref, strerror(errno));
+        if (image_fd != -1)
+        {
+            close(image_fd);
+        }
+        if (control_fd != -1)
+        {
+            close(control_fd);
+        }
+        return -1;
+    }
+
+    int loop_fd = -1;
+    for (int attempt = 0; attempt < LOOP_ATTEMPTS && loop_fd == -1; attempt++)
+    {
+        int n = ioctl(control_fd, LOOP_CTL_GET_FREE);
+        if (n == -1)
+        {
+            LOG("[FSIMAGE] No free loop device: %s\n", strerror(errno));
+            break;
+        }
+
+        snprintf(device, size, "/dev/loop%d", n);
+        loop_fd = open(device, O_RDONLY | O_CLOEXEC);
+        if (loop_fd == -1)
+        {
+            LOG("[FSIMAGE] Failed to open %s: %s\n", device, strerror(errno));
+            break;
+        }
+
+        if (configure_loop(loop_fd, image_fd) == -1)
+        {
+            // someone else got the device first
+            int busy = errno == EBUSY;
+            LOG("[FSIMAGE] Failed to set up %s: %s\n", device, strerror(errno));
+            close(loop_fd);
+            loop_fd = -1;
+            if (!busy)
+            {
+                break;
+            }
+        }
+    }
+
+    close(control_fd);
+    close(image_fd);
+    return loop_fd;
+}
+
+// Whether something is mounted on `dir`, i.e. it's on another device than
+// its parent
+static int is_mounted(const char *dir)
+{
+    struct stat st;
+    struct stat parent;
+
+    return stat(dir, &st) == 0 && stat(FSIMAGE_MOUNT_DIR, &parent) == 0 && st.st_dev != parent.st_dev;
+}
+
+// Notes which file the mount on `lowerdir` is of, i.e.
+// ln -s path lowerdir.image
+static void record_source(const char *path, const char *lowerdir)
+{
+    char link[PATH_MAX];
+
+    snprintf(link, sizeof(link), "%s%s", lowerdir, FSIMAGE_SOURCE_SUFFIX);
+    unlink(link);
+    if (symlink(path, link) == -1)
+    {
+        LOG("[FSIMAGE] Warning: Failed to record %s for %s: %s\n", path, lowerdir, strerror(errno));
+    }
+}
+
+// Unmounts what earlier versions of the image file at `path` left mounted,
+// now that it is mounted under `key`. The unmounts are lazy: containers still
+// running on an old version keep it until they exit, and its loop device
+// detaches itself after that.
+static void unmount_stale(const char *path, const char *key)
+{
+    size_t suffix = strlen(FSIMAGE_SOURCE_SUFFIX);
+    struct dirent *entry;
+
+    DIR *dir = opendir(FSIMAGE_MOUNT_DIR);
+    if (dir == NULL)
+    {
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        size_t len = strlen(entry->d_name);
+        if (len <= suffix || strcmp(entry->d_name + len - suffix, FSIMAGE_SOURCE_SUFFIX) != 0 ||
+            (len - suffix == strlen(key) && strncmp(entry->d_name, key, len - suffix) == 0))
+        {
+            continue;
+        }
+
+        char link[PATH_MAX];
+        char source[PATH_MAX];
+        snprintf(link, sizeof(link), "%s/%s", FSIMAGE_MOUNT_DIR, entry->d_name);
+        ssize_t n = readlink(link, source, sizeof(source) - 1);
+        if (n == -1)
+        {
+            continue;
+        }
+        source[n] = '\0';
+        if (strcmp(source, path) != 0)
+        {
+            continue;
+        }
+
+        // i.e. umount -l mounts/<key>
+        char stale[PATH_MAX];
+        snprintf(stale, sizeof(stale), "%s/%.*s", FSIMAGE_MOUNT_DIR, (int)(len - suffix), entry->d_name);
+        LOG("[FSIMAGE] Unmounting %s, an earlier version of %s\n", stale, path);
+        if (umount2(stale, MNT_DETACH) == -1 && errno != EINVAL && errno != ENOENT)
+        {
+            LOG("[FSIMAGE] Warning: Failed to unmount %s: %s\n", stale, strerror(errno));
+            continue;
+        }
+
+        rmdir(stale);
+        unlink(link);
+    }
+
+    closedir(dir);
+}
+
+// Mounts the erofs or squashfs image `ref`, unless it is mounted already, and
+// returns where as the overlay lowerdir. Nothing is unpacked: the kernel reads
+// the image as containers touch its files.
+int fsimage_lowerdir(const char *ref, char *lowerdir, size_t size)
+{
+    struct stat st;
+    char key[64];
+    char device[32] = "";
+
+    int fd = open(ref, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        fprintf(stderr, "Failed to open image %s: %s\n", ref, strerror(errno));
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    const char *type = fs_type(fd);
+    key_of(&st, key, sizeof(key));
+    snprintf(lowerdir, size, "%s/%s", FSIMAGE_MOUNT_DIR, key);
+    if (type == NULL || mkdir_p(lowerdir, 0755) != 0)
+    {
+        fprintf(stderr, "Failed to set up image %s\n", ref);
+        close(fd);
+        return -1;
+    }
+
+    // Only one of several first runs mounts it
+    if (flock(fd, LOCK_EX) == -1)
+    {
+        LOG("[FSIMAGE] Failed to lock %s: %s\n", ref, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    int ret = 0;
+    if (!is_mounted(lowerdir))
+    {
+        int loop_fd = attach_loop(ref, device, sizeof(device));
+
+        // i.e. mount -t erofs -o ro /dev/loopN lowerdir
+        LOG("[FSIMAGE] Mounting %s image %s from %s on %s\n", type, ref, device, lowerdir);
+        if (loop_fd == -1 || mount(device, lowerdir, type, MS_RDONLY, NULL) == -1)
+        {
+            fprintf(stderr, "Failed to mount image %s: %s\n", ref, strerror(errno));
+            ret = -1;
+        }
+
+        // the mount keeps the device attached
+        if (loop_fd != -1)
+        {
+            close(loop_fd);
+        }
+
+        if (ret == 0)
+        {
+            char path[PATH_MAX];
+            if (realpath(ref, path) == NULL)
+            {
+                snprintf(path, sizeof(path), "%s", ref);
+            }
+
+            record_source(path, lowerdir);
+            unmount_stale(path, key);
+        }
+    }
+
+    close(fd);
+    return ret;
+}
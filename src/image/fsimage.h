@@ -0,0 +1,19 @@
+#ifndef _FSIMAGE_H_
+#define _FSIMAGE_H_
+
+#include "../common.h"
+
+// Filesystem images mounted as container lower layers, one directory per
+// image file, named after its key:
+//   <device>-<inode>-<mtime>  e.g. 803-1a2b-17c3e4f5a6b7c8d9
+// Every container of the image shares the one mount. Next to it, a symlink
+// <key>.image points at the image file, so a mount of a newer version of the
+// file can find and unmount the older ones.
+#define FSIMAGE_MOUNT_DIR MOCKER_LIB_DIR "/mounts"
+#define FSIMAGE_SOURCE_SUFFIX ".image"
+
+const char *fsimage_type(const char *ref);
+int fsimage_key(const char *ref, char *key, size_t size);
+int fsimage_lowerdir(const char *ref, char *lowerdir, size_t size);
+
+#endif
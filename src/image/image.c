@@ -0,0 +1,520 @@
+#include "image.h"
+#include "json.h"
+#include "layer.h"
+#include "sha256.h"
+#include "../cgroup.h"
+#include "../logging.h"
+#include "../util.h"
+
+#include <pthread.h>
+
+// Annotation on the entries of index.json that holds their tag
+#define REF_NAME_ANNOTATION "org.opencontainers.image.ref.name"
+
+// How many image indexes deep a manifest may be
+#define MAX_INDEX_DEPTH 4
+
+// Architecture of the manifests we pick from multi-platform images, in the
+// GOARCH spelling that OCI platforms use
+#if defined(__x86_64__)
+#define HOST_ARCH "amd64"
+#elif defined(__aarch64__)
+#define HOST_ARCH "arm64"
+#elif defined(__arm__)
+#define HOST_ARCH "arm"
+#elif defined(__i386__)
+#define HOST_ARCH "386"
+#elif defined(__powerpc64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HOST_ARCH "ppc64le"
+#elif defined(__s390x__)
+#define HOST_ARCH "s390x"
+#elif defined(__riscv) && __riscv_xlen == 64
+#define HOST_ARCH "riscv64"
+#else
+#define HOST_ARCH ""
+#endif
+
+// Splits a reference, i.e. <layout directory>[:<tag>]. A directory whose name
+// has a colon in it is taken as is.
+static const char *split_ref(const char *ref, char *path, size_t size)
+{
+    struct stat st;
+
+    snprintf(path, size, "%s", ref);
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        return NULL;
+    }
+
+    char *colon = strrchr(path, ':');
+    if (colon == NULL || strchr(colon, '/') != NULL)
+    {
+        return NULL;
+    }
+
+    *colon = '\0';
+    return ref + (colon - path) + 1;
+}
+
+// Whether `ref` names an OCI image layout, rather than being a placeholder
+// for the built-in busybox root
+int image_is_layout(const char *ref)
+{
+    char path[PATH_MAX];
+    char file[PATH_MAX + 16];
+
+    split_ref(ref, path, sizeof(path));
+    snprintf(file, sizeof(file), "%s/oci-layout", path);
+    if (access(file, F_OK) != 0)
+    {
+        return 0;
+    }
+
+    snprintf(file, sizeof(file), "%s/index.json", path);
+    return access(file, F_OK) == 0;
+}
+
+// Splits a digest into its algorithm and encoded hash. Both end up in paths,
+// so only the characters that registered algorithms use are allowed.
+static int split_digest(const char *digest, char *algorithm, size_t size, const char **encoded)
+{
+    const char *colon = strchr(digest, ':');
+    if (colon == NULL || colon == digest || (size_t)(colon - digest) >= size ||
+        colon[1] == '\0' || strlen(digest) >= IMAGE_DIGEST_MAX)
+    {
+        return -1;
+    }
+
+    for (const char *c = digest; c < colon; c++)
+    {
+        if (!((*c >= 'a' && *c <= 'z') || (*c >= '0' && *c <= '9')))
+        {
+            return -1;
+        }
+    }
+
+    for (const char *c = colon + 1; *c != '\0'; c++)
+    {
+        if (!((*c >= 'a' && *c <= 'f') || (*c >= '0' && *c <= '9')))
+        {
+            return -1;
+        }
+    }
+
+    memcpy(algorithm, digest, colon - digest);
+    algorithm[colon - digest] = '\0';
+    *encoded = colon + 1;
+    return 0;
+}
+
+// i.e. <layout>/blobs/<algorithm>/<encoded>. Blobs are checked against their
+// digest as they are read, which we can only do for sha256 ones.
+static int blob_path(const struct image_s *image, const char *digest, char *path, size_t size)
+{
+    char algorithm[32];
+    const char *encoded;
+
+    if (split_digest(digest, algorithm, sizeof(algorithm), &encoded) != 0)
+    {
+        fprintf(stderr, "Invalid digest in %s: %s\n", image->layout, digest);
+        return -1;
+    }
+
+    if (strcmp(algorithm, "sha256") != 0)
+    {
+        fprintf(stderr, "Unsupported digest in %s: %s, only sha256 is\n", image->layout, digest);
+        return -1;
+    }
+
+    snprintf(path, size, "%s/blobs/%s/%s", image->layout, algorithm, encoded);
+    return 0;
+}
+
+// Reads a JSON blob, an index or a manifest, which has to have the sha256
+// `digest` and, unless it is 0, `size`
+static struct json_value *read_blob(const struct image_s *image, const char *digest, uint64_t size)
+{
+    char path[PATH_MAX * 2];
+    struct sha256 hash;
+    size_t len;
+
+    if (blob_path(image, digest, path, sizeof(path)) != 0)
+    {
+        return NULL;
+    }
+
+    char *text = json_read_file(path, &len);
+    if (text == NULL)
+    {
+        return NULL;
+    }
+
+    sha256_init(&hash);
+    sha256_update(&hash, text, len);
+    if ((size != 0 && len != size) || !sha256_matches(&hash, digest))
+    {
+        fprintf(stderr, "Blob %s doesn't match its digest (%zu bytes, %llu expected)\n", digest, len,
+                (unsigned long long)size);
+        free(text);
+        return NULL;
+    }
+
+    struct json_value *value = json_parse(text, len);
+    free(text);
+    return value;
+}
+
+// The size a descriptor gives its blob, or 0 if it doesn't
+static uint64_t descriptor_size(const struct json_value *descriptor)
+{
+    const struct json_value *size = json_get(descriptor, "size");
+
+    return size != NULL && size->type == JSON_NUMBER && size->number > 0 ? (uint64_t)size->number : 0;
+}
+
+// Manifests without a platform, e.g. in single-platform images, match any
+static int platform_matches(const struct json_value *descriptor)
+{
+    const struct json_value *platform = json_get(descriptor, "platform");
+    const char *os = json_get_string(platform, "os");
+    const char *arch = json_get_string(platform, "architecture");
+
+    return (os == NULL || strcmp(os, "linux") == 0) &&
+           (arch == NULL || strcmp(arch, HOST_ARCH) == 0);
+}
+
+// Picks the entry of an image index tagged `tag`, or without a tag the first
+// one for our platform
+static const struct json_value *select_manifest(const struct json_value *index, const char *tag)
+{
+    const struct json_value *manifests = json_get(index, "manifests");
+    if (manifests == NULL || manifests->type != JSON_ARRAY)
+    {
+        return NULL;
+    }
+
+    for (const struct json_value *descriptor = manifests->child; descriptor != NULL; descriptor = descriptor->next)
+    {
+        if (tag != NULL)
+        {
+            const char *name = json_get_string(json_get(descriptor, "annotations"), REF_NAME_ANNOTATION);
+            if (name != NULL && strcmp(name, tag) == 0)
+            {
+                return descriptor;
+            }
+        }
+        else if (platform_matches(descriptor))
+        {
+            return descriptor;
+        }
+    }
+
+    return NULL;
+}
+
+static int read_layers(struct image_s *image, const struct json_value *manifest)
+{
+    const struct json_value *layers = json_get(manifest, "layers");
+    if (layers == NULL || layers->type != JSON_ARRAY)
+    {
+        fprintf(stderr, "Manifest %s has no layers\n", image->digest);
+        return -1;
+    }
+
+    for (const struct json_value *layer = layers->child; layer != NULL; layer = layer->next)
+    {
+        const char *digest = json_get_string(layer, "digest");
+        const char *media_type = json_get_string(layer, "mediaType");
+        if (digest == NULL || strlen(digest) >= IMAGE_DIGEST_MAX)
+        {
+            fprintf(stderr, "Manifest %s has an invalid layer\n", image->digest);
+            return -1;
+        }
+
+        if (image->nlayers == IMAGE_MAX_LAYERS)
+        {
+            fprintf(stderr, "Image %s has more than %d layers\n", image->digest, IMAGE_MAX_LAYERS);
+            return -1;
+        }
+
+        struct image_layer *entry = &image->layers[image->nlayers++];
+        snprintf(entry->digest, sizeof(entry->digest), "%s", digest);
+        snprintf(entry->media_type, sizeof(entry->media_type), "%s", media_type != NULL ? media_type : "");
+        entry->size = descriptor_size(layer);
+    }
+
+    return 0;
+}
+
+// Resolves `ref` to an image manifest: index.json, through any nested image
+// indexes, to the manifest and its list of layers. Nothing is unpacked yet.
+int image_open(const char *ref, struct image_s *image)
+{
+    char path[PATH_MAX + 16];
+
+    memset(image, 0, sizeof(*image));
+    const char *tag = split_ref(ref, image->layout, sizeof(image->layout));
+
+    snprintf(path, sizeof(path), "%s/index.json", image->layout);
+    struct json_value *document = json_parse_file(path);
+    if (document == NULL)
+    {
+        fprintf(stderr, "Failed to read %s\n", path);
+        return -1;
+    }
+
+    // The tag only applies to index.json, below it we go by platform
+    for (int depth = 0; json_get(document, "manifests") != NULL; depth++)
+    {
+        const struct json_value *descriptor = select_manifest(document, depth == 0 ? tag : NULL);
+        const char *digest = json_get_string(descriptor, "digest");
+        if (digest == NULL || strlen(digest) >= sizeof(image->digest) || depth == MAX_INDEX_DEPTH)
+        {
+            if (tag != NULL && depth == 0)
+            {
+                fprintf(stderr, "No image tagged %s in %s\n", tag, image->layout);
+            }
+            else
+            {
+                fprintf(stderr, "No image for linux/%s in %s\n", HOST_ARCH, image->layout);
+            }
+            json_free(document);
+            return -1;
+        }
+
+        snprintf(image->digest, sizeof(image->digest), "%s", digest);
+        uint64_t size = descriptor_size(descriptor);
+        json_free(document);
+
+        if ((document = read_blob(image, image->digest, size)) == NULL)
+        {
+            fprintf(stderr, "Failed to read manifest %s\n", image->digest);
+            return -1;
+        }
+    }
+
+    int ret = read_layers(image, document);
+    json_free(document);
+    if (ret != 0)
+    {
+        return -1;
+    }
+
+    LOG("[IMAGE] %s is %s with %d layers\n", ref, image->digest, image->nlayers);
+    return 0;
+}
+
+// i.e. IMAGE_LAYER_STORE/sha256/<hex>
+static int layer_dir(const struct image_layer *layer, char *dir, size_t size)
+{
+    char algorithm[32];
+    const char *encoded;
+
+    if (split_digest(layer->digest, algorithm, sizeof(algorithm), &encoded) != 0)
+    {
+        fprintf(stderr, "Invalid layer digest: %s\n", layer->digest);
+        return -1;
+    }
+
+    snprintf(dir, size, "%s/%s/%s", IMAGE_LAYER_STORE, algorithm, encoded);
+    return 0;
+}
+
+// Unpacks a layer into its directory `dir` in the store
+static int unpack_layer(const struct image_s *image, const struct image_layer *layer, const char *dir)
+{
+    char path[PATH_MAX * 2];
+
+    // i.e. IMAGE_LAYER_STORE/sha256
+    snprintf(path, sizeof(path), "%s", dir);
+    *strrchr(path, '/') = '\0';
+    if (mkdir_p(path, 0755) != 0)
+    {
+        LOG("[IMAGE] Failed to create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (blob_path(image, layer->digest, path, sizeof(path)) != 0)
+    {
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Failed to open layer %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // Unpack next to the final directory and rename it into place, so the
+    // store only ever has complete layers that match their digest. Whoever
+    // renames first wins if several processes unpack the same layer.
+    LOG("[IMAGE] Unpacking layer %s\n", layer->digest);
+    snprintf(path, sizeof(path), "%s.tmp.%d", dir, getpid());
+    if (rm_rf(path) != 0 || mkdir(path, 0755) == -1)
+    {
+        LOG("[IMAGE] Failed to create %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (layer_extract(fd, path, layer->digest, layer->size) != 0)
+    {
+        fprintf(stderr, "Failed to unpack layer %s\n", layer->digest);
+        rm_rf(path);
+        return -1;
+    }
+
+    if (rename(path, dir) == -1)
+    {
+        int lost = errno == EEXIST || errno == ENOTEMPTY;
+        LOG("[IMAGE] Failed to move %s into place: %s\n", path, strerror(errno));
+        rm_rf(path);
+        return lost ? 0 : -1;
+    }
+
+    return 0;
+}
+
+// The layers of an image that aren't in the store yet, shared by the threads
+// unpacking them
+struct unpack_queue
+{
+    const struct image_s *image;
+    const struct image_layer *layers[IMAGE_MAX_LAYERS];
+    int count;
+    int next;
+    int failed;
+    pthread_mutex_t lock;
+};
+
+// Takes layers off the queue until it is empty, or one of them failed
+static void *unpack_worker(void *arg)
+{
+    struct unpack_queue *queue = arg;
+    char dir[PATH_MAX];
+
+    while (1)
+    {
+        pthread_mutex_lock(&queue->lock);
+        int i = queue->failed ? queue->count : queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (i >= queue->count)
+        {
+            return NULL;
+        }
+
+        if (layer_dir(queue->layers[i], dir, sizeof(dir)) != 0 ||
+            unpack_layer(queue->image, queue->layers[i], dir) != 0)
+        {
+            pthread_mutex_lock(&queue->lock);
+            queue->failed = 1;
+            pthread_mutex_unlock(&queue->lock);
+        }
+    }
+}
+
+// Largest first, so the longest extraction doesn't start last
+static int compare_size(const void *a, const void *b)
+{
+    const struct image_layer *layer_a = *(const struct image_layer *const *)a;
+    const struct image_layer *layer_b = *(const struct image_layer *const *)b;
+
+    return layer_a->size < layer_b->size ? 1 : layer_a->size > layer_b->size ? -1 : 0;
+}
+
+// Unpacks the layers that aren't in the store yet. Layers are independent
+// until they are stacked, so they are unpacked in parallel, on as many
+// threads as the CPUs our cgroup lets us use.
+static int unpack_layers(const struct image_s *image)
+{
+    struct unpack_queue queue = {
+        .image = image,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+    };
+    pthread_t threads[IMAGE_MAX_LAYERS];
+    char dir[PATH_MAX];
+    int nthreads = 0;
+
+    for (int i = 0; i < image->nlayers; i++)
+    {
+        const struct image_layer *layer = &image->layers[i];
+        if (layer_dir(layer, dir, sizeof(dir)) != 0)
+        {
+            return -1;
+        }
+
+        int queued = access(dir, F_OK) == 0;
+        for (int j = 0; j < queue.count && !queued; j++)
+        {
+            queued = strcmp(queue.layers[j]->digest, layer->digest) == 0;
+        }
+
+        if (!queued)
+        {
+            queue.layers[queue.count++] = layer;
+        }
+    }
+
+    if (queue.count == 0)
+    {
+        return 0;
+    }
+
+    qsort(queue.layers, queue.count, sizeof(queue.layers[0]), compare_size);
+
+    // this thread is a worker too
+    int workers = cgroup_cpu_count();
+    workers = workers < queue.count ? workers : queue.count;
+    LOG("[IMAGE] Unpacking %d layers on %d threads\n", queue.count, workers);
+    while (nthreads < workers - 1 && pthread_create(&threads[nthreads], NULL, unpack_worker, &queue) == 0)
+    {
+        nthreads++;
+    }
+
+    unpack_worker(&queue);
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    return queue.failed ? -1 : 0;
+}
+
+// Makes sure all of the image's layers are unpacked, and builds the overlay
+// lowerdir option that stacks them, topmost layer first
+int image_lowerdir(const struct image_s *image, char *lowerdir, size_t size)
+{
+    char dir[PATH_MAX];
+    size_t len = 0;
+
+    if (image->nlayers == 0)
+    {
+        fprintf(stderr, "Image %s has no layers\n", image->digest);
+        return -1;
+    }
+
+    if (unpack_layers(image) != 0)
+    {
+        return -1;
+    }
+
+    for (int i = image->nlayers - 1; i >= 0; i--)
+    {
+        if (layer_dir(&image->layers[i], dir, sizeof(dir)) != 0)
+        {
+            return -1;
+        }
+
+        int ret = snprintf(lowerdir + len, size - len, "%s%s", len > 0 ? ":" : "", dir);
+        if (ret < 0 || (size_t)ret >= size - len)
+        {
+            fprintf(stderr, "Image %s has too many layers to mount\n", image->digest);
+            return -1;
+        }
+        len += ret;
+    }
+
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+#include "../common.h"
+
+// Unpacked layers, one directory per layer blob, named by its digest:
+//   <algorithm>/<hex>  e.g. sha256/4a0c...
+// Images that share a layer share its directory.
+#define IMAGE_LAYER_STORE MOCKER_LIB_DIR "/layers"
+
+#define IMAGE_MAX_LAYERS 64
+// i.e. sha256:<64 hex characters>, or a longer algorithm
+#define IMAGE_DIGEST_MAX 136
+
+struct image_layer
+{
+    char digest[IMAGE_DIGEST_MAX];
+    char media_type[128];
+    uint64_t size;      // of the blob, as the manifest has it
+};
+
+// An image from a local OCI image layout, see
+// https://github.com/opencontainers/image-spec/blob/main/image-layout.md
+struct image_s
+{
+    char layout[PATH_MAX];                      // the layout's directory
+    char digest[IMAGE_DIGEST_MAX];              // of the image manifest
+    int nlayers;
+    struct image_layer layers[IMAGE_MAX_LAYERS]; // bottom layer first
+};
+
+int image_is_layout(const char *ref);
+int image_open(const char *ref, struct image_s *image);
+int image_lowerdir(const struct image_s *image, char *lowerdir, size_t size);
+
+#endif
@@ -0,0 +1,487 @@
+#include "json.h"
+#include "../logging.h"
+
+// Deeper documents than this are rejected rather than recursed into
+#define JSON_MAX_DEPTH 64
+
+// Largest document `json_parse_file()` reads, OCI manifests are a few KiB
+#define JSON_MAX_FILE (16 * 1024 * 1024)
+
+struct json_parser
+{
+    const char *p;
+    const char *end;
+    int depth;
+};
+
+static struct json_value *parse_value(struct json_parser *parser);
+
+static void skip_space(struct json_parser *parser)
+{
+    while (parser->p < parser->end &&
+           (*parser->p == ' ' || *parser->p == '\t' || *parser->p == '\n' || *parser->p == '\r'))
+    {
+        parser->p++;
+    }
+}
+
+static int consume(struct json_parser *parser, const char *literal)
+{
+    size_t len = strlen(literal);
+    if ((size_t)(parser->end - parser->p) < len || memcmp(parser->p, literal, len) != 0)
+    {
+        return -1;
+    }
+
+    parser->p += len;
+    return 0;
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Reads the 4 hex digits of a \u escape
+static int parse_hex4(struct json_parser *parser, uint32_t *code)
+{
+    if (parser->end - parser->p < 4)
+    {
+        return -1;
+    }
+
+    *code = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        int digit = hex_digit(*parser->p++);
+        if (digit < 0)
+        {
+            return -1;
+        }
+        *code = (*code << 4) | digit;
+    }
+
+    return 0;
+}
+
+static char *put_utf8(char *out, uint32_t code)
+{
+    if (code < 0x80)
+    {
+        *out++ = code;
+    }
+    else if (code < 0x800)
+    {
+        *out++ = 0xc0 | (code >> 6);
+        *out++ = 0x80 | (code & 0x3f);
+    }
+    else if (code < 0x10000)
+    {
+        *out++ = 0xe0 | (code >> 12);
+        *out++ = 0x80 | ((code >> 6) & 0x3f);
+        *out++ = 0x80 | (code & 0x3f);
+    }
+    else
+    {
+        *out++ = 0xf0 | (code >> 18);
+        *out++ = 0x80 | ((code >> 12) & 0x3f);
+        *out++ = 0x80 | ((code >> 6) & 0x3f);
+        *out++ = 0x80 | (code & 0x3f);
+    }
+    return out;
+}
+
+// Parses a string, with the parser on its opening quote. Escapes never take
+// more room decoded than they do encoded, so the input length is enough.
+static char *parse_string(struct json_parser *parser)
+{
+    const char *start = ++parser->p;
+    while (parser->p < parser->end && *parser->p != '"')
+    {
+        parser->p += *parser->p == '\\' ? 2 : 1;
+    }
+
+    if (parser->p >= parser->end)
+    {
+        return NULL;
+    }
+
+    // decode with the closing quote as the end of input
+    struct json_parser string_parser = {
+        .p = start,
+        .end = parser->p,
+    };
+    parser->p++;
+
+    char *string = malloc(string_parser.end - start + 1);
+    if (string == NULL)
+    {
+        return NULL;
+    }
+
+    char *out = string;
+    parser = &string_parser;
+    while (parser->p < parser->end)
+    {
+        char c = *parser->p++;
+        if ((unsigned char)c < 0x20)
+        {
+            goto invalid;
+        }
+
+        if (c != '\\')
+        {
+            *out++ = c;
+            continue;
+        }
+
+        uint32_t code;
+        switch (*parser->p++)
+        {
+        case '"':
+            *out++ = '"';
+            break;
+        case '\\':
+            *out++ = '\\';
+            break;
+        case '/':
+            *out++ = '/';
+            break;
+        case 'b':
+            *out++ = '\b';
+            break;
+        case 'f':
+            *out++ = '\f';
+            break;
+        case 'n':
+            *out++ = '\n';
+            break;
+        case 'r':
+            *out++ = '\r';
+            break;
+        case 't':
+            *out++ = '\t';
+            break;
+        case 'u':
+            if (parse_hex4(parser, &code) != 0)
+            {
+                goto invalid;
+            }
+
+            // a surrogate pair, i.e. \ud83d\ude00
+            if (code >= 0xd800 && code < 0xdc00)
+            {
+                uint32_t low;
+                if (consume(parser, "\\u") != 0 || parse_hex4(parser, &low) != 0 ||
+                    low < 0xdc00 || low >= 0xe000)
+                {
+                    goto invalid;
+                }
+                code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+            }
+
+            // NUL would cut the string short
+            if (code == 0)
+            {
+                goto invalid;
+            }
+            out = put_utf8(out, code);
+            break;
+        default:
+            goto invalid;
+        }
+    }
+
+    *out = '\0';
+    return string;
+
+invalid:
+    free(string);
+    return NULL;
+}
+
+static int parse_number(struct json_parser *parser, double *number)
+{
+    char buf[64];
+    size_t len = 0;
+
+    while (parser->p + len < parser->end && len < sizeof(buf) - 1 &&
+           strchr("+-0123456789.eE", parser->p[len]) != NULL)
+    {
+        len++;
+    }
+
+    if (len == 0)
+    {
+        return -1;
+    }
+
+    memcpy(buf, parser->p, len);
+    buf[len] = '\0';
+
+    char *end;
+    *number = strtod(buf, &end);
+    if (end != buf + len)
+    {
+        return -1;
+    }
+
+    parser->p += len;
+    return 0;
+}
+
+// Parses the elements of an array or the members of an object, with the
+// parser just past the opening bracket
+static int parse_elements(struct json_parser *parser, struct json_value *parent, char close)
+{
+    struct json_value **tail = &parent->child;
+
+    skip_space(parser);
+    if (parser->p < parser->end && *parser->p == close)
+    {
+        parser->p++;
+        return 0;
+    }
+
+    while (1)
+    {
+        char *key = NULL;
+        if (parent->type == JSON_OBJECT)
+        {
+            skip_space(parser);
+            if (parser->p >= parser->end || *parser->p != '"' ||
+                (key = parse_string(parser)) == NULL)
+            {
+                return -1;
+            }
+
+            skip_space(parser);
+            if (consume(parser, ":") != 0)
+            {
+                free(key);
+                return -1;
+            }
+        }
+
+        struct json_value *element = parse_value(parser);
+        if (element == NULL)
+        {
+            free(key);
+            return -1;
+        }
+        element->key = key;
+        *tail = element;
+        tail = &element->next;
+
+        skip_space(parser);
+        if (parser->p >= parser->end)
+        {
+            return -1;
+        }
+
+        if (*parser->p == close)
+        {
+            parser->p++;
+            return 0;
+        }
+
+        if (*parser->p++ != ',')
+        {
+            return -1;
+        }
+    }
+}
+
+static struct json_value *parse_value(struct json_parser *parser)
+{
+    skip_space(parser);
+    if (parser->p >= parser->end || parser->depth >= JSON_MAX_DEPTH)
+    {
+        return NULL;
+    }
+
+    struct json_value *value = calloc(1, sizeof(*value));
+    if (value == NULL)
+    {
+        return NULL;
+    }
+
+    int ret = 0;
+    switch (*parser->p)
+    {
+    case '{':
+    case '[':
+        value->type = *parser->p == '{' ? JSON_OBJECT : JSON_ARRAY;
+        parser->p++;
+        parser->depth++;
+        ret = parse_elements(parser, value, value->type == JSON_OBJECT ? '}' : ']');
+        parser->depth--;
+        break;
+    case '"':
+        value->type = JSON_STRING;
+        value->string = parse_string(parser);
+        ret = value->string != NULL ? 0 : -1;
+        break;
+    case 't':
+        value->type = JSON_BOOL;
+        value->boolean = 1;
+        ret = consume(parser, "true");
+        break;
+    case 'f':
+        value->type = JSON_BOOL;
+        ret = consume(parser, "false");
+        break;
+    case 'n':
+        value->type = JSON_NULL;
+        ret = consume(parser, "null");
+        break;
+    default:
+        value->type = JSON_NUMBER;
+        ret = parse_number(parser, &value->number);
+        break;
+    }
+
+    if (ret != 0)
+    {
+        json_free(value);
+        return NULL;
+    }
+
+    return value;
+}
+
+// Parses a whole document. Returns NULL if it isn't valid JSON.
+struct json_value *json_parse(const char *text, size_t len)
+{
+    struct json_parser parser = {
+        .p = text,
+        .end = text + len,
+    };
+
+    struct json_value *value = parse_value(&parser);
+    skip_space(&parser);
+    if (value != NULL && parser.p != parser.end)
+    {
+        json_free(value);
+        return NULL;
+    }
+
+    return value;
+}
+
+// Reads a whole document of at most JSON_MAX_FILE bytes, for the caller to
+// parse and free
+char *json_read_file(const char *path, size_t *len)
+{
+    struct stat st;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        LOG("[JSON] Failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_size > JSON_MAX_FILE)
+    {
+        LOG("[JSON] %s is too large\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    char *text = malloc(st.st_size + 1);
+    if (text == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    *len = 0;
+    while (*len < (size_t)st.st_size)
+    {
+        ssize_t ret = read(fd, text + *len, st.st_size - *len);
+        if (ret == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret <= 0)
+        {
+            break;
+        }
+        *len += ret;
+    }
+    close(fd);
+
+    return text;
+}
+
+struct json_value *json_parse_file(const char *path)
+{
+    size_t len;
+
+    char *text = json_read_file(path, &len);
+    if (text == NULL)
+    {
+        return NULL;
+    }
+
+    struct json_value *value = json_parse(text, len);
+    if (value == NULL)
+    {
+        LOG("[JSON] %s is not valid JSON\n", path);
+    }
+
+    free(text);
+    return value;
+}
+
+void json_free(struct json_value *value)
+{
+    while (value != NULL)
+    {
+        struct json_value *next = value->next;
+        json_free(value->child);
+        free(value->key);
+        free(value->string);
+        free(value);
+        value = next;
+    }
+}
+
+// Returns the member `key` of `object`, or NULL if there isn't one
+const struct json_value *json_get(const struct json_value *object, const char *key)
+{
+    if (object == NULL || object->type != JSON_OBJECT)
+    {
+        return NULL;
+    }
+
+    for (const struct json_value *member = object->child; member != NULL; member = member->next)
+    {
+        if (strcmp(member->key, key) == 0)
+        {
+            return member;
+        }
+    }
+
+    return NULL;
+}
+
+// Returns the member `key` of `object` if it is a string, or NULL
+const char *json_get_string(const struct json_value *object, const char *key)
+{
+    const struct json_value *member = json_get(object, key);
+    return member != NULL && member->type == JSON_STRING ? member->string : NULL;
+}
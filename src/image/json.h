@@ -0,0 +1,36 @@
+#ifndef _JSON_H_
+#define _JSON_H_
+
+#include "../common.h"
+
+enum json_type
+{
+    JSON_NULL,
+    JSON_BOOL,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT,
+};
+
+// A parsed JSON value. Arrays and objects keep their elements as a list
+// through `child` and `next`, object members also have a `key`.
+struct json_value
+{
+    enum json_type type;
+    char *key;                 // member name, if the parent is an object
+    char *string;              // JSON_STRING, NUL terminated
+    double number;             // JSON_NUMBER
+    int boolean;               // JSON_BOOL
+    struct json_value *child;  // first element of a JSON_ARRAY or JSON_OBJECT
+    struct json_value *next;   // next element of the parent
+};
+
+struct json_value *json_parse(const char *text, size_t len);
+char *json_read_file(const char *path, size_t *len);
+struct json_value *json_parse_file(const char *path);
+void json_free(struct json_value *value);
+const struct json_value *json_get(const struct json_value *object, const char *key);
+const char *json_get_string(const struct json_value *object, const char *key);
+
+#endif
@@ -0,0 +1,930 @@
+#define _GNU_SOURCE // for makedev
+#include "layer.h"
+#include "../common.h"
+#include "../logging.h"
+#include "sha256.h"
+
+#include <linux/openat2.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#define TAR_BLOCK 512
+
+// zstd frames start with 28 b5 2f fd, gzip with 1f 8b and tar with a name
+#define ZSTD_MAGIC "\x28\xb5\x2f\xfd"
+#define GZIP_MAGIC "\x1f\x8b"
+
+// inflate() window bits for a gzip stream, rather than a raw zlib one
+#define GZIP_WINDOW_BITS (15 + 16)
+
+// Entries of an OCI layer that delete what lower layers have, see
+// https://github.com/opencontainers/image-spec/blob/main/layer.md#whiteouts
+#define WHITEOUT_PREFIX ".wh."
+#define WHITEOUT_OPAQUE ".wh..wh..opq"
+
+// How much of a file is read from the stream at once
+#define COPY_BUFFER_SIZE (128 * 1024)
+
+// Largest extension header we accept, pax records may carry xattrs
+#define EXTENSION_MAX (1024 * 1024)
+
+// ustar header, the first block of every entry
+struct tar_header
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+// An entry, with whatever GNU and pax extension headers said about it
+struct tar_entry
+{
+    char type;
+    char *path;
+    char *link;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    uint64_t size;
+    time_t mtime;
+    dev_t dev;
+};
+
+struct layer_reader
+{
+    int blob_fd;
+    struct sha256 hash; // of the blob as far as it was read
+    z_stream *gz;       // gzip compressed, or
+    ZSTD_DStream *zstd; // zstd compressed, both fed from blob_fd through `in`,
+    ZSTD_inBuffer in;   // or else plain tar
+    int root_fd;        // the layer's directory, everything is resolved in it
+    int dir_fd;         // the directory of the last entry, or -1
+    char *dir_path;     // its path in the layer
+    int dir_setgid;     // whether new files in it take its group
+    uid_t uid;          // who new files belong to without a chown
+    gid_t gid;
+    char *buf;          // COPY_BUFFER_SIZE
+    char *long_path;    // from a GNU 'L' or pax header, for the next entry
+    char *long_link;    // from a GNU 'K' or pax header, for the next entry
+    int64_t pax_size;   // from a pax header, or -1
+};
+
+// Reads the blob itself. Every byte of it comes through here, so it is all
+// hashed, however it is compressed.
+static ssize_t blob_read(struct layer_reader *reader, void *buf, size_t len)
+{
+    ssize_t n;
+
+    do
+    {
+        n = read(reader->blob_fd, buf, len);
+    } while (n == -1 && errno == EINTR);
+
+    if (n > 0)
+    {
+        sha256_update(&reader->hash, buf, n);
+    }
+    return n;
+}
+
+// Refills `in` once the decompressor has used up what it has
+static ssize_t refill(struct layer_reader *reader)
+{
+    ssize_t n = blob_read(reader, (void *)reader->in.src, COPY_BUFFER_SIZE);
+    if (n > 0)
+    {
+        reader->in.size = n;
+        reader->in.pos = 0;
+    }
+    return n;
+}
+
+// Decompresses up to `len` bytes, reading as much of the blob as that takes
+static ssize_t zstd_read(struct layer_reader *reader, void *buf, size_t len)
+{
+    ZSTD_outBuffer out = {
+        .dst = buf,
+        .size = len,
+    };
+
+    while (1)
+    {
+        size_t ret = ZSTD_decompressStream(reader->zstd, &out, &reader->in);
+        if (ZSTD_isError(ret))
+        {
+            LOG("[LAYER] Failed to decompress: %s\n", ZSTD_getErrorName(ret));
+            return -1;
+        }
+
+        if (out.pos > 0)
+        {
+            return out.pos;
+        }
+
+        if (reader->in.pos < reader->in.size)
+        {
+            continue;
+        }
+
+        ssize_t n = refill(reader);
+        if (n <= 0)
+        {
+            return n;
+        }
+    }
+}
+
+static ssize_t gzip_read(struct layer_reader *reader, void *buf, size_t len)
+{
+    z_stream *gz = reader->gz;
+
+    gz->next_out = buf;
+    gz->avail_out = len;
+    while (gz->avail_out == len)
+    {
+        if (reader->in.pos == reader->in.size)
+        {
+            ssize_t n = refill(reader);
+            if (n <= 0)
+            {
+                return n;
+            }
+        }
+
+        gz->next_in = (unsigned char *)reader->in.src + reader->in.pos;
+        gz->avail_in = reader->in.size - reader->in.pos;
+        int ret = inflate(gz, Z_NO_FLUSH);
+        reader->in.pos = reader->in.size - gz->avail_in;
+
+        // a blob may be several gzip members one after the other
+        if (ret == Z_STREAM_END)
+        {
+            inflateReset(gz);
+        }
+        else if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            LOG("[LAYER] Failed to decompress: %s\n", gz->msg != NULL ? gz->msg : zError(ret));
+            return -1;
+        }
+    }
+
+    return len - gz->avail_out;
+}
+
+static int read_full(struct layer_reader *reader, void *buf, size_t len)
+{
+    while (len > 0)
+    {
+        size_t chunk = len > INT_MAX ? INT_MAX : len;
+        ssize_t ret = reader->zstd != NULL ? zstd_read(reader, buf, chunk)
+                      : reader->gz != NULL ? gzip_read(reader, buf, chunk)
+                                           : blob_read(reader, buf, chunk);
+        if (ret <= 0)
+        {
+            return -1;
+        }
+
+        buf = (char *)buf + ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+// Skips `size` bytes of content and the padding after it
+static int skip_content(struct layer_reader *reader, uint64_t size)
+{
+    uint64_t left = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    while (left > 0)
+    {
+        size_t chunk = left < COPY_BUFFER_SIZE ? left : COPY_BUFFER_SIZE;
+        if (read_full(reader, reader->buf, chunk) != 0)
+        {
+            return -1;
+        }
+        left -= chunk;
+    }
+
+    return 0;
+}
+
+// Parses a numeric header field, which is octal or, when the top bit of its
+// first byte is set, big-endian base-256
+static uint64_t parse_number(const char *field, size_t len)
+{
+    uint64_t value = 0;
+
+    if ((unsigned char)field[0] & 0x80)
+    {
+        value = (unsigned char)field[0] & 0x3f;
+        for (size_t i = 1; i < len; i++)
+        {
+            value = (value << 8) | (unsigned char)field[i];
+        }
+        return value;
+    }
+
+    for (size_t i = 0; i < len && field[i] != '\0'; i++)
+    {
+        if (field[i] >= '0' && field[i] <= '7')
+        {
+            value = (value << 3) | (field[i] - '0');
+        }
+    }
+
+    return value;
+}
+
+static int checksum_ok(const struct tar_header *header)
+{
+    const unsigned char *bytes = (const unsigned char *)header;
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < TAR_BLOCK; i++)
+    {
+        int in_chksum = i >= offsetof(struct tar_header, chksum) &&
+                        i < offsetof(struct tar_header, chksum) + sizeof(header->chksum);
+        sum += in_chksum ? ' ' : bytes[i];
+    }
+
+    return sum == parse_number(header->chksum, sizeof(header->chksum));
+}
+
+// Reads the content of an extension header: a GNU 'L'/'K' entry, i.e. a name
+// too long for the header, or pax records
+static char *read_extension(struct layer_reader *reader, uint64_t size)
+{
+    if (size == 0 || size > EXTENSION_MAX)
+    {
+        return NULL;
+    }
+
+    uint64_t padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    char *name = malloc(padded + 1);
+    if (name == NULL || read_full(reader, name, padded) != 0)
+    {
+        free(name);
+        return NULL;
+    }
+
+    name[size] = '\0';
+    return name;
+}
+
+// Reads a pax extended header, i.e. records of "<len> <key>=<value>\n"
+static int read_pax(struct layer_reader *reader, uint64_t size)
+{
+    char *records = read_extension(reader, size);
+    if (records == NULL)
+    {
+        return -1;
+    }
+
+    char *p = records;
+    char *end = records + size;
+    while (p < end)
+    {
+        char *space;
+        long len = strtol(p, &space, 10);
+        if (*space != ' ' || len <= 0 || len > end - p || p[len - 1] != '\n')
+        {
+            break;
+        }
+
+        char *key = space + 1;
+        char *eq = memchr(key, '=', p + len - key);
+        if (eq != NULL)
+        {
+            *eq = '\0';
+            p[len - 1] = '\0';
+            char *value = eq + 1;
+
+            if (strcmp(key, "path") == 0)
+            {
+                free(reader->long_path);
+                reader->long_path = strdup(value);
+            }
+            else if (strcmp(key, "linkpath") == 0)
+            {
+                free(reader->long_link);
+                reader->long_link = strdup(value);
+            }
+            else if (strcmp(key, "size") == 0)
+            {
+                reader->pax_size = strtoll(value, NULL, 10);
+            }
+        }
+
+        p += len;
+    }
+
+    free(records);
+    return 0;
+}
+
+// Copies a header field that may not be NUL terminated
+static char *field_string(const char *field, size_t len)
+{
+    return strndup(field, strnlen(field, len));
+}
+
+// Reads the next entry's header, handling any extension headers before it.
+// Returns 1 at the end of the archive.
+static int read_entry(struct layer_reader *reader, struct tar_entry *entry)
+{
+    struct tar_header header;
+
+    while (1)
+    {
+        if (read_full(reader, &header, sizeof(header)) != 0)
+        {
+            return -1;
+        }
+
+        // the archive ends with zero blocks
+        if (header.name[0] == '\0' && header.chksum[0] == '\0')
+        {
+            return 1;
+        }
+
+        if (!checksum_ok(&header))
+        {
+            LOG("[LAYER] Bad header checksum\n");
+            return -1;
+        }
+
+        uint64_t size = parse_number(header.size, sizeof(header.size));
+        switch (header.typeflag)
+        {
+        case 'L':
+            free(reader->long_path);
+            if ((reader->long_path = read_extension(reader, size)) == NULL)
+            {
+                return -1;
+            }
+            continue;
+        case 'K':
+            free(reader->long_link);
+            if ((reader->long_link = read_extension(reader, size)) == NULL)
+            {
+                return -1;
+            }
+            continue;
+        case 'x':
+            if (read_pax(reader, size) != 0)
+            {
+                return -1;
+            }
+            continue;
+        case 'g':
+            if (skip_content(reader, size) != 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        memset(entry, 0, sizeof(*entry));
+        entry->type = header.typeflag == '\0' ? '0' : header.typeflag;
+        entry->mode = parse_number(header.mode, sizeof(header.mode)) & 07777;
+        entry->uid = parse_number(header.uid, sizeof(header.uid));
+        entry->gid = parse_number(header.gid, sizeof(header.gid));
+        entry->size = reader->pax_size >= 0 ? (uint64_t)reader->pax_size : size;
+        entry->mtime = parse_number(header.mtime, sizeof(header.mtime));
+        entry->dev = makedev(parse_number(header.devmajor, sizeof(header.devmajor)),
+                             parse_number(header.devminor, sizeof(header.devminor)));
+
+        if (reader->long_path != NULL)
+        {
+            entry->path = reader->long_path;
+            reader->long_path = NULL;
+        }
+        else if (header.prefix[0] != '\0' && memcmp(header.magic, "ustar", 5) == 0)
+        {
+            char *prefix = field_string(header.prefix, sizeof(header.prefix));
+            char *name = field_string(header.name, sizeof(header.name));
+            if (prefix != NULL && name != NULL && asprintf(&entry->path, "%s/%s", prefix, name) == -1)
+            {
+                entry->path = NULL;
+            }
+            free(prefix);
+            free(name);
+        }
+        else
+        {
+            entry->path = field_string(header.name, sizeof(header.name));
+        }
+
+        if (reader->long_link != NULL)
+        {
+            entry->link = reader->long_link;
+            reader->long_link = NULL;
+        }
+        else
+        {
+            entry->link = field_string(header.linkname, sizeof(header.linkname));
+        }
+        reader->pax_size = -1;
+
+        return entry->path != NULL && entry->link != NULL ? 0 : -1;
+    }
+}
+
+// Turns an entry's path into one relative to the layer root, in place.
+// Returns NULL for the root itself and for paths that climb out of it.
+static char *clean_path(char *path)
+{
+    while (*path == '/' || (path[0] == '.' && path[1] == '/'))
+    {
+        path += path[0] == '/' ? 1 : 2;
+    }
+
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/')
+    {
+        path[--len] = '\0';
+    }
+
+    if (len == 0 || strcmp(path, ".") == 0)
+    {
+        return NULL;
+    }
+
+    for (char *component = path; component != NULL;)
+    {
+        char *slash = strchr(component, '/');
+        size_t component_len = slash != NULL ? (size_t)(slash - component) : strlen(component);
+        if (component_len == 2 && component[0] == '.' && component[1] == '.')
+        {
+            return NULL;
+        }
+        component = slash != NULL ? slash + 1 : NULL;
+    }
+
+    return path;
+}
+
+// Opens a directory of the layer, creating it and its parents if they don't
+// exist. Symlinks are resolved as if the layer root were /, so a symlink in
+// the layer can't make us write outside of it.
+static int open_dir(int root_fd, const char *path)
+{
+    struct open_how how = {
+        .flags = O_PATH | O_DIRECTORY | O_CLOEXEC,
+        .resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS,
+    };
+
+    if (path[0] == '\0')
+    {
+        return dup(root_fd);
+    }
+
+    int fd = syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+    if (fd != -1 || errno != ENOENT)
+    {
+        return fd;
+    }
+
+    // i.e. mkdir -p path
+    char *parent = strdup(path);
+    if (parent == NULL)
+    {
+        return -1;
+    }
+
+    char *slash = strrchr(parent, '/');
+    const char *name = slash != NULL ? slash + 1 : path;
+    if (slash != NULL)
+    {
+        *slash = '\0';
+    }
+    else
+    {
+        parent[0] = '\0';
+    }
+
+    int parent_fd = open_dir(root_fd, parent);
+    int ret = parent_fd != -1 ? mkdirat(parent_fd, name, 0755) : -1;
+    if (ret == -1 && errno == EEXIST)
+    {
+        ret = 0;
+    }
+
+    free(parent);
+    if (parent_fd != -1)
+    {
+        close(parent_fd);
+    }
+    if (ret == -1)
+    {
+        return -1;
+    }
+
+    return syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+}
+
+// Splits `path` into the directory it is in, opened, and its name
+static int open_parent(int root_fd, char *path, const char **name)
+{
+    char *slash = strrchr(path, '/');
+    if (slash == NULL)
+    {
+        *name = path;
+        return open_dir(root_fd, "");
+    }
+
+    *slash = '\0';
+    *name = slash + 1;
+    int fd = open_dir(root_fd, path);
+    *slash = '/';
+    return fd;
+}
+
+// Drops the cached directory, once an entry may have changed what its path
+// resolves to
+static void forget_parent(struct layer_reader *reader)
+{
+    if (reader->dir_fd != -1)
+    {
+        close(reader->dir_fd);
+    }
+    reader->dir_fd = -1;
+    free(reader->dir_path);
+    reader->dir_path = NULL;
+}
+
+// Like open_parent(), but the directory stays open for the next entry and
+// must not be closed. Layers list a directory's entries one after the other,
+// so most entries skip resolving their path.
+static int cached_parent(struct layer_reader *reader, char *path, const char **name)
+{
+    char *slash = strrchr(path, '/');
+    size_t len = slash != NULL ? (size_t)(slash - path) : 0;
+    *name = slash != NULL ? slash + 1 : path;
+
+    if (reader->dir_path != NULL && strlen(reader->dir_path) == len &&
+        strncmp(reader->dir_path, path, len) == 0)
+    {
+        return reader->dir_fd;
+    }
+
+    forget_parent(reader);
+    char *dir = strndup(path, len);
+    if (dir == NULL)
+    {
+        return -1;
+    }
+
+    int fd = open_dir(reader->root_fd, dir);
+    if (fd == -1)
+    {
+        free(dir);
+        return -1;
+    }
+
+    struct stat st;
+    reader->dir_fd = fd;
+    reader->dir_path = dir;
+    reader->dir_setgid = fstat(fd, &st) == -1 || (st.st_mode & S_ISGID);
+    return fd;
+}
+
+static int write_file(struct layer_reader *reader, int dir_fd, const char *name, const struct tar_entry *entry)
+{
+    int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    // The content and the padding up to the next header are read together,
+    // so a file smaller than the buffer takes one read and one write
+    uint64_t content = entry->size;
+    uint64_t left = (entry->size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    while (left > 0)
+    {
+        size_t chunk = left < COPY_BUFFER_SIZE ? left : COPY_BUFFER_SIZE;
+        size_t data = content < chunk ? content : chunk;
+        if (read_full(reader, reader->buf, chunk) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+
+        for (size_t done = 0; done < data;)
+        {
+            ssize_t ret = write(fd, reader->buf + done, data - done);
+            if (ret == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                close(fd);
+                return -1;
+            }
+            done += ret;
+        }
+        content -= data;
+        left -= chunk;
+    }
+
+    // chown() clears setuid and setgid bits, so the mode goes last. Most
+    // files already belong to the right owner.
+    struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = entry->mtime}};
+    int owned = entry->uid == reader->uid && entry->gid == reader->gid && !reader->dir_setgid;
+    int chown_ret = owned ? 0 : fchown(fd, entry->uid, entry->gid);
+    if (chown_ret == -1 || fchmod(fd, entry->mode) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    futimens(fd, times);
+    close(fd);
+    return 0;
+}
+
+static int make_dir(int dir_fd, const char *name, const struct tar_entry *entry)
+{
+    if (mkdirat(dir_fd, name, 0700) == -1 && errno != EEXIST)
+    {
+        return -1;
+    }
+
+    // O_NOFOLLOW, since a symlink in the layer may already have the name
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    int ret = fchown(fd, entry->uid, entry->gid) == -1 || fchmod(fd, entry->mode) == -1 ? -1 : 0;
+    close(fd);
+    return ret;
+}
+
+// i.e. ln target path
+static int make_hardlink(int root_fd, int dir_fd, const char *name, char *target)
+{
+    const char *target_name;
+
+    if ((target = clean_path(target)) == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int target_dir_fd = open_parent(root_fd, target, &target_name);
+    if (target_dir_fd == -1)
+    {
+        return -1;
+    }
+
+    int ret = linkat(target_dir_fd, target_name, dir_fd, name, 0);
+    close(target_dir_fd);
+    return ret;
+}
+
+// Overlayfs marks a deleted entry with a 0/0 character device, and a
+// directory that hides everything below it with an xattr
+static int make_whiteout(int dir_fd, const char *name)
+{
+    if (strcmp(name, WHITEOUT_OPAQUE) == 0)
+    {
+        int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            return -1;
+        }
+
+        int ret = fsetxattr(fd, "trusted.overlay.opaque", "y", 1, 0);
+        close(fd);
+        return ret;
+    }
+
+    name += strlen(WHITEOUT_PREFIX);
+    if (name[0] == '\0')
+    {
+        return 0;
+    }
+
+    unlinkat(dir_fd, name, 0);
+    return mknodat(dir_fd, name, S_IFCHR, makedev(0, 0));
+}
+
+static int extract_entry(struct layer_reader *reader, struct tar_entry *entry)
+{
+    const char *name;
+    int ret = 0;
+
+    char *path = clean_path(entry->path);
+    if (path == NULL)
+    {
+        // the root itself, or a path that tries to escape it
+        return skip_content(reader, entry->size);
+    }
+
+    int dir_fd = cached_parent(reader, path, &name);
+    if (dir_fd == -1)
+    {
+        LOG("[LAYER] Failed to open the directory of %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (strncmp(name, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) == 0)
+    {
+        ret = make_whiteout(dir_fd, name);
+        forget_parent(reader);
+        return ret == 0 ? skip_content(reader, entry->size) : -1;
+    }
+
+    // A later entry replaces an earlier one with the same name
+    if (entry->type != '5')
+    {
+        unlinkat(dir_fd, name, 0);
+    }
+
+    switch (entry->type)
+    {
+    case '0':
+    case '7':
+        return write_file(reader, dir_fd, name, entry);
+    case '5':
+        ret = make_dir(dir_fd, name, entry);
+        break;
+    case '2':
+        ret = symlinkat(entry->link, dir_fd, name);
+        if (ret == 0)
+        {
+            fchownat(dir_fd, name, entry->uid, entry->gid, AT_SYMLINK_NOFOLLOW);
+        }
+        break;
+    case '1':
+        ret = make_hardlink(reader->root_fd, dir_fd, name, entry->link);
+        break;
+    case '3':
+    case '4':
+    case '6':
+    {
+        mode_t type = entry->type == '3' ? S_IFCHR : entry->type == '4' ? S_IFBLK : S_IFIFO;
+        ret = mknodat(dir_fd, name, type | entry->mode, entry->dev);
+        if (ret == 0)
+        {
+            fchownat(dir_fd, name, entry->uid, entry->gid, AT_SYMLINK_NOFOLLOW);
+        }
+        break;
+    }
+    default:
+        LOG("[LAYER] Skipping %s of unknown type '%c'\n", path, entry->type);
+        break;
+    }
+
+    // Directories are never removed, so the cached one stays valid until an
+    // entry takes a name that may have been a symlink on its path
+    if (entry->type != '5')
+    {
+        forget_parent(reader);
+    }
+
+    if (ret != 0)
+    {
+        LOG("[LAYER] Failed to extract %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    return skip_content(reader, entry->size);
+}
+
+// Sets up decompression of the blob, going by its first bytes rather than by
+// the media type the manifest claims
+static int open_stream(struct layer_reader *reader)
+{
+    char magic[4];
+
+    ssize_t n = pread(reader->blob_fd, magic, sizeof(magic), 0);
+    if (n == sizeof(magic) && memcmp(magic, ZSTD_MAGIC, sizeof(magic)) == 0)
+    {
+        reader->zstd = ZSTD_createDStream();
+        reader->in.src = malloc(COPY_BUFFER_SIZE);
+        if (reader->zstd == NULL || reader->in.src == NULL ||
+            ZSTD_isError(ZSTD_initDStream(reader->zstd)))
+        {
+            return -1;
+        }
+        return 0;
+    }
+
+    if (n >= 2 && memcmp(magic, GZIP_MAGIC, 2) == 0)
+    {
+        reader->gz = calloc(1, sizeof(*reader->gz));
+        reader->in.src = malloc(COPY_BUFFER_SIZE);
+        if (reader->gz == NULL || reader->in.src == NULL ||
+            inflateInit2(reader->gz, GZIP_WINDOW_BITS) != Z_OK)
+        {
+            free(reader->gz);
+            reader->gz = NULL;
+            return -1;
+        }
+        return 0;
+    }
+
+    // plain tar is read as is
+    return 0;
+}
+
+// Reads what is left of the blob after the end of the archive, and checks
+// that all of it is what the manifest says it is
+static int verify_blob(struct layer_reader *reader, const char *digest, uint64_t size)
+{
+    ssize_t n;
+
+    while ((n = blob_read(reader, reader->buf, COPY_BUFFER_SIZE)) > 0)
+    {
+    }
+
+    uint64_t length = reader->hash.length;
+    if (n == -1 || (size != 0 && length != size) || !sha256_matches(&reader->hash, digest))
+    {
+        fprintf(stderr, "Layer %s doesn't match its digest (%llu bytes, %llu expected)\n", digest,
+                (unsigned long long)length, (unsigned long long)size);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Unpacks a layer blob, a tar archive that may be gzip or zstd compressed,
+// into the directory `dest`, decompressing as it goes. The blob is hashed as
+// it is read, and only counts as unpacked if it has the sha256 `digest` and,
+// unless it is 0, `size`. Takes ownership of `blob_fd`.
+int layer_extract(int blob_fd, const char *dest, const char *digest, uint64_t size)
+{
+    struct layer_reader reader = {
+        .blob_fd = blob_fd,
+        .dir_fd = -1,
+        .uid = geteuid(),
+        .gid = getegid(),
+        .pax_size = -1,
+    };
+    struct tar_entry entry;
+    int ret;
+
+    sha256_init(&reader.hash);
+    reader.root_fd = open(dest, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    reader.buf = malloc(COPY_BUFFER_SIZE);
+    if (reader.root_fd == -1 || reader.buf == NULL || open_stream(&reader) != 0)
+    {
+        LOG("[LAYER] Failed to open %s\n", dest);
+        ret = -1;
+        goto out;
+    }
+
+    while ((ret = read_entry(&reader, &entry)) == 0)
+    {
+        ret = extract_entry(&reader, &entry);
+        free(entry.path);
+        free(entry.link);
+        if (ret != 0)
+        {
+            break;
+        }
+    }
+
+    // 1 is the end of the archive
+    ret = ret == 1 ? verify_blob(&reader, digest, size) : -1;
+
+out:
+    if (reader.gz != NULL)
+    {
+        inflateEnd(reader.gz);
+        free(reader.gz);
+    }
+    close(blob_fd);
+    ZSTD_freeDStream(reader.zstd);
+    free((void *)reader.in.src);
+    forget_parent(&reader);
+    if (reader.root_fd != -1)
+    {
+        close(reader.root_fd);
+    }
+    free(reader.buf);
+    free(reader.long_path);
+    free(reader.long_link);
+    return ret;
+}
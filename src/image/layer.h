@@ -0,0 +1,8 @@
+#ifndef _LAYER_H_
+#define _LAYER_H_
+
+#include "../common.h"
+
+int layer_extract(int blob_fd, const char *dest, const char *digest, uint64_t size);
+
+#endif
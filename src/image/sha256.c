@@ -0,0 +1,134 @@
+#include "sha256.h"
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void transform(struct sha256 *ctx, const unsigned char *block)
+{
+    uint32_t w[64];
+    uint32_t s[8];
+
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+               (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    memcpy(s, ctx->state, sizeof(s));
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = s[7] + (ROTR(s[4], 6) ^ ROTR(s[4], 11) ^ ROTR(s[4], 25)) +
+                      ((s[4] & s[5]) ^ (~s[4] & s[6])) + K[i] + w[i];
+        uint32_t t2 = (ROTR(s[0], 2) ^ ROTR(s[0], 13) ^ ROTR(s[0], 22)) +
+                      ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+        memmove(s + 1, s, sizeof(s[0]) * 7);
+        s[4] += t1;
+        s[0] = t1 + t2;
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        ctx->state[i] += s[i];
+    }
+}
+
+void sha256_init(struct sha256 *ctx)
+{
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+}
+
+void sha256_update(struct sha256 *ctx, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t used = ctx->length % SHA256_BLOCK;
+
+    ctx->length += len;
+
+    // top up the partial block first
+    if (used > 0)
+    {
+        size_t take = SHA256_BLOCK - used < len ? SHA256_BLOCK - used : len;
+        memcpy(ctx->block + used, p, take);
+        p += take;
+        len -= take;
+        if (used + take < SHA256_BLOCK)
+        {
+            return;
+        }
+        transform(ctx, ctx->block);
+    }
+
+    for (; len >= SHA256_BLOCK; p += SHA256_BLOCK, len -= SHA256_BLOCK)
+    {
+        transform(ctx, p);
+    }
+
+    memcpy(ctx->block, p, len);
+}
+
+// Pads the message with a 1 bit, zeros and its length in bits
+void sha256_final(struct sha256 *ctx, unsigned char hash[SHA256_SIZE])
+{
+    uint64_t bits = ctx->length * 8;
+    size_t used = ctx->length % SHA256_BLOCK;
+
+    ctx->block[used++] = 0x80;
+    if (used > SHA256_BLOCK - 8)
+    {
+        memset(ctx->block + used, 0, SHA256_BLOCK - used);
+        transform(ctx, ctx->block);
+        used = 0;
+    }
+    memset(ctx->block + used, 0, SHA256_BLOCK - 8 - used);
+
+    for (int i = 0; i < 8; i++)
+    {
+        ctx->block[SHA256_BLOCK - 1 - i] = bits >> (i * 8);
+    }
+    transform(ctx, ctx->block);
+
+    for (int i = 0; i < 8; i++)
+    {
+        hash[i * 4] = ctx->state[i] >> 24;
+        hash[i * 4 + 1] = ctx->state[i] >> 16;
+        hash[i * 4 + 2] = ctx->state[i] >> 8;
+        hash[i * 4 + 3] = ctx->state[i];
+    }
+}
+
+// Finishes the hash and compares it to an OCI digest, i.e. sha256:<hex>
+int sha256_matches(struct sha256 *ctx, const char *digest)
+{
+    unsigned char hash[SHA256_SIZE];
+    char computed[7 + SHA256_SIZE * 2 + 1] = "sha256:";
+
+    sha256_final(ctx, hash);
+    for (int i = 0; i < SHA256_SIZE; i++)
+    {
+        snprintf(computed + 7 + i * 2, 3, "%02x", hash[i]);
+    }
+
+    return strcmp(digest, computed) == 0;
+}
@@ -0,0 +1,22 @@
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include "../common.h"
+
+#define SHA256_SIZE 32
+#define SHA256_BLOCK 64
+
+// A SHA-256 hash being computed, see FIPS 180-4
+struct sha256
+{
+    uint32_t state[8];
+    uint64_t length;                    // bytes hashed so far
+    unsigned char block[SHA256_BLOCK];  // the last, partial block
+};
+
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const void *data, size_t len);
+void sha256_final(struct sha256 *ctx, unsigned char hash[SHA256_SIZE]);
+int sha256_matches(struct sha256 *ctx, const char *digest);
+
+#endif
@@ -0,0 +1,617 @@
+#define _GNU_SOURCE // for environ
+#include "ipc.h"
+#include "common.h"
+#include "logging.h"
+#include "util.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+// Room for the SCM_RIGHTS control message, suitably aligned
+union ipc_cmsg
+{
+    char buf[CMSG_SPACE(sizeof(int) * IPC_MAX_FDS)];
+    struct cmsghdr align;
+};
+
+static int write_full(int sock, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t ret = send(sock, buf, len, MSG_NOSIGNAL);
+        if (ret == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        buf += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static int read_full(int sock, char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t ret = read(sock, buf, len);
+        if (ret == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (ret <= 0)
+        {
+            return -1;
+        }
+
+        buf += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+// Sends one message. The fds ride along with the first byte of the header, so
+// the receiver gets them with the header.
+int ipc_send(int sock, uint32_t type, const void *payload, size_t len, const int *fds, int nfds)
+{
+    struct ipc_hdr hdr = {
+        .type = type,
+        .len = len,
+    };
+    struct iovec iov = {
+        .iov_base = &hdr,
+        .iov_len = sizeof(hdr),
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    union ipc_cmsg cmsg_buf;
+    ssize_t ret;
+
+    if (len > IPC_MAX_PAYLOAD || nfds < 0 || nfds > IPC_MAX_FDS)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (nfds > 0)
+    {
+        memset(&cmsg_buf, 0, sizeof(cmsg_buf));
+        msg.msg_control = cmsg_buf.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    do
+    {
+        ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1)
+    {
+        LOG("[IPC] sendmsg: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // the rest of the header if the send was cut short, then the payload
+    if (write_full(sock, (const char *)&hdr + ret, sizeof(hdr) - ret) != 0 ||
+        write_full(sock, payload, len) != 0)
+    {
+        LOG("[IPC] send: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Receives one message. On success the caller owns `*payload` (NUL
+// terminated, free it) and the `*nfds` descriptors stored in `fds`, which is
+// room for IPC_MAX_FDS of them. Returns -1 on EOF.
+// Room for the argv and envp pointers of an exec request of `len` bytes,
+// after its payload. Every string takes at least its NUL.
+static size_t exec_mapping_size(size_t len)
+{
+    size_t strings = (len + 1 + sizeof(char *) - 1) / sizeof(char *) * sizeof(char *);
+    return strings + (len + 2) * sizeof(char *);
+}
+
+// Receives a message. The payload is malloc()ed, or with `mapped`, put in an
+// anonymous mapping of *mapped bytes, sized for an exec request.
+static int recv_message(int sock, uint32_t *type, char **payload, size_t *len, int *fds, int *nfds,
+                        size_t *mapped)
+{
+    struct ipc_hdr hdr;
+    struct iovec iov = {
+        .iov_base = &hdr,
+        .iov_len = sizeof(hdr),
+    };
+    union ipc_cmsg cmsg_buf;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cmsg_buf.buf,
+        .msg_controllen = sizeof(cmsg_buf.buf),
+    };
+    ssize_t ret;
+
+    *nfds = 0;
+    do
+    {
+        ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret <= 0)
+    {
+        return -1;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *received = (int *)CMSG_DATA(cmsg);
+        for (int i = 0; i < count; i++)
+        {
+            if (*nfds < IPC_MAX_FDS)
+            {
+                fds[(*nfds)++] = received[i];
+            }
+            else
+            {
+                close(received[i]);
+            }
+        }
+    }
+
+    if (read_full(sock, (char *)&hdr + ret, sizeof(hdr) - ret) != 0 || hdr.len > IPC_MAX_PAYLOAD)
+    {
+        goto fail;
+    }
+
+    if (mapped != NULL)
+    {
+        *mapped = exec_mapping_size(hdr.len);
+        *payload = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (*payload == MAP_FAILED)
+        {
+            goto fail;
+        }
+    }
+    else if ((*payload = malloc(hdr.len + 1)) == NULL)
+    {
+        goto fail;
+    }
+
+    if (read_full(sock, *payload, hdr.len) != 0)
+    {
+        if (mapped != NULL)
+        {
+            munmap(*payload, *mapped);
+        }
+        else
+        {
+            free(*payload);
+        }
+        goto fail;
+    }
+
+    (*payload)[hdr.len] = '\0';
+    *type = hdr.type;
+    *len = hdr.len;
+    return 0;
+
+fail:
+    for (int i = 0; i < *nfds; i++)
+    {
+        close(fds[i]);
+    }
+    *nfds = 0;
+    return -1;
+}
+
+int ipc_recv(int sock, uint32_t *type, char **payload, size_t *len, int *fds, int *nfds)
+{
+    return recv_message(sock, type, payload, len, fds, nfds, NULL);
+}
+
+// Reads whatever has arrived of a message without blocking, picking up the
+// fds that come with it. Returns 1 once all of it is in `msg`, 0 if more is
+// to come, and -1 on EOF or if the message is too big.
+int ipc_recv_partial(int sock, struct ipc_partial *msg)
+{
+    union ipc_cmsg cmsg_buf;
+
+    for (;;)
+    {
+        struct iovec iov;
+        if (msg->received < sizeof(msg->hdr))
+        {
+            iov.iov_base = (char *)&msg->hdr + msg->received;
+            iov.iov_len = sizeof(msg->hdr) - msg->received;
+        }
+        else
+        {
+            size_t done = msg->received - sizeof(msg->hdr);
+            if (msg->payload == NULL)
+            {
+                if (msg->hdr.len > IPC_MAX_PAYLOAD || (msg->payload = malloc(msg->hdr.len + 1)) == NULL)
+                {
+                    return -1;
+                }
+            }
+
+            if (done == msg->hdr.len)
+            {
+                msg->payload[msg->hdr.len] = '\0';
+                return 1;
+            }
+
+            // never past the end of this message
+            iov.iov_base = msg->payload + done;
+            iov.iov_len = msg->hdr.len - done;
+        }
+
+        struct msghdr mh = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = cmsg_buf.buf,
+            .msg_controllen = sizeof(cmsg_buf.buf),
+        };
+        ssize_t ret = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+        if (ret == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return 0;
+        }
+        if (ret <= 0)
+        {
+            return -1;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            {
+                continue;
+            }
+
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *received = (int *)CMSG_DATA(cmsg);
+            for (int i = 0; i < count; i++)
+            {
+                if (msg->nfds < IPC_MAX_FDS)
+                {
+                    msg->fds[msg->nfds++] = received[i];
+                }
+                else
+                {
+                    close(received[i]);
+                }
+            }
+        }
+
+        msg->received += ret;
+    }
+}
+
+// Frees what `ipc_recv_partial()` has received so far, fds included
+void ipc_partial_free(struct ipc_partial *msg)
+{
+    for (int i = 0; i < msg->nfds; i++)
+    {
+        close(msg->fds[i]);
+    }
+
+    free(msg->payload);
+    memset(msg, 0, sizeof(*msg));
+}
+
+static void socket_address(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", path);
+}
+
+// Creates a listening socket at `path`, replacing a stale one. Only root can
+// connect to it.
+int ipc_listen(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (mkdir_p(MOCKER_RUN_DIR, 0755) != 0)
+    {
+        LOG("[IPC] Failed to create %s: %s\n", MOCKER_RUN_DIR, strerror(errno));
+        return -1;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+    {
+        return -1;
+    }
+
+    socket_address(&addr, path);
+    unlink(path);
+    mode_t old_umask = umask(077);
+    int ret = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+
+    if (ret == -1 || listen(sock, SOMAXCONN) == -1)
+    {
+        LOG("[IPC] Failed to listen on %s: %s\n", path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+// Returns -1 if nothing is listening on `path`
+int ipc_connect(const char *path)
+{
+    struct sockaddr_un addr;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+    {
+        return -1;
+    }
+
+    socket_address(&addr, path);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+// Has whoever is on the other end of `sock` run the command in a container of
+// `image`, with our environment and stdio, and returns its wait status. The command may
+// already be running when this fails, so it exits instead of letting the
+// caller try again.
+int ipc_run(int sock, const char *image, const struct cgroup_limits *limits, char **cmd)
+{
+    const int stdio[IPC_MAX_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    uint32_t type;
+    char *payload;
+    size_t len;
+    int fds[IPC_MAX_FDS];
+    int nfds;
+    int status;
+
+    if (ipc_send_exec(sock, image, limits, cmd, environ, stdio) != 0)
+    {
+        handle_error("ipc_send_exec");
+    }
+
+    if (ipc_recv(sock, &type, &payload, &len, fds, &nfds) != 0)
+    {
+        fprintf(stderr, "Lost connection before the container exited\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (type == IPC_ERROR)
+    {
+        fprintf(stderr, "%s\n", payload);
+        exit(EXIT_FAILURE);
+    }
+
+    if (type != IPC_STATUS || len != sizeof(status))
+    {
+        fprintf(stderr, "Invalid reply while waiting for the container to exit\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(&status, payload, sizeof(status));
+    free(payload);
+    return status;
+}
+
+// Sends a command to exec with its image, cgroup limits, environment and
+// stdio. The payload is the argument and environment counts and the limits,
+// followed by all of the strings, image first, each NUL terminated. `image`
+// and `limits` may be NULL.
+int ipc_send_exec(int sock, const char *image, const struct cgroup_limits *limits, char *const argv[],
+                  char *const envp[], const int fds[IPC_MAX_FDS])
+{
+    uint32_t counts[2] = {0, 0};
+    struct cgroup_limits unset;
+
+    if (image == NULL)
+    {
+        image = "";
+    }
+    if (limits == NULL)
+    {
+        cgroup_limits_init(&unset);
+        limits = &unset;
+    }
+    size_t len = sizeof(counts) + sizeof(*limits) + strlen(image) + 1;
+
+    for (; argv[counts[0]] != NULL; counts[0]++)
+    {
+        len += strlen(argv[counts[0]]) + 1;
+    }
+
+    for (; envp[counts[1]] != NULL; counts[1]++)
+    {
+        len += strlen(envp[counts[1]]) + 1;
+    }
+
+    if (len > IPC_MAX_PAYLOAD)
+    {
+        fprintf(stderr, "Command and environment are too long\n");
+        return -1;
+    }
+
+    char *payload = malloc(len);
+    if (payload == NULL)
+    {
+        return -1;
+    }
+
+    char *p = payload;
+    memcpy(p, counts, sizeof(counts));
+    p += sizeof(counts);
+    memcpy(p, limits, sizeof(*limits));
+    p += sizeof(*limits);
+    p = stpcpy(p, image) + 1;
+    for (uint32_t i = 0; i < counts[0]; i++)
+    {
+        p = stpcpy(p, argv[i]) + 1;
+    }
+    for (uint32_t i = 0; i < counts[1]; i++)
+    {
+        p = stpcpy(p, envp[i]) + 1;
+    }
+
+    int ret = ipc_send(sock, IPC_EXEC, payload, len, fds, IPC_MAX_FDS);
+    free(payload);
+    return ret;
+}
+
+static int parse_exec(struct exec_request *req, uint32_t type, char *payload, size_t len, const int *fds,
+                      int nfds, size_t mapped);
+
+// Receives a command sent with `ipc_send_exec()`. Returns -1 on EOF or if the
+// message is malformed. The container's child runs this between clone() and
+// exec, where a lock another thread of the parent held may be stuck, so it
+// stays clear of malloc(): the request lives in a mapping of its own, which
+// exec drops.
+int ipc_recv_exec(int sock, struct exec_request *req)
+{
+    uint32_t type;
+    char *payload;
+    size_t len;
+    size_t mapped;
+    int fds[IPC_MAX_FDS];
+    int nfds;
+
+    if (recv_message(sock, &type, &payload, &len, fds, &nfds, &mapped) != 0)
+    {
+        memset(req, 0, sizeof(*req));
+        return -1;
+    }
+
+    return parse_exec(req, type, payload, len, fds, nfds, mapped);
+}
+
+// Parses a message sent with `ipc_send_exec()`, which `req` takes over, fds
+// and all, even if it is malformed. Returns -1 if it is.
+int ipc_parse_exec(struct exec_request *req, uint32_t type, char *payload, size_t len, const int *fds, int nfds)
+{
+    return parse_exec(req, type, payload, len, fds, nfds, 0);
+}
+
+// The argv and envp pointers go after the payload in its mapping if it has
+// one, or else get allocated
+static int parse_exec(struct exec_request *req, uint32_t type, char *payload, size_t len, const int *fds,
+                      int nfds, size_t mapped)
+{
+    uint32_t counts[2];
+
+    memset(req, 0, sizeof(*req));
+    req->payload = payload;
+    req->mapped = mapped;
+    req->nfds = nfds;
+    memcpy(req->fds, fds, nfds * sizeof(int));
+
+    if (type != IPC_EXEC || req->nfds != IPC_MAX_FDS || len < sizeof(counts) + sizeof(req->limits))
+    {
+        goto invalid;
+    }
+
+    memcpy(counts, req->payload, sizeof(counts));
+    memcpy(&req->limits, req->payload + sizeof(counts), sizeof(req->limits));
+    req->limits.cpuset_cpus[CGROUP_CPUSET_MAX - 1] = '\0';
+    req->limits.cpuset_mems[CGROUP_CPUSET_MAX - 1] = '\0';
+    req->limits.tenant[CGROUP_TENANT_MAX - 1] = '\0';
+    if (counts[0] == 0 || counts[0] > len || counts[1] > len)
+    {
+        goto invalid;
+    }
+
+    // one array for both, argv first
+    char **strings = mapped != 0 ? (char **)(payload + exec_mapping_size(len)) - (len + 2)
+                                 : calloc(counts[0] + counts[1] + 2, sizeof(char *));
+    if (strings == NULL)
+    {
+        goto invalid;
+    }
+    req->argv = strings;
+    req->envp = strings + counts[0] + 1;
+
+    // the payload is NUL terminated, so strlen() can't run off its end
+    char *p = req->payload + sizeof(counts) + sizeof(req->limits);
+    char *end = req->payload + len;
+    req->image = p;
+    p += strlen(p) + 1;
+    for (uint32_t i = 0; i < counts[0] + counts[1]; i++)
+    {
+        if (p >= end)
+        {
+            goto invalid;
+        }
+
+        if (i < counts[0])
+        {
+            req->argv[i] = p;
+        }
+        else
+        {
+            req->envp[i - counts[0]] = p;
+        }
+        p += strlen(p) + 1;
+    }
+
+    return 0;
+
+invalid:
+    LOG("[IPC] Invalid exec request\n");
+    exec_request_free(req);
+    return -1;
+}
+
+void exec_request_free(struct exec_request *req)
+{
+    for (int i = 0; i < req->nfds; i++)
+    {
+        close(req->fds[i]);
+    }
+
+    if (req->mapped != 0)
+    {
+        munmap(req->payload, req->mapped);
+    }
+    else
+    {
+        free(req->argv);
+        free(req->payload);
+    }
+    memset(req, 0, sizeof(*req));
+}
@@ -0,0 +1,75 @@
+#ifndef _IPC_H_
+#define _IPC_H_
+
+#include "cgroup.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Messages on our Unix sockets are a header followed by `len` bytes of
+// payload, with up to IPC_MAX_FDS file descriptors attached (SCM_RIGHTS)
+#define IPC_MAX_FDS 3
+#define IPC_MAX_PAYLOAD (1 << 20)
+
+// Message types
+#define IPC_EXEC 'E'   // command to run, see `ipc_send_exec()`
+#define IPC_STATUS 'S' // wait status of a container that exited
+#define IPC_STOP 'K'   // kill the container whose ID starts with the payload
+#define IPC_PAUSE 'P'  // freeze the container whose ID starts with the payload
+#define IPC_RESUME 'R' // thaw it
+#define IPC_LIST 'L'   // list running containers
+#define IPC_STATS 'T'  // resource usage of one container, or all of them
+#define IPC_WATCH 'W'  // IPC_STATS every "<interval ms> <id>", until the client goes away
+#define IPC_SAMPLES 'M' // array of `struct stats_sample`
+#define IPC_EVENT 'N'  // a line of JSON about a container, i.e. it was under memory pressure
+#define IPC_REPLY 'A'  // text to show the user
+#define IPC_ERROR 'X'  // error message to show the user
+
+struct ipc_hdr
+{
+    uint32_t type;
+    uint32_t len;
+};
+
+// A message read a piece at a time from a non-blocking socket, with
+// `ipc_recv_partial()`. Zero it before the first call.
+struct ipc_partial
+{
+    struct ipc_hdr hdr;
+    size_t received; // bytes of header and payload so far
+    char *payload;
+    int fds[IPC_MAX_FDS];
+    int nfds;
+};
+
+// A command to exec, as received by `ipc_recv_exec()`. image, argv and envp
+// point into the payload, and the fds become the command's stdin, stdout and
+// stderr.
+struct exec_request
+{
+    char *image; // to run the command in, "" when the container already exists
+    struct cgroup_limits limits;
+    char **argv;
+    char **envp;
+    int fds[IPC_MAX_FDS];
+    int nfds;
+    char *payload;
+    size_t mapped; // size of the mapping holding payload and argv, 0 if malloc()ed
+};
+
+int ipc_send(int sock, uint32_t type, const void *payload, size_t len, const int *fds, int nfds);
+int ipc_recv(int sock, uint32_t *type, char **payload, size_t *len, int *fds, int *nfds);
+int ipc_recv_partial(int sock, struct ipc_partial *msg);
+void ipc_partial_free(struct ipc_partial *msg);
+
+int ipc_listen(const char *path);
+int ipc_connect(const char *path);
+int ipc_run(int sock, const char *image, const struct cgroup_limits *limits, char **cmd);
+
+int ipc_send_exec(int sock, const char *image, const struct cgroup_limits *limits, char *const argv[],
+                  char *const envp[], const int fds[IPC_MAX_FDS]);
+int ipc_recv_exec(int sock, struct exec_request *req);
+int ipc_parse_exec(struct exec_request *req, uint32_t type, char *payload, size_t len, const int *fds, int nfds);
+void exec_request_free(struct exec_request *req);
+
+#endif
@@ -2,12 +2,9 @@
 #define _LOGGING_H_
 
 #ifdef ENABLE_LOGGING
-#define LOG(...)             \
-    do                       \
-    {                        \
-        printf(__VA_ARGS__); \
-        fflush(stdout);      \
-    } while (0)
+// Straight to the descriptor, without stdio's lock, so the container's child
+// can log before it execs too
+#define LOG(...) dprintf(STDOUT_FILENO, __VA_ARGS__)
 #else
 #define LOG(...)
 #endif
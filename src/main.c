@@ -1,104 +1,368 @@
 #define _GNU_SOURCE
-#include "child_process.h"
+#include "batch.h"
+#include "bench.h"
+#include "cgroup.h"
 #include "common.h"
-#include "file_system.h"
-#include "logging.h"
-#include "networking/networking.h"
+#include "container.h"
+#include "daemon.h"
+#include "ipc.h"
+#include "networking/netns_pool.h"
+#include "stats.h"
 #include "util.h"
-#include "cgroup.h"
+#include "zygote.h"
 
-#define STACK_SIZE (1024 * 1024)
-// Define namespaces for isolation
-#define CLONE_FLAGS (CLONE_NEWPID | CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWIPC | CLONE_NEWNET)
+#include <getopt.h>
 
-int main(int argc, char *argv[])
+// `mocker run` flags, each setting one of the container's cgroup limits, see
+// `cgroup_parse_limit()`
+static const struct option run_options[] = {
+  {"cpu-quota", required_argument, NULL, 0},
+  {"cpu-period", required_argument, NULL, 0},
+  {"cpu-weight", required_argument, NULL, 0},
+  {"cpuset-cpus", required_argument, NULL, 0},
+  {"cpuset-mems", required_argument, NULL, 0},
+  {"memory", required_argument, NULL, 0},
+  {"memory-high", required_argument, NULL, 0},
+  {"memory-swap", required_argument, NULL, 0},
+  {"pids", required_argument, NULL, 0},
+  {"io-device", required_argument, NULL, 0},
+  {"io-rbps", required_argument, NULL, 0},
+  {"io-wbps", required_argument, NULL, 0},
+  {"io-riops", required_argument, NULL, 0},
+  {"io-wiops", required_argument, NULL, 0},
+  {"io-weight", required_argument, NULL, 0},
+  {"io-latency", required_argument, NULL, 0},
+  {"tenant", required_argument, NULL, 0},
+  {"pressure-cpu", required_argument, NULL, 0},
+  {"pressure-memory", required_argument, NULL, 0},
+  {"pressure-io", required_argument, NULL, 0},
+  {"pressure-window", required_argument, NULL, 0},
+  {"on-pressure", required_argument, NULL, 0},
+  {"hugepages", required_argument, NULL, 0},
+  {"hugepage-size", required_argument, NULL, 0},
+  {"thp", required_argument, NULL, 0},
+  {"place", required_argument, NULL, 0},
+  {"smt", required_argument, NULL, 0},
+  {NULL, 0, NULL, 0},
+};
+
+// `mocker batch` flags
+static const struct option batch_options[] = {
+  {"workers", required_argument, NULL, 'w'},
+  {"output", required_argument, NULL, 'o'},
+  {NULL, 0, NULL, 0},
+};
+
+// `mocker stats` flags
+static const struct option stats_options[] = {
+  {"interval", required_argument, NULL, 'i'},
+  {"json", no_argument, NULL, 'j'},
+  {NULL, 0, NULL, 0},
+};
+
+static void usage(const char *prog)
 {
-  disable_buffering();
+  fprintf(stderr, "Usage: %s run [options] <image> <command> [args...]\n", prog);
+  fprintf(stderr, "       %s slice [options]\n", prog);
+  fprintf(stderr, "       %s batch [--workers <n>] [--output <file>] <manifest>\n", prog);
+  fprintf(stderr, "       %s bench <runs> <image> <command> [args...]\n", prog);
+  fprintf(stderr, "       %s pool fill <size>\n", prog);
+  fprintf(stderr, "       %s pool drain\n", prog);
+  fprintf(stderr, "       %s zygote <size> [image]\n", prog);
+  fprintf(stderr, "       %s daemon\n", prog);
+  fprintf(stderr, "       %s list\n", prog);
+  fprintf(stderr, "       %s stats [--interval <ms>] [--json] [id]\n", prog);
+  fprintf(stderr, "       %s stop <id>\n", prog);
+  fprintf(stderr, "       %s pause <id>\n", prog);
+  fprintf(stderr, "       %s resume <id>\n", prog);
+  fprintf(stderr, "\nrun options, i.e. the container's cgroup limits, and slice options, i.e.\n");
+  fprintf(stderr, "those all containers (or a tenant's) share:\n");
+  fprintf(stderr, "  --tenant <name>          group under %s/%s to run in, or to set\n", CGROUP_ROOT, CGROUP_SLICE);
+  fprintf(stderr, "  --cpu-quota <us|max>     cpu.max quota per period (default 100000)\n");
+  fprintf(stderr, "  --cpu-period <us>        cpu.max period, 1000 to 1000000 (default 100000)\n");
+  fprintf(stderr, "  --cpu-weight <1-10000>   cpu.weight\n");
+  fprintf(stderr, "  --cpuset-cpus <list>     cpuset.cpus, i.e. 0-3,8\n");
+  fprintf(stderr, "  --cpuset-mems <list>     cpuset.mems\n");
+  fprintf(stderr, "  --place <n>              pick n CPUs on the least loaded NUMA node and L3\n");
+  fprintf(stderr, "  --smt <mode>             shared, or exclusive for n whole cores (default shared)\n");
+  fprintf(stderr, "  --memory <size|max>      memory.max, i.e. 512m (default 1g)\n");
+  fprintf(stderr, "  --memory-high <size|max> memory.high\n");
+  fprintf(stderr, "  --memory-swap <size|max> memory.swap.max\n");
+  fprintf(stderr, "  --pids <n|max>           pids.max\n");
+  fprintf(stderr, "  --io-device <path>       disk for io.max and io.latency, i.e. / (default %s)\n", MOCKER_LIB_DIR);
+  fprintf(stderr, "  --io-rbps <size|max>     io.max bytes read per second\n");
+  fprintf(stderr, "  --io-wbps <size|max>     io.max bytes written per second\n");
+  fprintf(stderr, "  --io-riops <n|max>       io.max reads per second\n");
+  fprintf(stderr, "  --io-wiops <n|max>       io.max writes per second\n");
+  fprintf(stderr, "  --io-weight <1-10000>    io.weight\n");
+  fprintf(stderr, "  --io-latency <us>        io.latency target\n");
+  fprintf(stderr, "  --hugepages <size|max>   hugetlb.<size>.max, and a hugetlbfs at /mnt/hugepages\n");
+  fprintf(stderr, "  --hugepage-size <size>   of those huge pages, i.e. 1g (default 2m)\n");
+  fprintf(stderr, "  --thp <mode>             transparent huge pages: system, never or madvise\n");
+  fprintf(stderr, "\nrun options for containers under the daemon, which reports when their tasks stall:\n");
+  fprintf(stderr, "  --pressure-cpu <us>      on the CPU for longer than this per window\n");
+  fprintf(stderr, "  --pressure-memory <us>   on memory for longer than this per window\n");
+  fprintf(stderr, "  --pressure-io <us>       on I/O for longer than this per window\n");
+  fprintf(stderr, "  --pressure-window <us>   500000 to 10000000 (default 1000000)\n");
+  fprintf(stderr, "  --on-pressure <action>   event, raise-memory-high or freeze (default event)\n");
+  exit(1);
+}
 
-  if (argc < 4)
+// Maps a container's wait status to our own exit status, the way a shell does
+static int exit_code(int status)
+{
+  if (status == -1)
   {
-    fprintf(stderr, "Usage: %s run <image> <command> [args...]\n", argv[0]);
-    exit(1);
+    return 1;
   }
 
-  if (strcmp(argv[1], "run") != 0)
+  if (WIFEXITED(status))
+  {
+    return WEXITSTATUS(status);
+  }
+
+  if (WIFSIGNALED(status))
+  {
+    return 128 + WTERMSIG(status);
+  }
+
+  return 1;
+}
+
+// Parses the flags of `mocker run` or `mocker slice` into `limits` and returns
+// the index of the first argument after them
+static int parse_run_options(int argc, char *argv[], struct cgroup_limits *limits)
+{
+  int index;
+  int opt;
+
+  cgroup_limits_init(limits);
+
+  // "+" stops at the image, so the command's own flags are left alone
+  optind = 2;
+  while ((opt = getopt_long(argc, argv, "+", run_options, &index)) != -1)
+  {
+    if (opt != 0)
+    {
+      usage(argv[0]);
+    }
+
+    if (cgroup_parse_limit(limits, run_options[index].name, optarg) != 0)
+    {
+      exit(1);
+    }
+  }
+
+  if (cgroup_check_limits(limits) != 0)
   {
-    fprintf(stderr, "Unknown command: %s\n", argv[1]);
     exit(1);
   }
 
-  // Setup child arguments
-  struct child_args args = {
-      .argv = argv,
-  };
+  return optind;
+}
+
+int main(int argc, char *argv[])
+{
+  disable_buffering();
+
+  if (argc < 2)
+  {
+    usage(argv[0]);
+  }
 
-  // Allocate stack for child
-  char *stack = malloc(STACK_SIZE);
-  if (stack == NULL)
+  if (strcmp(argv[1], "run") == 0)
   {
-    handle_error("malloc");
+    struct cgroup_limits limits;
+    int image = parse_run_options(argc, argv, &limits);
+    if (argc - image < 2)
+    {
+      usage(argv[0]);
+    }
+
+    // Use a parked container if a zygote is running, or hand the command to
+    // the daemon if that is running
+    int status = zygote_submit(argv[image], &limits, &argv[image + 1]);
+    if (status == -1)
+    {
+      status = daemon_submit(argv[image], &limits, &argv[image + 1]);
+    }
+
+    // Only the daemon watches pressure, so don't run without it
+    if (status == -1 && cgroup_watches_pressure(&limits))
+    {
+      fprintf(stderr, "--pressure-* and --on-pressure only work under mocker daemon, which is not running\n");
+      return 1;
+    }
+
+    if (status == -1)
+    {
+      status = run_container(argv[image], &argv[image + 1], &limits, NULL);
+    }
+    return exit_code(status);
   }
 
-  // Create new process with namespaces
-  pid_t child_pid = clone(child_function, stack + STACK_SIZE, CLONE_FLAGS | SIGCHLD, &args);
-  if (child_pid == -1)
+  if (strcmp(argv[1], "slice") == 0)
   {
-    handle_error("clone");
+    struct cgroup_limits limits;
+    if (parse_run_options(argc, argv, &limits) != argc)
+    {
+      usage(argv[0]);
+    }
+
+    return cgroup_set_slice(&limits) == 0 ? 0 : 1;
   }
 
-  // cgroup setup
-  if (setup_cgroup(child_pid) != 0)
+  if (strcmp(argv[1], "bench") == 0)
   {
-    LOG("[MAIN] Warning: Failed to setup cgroup\n");
-    kill(child_pid, SIGKILL);
-    free(stack);
-    handle_error("setup_cgroup");
+    if (argc < 5)
+    {
+      usage(argv[0]);
+    }
+
+    int runs = atoi(argv[2]);
+    if (runs <= 0)
+    {
+      fprintf(stderr, "Invalid number of runs: %s\n", argv[2]);
+      exit(1);
+    }
+
+    return run_bench(runs, argv[3], &argv[4]);
   }
-  else
+
+  if (strcmp(argv[1], "batch") == 0)
   {
-    LOG("[MAIN] Cgroup setup complete\n");
+    const char *output = BATCH_RESULTS;
+    int workers = 0;
+    int opt;
+
+    optind = 2;
+    while ((opt = getopt_long(argc, argv, "+", batch_options, NULL)) != -1)
+    {
+      if (opt == 'o')
+      {
+        output = optarg;
+      }
+      else if (opt == 'w' && (workers = atoi(optarg)) <= 0)
+      {
+        fprintf(stderr, "Invalid number of workers: %s\n", optarg);
+        exit(1);
+      }
+      else if (opt != 'w')
+      {
+        usage(argv[0]);
+      }
+    }
+
+    if (argc - optind != 1)
+    {
+      usage(argv[0]);
+    }
+
+    return run_batch(argv[optind], workers, output) == 0 ? 0 : 1;
   }
 
-  // let filesystem setup complete so we can copy /etc/resolv.conf
-  usleep(50000);
+  if (strcmp(argv[1], "daemon") == 0)
+  {
+    return daemon_serve() == 0 ? 0 : 1;
+  }
 
-  // Now setup networking
-  LOG("[MAIN] Setting up networking...\n");
-  if (setup_networking(child_pid) != 0)
+  if (strcmp(argv[1], "list") == 0)
   {
-    LOG("[MAIN] Warning: Failed to setup networking\n");
-    kill(child_pid, SIGKILL);
-    cleanup_container_root();
-    cleanup_cgroup();
-    free(stack);
-    handle_error("setup_networking");
+    return daemon_request(IPC_LIST, "") == 0 ? 0 : 1;
   }
-  else
+
+  if (strcmp(argv[1], "stats") == 0)
   {
-    LOG("[MAIN] Network setup complete\n");
+    int interval_ms = 0;
+    int json = 0;
+    int opt;
+
+    optind = 2;
+    while ((opt = getopt_long(argc, argv, "+", stats_options, NULL)) != -1)
+    {
+      if (opt == 'j')
+      {
+        json = 1;
+      }
+      else if (opt == 'i' && (interval_ms = atoi(optarg)) < STATS_INTERVAL_MIN)
+      {
+        fprintf(stderr, "Invalid interval: %s (at least %d ms)\n", optarg, STATS_INTERVAL_MIN);
+        exit(1);
+      }
+      else if (opt != 'i')
+      {
+        usage(argv[0]);
+      }
+    }
+
+    if (argc - optind > 1)
+    {
+      usage(argv[0]);
+    }
+
+    return stats_watch(optind < argc ? argv[optind] : "", interval_ms, json) == 0 ? 0 : 1;
   }
 
-  // Wait for child to finish
-  int status;
-  if (waitpid(child_pid, &status, 0) == -1)
+  if (strcmp(argv[1], "stop") == 0)
   {
-    handle_error("waitpid");
+    if (argc != 3)
+    {
+      usage(argv[0]);
+    }
+
+    return daemon_request(IPC_STOP, argv[2]) == 0 ? 0 : 1;
   }
 
-  cleanup_networking();
-  cleanup_container_root();
-  cleanup_cgroup();
-  free(stack);
+  if (strcmp(argv[1], "pause") == 0 || strcmp(argv[1], "resume") == 0)
+  {
+    if (argc != 3)
+    {
+      usage(argv[0]);
+    }
 
-  // Report exit status
-  if (WIFEXITED(status))
+    return daemon_request(argv[1][0] == 'p' ? IPC_PAUSE : IPC_RESUME, argv[2]) == 0 ? 0 : 1;
+  }
+
+  if (strcmp(argv[1], "zygote") == 0)
   {
-    LOG("Container exited with status %d\n", WEXITSTATUS(status));
+    if (argc != 3 && argc != 4)
+    {
+      usage(argv[0]);
+    }
+
+    int size = atoi(argv[2]);
+    if (size <= 0)
+    {
+      fprintf(stderr, "Invalid zygote size: %s\n", argv[2]);
+      exit(1);
+    }
+
+    // without an image, the built-in busybox root
+    return zygote_serve(size, argc == 4 ? argv[3] : "") == 0 ? 0 : 1;
   }
-  else if (WIFSIGNALED(status))
+
+  if (strcmp(argv[1], "pool") == 0)
   {
-    LOG("Container killed by signal %d\n", WTERMSIG(status));
+    if (argc == 4 && strcmp(argv[2], "fill") == 0)
+    {
+      int size = atoi(argv[3]);
+      if (size <= 0)
+      {
+        fprintf(stderr, "Invalid pool size: %s\n", argv[3]);
+        exit(1);
+      }
+
+      return netns_pool_fill(size) == 0 ? 0 : 1;
+    }
+
+    if (argc == 3 && strcmp(argv[2], "drain") == 0)
+    {
+      return netns_pool_drain() == 0 ? 0 : 1;
+    }
+
+    usage(argv[0]);
   }
 
-  return 0;
-}
\ No newline at end of file
+  fprintf(stderr, "Unknown command: %s\n", argv[1]);
+  exit(1);
+}
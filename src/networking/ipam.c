@@ -0,0 +1,391 @@
+#include "ipam.h"
+#include "../common.h"
+#include "../container.h"
+#include "../logging.h"
+#include "../util.h"
+
+#include <arpa/inet.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+// The allocation state shared by every mocker process on the host. It's a
+// small file that we mmap and only modify while holding flock() on it, so
+// parallel `mocker run`s never hand out the same block twice.
+#define IPAM_FILE MOCKER_RUN_DIR "/ipam"
+#define IPAM_MAGIC 0x6d6b6970 // "mkip"
+
+// Containers share the subnet on the bridge, so every slot is one address.
+// The network address, the gateway (network + 1) and the broadcast address
+// are reserved when the pool is initialised.
+#define IPAM_GATEWAY_SLOT 1
+
+// Bounds on the subnet, so the state file stays small (at most 2^16 slots)
+#define IPAM_MIN_PREFIX 16
+#define IPAM_MAX_PREFIX 30
+#define IPAM_MAX_SLOTS (1U << (32 - IPAM_MIN_PREFIX))
+
+// Owner of the reserved slots, which are never reclaimed
+#define IPAM_RESERVED -1
+// Owner of slots held by the network namespace pool, which outlive the
+// process that leased them. They are only given back by `ipam_release()`.
+#define IPAM_POOLED -2
+
+#define BITS_PER_WORD 64
+
+// Who holds a slot. The start time guards against the pid being reused after
+// the owner died without releasing it.
+struct ipam_owner
+{
+    int32_t pid;
+    uint64_t start_time;
+};
+
+struct ipam_state
+{
+    uint32_t magic;
+    uint32_t network; // host byte order
+    uint32_t prefix_len;
+    uint32_t slots;
+    uint32_t hint; // word to start the next search from
+    uint64_t used[IPAM_MAX_SLOTS / BITS_PER_WORD];
+    struct ipam_owner owner[IPAM_MAX_SLOTS];
+};
+
+// Start time of a process in clock ticks since boot (field 22 of
+// /proc/<pid>/stat), or 0 if it doesn't exist
+static uint64_t process_start_time(pid_t pid)
+{
+    char path[64];
+    char buf[1024];
+    uint64_t start_time = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return 0;
+    }
+
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+    {
+        return 0;
+    }
+    buf[len] = '\0';
+
+    // comm can contain spaces, so start counting fields after its ')'
+    char *p = strrchr(buf, ')');
+    if (p == NULL)
+    {
+        return 0;
+    }
+
+    // p + 2 is field 3 (state), so skip 19 more fields to get to field 22
+    p += 2;
+    for (int field = 3; field < 22 && p != NULL; field++)
+    {
+        p = strchr(p, ' ');
+        if (p != NULL)
+        {
+            p++;
+        }
+    }
+
+    if (p != NULL)
+    {
+        start_time = strtoull(p, NULL, 10);
+    }
+
+    return start_time;
+}
+
+static int owner_alive(const struct ipam_owner *owner)
+{
+    if (owner->pid == IPAM_RESERVED || owner->pid == IPAM_POOLED)
+    {
+        return 1;
+    }
+
+    if (owner->pid <= 0)
+    {
+        return 0;
+    }
+
+    return process_start_time(owner->pid) == owner->start_time;
+}
+
+static int parse_subnet(const char *cidr, uint32_t *network, uint32_t *prefix_len)
+{
+    char addr[INET_ADDRSTRLEN];
+    struct in_addr in_addr;
+    int len;
+
+    if (sscanf(cidr, "%15[0-9.]/%d", addr, &len) != 2 ||
+        len < IPAM_MIN_PREFIX || len > IPAM_MAX_PREFIX ||
+        inet_pton(AF_INET, addr, &in_addr) != 1)
+    {
+        fprintf(stderr, "Invalid subnet %s (expected a.b.c.d/%d-%d)\n", cidr, IPAM_MIN_PREFIX, IPAM_MAX_PREFIX);
+        return -1;
+    }
+
+    *prefix_len = len;
+    *network = ntohl(in_addr.s_addr) & (~0U << (32 - len));
+    return 0;
+}
+
+static void slot_take(struct ipam_state *state, uint32_t slot, pid_t pid)
+{
+    state->used[slot / BITS_PER_WORD] |= 1ULL << (slot % BITS_PER_WORD);
+    state->owner[slot].pid = pid;
+    state->owner[slot].start_time = pid > 0 ? process_start_time(pid) : 0;
+}
+
+static void slot_free(struct ipam_state *state, uint32_t slot)
+{
+    state->used[slot / BITS_PER_WORD] &= ~(1ULL << (slot % BITS_PER_WORD));
+    memset(&state->owner[slot], 0, sizeof(state->owner[slot]));
+}
+
+// Frees every slot whose owner has gone away without releasing it (e.g. a
+// crashed mocker). Returns the number of live leases left, not counting the
+// reserved addresses.
+static uint32_t reclaim_dead(struct ipam_state *state)
+{
+    uint32_t live = 0;
+
+    for (uint32_t w = 0; w < (state->slots + BITS_PER_WORD - 1) / BITS_PER_WORD; w++)
+    {
+        uint64_t word = state->used[w];
+        while (word)
+        {
+            uint32_t slot = w * BITS_PER_WORD + __builtin_ctzll(word);
+            word &= word - 1;
+
+            if (state->owner[slot].pid == IPAM_RESERVED)
+            {
+                continue;
+            }
+
+            if (owner_alive(&state->owner[slot]))
+            {
+                live++;
+            }
+            else
+            {
+                LOG("[IPAM] Reclaiming slot %u from dead owner %d\n", slot, state->owner[slot].pid);
+                slot_free(state, slot);
+            }
+        }
+    }
+
+    return live;
+}
+
+// Finds a clear bit, starting at the hint. Returns -1 if every slot is taken.
+static int64_t find_free(struct ipam_state *state)
+{
+    uint32_t words = (state->slots + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+    for (uint32_t i = 0; i < words; i++)
+    {
+        uint32_t w = (state->hint + i) % words;
+        uint64_t free_bits = ~state->used[w];
+
+        // the last word may extend past the end of the subnet
+        if (w == words - 1 && state->slots % BITS_PER_WORD)
+        {
+            free_bits &= (1ULL << (state->slots % BITS_PER_WORD)) - 1;
+        }
+
+        if (free_bits)
+        {
+            state->hint = w;
+            return (int64_t)w * BITS_PER_WORD + __builtin_ctzll(free_bits);
+        }
+    }
+
+    return -1;
+}
+
+// Maps and locks the state file, (re)initialising it for `subnet` if it's new
+// or was set up for a different subnet that no one is using anymore
+static struct ipam_state *ipam_open(const char *subnet, int *lock_fd)
+{
+    uint32_t network;
+    uint32_t prefix_len;
+
+    if (parse_subnet(subnet, &network, &prefix_len) != 0)
+    {
+        return NULL;
+    }
+
+    if (mkdir_p(MOCKER_RUN_DIR, 0755) != 0)
+    {
+        LOG("[IPAM] Failed to create %s: %s\n", MOCKER_RUN_DIR, strerror(errno));
+        return NULL;
+    }
+
+    int fd = open(IPAM_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        LOG("[IPAM] Failed to open %s: %s\n", IPAM_FILE, strerror(errno));
+        return NULL;
+    }
+
+    if (flock(fd, LOCK_EX) == -1 || ftruncate(fd, sizeof(struct ipam_state)) == -1)
+    {
+        LOG("[IPAM] Failed to lock %s: %s\n", IPAM_FILE, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    struct ipam_state *state = mmap(NULL, sizeof(*state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (state == MAP_FAILED)
+    {
+        LOG("[IPAM] Failed to map %s: %s\n", IPAM_FILE, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    if (state->magic != IPAM_MAGIC || state->network != network || state->prefix_len != prefix_len)
+    {
+        if (state->magic == IPAM_MAGIC && reclaim_dead(state) > 0)
+        {
+            fprintf(stderr, "Cannot switch to subnet %s while containers are using the old one\n", subnet);
+            munmap(state, sizeof(*state));
+            close(fd);
+            return NULL;
+        }
+
+        LOG("[IPAM] Initialising address pool for %s\n", subnet);
+        memset(state, 0, sizeof(*state));
+        state->magic = IPAM_MAGIC;
+        state->network = network;
+        state->prefix_len = prefix_len;
+        state->slots = 1U << (32 - prefix_len);
+
+        slot_take(state, 0, IPAM_RESERVED);
+        slot_take(state, IPAM_GATEWAY_SLOT, IPAM_RESERVED);
+        slot_take(state, state->slots - 1, IPAM_RESERVED);
+    }
+
+    *lock_fd = fd;
+    return state;
+}
+
+static void ipam_close(struct ipam_state *state, int lock_fd)
+{
+    munmap(state, sizeof(*state));
+    // closing the fd drops the lock
+    close(lock_fd);
+}
+
+static const char *ipam_subnet(void)
+{
+    const char *subnet = getenv("MOCKER_SUBNET");
+    return subnet != NULL ? subnet : IPAM_DEFAULT_SUBNET;
+}
+
+// Leases an address on the bridge to the container and fills in its
+// addresses
+int ipam_allocate(struct container_s *container)
+{
+    int lock_fd;
+    const char *subnet = ipam_subnet();
+    struct ipam_state *state = ipam_open(subnet, &lock_fd);
+    if (state == NULL)
+    {
+        return -1;
+    }
+
+    int64_t slot = find_free(state);
+    if (slot < 0)
+    {
+        reclaim_dead(state);
+        slot = find_free(state);
+    }
+
+    if (slot < 0)
+    {
+        fprintf(stderr, "No free addresses left in %s\n", subnet);
+        ipam_close(state, lock_fd);
+        return -1;
+    }
+
+    slot_take(state, slot, getpid());
+
+    struct in_addr gateway = {.s_addr = htonl(state->network + IPAM_GATEWAY_SLOT)};
+    struct in_addr cont = {.s_addr = htonl(state->network + (uint32_t)slot)};
+    struct in_addr network = {.s_addr = htonl(state->network)};
+    char network_str[INET_ADDRSTRLEN];
+
+    inet_ntop(AF_INET, &gateway, container->gateway, sizeof(container->gateway));
+    inet_ntop(AF_INET, &cont, container->container_ip, sizeof(container->container_ip));
+    inet_ntop(AF_INET, &network, network_str, sizeof(network_str));
+    snprintf(container->network, sizeof(container->network), "%s/%u", network_str, state->prefix_len);
+    container->prefix_len = state->prefix_len;
+    container->ipam_slot = slot;
+    container->ipam_owner = getpid();
+
+    ipam_close(state, lock_fd);
+
+    LOG("[IPAM] Leased %s/%d (slot %ld) to %s\n", container->container_ip, container->prefix_len, (long)slot, container->id);
+    return 0;
+}
+
+// Hands the container's lease over to the network namespace pool, so that it
+// stays leased after this process exits
+int ipam_pin(struct container_s *container)
+{
+    int lock_fd;
+
+    struct ipam_state *state = ipam_open(container->network, &lock_fd);
+    if (state == NULL)
+    {
+        return -1;
+    }
+
+    int ret = -1;
+    if (container->ipam_slot >= 0 && (uint32_t)container->ipam_slot < state->slots &&
+        state->owner[container->ipam_slot].pid == getpid())
+    {
+        slot_take(state, container->ipam_slot, IPAM_POOLED);
+        ret = 0;
+    }
+
+    ipam_close(state, lock_fd);
+    return ret;
+}
+
+// Gives the container's block back to the pool. This may run in a different
+// process than `ipam_allocate()` did (see `container_wait_async()`), so the
+// lease is matched against the owner recorded in the container.
+int ipam_release(struct container_s *container)
+{
+    int lock_fd;
+
+    if (container->ipam_slot < 0)
+    {
+        return 0;
+    }
+
+    struct ipam_state *state = ipam_open(container->network, &lock_fd);
+    if (state == NULL)
+    {
+        return -1;
+    }
+
+    if ((uint32_t)container->ipam_slot < state->slots)
+    {
+        pid_t owner = state->owner[container->ipam_slot].pid;
+        if (owner == container->ipam_owner || owner == IPAM_POOLED)
+        {
+            slot_free(state, container->ipam_slot);
+        }
+    }
+
+    ipam_close(state, lock_fd);
+    container->ipam_slot = -1;
+    return 0;
+}
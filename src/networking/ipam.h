@@ -0,0 +1,14 @@
+#ifndef _IPAM_H_
+#define _IPAM_H_
+
+struct container_s;
+
+// Subnet that container addresses are handed out from, unless overridden
+// with the MOCKER_SUBNET environment variable
+#define IPAM_DEFAULT_SUBNET "172.18.0.0/16"
+
+int ipam_allocate(struct container_s *container);
+int ipam_pin(struct container_s *container);
+int ipam_release(struct container_s *container);
+
+#endif
@@ -11,465 +11,559 @@
 #include <linux/if_addr.h>
 #include <arpa/inet.h>
 
-// \todo: make the log messages more meaningful. Too many duplicate messages.
-
 // fallback (compiler is complaining about missing definitions)
 #ifndef IFLA_VETH_INFO_PEER
 #define IFLA_VETH_INFO_PEER 1
 #endif
 
-// This callback is invoked for each netlink message in the response.
-// We check for netlink errors or an ACK.
-static int netlink_response_cb(const struct nlmsghdr *nlh, void *data)
+// The largest single request we build. `nl_session_put()` refuses to start a
+// message unless at least this much room is left in the batch.
+#define NL_MSG_MAX 512
+
+// Passed to every callback while we collect the replies to a batch
+struct nl_reply_ctx
 {
-    (void)data;
+    struct nl_session *session;
+    mnl_cb_t cb; // optional, for replies other than ACKs
+    void *data;
+};
+
+// Invoked for every NLMSG_ERROR in a reply. An NLMSG_ERROR with error == 0 is
+// an ACK. The header of the request it answers is echoed back, so we can use
+// its sequence number to match the ACK to a request in the current batch.
+static int netlink_ack_cb(const struct nlmsghdr *nlh, void *data)
+{
+    struct nl_session *session = ((struct nl_reply_ctx *)data)->session;
+    struct nlmsgerr *err = (struct nlmsgerr *)mnl_nlmsg_get_payload(nlh);
+    uint32_t seq = err->msg.nlmsg_seq;
 
-    // Possible message types: NLMSG_ERROR, NLMSG_DONE, etc.
-    switch (nlh->nlmsg_type)
+    // Stale reply to an earlier batch
+    if (seq - session->first_seq >= session->seq - session->first_seq)
     {
-    case NLMSG_ERROR:
+        LOG("[LIBMNL] Ignoring reply for sequence %u\n", seq);
+        return MNL_CB_OK;
+    }
+
+    session->acked++;
+    if (err->error)
     {
-        // netlink error
-        struct nlmsgerr *err = (struct nlmsgerr *)mnl_nlmsg_get_payload(nlh);
-        if (err->error)
+        LOG("[LIBMNL] Request %u failed: %s\n", seq, strerror(-err->error));
+        if (session->error == 0)
         {
-            // Negative value in err->error
-            errno = -err->error;
-            LOG("[LIBMNL] Netlink reported an error: %s\n", strerror(errno));
-            return MNL_CB_ERROR;
+            session->error = err->error;
         }
-        // If err->error == 0, that’s a success ACK
-        return MNL_CB_OK;
-    }
-    case NLMSG_DONE:
-        // Terminate the netlink processing loop.
-        return MNL_CB_STOP;
-    default:
-        // Just continue processing
-        break;
+        return MNL_CB_ERROR;
     }
 
-    LOG("[LIBMNL] netlink_response_cb -> MNL_CB_OK\n");
     return MNL_CB_OK;
 }
 
-static void construct_netlink_msg_header(struct nlmsghdr *nlh, uint16_t type, uint16_t flags, uint32_t seq)
+// NLMSG_DONE ends a dump, which is how dump requests are answered instead of
+// with an ACK
+static int netlink_done_cb(const struct nlmsghdr *nlh, void *data)
 {
-    nlh->nlmsg_type = type;
-    nlh->nlmsg_flags = flags;
-    nlh->nlmsg_seq = seq;
-}
-
-static void build_set_ip_msg(struct veth_config_s *config, const char *ip, const int prefix_len, char *buf)
-{
-    struct ifaddrmsg *ifa;
-    struct in_addr in_addr;
+    struct nl_session *session = ((struct nl_reply_ctx *)data)->session;
 
-    LOG("[NET] Setting IP address %s/%d on interface %s\n", ip, prefix_len, config->host);
-    if (inet_pton(AF_INET, ip, &in_addr) != 1)
+    if (nlh->nlmsg_seq - session->first_seq < session->seq - session->first_seq)
     {
-        LOG("[NET] Error: Invalid IP address: %s\n", ip);
-        return;
+        session->acked++;
     }
 
-    // Construct the netlink message
-    config->nlh = mnl_nlmsg_put_header(buf);
-    construct_netlink_msg_header(config->nlh, RTM_NEWADDR, NLM_F_REQUEST | NLM_F_CREATE | NLM_F_REPLACE | NLM_F_ACK, config->seq);
-
-    // Add the ifaddrmsg structure
-    ifa = mnl_nlmsg_put_extra_header(config->nlh, sizeof(struct ifaddrmsg));
-    ifa->ifa_family = AF_INET;                     // IPv4
-    ifa->ifa_prefixlen = prefix_len;               // Set prefix length
-    ifa->ifa_flags = 0;                            // No special flags
-    ifa->ifa_scope = RT_SCOPE_UNIVERSE;            // Global scope
-    ifa->ifa_index = if_nametoindex(config->host); // Interface index
+    return MNL_CB_STOP;
+}
 
-    // Add the IFA_LOCAL attribute (Primary IPv4 address)
-    mnl_attr_put(config->nlh, IFA_LOCAL, sizeof(struct in_addr), &in_addr);
+static int netlink_data_cb(const struct nlmsghdr *nlh, void *data)
+{
+    struct nl_reply_ctx *ctx = data;
+    if (ctx->cb == NULL)
+    {
+        return MNL_CB_OK;
+    }
 
-    // Add the IFA_ADDRESS attribute (Peer or broadcast address, same as local)
-    mnl_attr_put(config->nlh, IFA_ADDRESS, sizeof(struct in_addr), &in_addr);
+    return ctx->cb(nlh, ctx->data);
 }
 
-static void build_newroute_msg(struct veth_config_s *config, const char *gateway_ip, char *buf)
+int nl_session_open(struct nl_session *session, int bus)
 {
-    config->nlh = mnl_nlmsg_put_header(buf);
-    construct_netlink_msg_header(config->nlh, RTM_NEWROUTE, NLM_F_REQUEST | NLM_F_CREATE | NLM_F_ACK, config->seq);
+    memset(session, 0, sizeof(*session));
 
-    struct rtmsg *rtm;
-    rtm = mnl_nlmsg_put_extra_header(config->nlh, sizeof(struct rtmsg));
-    rtm->rtm_family = AF_INET;          // IPv4
-    rtm->rtm_dst_len = 0;               // Default route
-    rtm->rtm_src_len = 0;               // No source filter
-    rtm->rtm_table = RT_TABLE_MAIN;     // Main routing table
-    rtm->rtm_protocol = RTPROT_STATIC;  // Static route
-    rtm->rtm_scope = RT_SCOPE_UNIVERSE; // Global scope
-    rtm->rtm_type = RTN_UNICAST;        // Unicast route
-
-    // Add the gateway attribute (RTA_GATEWAY)
-    struct in_addr gateway;
-    if (inet_pton(AF_INET, gateway_ip, &gateway) != 1)
+    // Open Netlink socket
+    LOG("[LIBMNL] Opening Netlink socket\n");
+    session->nl = mnl_socket_open(bus);
+    if (session->nl == NULL)
     {
-        LOG("[NET] build_newroute_msg: Error: Invalid gateway IP address\n");
-        mnl_socket_close(config->nl);
-        return;
+        LOG("[LIBMNL] mnl_socket_open: %s\n", strerror(errno));
+        return EXIT_FAILURE;
     }
 
-    mnl_attr_put_u32(config->nlh, RTA_GATEWAY, gateway.s_addr);
-
-    // Add the output interface (RTA_OIF)
-    uint32_t ifindex = if_nametoindex(config->cont);
-    if (ifindex == 0)
+    // Bind to netlink
+    if (mnl_socket_bind(session->nl, 0, MNL_SOCKET_AUTOPID) < 0)
     {
-        LOG("[NET] build_newroute_msg: Error: Failed to get index for interface %s\n", config->cont);
-        mnl_socket_close(config->nl);
-        return;
+        LOG("[LIBMNL] mnl_socket_bind: %s\n", strerror(errno));
+        mnl_socket_close(session->nl);
+        session->nl = NULL;
+        return EXIT_FAILURE;
     }
 
-    mnl_attr_put_u32(config->nlh, RTA_OIF, ifindex);
+    // Replies are routed to us by port id, so sequence numbers only need to
+    // be unique within this socket
+    session->portid = mnl_socket_get_portid(session->nl);
+    session->seq = 1;
+    session->first_seq = session->seq;
+
+    return EXIT_SUCCESS;
 }
 
-static void build_link_up_msg(struct veth_config_s *config, char *buf)
+void nl_session_close(struct nl_session *session)
 {
-    config->nlh = mnl_nlmsg_put_header(buf);
-    construct_netlink_msg_header(config->nlh, RTM_NEWLINK, NLM_F_REQUEST | NLM_F_ACK, config->seq);
-
-    // Add ifinfomsg structure
-    config->ifi = mnl_nlmsg_put_extra_header(config->nlh, sizeof(struct ifinfomsg));
-    config->ifi->ifi_family = AF_UNSPEC;
-    config->ifi->ifi_index = if_nametoindex(config->host);
-    config->ifi->ifi_flags = IFF_UP;
-    config->ifi->ifi_change = IFF_UP;
-
-    // Add the interface name attribute
-    mnl_attr_put_strz(config->nlh, IFLA_IFNAME, config->host);
+    if (session->nl != NULL)
+    {
+        mnl_socket_close(session->nl);
+        session->nl = NULL;
+    }
 }
 
-static void build_setlink_msg(struct veth_config_s *config, char *buf)
+// Appends a new request to the batch and gives it the next sequence number.
+// Returns NULL if the batch is full.
+struct nlmsghdr *nl_session_put(struct nl_session *session, uint16_t type, uint16_t flags)
 {
-    config->nlh = mnl_nlmsg_put_header(buf);
-    construct_netlink_msg_header(config->nlh, RTM_SETLINK, NLM_F_REQUEST | NLM_F_ACK, config->seq);
+    if (session->len + NL_MSG_MAX > sizeof(session->buf))
+    {
+        LOG("[LIBMNL] Netlink batch is full\n");
+        return NULL;
+    }
 
-    config->ifi = mnl_nlmsg_put_extra_header(config->nlh, sizeof(struct ifinfomsg));
-    config->ifi->ifi_family = AF_UNSPEC;
+    struct nlmsghdr *nlh = mnl_nlmsg_put_header(session->buf + session->len);
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = flags;
+    nlh->nlmsg_seq = session->seq++;
 
-    // Add the interface name
-    mnl_attr_put_strz(config->nlh, IFLA_IFNAME, config->cont);
+    if (flags & NLM_F_ACK)
+    {
+        session->pending++;
+    }
 
-    // Add the target namespace PID
-    mnl_attr_put_u32(config->nlh, IFLA_NET_NS_PID, config->child_pid);
+    return nlh;
 }
 
-static void build_netlink_msg(struct veth_config_s *config, char *buf)
+// Appends a dump request (e.g. RTM_GETADDR for every address) to the batch.
+// The dump is complete once its NLMSG_DONE arrives.
+struct nlmsghdr *nl_session_put_dump(struct nl_session *session, uint16_t type)
 {
-    config->nlh = mnl_nlmsg_put_header(buf);
-    construct_netlink_msg_header(config->nlh, RTM_NEWLINK, NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL, config->seq);
-
-    // Outer ifinfomsg for the host interface
-    // Note: u have to invoke mnl_nlmsg_put_header() before you call this function.
-    config->ifi = mnl_nlmsg_put_extra_header(config->nlh, sizeof(struct ifinfomsg));
-    config->ifi->ifi_family = AF_UNSPEC;
-
-    // IFLA_IFNAME = host
-    mnl_attr_put_strz(config->nlh, IFLA_IFNAME, config->host);
-
-    // IFLA_LINKINFO
-    LOG("[LIBMNL] Nesting IFLA_LINKINFO\n");
-    struct nlattr *linkinfo = mnl_attr_nest_start(config->nlh, IFLA_LINKINFO);
+    struct nlmsghdr *nlh = nl_session_put(session, type, NLM_F_REQUEST | NLM_F_DUMP);
+    if (nlh != NULL)
     {
-        mnl_attr_put_strz(config->nlh, IFLA_INFO_KIND, "veth");
+        session->pending++;
+    }
 
-        // IFLA_INFO_DATA
-        LOG("[LIBMNL] Nesting IFLA_INFO_DATA\n");
-        struct nlattr *infodata = mnl_attr_nest_start(config->nlh, IFLA_INFO_DATA);
-        {
-            // The kernel expects IFLA_VETH_INFO_PEER with a peer ifinfomsg
-            LOG("[LIBMNL] Nesting IFLA_VETH_INFO_PEER\n");
-            struct nlattr *peerinfo = mnl_attr_nest_start(config->nlh, IFLA_VETH_INFO_PEER);
-            {
-                struct ifinfomsg peer_ifi = {
-                    .ifi_family = AF_UNSPEC,
-                };
+    return nlh;
+}
 
-                // Put the peer ifinfomsg directly into the message
-                LOG("[LIBMNL] Adding peer ifinfomsg\n");
-                size_t sz = NLMSG_ALIGN(sizeof(peer_ifi));
-                memcpy(mnl_nlmsg_get_payload_tail(config->nlh), &peer_ifi, sizeof(peer_ifi));
-                config->nlh->nlmsg_len += sz;
+// Closes off the request most recently started with `nl_session_put()`
+void nl_session_end(struct nl_session *session, struct nlmsghdr *nlh)
+{
+    session->len += MNL_ALIGN(nlh->nlmsg_len);
+}
 
-                // Then the peer’s name
-                mnl_attr_put_strz(config->nlh, IFLA_IFNAME, config->cont);
-                LOG("[LIBMNL] Peer name: %s\n", config->cont);
-            }
-            mnl_attr_nest_end(config->nlh, peerinfo);
-        }
-        mnl_attr_nest_end(config->nlh, infodata);
-    }
-    mnl_attr_nest_end(config->nlh, linkinfo);
+static void nl_session_reset(struct nl_session *session)
+{
+    session->len = 0;
+    session->pending = 0;
+    session->acked = 0;
+    session->error = 0;
+    session->first_seq = session->seq;
 }
 
-static int receive_netlink_responses(struct veth_config_s *config)
+// Sends the whole batch in one go and waits until every request that asked
+// for an ACK has been answered. Any other reply is passed to `cb`.
+static int nl_session_commit_cb(struct nl_session *session, mnl_cb_t cb, void *data)
 {
     char buf[MNL_SOCKET_BUFFER_SIZE];
-    int ret;
+    mnl_cb_t ctl_cb[NLMSG_MIN_TYPE] = {
+        [NLMSG_ERROR] = netlink_ack_cb,
+        [NLMSG_DONE] = netlink_done_cb,
+    };
+    struct nl_reply_ctx ctx = {
+        .session = session,
+        .cb = cb,
+        .data = data,
+    };
+    int ret = EXIT_SUCCESS;
+
+    if (session->len == 0)
+    {
+        return EXIT_SUCCESS;
+    }
 
-    while (true)
+    LOG("[LIBMNL] Sending batch of %zu bytes (%d requests)\n", session->len, session->pending);
+    if (mnl_socket_sendto(session->nl, session->buf, session->len) < 0)
     {
-        ret = mnl_socket_recvfrom(config->nl, buf, sizeof(buf));
-        if (ret == -1)
+        LOG("[LIBMNL] mnl_socket_sendto: %s\n", strerror(errno));
+        nl_session_reset(session);
+        return EXIT_FAILURE;
+    }
+
+    while (session->acked < session->pending && session->error == 0)
+    {
+        ssize_t len = mnl_socket_recvfrom(session->nl, buf, sizeof(buf));
+        if (len == -1)
         {
-            if (errno == EAGAIN)
+            if (errno == EINTR)
             {
-                LOG("[LIBMNL] mnl_socket_recvfrom: errno == EAGAIN\n");
-                break;
+                continue;
             }
 
-            LOG("[LIBMNL] mnl_socket_recvfrom: errno != EAGAIN\n");
-            mnl_socket_close(config->nl);
-            return EXIT_FAILURE;
-        }
-
-        if (ret == 0)
-        {
-            LOG("[LIBMNL] mnl_socket_recvfrom: EOF\n");
+            LOG("[LIBMNL] mnl_socket_recvfrom: %s\n", strerror(errno));
+            ret = EXIT_FAILURE;
             break;
         }
 
-        // Let libmnl parse the messages; netlink_response_cb will handle errors
-        ret = mnl_cb_run(buf, ret, 0, config->seq, netlink_response_cb, NULL);
-        if (ret <= 0)
-        {
-            LOG("[LIBMNL] mnl_cb_run: MNL_CB_ERROR or MNL_CB_STOP\n");
-            break;
-        }
+        // Sequence numbers are checked by netlink_ack_cb, port ids by libmnl
+        mnl_cb_run2(buf, len, 0, session->portid, netlink_data_cb, &ctx, ctl_cb, NLMSG_MIN_TYPE);
     }
 
-    return EXIT_SUCCESS;
+    if (session->error != 0)
+    {
+        errno = -session->error;
+        ret = EXIT_FAILURE;
+    }
+
+    nl_session_reset(session);
+    return ret;
 }
 
-static int open_and_bind_netlink_socket(struct mnl_socket **nl)
+int nl_session_commit(struct nl_session *session)
 {
-    // Open Netlink socket
-    LOG("[LIBMNL] Opening Netlink socket\n");
-    *nl = mnl_socket_open(NETLINK_ROUTE);
-    if (!*nl)
+    return nl_session_commit_cb(session, NULL, NULL);
+}
+
+static int ifindex_cb(const struct nlmsghdr *nlh, void *data)
+{
+    if (nlh->nlmsg_type == RTM_NEWLINK)
     {
-        LOG("[LIBMNL] mnl_socket_open");
-        goto error;
+        struct ifinfomsg *ifi = mnl_nlmsg_get_payload(nlh);
+        *(int *)data = ifi->ifi_index;
     }
 
-    // Bind to netlink
-    LOG("[LIBMNL] Binding to Netlink\n");
-    if (mnl_socket_bind(*nl, 0, MNL_SOCKET_AUTOPID) < 0)
+    return MNL_CB_OK;
+}
+
+// Looks up an interface index through the session's socket. Unlike
+// if_nametoindex() this works for whatever namespace the socket lives in.
+int nl_get_ifindex(struct nl_session *session, const char *iface)
+{
+    int ifindex = 0;
+
+    // i.e. ip link show iface
+    struct nlmsghdr *nlh = nl_session_put(session, RTM_GETLINK, NLM_F_REQUEST | NLM_F_ACK);
+    if (nlh == NULL)
     {
-        LOG("[LIBMNL] mnl_socket_bind\n");
-        goto error_with_socket;
+        return -1;
     }
 
-    return EXIT_SUCCESS;
+    struct ifinfomsg *ifi = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifinfomsg));
+    ifi->ifi_family = AF_UNSPEC;
+    mnl_attr_put_strz(nlh, IFLA_IFNAME, iface);
+    nl_session_end(session, nlh);
+
+    if (nl_session_commit_cb(session, ifindex_cb, &ifindex) != EXIT_SUCCESS || ifindex == 0)
+    {
+        LOG("[LIBMNL] Failed to get index for interface %s\n", iface);
+        return -1;
+    }
 
-error_with_socket:
-    mnl_socket_close(*nl);
-error:
-    return EXIT_FAILURE;
+    return ifindex;
 }
 
-// \todo: not sure how to use libmnl to do this....
-int setup_nat_rules(struct veth_config_s *veth_config, const char *container_network)
+// Collects the IPv4 addresses of one interface while dumping all of them
+struct addr_dump_s
 {
-    char cmd[256];
+    int ifindex;
+    struct nl_addr *addrs;
+    int max;
+    int count;
+};
 
-    // Clear any existing NAT rules for our network
-    snprintf(cmd, sizeof(cmd),
-             "iptables -t nat -D POSTROUTING -s %s ! -o %s -j MASQUERADE 2>/dev/null",
-             container_network, veth_config->host);
-    system(cmd);
-
-    // Add NAT rule
-    snprintf(cmd, sizeof(cmd),
-             "iptables -t nat -A POSTROUTING -s %s ! -o %s -j MASQUERADE",
-             container_network, veth_config->host);
-    if (system(cmd) != 0)
+static int addr_attr_cb(const struct nlattr *attr, void *data)
+{
+    if (mnl_attr_get_type(attr) == IFA_LOCAL && mnl_attr_get_payload_len(attr) == sizeof(uint32_t))
     {
-        LOG("[NET] Failed to set up NAT rules\n");
-        return -1;
+        *(uint32_t *)data = mnl_attr_get_u32(attr);
     }
 
-    return 0;
+    return MNL_CB_OK;
 }
 
-int set_interface_ip(struct veth_config_s *veth_config, const char *iface, const char *ip, const int prefix_len)
+static int addr_dump_cb(const struct nlmsghdr *nlh, void *data)
 {
-    char buf[MNL_SOCKET_BUFFER_SIZE];
-    veth_config->host = iface;
-    veth_config->seq = (uint32_t)time(NULL);
+    struct addr_dump_s *dump = data;
+    struct ifaddrmsg *ifa = mnl_nlmsg_get_payload(nlh);
+    uint32_t local = 0;
 
-    if (open_and_bind_netlink_socket(&veth_config->nl) != EXIT_SUCCESS)
+    if (nlh->nlmsg_type != RTM_NEWADDR || (int)ifa->ifa_index != dump->ifindex || dump->count >= dump->max)
+    {
+        return MNL_CB_OK;
+    }
+
+    mnl_attr_parse(nlh, sizeof(*ifa), addr_attr_cb, &local);
+    dump->addrs[dump->count].addr = local;
+    dump->addrs[dump->count].prefix_len = ifa->ifa_prefixlen;
+    dump->count++;
+
+    return MNL_CB_OK;
+}
+
+// i.e. ip -4 addr show dev ifindex
+// Returns the number of addresses stored in `addrs` (at most `max`)
+int nl_get_addresses(struct nl_session *session, int ifindex, struct nl_addr *addrs, int max)
+{
+    struct addr_dump_s dump = {
+        .ifindex = ifindex,
+        .addrs = addrs,
+        .max = max,
+        .count = 0,
+    };
+
+    struct nlmsghdr *nlh = nl_session_put_dump(session, RTM_GETADDR);
+    if (nlh == NULL)
     {
-        LOG("[NET] Error: Failed to open netlink socket\n");
         return -1;
     }
 
-    // Build and send the netlink message
-    build_set_ip_msg(veth_config, ip, prefix_len, buf);
-    if (mnl_socket_sendto(veth_config->nl, veth_config->nlh, veth_config->nlh->nlmsg_len) < 0)
+    struct ifaddrmsg *ifa = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifaddrmsg));
+    ifa->ifa_family = AF_INET;
+    nl_session_end(session, nlh);
+
+    if (nl_session_commit_cb(session, addr_dump_cb, &dump) != EXIT_SUCCESS)
     {
-        LOG("[NET] Error: Failed to send netlink message\n");
-        mnl_socket_close(veth_config->nl);
-        return EXIT_FAILURE;
+        LOG("[LIBMNL] Failed to dump addresses: %s\n", strerror(errno));
+        return -1;
     }
 
-    // Process responses
-    if (receive_netlink_responses(veth_config) != EXIT_SUCCESS)
+    return dump.count;
+}
+
+// i.e. ip addr del addr/prefix_len dev ifindex
+int delete_interface_ip(struct nl_session *session, int ifindex, const struct nl_addr *addr)
+{
+    struct nlmsghdr *nlh = nl_session_put(session, RTM_DELADDR, NLM_F_REQUEST | NLM_F_ACK);
+    if (nlh == NULL)
     {
-        LOG("[NET] Error: Failed to set interface IP\n");
-        mnl_socket_close(veth_config->nl);
         return EXIT_FAILURE;
     }
 
-    mnl_socket_close(veth_config->nl);
+    struct ifaddrmsg *ifa = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifaddrmsg));
+    ifa->ifa_family = AF_INET;
+    ifa->ifa_prefixlen = addr->prefix_len;
+    ifa->ifa_index = ifindex;
+    mnl_attr_put(nlh, IFA_LOCAL, sizeof(addr->addr), &addr->addr);
+
+    nl_session_end(session, nlh);
     return EXIT_SUCCESS;
 }
 
-int set_default_route(struct veth_config_s *veth_config, const char *gateway_ip)
+// i.e. ip addr add ip/prefix_len dev ifindex
+int set_interface_ip(struct nl_session *session, int ifindex, const char *ip, const int prefix_len)
 {
-    char buf[MNL_SOCKET_BUFFER_SIZE];
-    veth_config->seq = (uint32_t)time(NULL);
+    struct in_addr in_addr;
 
-    if (open_and_bind_netlink_socket(&veth_config->nl) != EXIT_SUCCESS)
+    LOG("[NET] Setting IP address %s/%d on interface %d\n", ip, prefix_len, ifindex);
+    if (inet_pton(AF_INET, ip, &in_addr) != 1)
     {
-        LOG("[NET] Error: Failed to open netlink socket\n");
+        LOG("[NET] Error: Invalid IP address: %s\n", ip);
         return EXIT_FAILURE;
     }
 
-    build_newroute_msg(veth_config, gateway_ip, buf);
-    if (mnl_socket_sendto(veth_config->nl, veth_config->nlh, veth_config->nlh->nlmsg_len) < 0)
+    struct nlmsghdr *nlh = nl_session_put(session, RTM_NEWADDR, NLM_F_REQUEST | NLM_F_CREATE | NLM_F_REPLACE | NLM_F_ACK);
+    if (nlh == NULL)
     {
-        LOG("[NET] Error: Failed to send netlink message\n");
-        mnl_socket_close(veth_config->nl);
         return EXIT_FAILURE;
     }
 
-    if (receive_netlink_responses(veth_config) != EXIT_SUCCESS)
-    {
-        LOG("[NET] Error: Failed to set default route\n");
-        mnl_socket_close(veth_config->nl);
-        return EXIT_FAILURE;
-    }
+    // Add the ifaddrmsg structure
+    struct ifaddrmsg *ifa = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifaddrmsg));
+    ifa->ifa_family = AF_INET;          // IPv4
+    ifa->ifa_prefixlen = prefix_len;    // Set prefix length
+    ifa->ifa_flags = 0;                 // No special flags
+    ifa->ifa_scope = RT_SCOPE_UNIVERSE; // Global scope
+    ifa->ifa_index = ifindex;           // Interface index
+
+    // Add the IFA_LOCAL attribute (Primary IPv4 address)
+    mnl_attr_put(nlh, IFA_LOCAL, sizeof(struct in_addr), &in_addr);
+
+    // Add the IFA_ADDRESS attribute (Peer or broadcast address, same as local)
+    mnl_attr_put(nlh, IFA_ADDRESS, sizeof(struct in_addr), &in_addr);
 
-    mnl_socket_close(veth_config->nl);
+    nl_session_end(session, nlh);
     return EXIT_SUCCESS;
 }
 
-int set_interface_up(struct veth_config_s *veth_config, const char *iface)
+// i.e. ip route replace default via gateway_ip dev ifindex
+int set_default_route(struct nl_session *session, int ifindex, const char *gateway_ip)
 {
-    char buf[MNL_SOCKET_BUFFER_SIZE];
-    veth_config->host = iface;
-    veth_config->seq = (uint32_t)time(NULL);
-
-    if (open_and_bind_netlink_socket(&veth_config->nl) != EXIT_SUCCESS)
+    struct in_addr gateway;
+    if (inet_pton(AF_INET, gateway_ip, &gateway) != 1)
     {
-        LOG("[NET] Error: Failed to open netlink socket\n");
-        return -1;
+        LOG("[NET] set_default_route: Error: Invalid gateway IP address\n");
+        return EXIT_FAILURE;
     }
 
-    // Build and send the netlink message
-    build_link_up_msg(veth_config, buf);
-    if (mnl_socket_sendto(veth_config->nl, veth_config->nlh, veth_config->nlh->nlmsg_len) < 0)
+    struct nlmsghdr *nlh = nl_session_put(session, RTM_NEWROUTE, NLM_F_REQUEST | NLM_F_CREATE | NLM_F_REPLACE | NLM_F_ACK);
+    if (nlh == NULL)
     {
-        LOG("[NET] Error: Failed to send netlink message\n");
-        mnl_socket_close(veth_config->nl);
         return EXIT_FAILURE;
     }
 
-    // Process responses
-    if (receive_netlink_responses(veth_config) != EXIT_SUCCESS)
+    struct rtmsg *rtm = mnl_nlmsg_put_extra_header(nlh, sizeof(struct rtmsg));
+    rtm->rtm_family = AF_INET;          // IPv4
+    rtm->rtm_dst_len = 0;               // Default route
+    rtm->rtm_src_len = 0;               // No source filter
+    rtm->rtm_table = RT_TABLE_MAIN;     // Main routing table
+    rtm->rtm_protocol = RTPROT_STATIC;  // Static route
+    rtm->rtm_scope = RT_SCOPE_UNIVERSE; // Global scope
+    rtm->rtm_type = RTN_UNICAST;        // Unicast route
+
+    // Add the gateway attribute (RTA_GATEWAY)
+    mnl_attr_put_u32(nlh, RTA_GATEWAY, gateway.s_addr);
+
+    // Add the output interface (RTA_OIF)
+    mnl_attr_put_u32(nlh, RTA_OIF, ifindex);
+
+    nl_session_end(session, nlh);
+    return EXIT_SUCCESS;
+}
+
+// i.e. ip link set iface up
+// The interface is looked up by name, so this can be queued in the same
+// batch as the request that creates it.
+int set_interface_up(struct nl_session *session, const char *iface)
+{
+    struct nlmsghdr *nlh = nl_session_put(session, RTM_NEWLINK, NLM_F_REQUEST | NLM_F_ACK);
+    if (nlh == NULL)
     {
-        LOG("[NET] Error: Failed to set interface up\n");
-        mnl_socket_close(veth_config->nl);
         return EXIT_FAILURE;
     }
 
-    mnl_socket_close(veth_config->nl);
+    // Add ifinfomsg structure
+    struct ifinfomsg *ifi = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifinfomsg));
+    ifi->ifi_family = AF_UNSPEC;
+    ifi->ifi_flags = IFF_UP;
+    ifi->ifi_change = IFF_UP;
+
+    // Add the interface name attribute
+    mnl_attr_put_strz(nlh, IFLA_IFNAME, iface);
+
+    nl_session_end(session, nlh);
     return EXIT_SUCCESS;
 }
 
-int move_veth_to_ns(struct veth_config_s *veth_config)
+// i.e. ip link set iface master master_ifindex
+int set_interface_master(struct nl_session *session, const char *iface, int master_ifindex)
 {
-    char buf[MNL_SOCKET_BUFFER_SIZE];
-    veth_config->seq = (uint32_t)time(NULL);
-
-    if (open_and_bind_netlink_socket(&veth_config->nl) != EXIT_SUCCESS)
+    struct nlmsghdr *nlh = nl_session_put(session, RTM_NEWLINK, NLM_F_REQUEST | NLM_F_ACK);
+    if (nlh == NULL)
     {
-        LOG("[LIBMNL] Error: open_and_bind_netlink_socket\n");
         return EXIT_FAILURE;
     }
 
-    // Build the Netlink message
-    LOG("[LIBMNL] Building RTM_SETLINK message\n");
-    build_setlink_msg(veth_config, buf);
+    struct ifinfomsg *ifi = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifinfomsg));
+    ifi->ifi_family = AF_UNSPEC;
 
-    // Send the message
-    LOG("[LIBMNL] Sending Netlink message\n");
-    if (mnl_socket_sendto(veth_config->nl, veth_config->nlh, veth_config->nlh->nlmsg_len) < 0)
-    {
-        LOG("[LIBMNL] Error: mnl_socket_sendto\n");
-        goto error;
-    }
+    mnl_attr_put_strz(nlh, IFLA_IFNAME, iface);
+    mnl_attr_put_u32(nlh, IFLA_MASTER, master_ifindex);
 
-    // Receive and parse all responses in a loop
-    LOG("[LIBMNL] Receiving Netlink responses\n");
-    if (receive_netlink_responses(veth_config) != EXIT_SUCCESS)
+    nl_session_end(session, nlh);
+    return EXIT_SUCCESS;
+}
+
+// i.e. ip link add name type bridge
+int create_bridge(struct nl_session *session, const char *name)
+{
+    struct nlmsghdr *nlh = nl_session_put(session, RTM_NEWLINK, NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL);
+    if (nlh == NULL)
     {
-        LOG("[LIBMNL] Error: receive_netlink_responses\n");
-        goto error;
+        return EXIT_FAILURE;
     }
 
-    LOG("[LIBMNL] Successfully moved interface to namespace\n");
-    mnl_socket_close(veth_config->nl);
-    return EXIT_SUCCESS;
+    struct ifinfomsg *ifi = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifinfomsg));
+    ifi->ifi_family = AF_UNSPEC;
+
+    mnl_attr_put_strz(nlh, IFLA_IFNAME, name);
 
-error:
-    mnl_socket_close(veth_config->nl);
-    return EXIT_FAILURE;
+    struct nlattr *linkinfo = mnl_attr_nest_start(nlh, IFLA_LINKINFO);
+    mnl_attr_put_strz(nlh, IFLA_INFO_KIND, "bridge");
+    mnl_attr_nest_end(nlh, linkinfo);
+
+    nl_session_end(session, nlh);
+    return EXIT_SUCCESS;
 }
 
-int create_veth_pair(struct veth_config_s *veth_config)
+// i.e. ip link add host type veth peer name cont netns netns_fd
+// The peer is created directly inside the child's network namespace, so
+// there's no separate request to move it there.
+int create_veth_pair(struct nl_session *session, struct veth_config_s *veth_config)
 {
-    char buf[MNL_SOCKET_BUFFER_SIZE];
-    veth_config->seq = (uint32_t)time(NULL);
-
-    if (open_and_bind_netlink_socket(&veth_config->nl) != EXIT_SUCCESS)
+    struct nlmsghdr *nlh = nl_session_put(session, RTM_NEWLINK, NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL);
+    if (nlh == NULL)
     {
-        LOG("[LIBMNL] Error: open_and_bind_netlink_socket\n");
         return EXIT_FAILURE;
     }
 
-    // Build the Netlink message
-    LOG("[LIBMNL] Building Netlink message\n");
-    build_netlink_msg(veth_config, buf);
+    // Outer ifinfomsg for the host interface
+    struct ifinfomsg *ifi = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifinfomsg));
+    ifi->ifi_family = AF_UNSPEC;
+
+    // IFLA_IFNAME = host
+    mnl_attr_put_strz(nlh, IFLA_IFNAME, veth_config->host);
 
-    // Send the message
-    LOG("[LIBMNL] Sending Netlink message\n");
-    if (mnl_socket_sendto(veth_config->nl, veth_config->nlh, veth_config->nlh->nlmsg_len) < 0)
+    // IFLA_LINKINFO
+    struct nlattr *linkinfo = mnl_attr_nest_start(nlh, IFLA_LINKINFO);
     {
-        LOG("[LIBMNL] Error: mnl_socket_sendto\n");
-        goto error;
+        mnl_attr_put_strz(nlh, IFLA_INFO_KIND, "veth");
+
+        // IFLA_INFO_DATA
+        struct nlattr *infodata = mnl_attr_nest_start(nlh, IFLA_INFO_DATA);
+        {
+            // The kernel expects IFLA_VETH_INFO_PEER with a peer ifinfomsg
+            struct nlattr *peerinfo = mnl_attr_nest_start(nlh, IFLA_VETH_INFO_PEER);
+            {
+                struct ifinfomsg peer_ifi = {
+                    .ifi_family = AF_UNSPEC,
+                };
+
+                // Put the peer ifinfomsg directly into the message
+                size_t sz = NLMSG_ALIGN(sizeof(peer_ifi));
+                memcpy(mnl_nlmsg_get_payload_tail(nlh), &peer_ifi, sizeof(peer_ifi));
+                nlh->nlmsg_len += sz;
+
+                // Then the peer’s name and the namespace to create it in
+                mnl_attr_put_strz(nlh, IFLA_IFNAME, veth_config->cont);
+                mnl_attr_put_u32(nlh, IFLA_NET_NS_FD, veth_config->netns_fd);
+                LOG("[LIBMNL] Peer name: %s\n", veth_config->cont);
+            }
+            mnl_attr_nest_end(nlh, peerinfo);
+        }
+        mnl_attr_nest_end(nlh, infodata);
     }
+    mnl_attr_nest_end(nlh, linkinfo);
 
-    // Receive and parse all responses in a loop
-    LOG("[LIBMNL] Receiving Netlink responses\n");
-    if (receive_netlink_responses(veth_config) != EXIT_SUCCESS)
+    nl_session_end(session, nlh);
+    return EXIT_SUCCESS;
+}
+
+// i.e. ip link delete iface
+int delete_link(struct nl_session *session, const char *iface)
+{
+    struct nlmsghdr *nlh = nl_session_put(session, RTM_DELLINK, NLM_F_REQUEST | NLM_F_ACK);
+    if (nlh == NULL)
     {
-        LOG("[LIBMNL] Error: receive_netlink_responses\n");
-        goto error;
+        return EXIT_FAILURE;
     }
 
-    LOG("[LIBMNL] veth pair created successfully\n");
-    mnl_socket_close(veth_config->nl);
-    return EXIT_SUCCESS;
+    struct ifinfomsg *ifi = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifinfomsg));
+    ifi->ifi_family = AF_UNSPEC;
+    mnl_attr_put_strz(nlh, IFLA_IFNAME, iface);
 
-error:
-    mnl_socket_close(veth_config->nl);
-    return EXIT_FAILURE;
+    nl_session_end(session, nlh);
+    return EXIT_SUCCESS;
 }
@@ -3,29 +3,65 @@
 
 #include <sys/types.h> // for pid_t
 #include <stdint.h>    // for uint32_t
+#include <stddef.h>    // for size_t
 
 // forward declarations to avoid including libmnl headers
 struct mnl_socket;
 struct nlmsghdr;
-struct ifinfomsg;
+
+// Room for a whole batch of requests. Each of our requests is well under 256
+// bytes, so this fits every batch we build with plenty to spare.
+#define NL_BATCH_SIZE 8192
+
+// A netlink socket that stays open for all the requests we make in one
+// namespace (a netlink socket is bound to the namespace it was created in).
+// Requests are queued into a batch with distinct sequence numbers and sent
+// with a single sendto() by `nl_session_commit()`, which then matches every
+// ACK back to its request.
+struct nl_session
+{
+    struct mnl_socket *nl;
+    uint32_t portid;
+    uint32_t seq;       // sequence number of the next request
+    uint32_t first_seq; // sequence number of the first request in the batch
+    int pending;        // requests in the batch that asked for an ACK
+    int acked;          // ACKs received so far for the batch
+    int error;          // first error reported for the batch (negative errno)
+    size_t len;         // bytes queued in buf
+    char buf[NL_BATCH_SIZE];
+};
 
 struct veth_config_s
 {
-    const uint16_t child_pid;
-    const char *child_namespace;
+    int netns_fd; // network namespace the container end is created in
     const char *host;
     const char *cont;
-    struct mnl_socket *nl;
-    struct nlmsghdr *nlh;
-    struct ifinfomsg *ifi;
-    uint32_t seq;
 };
 
-int setup_nat_rules(struct veth_config_s *veth_config, const char *container_network);
-int set_default_route(struct veth_config_s *veth_config, const char *gateway_ip);
-int set_interface_ip(struct veth_config_s *veth_config, const char *iface, const char *ip, const int prefix_len);
-int set_interface_up(struct veth_config_s *veth_config, const char *iface);
-int move_veth_to_ns(struct veth_config_s *veth_config);
-int create_veth_pair(struct veth_config_s *veth_config);
+// An IPv4 address as reported by `nl_get_addresses()`
+struct nl_addr
+{
+    uint32_t addr; // network byte order
+    int prefix_len;
+};
+
+int nl_session_open(struct nl_session *session, int bus);
+void nl_session_close(struct nl_session *session);
+struct nlmsghdr *nl_session_put(struct nl_session *session, uint16_t type, uint16_t flags);
+struct nlmsghdr *nl_session_put_dump(struct nl_session *session, uint16_t type);
+void nl_session_end(struct nl_session *session, struct nlmsghdr *nlh);
+int nl_session_commit(struct nl_session *session);
+
+int nl_get_ifindex(struct nl_session *session, const char *iface);
+int nl_get_addresses(struct nl_session *session, int ifindex, struct nl_addr *addrs, int max);
+
+int set_default_route(struct nl_session *session, int ifindex, const char *gateway_ip);
+int set_interface_ip(struct nl_session *session, int ifindex, const char *ip, const int prefix_len);
+int delete_interface_ip(struct nl_session *session, int ifindex, const struct nl_addr *addr);
+int set_interface_up(struct nl_session *session, const char *iface);
+int set_interface_master(struct nl_session *session, const char *iface, int master_ifindex);
+int create_bridge(struct nl_session *session, const char *name);
+int create_veth_pair(struct nl_session *session, struct veth_config_s *veth_config);
+int delete_link(struct nl_session *session, const char *iface);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,667 @@
+#define _GNU_SOURCE // for unshare, setns and close_range
+#include "netns_pool.h"
+#include "ipam.h"
+#include "libmnl.h"
+#include "networking.h"
+#include "nftables.h"
+#include "../container.h"
+#include "../logging.h"
+#include "../util.h"
+
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <sys/file.h>
+#include <sys/mount.h>
+
+// Size that the background refill keeps the pool at, set by `mocker pool fill`
+#define NETNS_POOL_TARGET NETNS_POOL_DIR "/target"
+
+// Held while entries are added or removed, so only one refill runs at a time
+#define NETNS_POOL_LOCK NETNS_POOL_DIR "/fill.lock"
+
+#define LEASE_SUFFIX ".lease"
+#define NS_SUFFIX ".ns"
+
+// Addresses we look at on the container end when recycling an entry
+#define MAX_ADDRS 16
+
+static void entry_path(char *path, size_t size, const char *id, const char *suffix)
+{
+    snprintf(path, size, "%s/%s%s", NETNS_POOL_DIR, id, suffix);
+}
+
+static int read_target(void)
+{
+    int target = 0;
+    FILE *fp = fopen(NETNS_POOL_TARGET, "r");
+    if (fp == NULL)
+    {
+        return 0;
+    }
+
+    if (fscanf(fp, "%d", &target) != 1 || target < 0)
+    {
+        target = 0;
+    }
+
+    fclose(fp);
+    return target;
+}
+
+static int write_target(int target)
+{
+    FILE *fp = fopen(NETNS_POOL_TARGET, "w");
+    if (fp == NULL)
+    {
+        LOG("[POOL] Failed to open %s: %s\n", NETNS_POOL_TARGET, strerror(errno));
+        return -1;
+    }
+
+    fprintf(fp, "%d\n", target);
+    fclose(fp);
+    return 0;
+}
+
+// The lease is a single line:
+//   <veth_host> <container_ip> <gateway> <network> <prefix_len> <ipam_slot>
+// It's only written once the entry is complete, so an empty lease belongs to
+// an entry that is still being set up (or whose creator died).
+static int write_lease(int fd, const struct container_s *entry)
+{
+    if (ftruncate(fd, 0) == -1 ||
+        dprintf(fd, "%s %s %s %s %d %d\n", entry->veth_host, entry->container_ip, entry->gateway,
+                entry->network, entry->prefix_len, entry->ipam_slot) < 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int read_lease(int fd, const char *id, struct container_s *entry)
+{
+    char buf[256];
+
+    ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0)
+    {
+        return -1;
+    }
+    buf[len] = '\0';
+
+    memset(entry, 0, sizeof(*entry));
+    if (sscanf(buf, "%15s %15s %15s %18s %d %d", entry->veth_host, entry->container_ip, entry->gateway,
+               entry->network, &entry->prefix_len, &entry->ipam_slot) != 6)
+    {
+        return -1;
+    }
+
+    snprintf(entry->netns_id, sizeof(entry->netns_id), "%s", id);
+    entry->netns_fd = -1;
+    entry->netns_lock_fd = -1;
+    return 0;
+}
+
+// Creates a network namespace and pins it with a bind mount on `path`. We only
+// stay in the new namespace for as long as it takes to mount it, and only on
+// the calling thread.
+// i.e. ip netns add
+static int create_netns(const char *path)
+{
+    int host_ns_fd = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (host_ns_fd == -1)
+    {
+        LOG("[POOL] Failed to open host namespace: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // the mount point has to exist
+    int fd = open(path, O_RDONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+    if (fd == -1)
+    {
+        LOG("[POOL] Failed to create %s: %s\n", path, strerror(errno));
+        close(host_ns_fd);
+        return -1;
+    }
+    close(fd);
+
+    if (unshare(CLONE_NEWNET) == -1)
+    {
+        LOG("[POOL] Failed to create network namespace: %s\n", strerror(errno));
+        close(host_ns_fd);
+        unlink(path);
+        return -1;
+    }
+
+    int ret = mount("/proc/thread-self/ns/net", path, NULL, MS_BIND, NULL);
+    if (ret == -1)
+    {
+        LOG("[POOL] Failed to bind mount namespace on %s: %s\n", path, strerror(errno));
+        unlink(path);
+    }
+
+    // everything else we do has to happen in the host namespace
+    if (setns(host_ns_fd, CLONE_NEWNET) == -1)
+    {
+        handle_error("setns");
+    }
+    close(host_ns_fd);
+
+    return ret;
+}
+
+// Removes an entry, along with its veth pair, lease and NAT reference if it
+// got far enough to have them (`entry` is NULL otherwise)
+static void destroy_entry(const char *id, struct container_s *entry)
+{
+    char path[PATH_MAX];
+
+    LOG("[POOL] Removing network namespace %s\n", id);
+    if (entry != NULL)
+    {
+        delete_veth_pair(entry);
+        cleanup_nat_rules(entry->network);
+        ipam_release(entry);
+    }
+
+    // i.e. ip netns delete
+    entry_path(path, sizeof(path), id, NS_SUFFIX);
+    umount2(path, MNT_DETACH);
+    unlink(path);
+
+    entry_path(path, sizeof(path), id, LEASE_SUFFIX);
+    unlink(path);
+}
+
+// Sets up one new entry, exactly the way `setup_networking()` would for a
+// container, and leaves it unlocked for `netns_pool_claim()`
+static int add_entry(void)
+{
+    struct container_s entry;
+    char lease_path[PATH_MAX];
+    char ns_path[PATH_MAX];
+    int netns_fd = -1;
+
+    // the entry's ID names its files and the host end of its veth pair
+    if (container_init(&entry) != 0)
+    {
+        return -1;
+    }
+    snprintf(entry.netns_id, sizeof(entry.netns_id), "%s", entry.id);
+
+    entry_path(lease_path, sizeof(lease_path), entry.id, LEASE_SUFFIX);
+    entry_path(ns_path, sizeof(ns_path), entry.id, NS_SUFFIX);
+
+    // The lease stays locked until the entry is complete, so claims skip it
+    int lock_fd = open(lease_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (lock_fd == -1)
+    {
+        LOG("[POOL] Failed to create %s: %s\n", lease_path, strerror(errno));
+        return -1;
+    }
+
+    if (flock(lock_fd, LOCK_EX) == -1 || create_netns(ns_path) != 0)
+    {
+        goto fail;
+    }
+
+    netns_fd = open(ns_path, O_RDONLY | O_CLOEXEC);
+    if (netns_fd == -1)
+    {
+        LOG("[POOL] Failed to open %s: %s\n", ns_path, strerror(errno));
+        goto fail_ns;
+    }
+
+    if (ipam_allocate(&entry) != 0)
+    {
+        goto fail_ns;
+    }
+
+    if (attach_netns(&entry, netns_fd) != 0)
+    {
+        goto fail_lease;
+    }
+
+    // i.e. nft add rule ip mocker postrouting ip saddr network
+    //          ip daddr != network masquerade
+    if (enable_ip_forwarding() != 0 || setup_nat_rules(entry.network) != 0)
+    {
+        goto fail_veth;
+    }
+
+    // The lease now belongs to the pool rather than to this process
+    if (ipam_pin(&entry) != 0 || write_lease(lock_fd, &entry) != 0)
+    {
+        goto fail_nat;
+    }
+
+    close(netns_fd);
+    close(lock_fd);
+
+    LOG("[POOL] Added network namespace %s (%s)\n", entry.id, entry.container_ip);
+    return 0;
+
+fail_nat:
+    cleanup_nat_rules(entry.network);
+fail_veth:
+    delete_veth_pair(&entry);
+fail_lease:
+    ipam_release(&entry);
+fail_ns:
+    if (netns_fd != -1)
+    {
+        close(netns_fd);
+    }
+    umount2(ns_path, MNT_DETACH);
+    unlink(ns_path);
+fail:
+    LOG("[POOL] Failed to add network namespace %s\n", entry.id);
+    unlink(lease_path);
+    close(lock_fd);
+    return -1;
+}
+
+typedef int (*entry_fn)(const char *id, int lock_fd, void *data);
+
+// Calls `fn` for every entry that no one else is using, with its lease locked.
+// `fn` takes over the lock. Stops as soon as `fn` returns non-zero, and returns
+// that value.
+static int for_each_idle_entry(entry_fn fn, void *data)
+{
+    const size_t suffix_len = strlen(LEASE_SUFFIX);
+    struct dirent *dirent;
+    int ret = 0;
+
+    DIR *dir = opendir(NETNS_POOL_DIR);
+    if (dir == NULL)
+    {
+        return 0;
+    }
+
+    while (ret == 0 && (dirent = readdir(dir)) != NULL)
+    {
+        char id[CONTAINER_ID_LEN + 1];
+        size_t len = strlen(dirent->d_name);
+        struct stat st;
+
+        if (len <= suffix_len || len - suffix_len > CONTAINER_ID_LEN ||
+            strcmp(dirent->d_name + len - suffix_len, LEASE_SUFFIX) != 0)
+        {
+            continue;
+        }
+
+        memcpy(id, dirent->d_name, len - suffix_len);
+        id[len - suffix_len] = '\0';
+
+        int lock_fd = openat(dirfd(dir), dirent->d_name, O_RDWR | O_CLOEXEC);
+        if (lock_fd == -1)
+        {
+            continue;
+        }
+
+        // In use, or removed while we were waiting for it
+        if (flock(lock_fd, LOCK_EX | LOCK_NB) == -1 ||
+            fstat(lock_fd, &st) == -1 || st.st_nlink == 0)
+        {
+            close(lock_fd);
+            continue;
+        }
+
+        ret = fn(id, lock_fd, data);
+    }
+
+    closedir(dir);
+    return ret;
+}
+
+// Only called with the pool lock held, so an empty lease can't belong to an
+// entry that is still being set up
+static int count_entry(const char *id, int lock_fd, void *data)
+{
+    struct container_s entry;
+
+    if (read_lease(lock_fd, id, &entry) == 0)
+    {
+        (*(int *)data)++;
+    }
+    else
+    {
+        destroy_entry(id, NULL);
+    }
+
+    close(lock_fd);
+    return 0;
+}
+
+static int drain_entry(const char *id, int lock_fd, void *data)
+{
+    struct container_s entry;
+
+    destroy_entry(id, read_lease(lock_fd, id, &entry) == 0 ? &entry : NULL);
+    close(lock_fd);
+    (*(int *)data)++;
+    return 0;
+}
+
+// Removes entries while `data` says there are more than we want
+static int trim_entry(const char *id, int lock_fd, void *data)
+{
+    int *excess = data;
+    struct container_s entry;
+
+    if (*excess <= 0)
+    {
+        close(lock_fd);
+        return 1;
+    }
+
+    destroy_entry(id, read_lease(lock_fd, id, &entry) == 0 ? &entry : NULL);
+    close(lock_fd);
+    (*excess)--;
+    return 0;
+}
+
+static int claim_entry(const char *id, int lock_fd, void *data)
+{
+    struct container_s *container = data;
+    struct container_s entry;
+    char ns_path[PATH_MAX];
+
+    // still being set up
+    if (read_lease(lock_fd, id, &entry) != 0)
+    {
+        close(lock_fd);
+        return 0;
+    }
+
+    entry_path(ns_path, sizeof(ns_path), id, NS_SUFFIX);
+    int netns_fd = open(ns_path, O_RDONLY | O_CLOEXEC);
+    if (netns_fd == -1)
+    {
+        LOG("[POOL] Failed to open %s: %s\n", ns_path, strerror(errno));
+        close(lock_fd);
+        return 0;
+    }
+
+    // The container takes over the entry's interface and addresses
+    memcpy(container->veth_host, entry.veth_host, sizeof(container->veth_host));
+    memcpy(container->network, entry.network, sizeof(container->network));
+    memcpy(container->gateway, entry.gateway, sizeof(container->gateway));
+    memcpy(container->container_ip, entry.container_ip, sizeof(container->container_ip));
+    memcpy(container->netns_id, entry.netns_id, sizeof(container->netns_id));
+    container->prefix_len = entry.prefix_len;
+    container->ipam_slot = entry.ipam_slot;
+    container->netns_fd = netns_fd;
+    container->netns_lock_fd = lock_fd;
+
+    return 1;
+}
+
+// Adds entries until `target` of them are idle. With LOCK_NB in `lock_flags`
+// it gives up straight away if another process is already filling the pool.
+static int fill(int target, int lock_flags)
+{
+    int idle = 0;
+    int ret = 0;
+
+    if (mkdir_p(NETNS_POOL_DIR, 0755) != 0)
+    {
+        LOG("[POOL] Failed to create %s: %s\n", NETNS_POOL_DIR, strerror(errno));
+        return -1;
+    }
+
+    int lock_fd = open(NETNS_POOL_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd == -1)
+    {
+        LOG("[POOL] Failed to open %s: %s\n", NETNS_POOL_LOCK, strerror(errno));
+        return -1;
+    }
+
+    if (flock(lock_fd, LOCK_EX | lock_flags) == -1)
+    {
+        close(lock_fd);
+        return errno == EWOULDBLOCK ? 0 : -1;
+    }
+
+    for_each_idle_entry(count_entry, &idle);
+    LOG("[POOL] %d idle network namespaces, target is %d\n", idle, target);
+
+    for (; idle < target; idle++)
+    {
+        if (add_entry() != 0)
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    close(lock_fd);
+    return ret;
+}
+
+// Sets the size of the pool and fills it up to that size
+// i.e. mocker pool fill <target>
+int netns_pool_fill(int target)
+{
+    if (mkdir_p(NETNS_POOL_DIR, 0755) != 0 || write_target(target) != 0)
+    {
+        return -1;
+    }
+
+    return fill(target, 0);
+}
+
+// Grows the pool to `target` unless it's bigger already, and fills it up, so
+// many containers in a row recycle pooled namespaces rather than each setting
+// up its own, i.e. for `mocker batch`. The target only holds until
+// `netns_pool_release()` gets back what this returns, the previous target, or
+// -1 if it couldn't raise it.
+int netns_pool_reserve(int target)
+{
+    int previous = read_target();
+
+    if (target > previous && (mkdir_p(NETNS_POOL_DIR, 0755) != 0 || write_target(target) != 0))
+    {
+        return -1;
+    }
+
+    if (fill(previous > target ? previous : target, 0) != 0)
+    {
+        LOG("[POOL] Failed to fill the pool up to %d\n", target);
+    }
+
+    return previous;
+}
+
+// Puts the pool's target back to what it was before `netns_pool_reserve()`,
+// and removes the idle entries beyond it
+int netns_pool_release(int previous)
+{
+    int idle = 0;
+
+    if (write_target(previous) != 0)
+    {
+        return -1;
+    }
+
+    int lock_fd = open(NETNS_POOL_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd == -1 || flock(lock_fd, LOCK_EX) == -1)
+    {
+        LOG("[POOL] Failed to lock %s: %s\n", NETNS_POOL_LOCK, strerror(errno));
+        if (lock_fd != -1)
+        {
+            close(lock_fd);
+        }
+        return -1;
+    }
+
+    for_each_idle_entry(count_entry, &idle);
+    int excess = idle - previous;
+    for_each_idle_entry(trim_entry, &excess);
+    close(lock_fd);
+
+    LOG("[POOL] Back to a target of %d from %d idle network namespaces\n", previous, idle);
+    return 0;
+}
+
+// Removes every idle entry and stops the pool from being refilled. Entries
+// that are in use are removed when their container exits.
+// i.e. mocker pool drain
+int netns_pool_drain(void)
+{
+    int drained = 0;
+
+    if (mkdir_p(NETNS_POOL_DIR, 0755) != 0 || write_target(0) != 0)
+    {
+        return -1;
+    }
+
+    int lock_fd = open(NETNS_POOL_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd == -1 || flock(lock_fd, LOCK_EX) == -1)
+    {
+        LOG("[POOL] Failed to lock %s: %s\n", NETNS_POOL_LOCK, strerror(errno));
+        if (lock_fd != -1)
+        {
+            close(lock_fd);
+        }
+        return -1;
+    }
+
+    for_each_idle_entry(drain_entry, &drained);
+    close(lock_fd);
+
+    LOG("[POOL] Removed %d network namespaces\n", drained);
+    return 0;
+}
+
+// Takes an idle entry for the container, which then joins its namespace
+// instead of getting a new one. The entry stays locked until
+// `netns_pool_recycle()`, or until we die. Returns -1 if the pool is empty.
+int netns_pool_claim(struct container_s *container)
+{
+    if (for_each_idle_entry(claim_entry, container) != 1)
+    {
+        LOG("[POOL] No idle network namespace available\n");
+        return -1;
+    }
+
+    LOG("[POOL] Claimed network namespace %s (%s)\n", container->netns_id, container->container_ip);
+    return 0;
+}
+
+// Puts the container's entry back the way `add_entry()` left it, and unlocks
+// it for the next container. The container can't have left any processes
+// behind (its PID namespace is gone), only state in the namespace itself.
+// Entries that can't be restored are removed instead.
+void netns_pool_recycle(struct container_s *container)
+{
+    struct nl_session session;
+    struct nl_addr addrs[MAX_ADDRS];
+    struct in_addr lease;
+    int ifindex;
+    int count;
+
+    if (read_target() == 0 || inet_pton(AF_INET, container->container_ip, &lease) != 1)
+    {
+        goto destroy;
+    }
+
+    // Connections the container made must not be matched for the next one
+    // i.e. conntrack -F
+    if (open_netns_session(container->netns_fd, NETLINK_NETFILTER, &session) == 0)
+    {
+        if (flush_conntrack(&session) != 0 || nl_session_commit(&session) != 0)
+        {
+            LOG("[POOL] Failed to flush conntrack: %s\n", strerror(errno));
+        }
+        nl_session_close(&session);
+    }
+
+    if (open_netns_session(container->netns_fd, NETLINK_ROUTE, &session) != 0)
+    {
+        goto destroy;
+    }
+
+    // Drop any addresses the container added to its interface
+    // i.e. ip addr del addr/prefix_len dev VETH_CONTAINER
+    ifindex = nl_get_ifindex(&session, VETH_CONTAINER);
+    count = ifindex < 0 ? -1 : nl_get_addresses(&session, ifindex, addrs, MAX_ADDRS);
+    if (count < 0)
+    {
+        goto destroy_session;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if ((addrs[i].addr != lease.s_addr || addrs[i].prefix_len != container->prefix_len) &&
+            delete_interface_ip(&session, ifindex, &addrs[i]) != 0)
+        {
+            goto destroy_session;
+        }
+    }
+
+    // ...and put back anything it took away
+    // i.e. ip link set lo up
+    //      && ip link set VETH_CONTAINER up
+    //      && ip addr replace container_ip/prefix_len dev VETH_CONTAINER
+    //      && ip route replace default via gateway
+    if (set_interface_up(&session, "lo") != 0 ||
+        set_interface_up(&session, VETH_CONTAINER) != 0 ||
+        set_interface_ip(&session, ifindex, container->container_ip, container->prefix_len) != 0 ||
+        set_default_route(&session, ifindex, container->gateway) != 0 ||
+        nl_session_commit(&session) != 0)
+    {
+        LOG("[POOL] Failed to restore network namespace %s: %s\n", container->netns_id, strerror(errno));
+        goto destroy_session;
+    }
+
+    nl_session_close(&session);
+    LOG("[POOL] Recycled network namespace %s\n", container->netns_id);
+    goto unlock;
+
+destroy_session:
+    nl_session_close(&session);
+destroy:
+    destroy_entry(container->netns_id, container);
+unlock:
+    close(container->netns_fd);
+    // closing the lease drops the lock, which hands the entry back
+    close(container->netns_lock_fd);
+    container->netns_fd = -1;
+    container->netns_lock_fd = -1;
+}
+
+// Tops the pool back up to its target in a detached process, so the
+// container that just took an entry doesn't wait for a new one
+void netns_pool_refill(void)
+{
+    if (read_target() == 0)
+    {
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        LOG("[POOL] Failed to fork refill: %s\n", strerror(errno));
+        return;
+    }
+
+    if (pid == 0)
+    {
+        // Fork again so the refill is reparented to init instead of
+        // becoming our zombie
+        if (fork() == 0)
+        {
+            // Don't hold on to any of our caller's descriptors. The lock on
+            // a claimed lease has to go away with its container.
+            close_range(3, ~0U, 0);
+            setsid();
+            fill(read_target(), LOCK_NB);
+            _exit(EXIT_SUCCESS);
+        }
+        _exit(EXIT_SUCCESS);
+    }
+
+    waitpid(pid, NULL, 0);
+}
@@ -0,0 +1,23 @@
+#ifndef _NETNS_POOL_H_
+#define _NETNS_POOL_H_
+
+#include "../common.h"
+
+// Network namespaces that are already plugged into the bridge, with an
+// address and a default route, waiting for a container to join them. Every
+// entry is a pair of files in this directory:
+//   <id>.ns     bind mount that keeps the namespace alive
+//   <id>.lease  its addresses, flock()ed by whoever is using the entry
+#define NETNS_POOL_DIR MOCKER_RUN_DIR "/netns"
+
+struct container_s;
+
+int netns_pool_fill(int target);
+int netns_pool_reserve(int target);
+int netns_pool_release(int previous);
+int netns_pool_drain(void);
+int netns_pool_claim(struct container_s *container);
+void netns_pool_recycle(struct container_s *container);
+void netns_pool_refill(void);
+
+#endif
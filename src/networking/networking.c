@@ -1,44 +1,27 @@
 #define _GNU_SOURCE // note: i needed this for setns ?? see `man 2 setns`
 #include "networking.h"
+#include "ipam.h"
 #include "libmnl.h"
+#include "netns_pool.h"
+#include "nftables.h"
+#include "../container.h"
 #include "../logging.h"
 
-#define VETH_HOST "veth0"
-#define VETH_CONTAINER "ceth0"
-#define HOST_IP "172.18.0.1"
-#define CONTAINER_IP "172.18.0.2"
-#define NETMASK "16"
-#define CONTAINER_NETWORK "172.18.0.0/16"
+#include <arpa/inet.h>
+#include <linux/netlink.h>
 
-static int switch_to_container_ns(struct veth_config_s *veth_config)
-{
-    char ns_path[256];
-    snprintf(ns_path, sizeof(ns_path), "/proc/%d/ns/%s", veth_config->child_pid, veth_config->child_namespace);
-
-    int fd = open(ns_path, O_RDONLY);
-    if (fd == -1)
-    {
-        perror("open namespace");
-        LOG("[LIBMNL] switch_to_container_ns: Error: open namespace\n");
-        return EXIT_FAILURE;
-    }
-
-    if (setns(fd, 0) == -1)
-    {
-        perror("setns");
-        LOG("[LIBMNL] switch_to_container_ns: Error: setns\n");
-        close(fd);
-        return -1;
-    }
+// All containers hang off one bridge, which holds the gateway address
+#define BRIDGE_NAME "mocker0"
 
-    close(fd);
-    return 0;
-}
+// Most addresses of the bridge looked at for the gateway
+#define BRIDGE_MAX_ADDRS 16
 
+// The calling thread's namespace, which is not the process's when the daemon
+// sets up containers on a thread of its own
 static int save_current_namespace(const char *namespace, int *ns_fd)
 {
     char ns_path[256];
-    snprintf(ns_path, sizeof(ns_path), "/proc/self/ns/%s", namespace);
+    snprintf(ns_path, sizeof(ns_path), "/proc/thread-self/ns/%s", namespace);
 
     *ns_fd = open(ns_path, O_RDONLY);
     if (*ns_fd == -1)
@@ -65,244 +48,296 @@ static int restore_namespace(int ns_fd)
     return 0;
 }
 
-static int setup_dns(void)
+int enable_ip_forwarding(void)
 {
-    char etc_path[256];
-    char src_file[] = "/etc/resolv.conf";
-    char dst_file[256];
-    int fd_src = -1;
-    int fd_dst = -1;
-
-    // i.e. mkdir -p CONTAINER_ROOT/etc
-    snprintf(etc_path, sizeof(etc_path), "%s/etc", CONTAINER_ROOT);
-    if (mkdir(etc_path, 0755) == -1 && errno != EEXIST)
+    const char *forwarding_file = "/proc/sys/net/ipv4/ip_forward";
+    FILE *fp = fopen(forwarding_file, "w");
+    if (!fp)
     {
-        LOG("[NET] Failed to create directory %s: %s\n",
-            etc_path, strerror(errno));
+        LOG("[NET] Failed to open %s\n", forwarding_file);
         return -1;
     }
 
-    // open /etc/resolv.conf to read from
-    fd_src = open(src_file, O_RDONLY);
-    if (fd_src < 0)
+    fprintf(fp, "1");
+    fclose(fp);
+
+    return 0;
+}
+
+void delete_veth_pair(struct container_s *container)
+{
+    struct nl_session session;
+    LOG("[NET] Cleaning up network interfaces...\n");
+
+    if (nl_session_open(&session, NETLINK_ROUTE) != EXIT_SUCCESS)
     {
-        LOG("[NET] Failed to open source %s: %s\n",
-            src_file, strerror(errno));
-        return -1;
+        LOG("[NET] Failed to open netlink socket\n");
+        return;
     }
 
-    // open CONTAINER_ROOT/etc/resolv.conf to write to
-    snprintf(dst_file, sizeof(dst_file), "%s/etc/resolv.conf", CONTAINER_ROOT);
-    fd_dst = open(dst_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd_dst < 0)
+    // Delete veth pair (deleting one end automatically removes the peer)
+    // i.e. ip link delete veth_host
+    if (delete_link(&session, container->veth_host) != 0 || nl_session_commit(&session) != 0)
     {
-        LOG("[NET] Failed to open destination %s: %s\n",
-            dst_file, strerror(errno));
-        close(fd_src);
-        return -1;
+        LOG("[NET] Failed to delete %s: %s\n", container->veth_host, strerror(errno));
     }
 
-    // cp /etc/resolv.conf CONTAINER_ROOT/etc/resolv.conf
-    {
-        char buffer[4096];
-        ssize_t bytes_read;
+    nl_session_close(&session);
+}
 
-        while ((bytes_read = read(fd_src, buffer, sizeof(buffer))) > 0)
-        {
-            ssize_t bytes_written = 0;
-            char *write_ptr = buffer;
-
-            while (bytes_written < bytes_read)
-            {
-                ssize_t w = write(fd_dst, write_ptr + bytes_written,
-                                  bytes_read - bytes_written);
-                if (w < 0)
-                {
-                    LOG("[NET] Write failed: %s\n", strerror(errno));
-                    close(fd_src);
-                    close(fd_dst);
-                    return -1;
-                }
-                bytes_written += w;
-            }
-        }
+// Makes sure the bridge holds the gateway address. The process that created
+// the bridge may have died before adding it, so this checks every time rather
+// than trusting whoever got there first.
+// i.e. ip addr replace gateway/prefix_len dev BRIDGE_NAME
+static int ensure_gateway(struct nl_session *session, int ifindex, struct container_s *container)
+{
+    struct nl_addr addrs[BRIDGE_MAX_ADDRS];
+    struct in_addr gateway;
+
+    if (inet_pton(AF_INET, container->gateway, &gateway) != 1)
+    {
+        LOG("[NET] Invalid gateway address: %s\n", container->gateway);
+        return -1;
+    }
 
-        if (bytes_read < 0)
+    int count = nl_get_addresses(session, ifindex, addrs, BRIDGE_MAX_ADDRS);
+    for (int i = 0; i < count; i++)
+    {
+        if (addrs[i].addr == gateway.s_addr)
         {
-            LOG("[NET] Read failed: %s\n", strerror(errno));
-            close(fd_src);
-            close(fd_dst);
-            return -1;
+            return 0;
         }
     }
 
-    close(fd_src);
-    close(fd_dst);
+    // Another mocker adding it at the same time is as good as adding it
+    if (set_interface_ip(session, ifindex, container->gateway, container->prefix_len) != 0 ||
+        (nl_session_commit(session) != 0 && errno != EEXIST))
+    {
+        LOG("[NET] Failed to set bridge address: %s\n", strerror(errno));
+        return -1;
+    }
 
-    LOG("[NET] DNS configuration successfully copied.\n");
+    LOG("[NET] Set gateway %s on bridge %s\n", container->gateway, BRIDGE_NAME);
     return 0;
 }
 
-static int enable_ip_forwarding(void)
+// Returns the index of the shared bridge, creating it the first time any
+// container needs it, and making sure it has the gateway address
+static int ensure_bridge(struct nl_session *session, struct container_s *container)
 {
-    const char *forwarding_file = "/proc/sys/net/ipv4/ip_forward";
-    FILE *fp = fopen(forwarding_file, "w");
-    if (!fp)
+    int ifindex = nl_get_ifindex(session, BRIDGE_NAME);
+    if (ifindex > 0)
     {
-        LOG("[NET] Failed to open %s\n", forwarding_file);
-        return -1;
+        return ensure_gateway(session, ifindex, container) == 0 ? ifindex : -1;
     }
 
-    fprintf(fp, "1");
-    fclose(fp);
-
-    return 0;
-}
+    // i.e. ip link add BRIDGE_NAME type bridge && ip link set BRIDGE_NAME up
+    if (create_bridge(session, BRIDGE_NAME) != 0 ||
+        set_interface_up(session, BRIDGE_NAME) != 0)
+    {
+        return -1;
+    }
 
-static void cleanup_nat_rules(void)
-{
-    char cmd[256];
-    snprintf(cmd, sizeof(cmd),
-             "iptables -t nat -D POSTROUTING -s %s ! -o %s -j MASQUERADE 2>/dev/null",
-             CONTAINER_NETWORK, VETH_HOST);
-    system(cmd);
-}
+    // EEXIST: another mocker beat us to it
+    if (nl_session_commit(session) != 0 && errno != EEXIST)
+    {
+        LOG("[NET] Failed to create bridge %s: %s\n", BRIDGE_NAME, strerror(errno));
+        return -1;
+    }
 
-void cleanup_networking(void)
-{
-    char cmd[256];
-    LOG("[NET] Cleaning up network interfaces...\n");
+    ifindex = nl_get_ifindex(session, BRIDGE_NAME);
+    if (ifindex < 0 || ensure_gateway(session, ifindex, container) != 0)
+    {
+        return -1;
+    }
 
-    // Delete veth pair (deleting one end automatically removes the peer)
-    snprintf(cmd, sizeof(cmd), "ip link delete %s 2>/dev/null", VETH_HOST);
-    system(cmd);
+    return ifindex;
 }
 
-int setup_networking(pid_t child_pid)
+// Opens a netlink session on `bus` inside the network namespace `netns_fd`.
+// The socket stays bound to that namespace after we switch back to the host's.
+int open_netns_session(int netns_fd, int bus, struct nl_session *session)
 {
     int host_ns_fd;
-
-    struct veth_config_s veth_config = {
-        .child_pid = child_pid,
-        .child_namespace = "net",
-        .host = VETH_HOST,
-        .cont = VETH_CONTAINER,
-        .nl = NULL,
-        .nlh = NULL,
-        .ifi = NULL,
-        .seq = 0,
-    };
-
-    LOG("[NET] Setting up container networking...\n");
+    int ret = -1;
 
     // Save the current (host) namespace
     if (save_current_namespace("net", &host_ns_fd) != 0)
     {
         LOG("[NET] Failed to save host namespace\n");
-        goto cleanup;
+        return -1;
     }
 
-    // i.e. mkdir -p CONTAINER_ROOT/etc
-    //      && cp /etc/resolv.conf CONTAINER_ROOT/etc/resolv.conf
-    if (setup_dns() != 0)
+    // i.e. nsenter --net=netns_fd
+    if (setns(netns_fd, CLONE_NEWNET) == -1)
     {
-        LOG("[NET] Failed to setup DNS\n");
-        goto cleanup;
+        LOG("[NET] Failed to switch to container namespace: %s\n", strerror(errno));
+        close(host_ns_fd);
+        return -1;
     }
 
-    // create veth pair
-    // i.e. ip link add VETH_HOST type veth peer name VETH_CONTAINER
-    if (create_veth_pair(&veth_config) != 0)
+    ret = nl_session_open(session, bus);
+
+    if (restore_namespace(host_ns_fd) != 0)
     {
-        LOG("[NET] Failed to create veth pair\n");
-        goto cleanup;
+        LOG("[NET] Failed to restore host namespace\n");
+        nl_session_close(session);
+        return -1;
     }
 
-    // move container end to child's network namespace
-    // i.e. ip link set VETH_CONTAINER netns child_pid
-    if (move_veth_to_ns(&veth_config) != 0)
+    return ret;
+}
+
+// Plugs the network namespace `netns_fd` into the bridge with a veth pair and
+// gives the container end the container's leased address. On failure the veth
+// pair is removed again, but the lease is left to the caller.
+int attach_netns(struct container_s *container, int netns_fd)
+{
+    struct nl_session host_session;
+    struct nl_session cont_session;
+    int bridge_ifindex;
+    int cont_ifindex;
+
+    struct veth_config_s veth_config = {
+        .netns_fd = netns_fd,
+        .host = container->veth_host,
+        .cont = VETH_CONTAINER,
+    };
+
+    // One netlink socket per namespace for all of the requests below
+    if (nl_session_open(&host_session, NETLINK_ROUTE) != 0)
     {
-        LOG("[NET] Failed to move interface to container namespace\n");
-        goto cleanup;
+        LOG("[NET] Failed to open host netlink socket\n");
+        return -1;
     }
 
-    // setup host end
-    // i.e. ip link set VETH_HOST up"
-    if (set_interface_up(&veth_config, VETH_HOST) != 0)
+    if (open_netns_session(netns_fd, NETLINK_ROUTE, &cont_session) != 0)
     {
-        LOG("[NET] Failed to set host interface up\n");
-        goto cleanup;
+        LOG("[NET] Failed to open container netlink socket\n");
+        nl_session_close(&host_session);
+        return -1;
     }
 
-    // setup host ip address
-    // i.e. ip addr add HOST_IP/NETMASK dev VETH_HOST
-    // \todo: change NETMASK to 16 (int instead of string) and pass in here
-    if (set_interface_ip(&veth_config, VETH_HOST, HOST_IP, 16) != 0)
+    bridge_ifindex = ensure_bridge(&host_session, container);
+    if (bridge_ifindex < 0)
     {
-        LOG("[NET] Failed to set host IP\n");
+        LOG("[NET] Failed to set up bridge %s\n", BRIDGE_NAME);
         goto cleanup;
     }
 
-    // setup container end
-    // i.e. nsenter -t child_pid
-    if (switch_to_container_ns(&veth_config) != 0)
+    // create veth pair with the container end already in the container's
+    // namespace, and plug the host end into the bridge
+    // i.e. ip link add veth_host type veth peer name VETH_CONTAINER netns netns_fd
+    //      && ip link set veth_host master BRIDGE_NAME
+    //      && ip link set veth_host up
+    if (create_veth_pair(&host_session, &veth_config) != 0 ||
+        set_interface_master(&host_session, container->veth_host, bridge_ifindex) != 0 ||
+        set_interface_up(&host_session, container->veth_host) != 0 ||
+        nl_session_commit(&host_session) != 0)
     {
-        LOG("[NET] Failed to switch to container namespace\n");
+        LOG("[NET] Failed to create veth pair: %s\n", strerror(errno));
         goto cleanup;
     }
 
-    if (set_interface_up(&veth_config, "lo") != 0)
+    // setup container end, all in one batch
+    // i.e. ip link set lo up
+    //      && ip link set VETH_CONTAINER up
+    //      && ip addr add container_ip/prefix_len dev VETH_CONTAINER
+    //      && ip route replace default via gateway
+    cont_ifindex = nl_get_ifindex(&cont_session, VETH_CONTAINER);
+    if (cont_ifindex < 0 ||
+        set_interface_up(&cont_session, "lo") != 0 ||
+        set_interface_up(&cont_session, VETH_CONTAINER) != 0 ||
+        set_interface_ip(&cont_session, cont_ifindex, container->container_ip, container->prefix_len) != 0 ||
+        set_default_route(&cont_session, cont_ifindex, container->gateway) != 0 ||
+        nl_session_commit(&cont_session) != 0)
     {
-        LOG("[NET] Failed to set up loopback interface in container\n");
+        LOG("[NET] Failed to set up container interface: %s\n", strerror(errno));
         goto cleanup;
     }
 
-    if (set_interface_up(&veth_config, VETH_CONTAINER) != 0)
+    nl_session_close(&cont_session);
+    nl_session_close(&host_session);
+    return 0;
+
+cleanup:
+    nl_session_close(&cont_session);
+    nl_session_close(&host_session);
+    delete_veth_pair(container);
+    return -1;
+}
+
+int setup_networking(struct container_s *container, pid_t child_pid)
+{
+    char ns_path[64];
+
+    LOG("[NET] Setting up container networking...\n");
+
+    // The child joined a namespace from the pool, which is already wired up
+    if (container->netns_fd >= 0)
     {
-        LOG("[NET] Failed to set up container interface\n");
-        goto cleanup;
+        LOG("[NET] Using pooled network namespace %s (%s)\n", container->netns_id, container->container_ip);
+        return 0;
     }
 
-    if (set_interface_ip(&veth_config, VETH_CONTAINER, CONTAINER_IP, 16) != 0)
+    // Lease the container's addresses
+    if (ipam_allocate(container) != 0)
     {
-        LOG("[NET] Failed to set container IP\n");
-        goto cleanup;
+        LOG("[NET] Failed to allocate addresses\n");
+        return -1;
     }
 
-    // set default route in container (still in container's namespace)
-    // i.e. ip route add default via HOST_IP
-    if (set_default_route(&veth_config, HOST_IP) != 0)
+    snprintf(ns_path, sizeof(ns_path), "/proc/%d/ns/net", child_pid);
+    int netns_fd = open(ns_path, O_RDONLY | O_CLOEXEC);
+    if (netns_fd == -1)
     {
-        LOG("[NET] Failed to switch to container namespace\n");
-        goto cleanup;
+        LOG("[NET] Failed to open %s: %s\n", ns_path, strerror(errno));
+        ipam_release(container);
+        return -1;
     }
 
-    if (restore_namespace(host_ns_fd) != 0)
+    int ret = attach_netns(container, netns_fd);
+    close(netns_fd);
+    if (ret != 0)
     {
-        LOG("[NET] Failed to restore host namespace\n");
-        goto cleanup;
+        ipam_release(container);
+        return -1;
     }
 
-    // \todo: convert the rest of this to use libmnl ....
-
     if (enable_ip_forwarding() != 0)
     {
         LOG("[NET] Failed to enable IP forwarding\n");
-        goto cleanup;
+        goto cleanup_links;
     }
 
-    if (setup_nat_rules(&veth_config, CONTAINER_NETWORK) != 0)
+    // i.e. nft add rule ip mocker postrouting ip saddr network
+    //          ip daddr != network masquerade
+    if (setup_nat_rules(container->network) != 0)
     {
         LOG("[NET] Failed to setup NAT\n");
-        goto cleanup;
+        goto cleanup_links;
     }
 
     LOG("[NET] Network setup completed successfully with NAT\n");
     return 0;
 
-cleanup:
+cleanup_links:
     LOG("[NET] Network setup failed, cleaning up...\n");
-    cleanup_networking();
-    cleanup_nat_rules();
+    delete_veth_pair(container);
+    ipam_release(container);
     return -1;
-}
\ No newline at end of file
+}
+
+void cleanup_networking(struct container_s *container)
+{
+    // Pooled namespaces keep their veth pair, lease and NAT reference
+    if (container->netns_fd >= 0)
+    {
+        netns_pool_recycle(container);
+        return;
+    }
+
+    delete_veth_pair(container);
+    cleanup_nat_rules(container->network);
+    ipam_release(container);
+}
@@ -3,7 +3,20 @@
 
 #include "../common.h"
 
-void cleanup_networking(void);
-int setup_networking(pid_t child_pid);
+// Every container has its own network namespace, so the container end can
+// have the same name everywhere. The host end is named after the container.
+#define VETH_CONTAINER "ceth0"
+
+struct container_s;
+struct nl_session;
+
+void cleanup_networking(struct container_s *container);
+int setup_networking(struct container_s *container, pid_t child_pid);
+
+// Shared with the network namespace pool
+int open_netns_session(int netns_fd, int bus, struct nl_session *session);
+int attach_netns(struct container_s *container, int netns_fd);
+void delete_veth_pair(struct container_s *container);
+int enable_ip_forwarding(void);
 
 #endif
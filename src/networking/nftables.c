@@ -0,0 +1,365 @@
+#include "nftables.h"
+#include "libmnl.h"
+#include "../common.h"
+#include "../logging.h"
+#include "../util.h"
+
+#include <arpa/inet.h>
+#include <libmnl/libmnl.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <linux/netfilter/nf_tables.h>
+#include <sys/file.h>
+
+// All of our NAT lives in its own table, so it never touches rules that
+// were installed by anyone else and can be removed in one go.
+#define NAT_TABLE "mocker"
+#define NAT_CHAIN "postrouting"
+#define NAT_PRIORITY 100 // NF_IP_PRI_NAT_SRC
+
+// Number of containers currently relying on the masquerade rule
+#define NAT_REFCOUNT MOCKER_RUN_DIR "/nat.ref"
+
+// IPv4 header offsets of the source and destination addresses
+#define IP_SADDR_OFFSET 12
+#define IP_DADDR_OFFSET 16
+
+static struct nlmsghdr *nft_put(struct nl_session *session, uint16_t type, uint16_t flags, uint8_t family, uint16_t res_id)
+{
+    struct nlmsghdr *nlh = nl_session_put(session, type, flags);
+    if (nlh == NULL)
+    {
+        return NULL;
+    }
+
+    struct nfgenmsg *nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
+    nfg->nfgen_family = family;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons(res_id);
+
+    return nlh;
+}
+
+// nf_tables only accepts changes wrapped in a batch, which the kernel
+// applies as a single transaction
+static int nft_batch_begin(struct nl_session *session)
+{
+    struct nlmsghdr *nlh = nft_put(session, NFNL_MSG_BATCH_BEGIN, NLM_F_REQUEST, AF_UNSPEC, NFNL_SUBSYS_NFTABLES);
+    if (nlh == NULL)
+    {
+        return -1;
+    }
+
+    nl_session_end(session, nlh);
+    return 0;
+}
+
+static int nft_batch_end(struct nl_session *session)
+{
+    struct nlmsghdr *nlh = nft_put(session, NFNL_MSG_BATCH_END, NLM_F_REQUEST, AF_UNSPEC, NFNL_SUBSYS_NFTABLES);
+    if (nlh == NULL)
+    {
+        return -1;
+    }
+
+    nl_session_end(session, nlh);
+    return 0;
+}
+
+// i.e. nft add table ip NAT_TABLE (or delete)
+static int nft_table(struct nl_session *session, uint16_t msg, uint16_t flags)
+{
+    struct nlmsghdr *nlh = nft_put(session, (NFNL_SUBSYS_NFTABLES << 8) | msg,
+                                   NLM_F_REQUEST | NLM_F_ACK | flags, NFPROTO_IPV4, 0);
+    if (nlh == NULL)
+    {
+        return -1;
+    }
+
+    mnl_attr_put_strz(nlh, NFTA_TABLE_NAME, NAT_TABLE);
+    nl_session_end(session, nlh);
+    return 0;
+}
+
+// i.e. nft add chain ip NAT_TABLE NAT_CHAIN { type nat hook postrouting priority 100; }
+static int nft_nat_chain(struct nl_session *session)
+{
+    struct nlmsghdr *nlh = nft_put(session, (NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_NEWCHAIN,
+                                   NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE, NFPROTO_IPV4, 0);
+    if (nlh == NULL)
+    {
+        return -1;
+    }
+
+    mnl_attr_put_strz(nlh, NFTA_CHAIN_TABLE, NAT_TABLE);
+    mnl_attr_put_strz(nlh, NFTA_CHAIN_NAME, NAT_CHAIN);
+    mnl_attr_put_strz(nlh, NFTA_CHAIN_TYPE, "nat");
+
+    struct nlattr *hook = mnl_attr_nest_start(nlh, NFTA_CHAIN_HOOK);
+    mnl_attr_put_u32(nlh, NFTA_HOOK_HOOKNUM, htonl(NF_INET_POST_ROUTING));
+    mnl_attr_put_u32(nlh, NFTA_HOOK_PRIORITY, htonl(NAT_PRIORITY));
+    mnl_attr_nest_end(nlh, hook);
+
+    nl_session_end(session, nlh);
+    return 0;
+}
+
+static void nft_put_data(struct nlmsghdr *nlh, uint16_t type, const void *data, size_t len)
+{
+    struct nlattr *nest = mnl_attr_nest_start(nlh, type);
+    mnl_attr_put(nlh, NFTA_DATA_VALUE, len, data);
+    mnl_attr_nest_end(nlh, nest);
+}
+
+// Loads the address at `offset` in the IP header into register 1, masks it
+// and compares it against the network (i.e. ip saddr/daddr [!=] network)
+static void nft_put_match_network(struct nlmsghdr *nlh, uint32_t offset, uint32_t network, uint32_t mask, uint32_t op)
+{
+    uint32_t zero = 0;
+    struct nlattr *elem;
+    struct nlattr *data;
+
+    // payload load 4b @ network header + offset => reg 1
+    elem = mnl_attr_nest_start(nlh, NFTA_LIST_ELEM);
+    mnl_attr_put_strz(nlh, NFTA_EXPR_NAME, "payload");
+    data = mnl_attr_nest_start(nlh, NFTA_EXPR_DATA);
+    mnl_attr_put_u32(nlh, NFTA_PAYLOAD_DREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_PAYLOAD_BASE, htonl(NFT_PAYLOAD_NETWORK_HEADER));
+    mnl_attr_put_u32(nlh, NFTA_PAYLOAD_OFFSET, htonl(offset));
+    mnl_attr_put_u32(nlh, NFTA_PAYLOAD_LEN, htonl(sizeof(uint32_t)));
+    mnl_attr_nest_end(nlh, data);
+    mnl_attr_nest_end(nlh, elem);
+
+    // bitwise reg 1 = (reg 1 & mask) ^ 0
+    elem = mnl_attr_nest_start(nlh, NFTA_LIST_ELEM);
+    mnl_attr_put_strz(nlh, NFTA_EXPR_NAME, "bitwise");
+    data = mnl_attr_nest_start(nlh, NFTA_EXPR_DATA);
+    mnl_attr_put_u32(nlh, NFTA_BITWISE_SREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_BITWISE_DREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_BITWISE_LEN, htonl(sizeof(uint32_t)));
+    nft_put_data(nlh, NFTA_BITWISE_MASK, &mask, sizeof(mask));
+    nft_put_data(nlh, NFTA_BITWISE_XOR, &zero, sizeof(zero));
+    mnl_attr_nest_end(nlh, data);
+    mnl_attr_nest_end(nlh, elem);
+
+    // cmp reg 1 op network
+    elem = mnl_attr_nest_start(nlh, NFTA_LIST_ELEM);
+    mnl_attr_put_strz(nlh, NFTA_EXPR_NAME, "cmp");
+    data = mnl_attr_nest_start(nlh, NFTA_EXPR_DATA);
+    mnl_attr_put_u32(nlh, NFTA_CMP_SREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_CMP_OP, htonl(op));
+    nft_put_data(nlh, NFTA_CMP_DATA, &network, sizeof(network));
+    mnl_attr_nest_end(nlh, data);
+    mnl_attr_nest_end(nlh, elem);
+}
+
+// i.e. nft add rule ip NAT_TABLE NAT_CHAIN ip saddr network ip daddr != network masquerade
+// One rule covers every container on the network, wherever the traffic leaves.
+static int nft_masquerade_rule(struct nl_session *session, uint32_t network, uint32_t mask)
+{
+    struct nlmsghdr *nlh = nft_put(session, (NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_NEWRULE,
+                                   NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_APPEND, NFPROTO_IPV4, 0);
+    if (nlh == NULL)
+    {
+        return -1;
+    }
+
+    mnl_attr_put_strz(nlh, NFTA_RULE_TABLE, NAT_TABLE);
+    mnl_attr_put_strz(nlh, NFTA_RULE_CHAIN, NAT_CHAIN);
+
+    struct nlattr *exprs = mnl_attr_nest_start(nlh, NFTA_RULE_EXPRESSIONS);
+    nft_put_match_network(nlh, IP_SADDR_OFFSET, network, mask, NFT_CMP_EQ);
+    nft_put_match_network(nlh, IP_DADDR_OFFSET, network, mask, NFT_CMP_NEQ);
+
+    struct nlattr *elem = mnl_attr_nest_start(nlh, NFTA_LIST_ELEM);
+    mnl_attr_put_strz(nlh, NFTA_EXPR_NAME, "masq");
+    mnl_attr_nest_end(nlh, elem);
+    mnl_attr_nest_end(nlh, exprs);
+
+    nl_session_end(session, nlh);
+    return 0;
+}
+
+// Parses "a.b.c.d/len" into a network address and mask (network byte order)
+static int parse_network(const char *cidr, uint32_t *network, uint32_t *mask)
+{
+    char addr[INET_ADDRSTRLEN];
+    struct in_addr in_addr;
+    int prefix_len;
+
+    if (sscanf(cidr, "%15[0-9.]/%d", addr, &prefix_len) != 2 ||
+        prefix_len < 0 || prefix_len > 32 ||
+        inet_pton(AF_INET, addr, &in_addr) != 1)
+    {
+        LOG("[NFT] Invalid network: %s\n", cidr);
+        return -1;
+    }
+
+    *mask = prefix_len == 0 ? 0 : htonl(~0U << (32 - prefix_len));
+    *network = in_addr.s_addr & *mask;
+    return 0;
+}
+
+// Opens and locks the shared NAT refcount, so concurrent mocker processes agree
+// on who installs and who removes the rule. Returns the locked fd and the
+// current count in `old`.
+static int lock_refcount(int *old)
+{
+    char buf[32] = {0};
+
+    if (mkdir_p(MOCKER_RUN_DIR, 0755) != 0)
+    {
+        LOG("[NFT] Failed to create %s: %s\n", MOCKER_RUN_DIR, strerror(errno));
+        return -1;
+    }
+
+    int fd = open(NAT_REFCOUNT, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        LOG("[NFT] Failed to open %s: %s\n", NAT_REFCOUNT, strerror(errno));
+        return -1;
+    }
+
+    if (flock(fd, LOCK_EX) == -1)
+    {
+        LOG("[NFT] Failed to lock %s: %s\n", NAT_REFCOUNT, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    *old = 0;
+    if (pread(fd, buf, sizeof(buf) - 1, 0) > 0)
+    {
+        *old = atoi(buf);
+    }
+
+    return fd;
+}
+
+// Writes the new count and drops the lock
+static void unlock_refcount(int fd, int count)
+{
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%d\n", count < 0 ? 0 : count);
+
+    if (ftruncate(fd, 0) == -1 || pwrite(fd, buf, len, 0) != len)
+    {
+        LOG("[NFT] Failed to update %s: %s\n", NAT_REFCOUNT, strerror(errno));
+    }
+
+    close(fd);
+}
+
+// Takes a reference on the masquerade rule for `container_network`, installing
+// it if we're the first container to need it.
+int setup_nat_rules(const char *container_network)
+{
+    struct nl_session session;
+    uint32_t network;
+    uint32_t mask;
+    int count;
+
+    if (parse_network(container_network, &network, &mask) != 0)
+    {
+        return -1;
+    }
+
+    int fd = lock_refcount(&count);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    if (count > 0)
+    {
+        LOG("[NFT] Masquerade rule already installed (%d users)\n", count);
+        unlock_refcount(fd, count + 1);
+        return 0;
+    }
+
+    if (nl_session_open(&session, NETLINK_NETFILTER) != EXIT_SUCCESS)
+    {
+        LOG("[NFT] Failed to open netfilter socket\n");
+        close(fd);
+        return -1;
+    }
+
+    // Adding and then deleting the table flushes whatever a previous run may
+    // have left behind, in the same transaction that installs the fresh rule
+    if (nft_batch_begin(&session) != 0 ||
+        nft_table(&session, NFT_MSG_NEWTABLE, NLM_F_CREATE) != 0 ||
+        nft_table(&session, NFT_MSG_DELTABLE, 0) != 0 ||
+        nft_table(&session, NFT_MSG_NEWTABLE, NLM_F_CREATE) != 0 ||
+        nft_nat_chain(&session) != 0 ||
+        nft_masquerade_rule(&session, network, mask) != 0 ||
+        nft_batch_end(&session) != 0 ||
+        nl_session_commit(&session) != EXIT_SUCCESS)
+    {
+        LOG("[NFT] Failed to install masquerade rule: %s\n", strerror(errno));
+        nl_session_close(&session);
+        close(fd);
+        return -1;
+    }
+
+    nl_session_close(&session);
+    unlock_refcount(fd, 1);
+
+    LOG("[NFT] Masquerade rule installed for %s\n", container_network);
+    return 0;
+}
+
+// Drops a reference on the masquerade rule, removing it with the last user
+int cleanup_nat_rules(const char *container_network)
+{
+    struct nl_session session;
+    int count;
+
+    int fd = lock_refcount(&count);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    if (count > 1)
+    {
+        unlock_refcount(fd, count - 1);
+        return 0;
+    }
+
+    if (nl_session_open(&session, NETLINK_NETFILTER) != EXIT_SUCCESS)
+    {
+        LOG("[NFT] Failed to open netfilter socket\n");
+        close(fd);
+        return -1;
+    }
+
+    // i.e. nft delete table ip NAT_TABLE
+    if (nft_batch_begin(&session) != 0 ||
+        nft_table(&session, NFT_MSG_DELTABLE, 0) != 0 ||
+        nft_batch_end(&session) != 0 ||
+        (nl_session_commit(&session) != EXIT_SUCCESS && errno != ENOENT))
+    {
+        LOG("[NFT] Failed to remove masquerade rule for %s: %s\n", container_network, strerror(errno));
+    }
+
+    nl_session_close(&session);
+    unlock_refcount(fd, 0);
+    return 0;
+}
+
+// Queues a request to drop every connection tracking entry in the namespace
+// the session lives in. A delete without a tuple flushes the whole table.
+// i.e. conntrack -F
+int flush_conntrack(struct nl_session *session)
+{
+    struct nlmsghdr *nlh = nft_put(session, (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_DELETE,
+                                   NLM_F_REQUEST | NLM_F_ACK, AF_INET, 0);
+    if (nlh == NULL)
+    {
+        return -1;
+    }
+
+    nl_session_end(session, nlh);
+    return 0;
+}
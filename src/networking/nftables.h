@@ -0,0 +1,10 @@
+#ifndef _NFTABLES_H_
+#define _NFTABLES_H_
+
+int setup_nat_rules(const char *container_network);
+int cleanup_nat_rules(const char *container_network);
+
+struct nl_session;
+int flush_conntrack(struct nl_session *session);
+
+#endif
@@ -0,0 +1,589 @@
+#include "placement.h"
+#include "container.h"
+#include "logging.h"
+#include "util.h"
+
+#include <sys/file.h>
+#include <sys/mman.h>
+
+// Which CPUs the containers placed on this host hold, shared by every mocker
+// process the way the address pool is (see ipam.c): a small file that we mmap
+// and only modify while holding flock() on it. The CPU topology is read from
+// sysfs once, when the file is created.
+#define PLACEMENT_FILE MOCKER_RUN_DIR "/placement"
+#define PLACEMENT_MAGIC 0x6d6b706c // "mkpl"
+
+// Most containers placed at once
+#define PLACEMENT_MAX_CONTAINERS 4096
+
+// Longest cgroup path of a placed container, i.e.
+// /sys/fs/cgroup/mocker.slice/<tenant>/mocker-<id>
+#define PLACEMENT_CGROUP_MAX 128
+
+#define BITS_PER_WORD 64
+#define CPU_WORDS (PLACEMENT_MAX_CPUS / BITS_PER_WORD)
+
+// Where a CPU sits. CPUs with the same `core` are SMT siblings, and those
+// with the same `cache` share an L3.
+struct cpu_topology
+{
+    uint16_t online;
+    uint16_t node;  // NUMA node
+    uint16_t core;  // first CPU of its SMT siblings
+    uint16_t cache; // first CPU sharing its L3, or PLACEMENT_MAX_CPUS + node without one
+};
+
+// A placed container, which holds its CPUs for as long as its cgroup exists
+struct placement_entry
+{
+    char cgroup[PLACEMENT_CGROUP_MAX]; // "" if the entry is free
+    uint64_t cpus[CPU_WORDS];
+};
+
+struct placement_state
+{
+    uint32_t magic;
+    uint32_t cpu_count;   // highest online CPU + 1
+    uint64_t node_memory; // NUMA nodes with memory, i.e. what cpuset.mems takes
+    struct cpu_topology cpu[PLACEMENT_MAX_CPUS];
+    struct placement_entry entries[PLACEMENT_MAX_CONTAINERS];
+};
+
+static int mask_test(const uint64_t *mask, uint32_t bit)
+{
+    return (mask[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1;
+}
+
+static void mask_set(uint64_t *mask, uint32_t bit)
+{
+    mask[bit / BITS_PER_WORD] |= 1ULL << (bit % BITS_PER_WORD);
+}
+
+// Parses a CPU or node list, i.e. "0-3,8\n", into a mask of `bits` bits.
+// Anything past those is left out.
+static void parse_list(const char *list, uint64_t *mask, uint32_t bits)
+{
+    const char *p = list;
+
+    memset(mask, 0, bits / BITS_PER_WORD * sizeof(*mask));
+    while (*p >= '0' && *p <= '9')
+    {
+        char *end;
+        unsigned long first = strtoul(p, &end, 10);
+        unsigned long last = first;
+        if (*end == '-')
+        {
+            last = strtoul(end + 1, &end, 10);
+        }
+
+        for (unsigned long bit = first; bit <= last && bit < bits; bit++)
+        {
+            mask_set(mask, bit);
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+}
+
+// The opposite of `parse_list()`, i.e. "0-3,8". Fails if it doesn't fit.
+static int format_list(const uint64_t *mask, uint32_t bits, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    buf[0] = '\0';
+    for (uint32_t first = 0; first < bits; first++)
+    {
+        if (!mask_test(mask, first))
+        {
+            continue;
+        }
+
+        uint32_t last = first;
+        while (last + 1 < bits && mask_test(mask, last + 1))
+        {
+            last++;
+        }
+
+        int n = last > first ? snprintf(buf + len, size - len, "%s%u-%u", len > 0 ? "," : "", first, last)
+                             : snprintf(buf + len, size - len, "%s%u", len > 0 ? "," : "", first);
+        if (n < 0 || (size_t)n >= size - len)
+        {
+            return -1;
+        }
+        len += n;
+        first = last;
+    }
+
+    return 0;
+}
+
+static int read_file(const char *path, char *buf, size_t size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    ssize_t len = read(fd, buf, size - 1);
+    close(fd);
+    if (len <= 0)
+    {
+        return -1;
+    }
+
+    buf[len] = '\0';
+    return 0;
+}
+
+// The first CPU in the list at `path`, or -1
+static int first_cpu(const char *path)
+{
+    char buf[64];
+
+    if (read_file(path, buf, sizeof(buf)) != 0 || buf[0] < '0' || buf[0] > '9')
+    {
+        return -1;
+    }
+
+    int cpu = atoi(buf);
+    return cpu < PLACEMENT_MAX_CPUS ? cpu : -1;
+}
+
+// Reads the node, SMT core and L3 of every online CPU from
+// /sys/devices/system/cpu
+static void read_topology(struct placement_state *state)
+{
+    char buf[4096];
+    char path[PATH_MAX];
+    uint64_t online[CPU_WORDS];
+    uint64_t memory[PLACEMENT_MAX_NODES / BITS_PER_WORD];
+
+    // without NUMA, all CPUs and all memory are node 0's
+    if (read_file("/sys/devices/system/cpu/online", buf, sizeof(buf)) != 0)
+    {
+        snprintf(buf, sizeof(buf), "0");
+    }
+    parse_list(buf, online, PLACEMENT_MAX_CPUS);
+
+    if (read_file("/sys/devices/system/node/has_memory", buf, sizeof(buf)) != 0)
+    {
+        snprintf(buf, sizeof(buf), "0");
+    }
+    parse_list(buf, memory, PLACEMENT_MAX_NODES);
+    state->node_memory = memory[0];
+
+    for (uint32_t cpu = 0; cpu < PLACEMENT_MAX_CPUS; cpu++)
+    {
+        struct cpu_topology *topology = &state->cpu[cpu];
+        if (!mask_test(online, cpu))
+        {
+            continue;
+        }
+
+        topology->online = 1;
+        topology->core = cpu;
+        state->cpu_count = cpu + 1;
+
+        // i.e. /sys/devices/system/cpu/cpu3/node0
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+        DIR *dir = opendir(path);
+        struct dirent *entry;
+        unsigned int node;
+        while (dir != NULL && (entry = readdir(dir)) != NULL)
+        {
+            if (sscanf(entry->d_name, "node%u", &node) == 1 && node < PLACEMENT_MAX_NODES)
+            {
+                topology->node = node;
+            }
+        }
+        if (dir != NULL)
+        {
+            closedir(dir);
+        }
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", cpu);
+        int first = first_cpu(path);
+        if (first != -1)
+        {
+            topology->core = first;
+        }
+
+        // The L3 is index3 on x86, but the numbering is up to the CPU
+        topology->cache = PLACEMENT_MAX_CPUS + topology->node;
+        for (int index = 0;; index++)
+        {
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%d/level", cpu, index);
+            if (read_file(path, buf, sizeof(buf)) != 0)
+            {
+                break;
+            }
+
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%d/shared_cpu_list", cpu, index);
+            if (atoi(buf) == 3 && (first = first_cpu(path)) != -1)
+            {
+                topology->cache = first;
+                break;
+            }
+        }
+    }
+}
+
+// Maps and locks the state file, reading the topology if it's new
+static struct placement_state *placement_open(int *lock_fd)
+{
+    if (mkdir_p(MOCKER_RUN_DIR, 0755) != 0)
+    {
+        LOG("[PLACEMENT] Failed to create %s: %s\n", MOCKER_RUN_DIR, strerror(errno));
+        return NULL;
+    }
+
+    int fd = open(PLACEMENT_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        LOG("[PLACEMENT] Failed to open %s: %s\n", PLACEMENT_FILE, strerror(errno));
+        return NULL;
+    }
+
+    if (flock(fd, LOCK_EX) == -1 || ftruncate(fd, sizeof(struct placement_state)) == -1)
+    {
+        LOG("[PLACEMENT] Failed to lock %s: %s\n", PLACEMENT_FILE, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    struct placement_state *state = mmap(NULL, sizeof(*state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (state == MAP_FAILED)
+    {
+        LOG("[PLACEMENT] Failed to map %s: %s\n", PLACEMENT_FILE, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    if (state->magic != PLACEMENT_MAGIC)
+    {
+        LOG("[PLACEMENT] Reading CPU topology\n");
+        memset(state, 0, sizeof(*state));
+        state->magic = PLACEMENT_MAGIC;
+        read_topology(state);
+    }
+
+    *lock_fd = fd;
+    return state;
+}
+
+static void placement_close(struct placement_state *state, int lock_fd)
+{
+    munmap(state, sizeof(*state));
+    // closing the fd drops the lock
+    close(lock_fd);
+}
+
+// Counts the containers on each CPU. Entries of containers that were torn
+// down without releasing them (e.g. a crashed mocker) are freed, as their
+// cgroup is gone.
+static void cpu_loads(struct placement_state *state, uint32_t *load)
+{
+    memset(load, 0, PLACEMENT_MAX_CPUS * sizeof(*load));
+
+    for (uint32_t i = 0; i < PLACEMENT_MAX_CONTAINERS; i++)
+    {
+        struct placement_entry *entry = &state->entries[i];
+        if (entry->cgroup[0] == '\0')
+        {
+            continue;
+        }
+
+        if (access(entry->cgroup, F_OK) != 0)
+        {
+            LOG("[PLACEMENT] Reclaiming the CPUs of %s\n", entry->cgroup);
+            memset(entry, 0, sizeof(*entry));
+            continue;
+        }
+
+        for (uint32_t cpu = 0; cpu < state->cpu_count; cpu++)
+        {
+            load[cpu] += mask_test(entry->cpus, cpu);
+        }
+    }
+}
+
+// Whether all of the SMT siblings of `core` are in `domain`
+static int whole_core(const struct placement_state *state, const uint64_t *domain, uint32_t core)
+{
+    for (uint32_t cpu = core; cpu < state->cpu_count; cpu++)
+    {
+        if (state->cpu[cpu].online && state->cpu[cpu].core == core && !mask_test(domain, cpu))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Picks `count` CPUs out of `domain`, the least loaded first, and spreads
+// them over SMT cores before putting two on the same one. With `exclusive`,
+// it picks `count` whole cores instead and takes all of their threads, so no
+// other container's load ends up on a sibling. Returns how loaded what it
+// picked already is, or UINT64_MAX if the domain is too small.
+static uint64_t pick(const struct placement_state *state, const uint64_t *domain, const uint32_t *load,
+                     uint64_t count, int exclusive, uint64_t *picked)
+{
+    uint32_t core_load[PLACEMENT_MAX_CPUS] = {0};
+    uint64_t cost = 0;
+
+    memset(picked, 0, CPU_WORDS * sizeof(*picked));
+    for (uint32_t cpu = 0; cpu < state->cpu_count; cpu++)
+    {
+        if (state->cpu[cpu].online)
+        {
+            core_load[state->cpu[cpu].core] += load[cpu];
+        }
+    }
+
+    for (uint64_t n = 0; n < count; n++)
+    {
+        int64_t best = -1;
+        uint64_t best_key = 0;
+
+        for (uint32_t cpu = 0; cpu < state->cpu_count; cpu++)
+        {
+            if (!state->cpu[cpu].online || !mask_test(domain, cpu) || mask_test(picked, cpu))
+            {
+                continue;
+            }
+            if (exclusive && (state->cpu[cpu].core != cpu || !whole_core(state, domain, cpu)))
+            {
+                continue;
+            }
+
+            // sharing a thread costs more than sharing its core
+            uint64_t key = exclusive ? core_load[cpu]
+                                     : ((uint64_t)load[cpu] << 32) + core_load[state->cpu[cpu].core];
+            if (best == -1 || key < best_key)
+            {
+                best = cpu;
+                best_key = key;
+            }
+        }
+
+        if (best == -1)
+        {
+            return UINT64_MAX;
+        }
+
+        for (uint32_t cpu = best; cpu < state->cpu_count; cpu++)
+        {
+            if (cpu == best || (exclusive && state->cpu[cpu].online && state->cpu[cpu].core == best))
+            {
+                mask_set(picked, cpu);
+            }
+        }
+        core_load[state->cpu[best].core]++;
+        cost += best_key;
+    }
+
+    return cost;
+}
+
+// The CPUs of `allowed` on NUMA node `node`, and of those, the ones sharing
+// the L3 `cache` unless that's -1
+static void node_domain(const struct placement_state *state, const uint64_t *allowed, uint64_t *domain,
+                        uint32_t node, int64_t cache)
+{
+    memset(domain, 0, CPU_WORDS * sizeof(*domain));
+    for (uint32_t cpu = 0; cpu < state->cpu_count; cpu++)
+    {
+        const struct cpu_topology *topology = &state->cpu[cpu];
+        if (topology->online && mask_test(allowed, cpu) && topology->node == node &&
+            (cache == -1 || topology->cache == cache))
+        {
+            mask_set(domain, cpu);
+        }
+    }
+}
+
+// Picks CPUs for the container out of `cpus_allowed` ("" for all online
+// CPUs), and records them until `placement_release()`: `count` of them, or
+// `count` whole cores with `exclusive`. They come from the NUMA node with the
+// least load per CPU that has room, and out of a single L3 of it if one has
+// room, so the container's threads share a cache and its memory is local.
+// Fills in its cpuset.cpus and cpuset.mems, the latter "" if the node has no
+// memory of its own.
+int placement_assign(struct container_s *container, const char *cpus_allowed, const char *mems_allowed,
+                     uint64_t count, int exclusive, char *cpus, char *mems, size_t size)
+{
+    uint32_t load[PLACEMENT_MAX_CPUS];
+    uint64_t allowed[CPU_WORDS];
+    uint64_t domain[CPU_WORDS];
+    uint64_t picked[CPU_WORDS];
+    uint64_t best[CPU_WORDS];
+    uint64_t nodes[PLACEMENT_MAX_NODES / BITS_PER_WORD];
+    int lock_fd;
+
+    if (strlen(container->cgroup) >= PLACEMENT_CGROUP_MAX)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    struct placement_state *state = placement_open(&lock_fd);
+    if (state == NULL)
+    {
+        return -1;
+    }
+
+    cpu_loads(state, load);
+    parse_list(cpus_allowed, allowed, PLACEMENT_MAX_CPUS);
+    for (uint32_t cpu = 0; cpu < state->cpu_count; cpu++)
+    {
+        if (cpus_allowed[0] == '\0' && state->cpu[cpu].online)
+        {
+            mask_set(allowed, cpu);
+        }
+    }
+
+    // The node with the least load per CPU that fits the container
+    int64_t node = -1;
+    uint64_t node_load = 0;
+    uint64_t node_cpus = 1;
+    for (uint32_t id = 0; id < PLACEMENT_MAX_NODES; id++)
+    {
+        uint64_t cpus_load = 0;
+        uint64_t cpus_count = 0;
+
+        node_domain(state, allowed, domain, id, -1);
+        for (uint32_t cpu = 0; cpu < state->cpu_count; cpu++)
+        {
+            if (mask_test(domain, cpu))
+            {
+                cpus_load += load[cpu];
+                cpus_count++;
+            }
+        }
+
+        if (cpus_count > 0 && pick(state, domain, load, count, exclusive, picked) != UINT64_MAX &&
+            (node == -1 || cpus_load * node_cpus < node_load * cpus_count))
+        {
+            node = id;
+            node_load = cpus_load;
+            node_cpus = cpus_count;
+        }
+    }
+
+    // The L3 of that node with the least load on what we'd pick, or the
+    // whole node, or when no node fits, any CPUs
+    uint64_t best_cost = UINT64_MAX;
+    uint64_t seen[(PLACEMENT_MAX_CPUS + PLACEMENT_MAX_NODES) / BITS_PER_WORD] = {0};
+    for (uint32_t cpu = 0; node != -1 && cpu < state->cpu_count; cpu++)
+    {
+        uint32_t cache = state->cpu[cpu].cache;
+        if (!state->cpu[cpu].online || state->cpu[cpu].node != node || !mask_test(allowed, cpu) ||
+            mask_test(seen, cache))
+        {
+            continue;
+        }
+        mask_set(seen, cache);
+
+        node_domain(state, allowed, domain, node, cache);
+        uint64_t cost = pick(state, domain, load, count, exclusive, picked);
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            memcpy(best, picked, sizeof(best));
+        }
+    }
+
+    if (best_cost == UINT64_MAX)
+    {
+        if (node != -1)
+        {
+            node_domain(state, allowed, domain, node, -1);
+        }
+        else
+        {
+            memcpy(domain, allowed, sizeof(domain));
+        }
+        best_cost = pick(state, domain, load, count, exclusive, best);
+    }
+
+    struct placement_entry *entry = NULL;
+    for (uint32_t i = 0; i < PLACEMENT_MAX_CONTAINERS && entry == NULL; i++)
+    {
+        if (state->entries[i].cgroup[0] == '\0')
+        {
+            entry = &state->entries[i];
+        }
+    }
+
+    if (best_cost == UINT64_MAX || entry == NULL)
+    {
+        fprintf(stderr, "Not enough CPUs to place the container on %llu %s\n", (unsigned long long)count,
+                exclusive ? "whole cores" : "CPUs");
+        placement_close(state, lock_fd);
+        errno = ENOSPC;
+        return -1;
+    }
+
+    // The memory nodes of the picked CPUs, those the parent allows
+    uint64_t mems_mask[PLACEMENT_MAX_NODES / BITS_PER_WORD];
+    parse_list(mems_allowed, mems_mask, PLACEMENT_MAX_NODES);
+    memset(nodes, 0, sizeof(nodes));
+    for (uint32_t cpu = 0; cpu < state->cpu_count; cpu++)
+    {
+        if (mask_test(best, cpu))
+        {
+            mask_set(nodes, state->cpu[cpu].node);
+        }
+    }
+    nodes[0] &= state->node_memory & (mems_allowed[0] != '\0' ? mems_mask[0] : UINT64_MAX);
+
+    if (format_list(best, PLACEMENT_MAX_CPUS, cpus, size) != 0 ||
+        format_list(nodes, PLACEMENT_MAX_NODES, mems, size) != 0)
+    {
+        placement_close(state, lock_fd);
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    // checked to fit above
+    memcpy(entry->cgroup, container->cgroup, strlen(container->cgroup) + 1);
+    memcpy(entry->cpus, best, sizeof(entry->cpus));
+    container->placed = 1;
+    placement_close(state, lock_fd);
+
+    LOG("[PLACEMENT] Placed %s on CPUs %s, memory nodes %s\n", container->id, cpus, mems);
+    return 0;
+}
+
+// Gives the container's CPUs back. This may run in a different process than
+// `placement_assign()` did (see `container_wait_async()`), so the entry is
+// found by the container's cgroup.
+int placement_release(struct container_s *container)
+{
+    int lock_fd;
+
+    if (!container->placed)
+    {
+        return 0;
+    }
+
+    struct placement_state *state = placement_open(&lock_fd);
+    if (state == NULL)
+    {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < PLACEMENT_MAX_CONTAINERS; i++)
+    {
+        if (strcmp(state->entries[i].cgroup, container->cgroup) == 0)
+        {
+            memset(&state->entries[i], 0, sizeof(state->entries[i]));
+            break;
+        }
+    }
+
+    placement_close(state, lock_fd);
+    container->placed = 0;
+    return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef _PLACEMENT_H_
+#define _PLACEMENT_H_
+
+#include "common.h"
+
+// Most CPUs and NUMA nodes placement knows about
+#define PLACEMENT_MAX_CPUS 1024
+#define PLACEMENT_MAX_NODES 64
+
+struct container_s;
+
+int placement_assign(struct container_s *container, const char *cpus_allowed, const char *mems_allowed,
+                     uint64_t count, int exclusive, char *cpus, char *mems, size_t size);
+int placement_release(struct container_s *container);
+
+#endif
@@ -0,0 +1,564 @@
+#define _GNU_SOURCE // for strchrnul
+#include "stats.h"
+#include "daemon.h"
+#include "ipc.h"
+#include "logging.h"
+
+#include <poll.h>
+#include <sys/signalfd.h>
+
+// Big enough for memory.stat, and io.stat with a line per device
+#define STATS_BUF_SIZE 8192
+
+static const char *const stats_file_names[STATS_FILE_COUNT] = {
+    [STATS_MEMORY_CURRENT] = "memory.current",
+    [STATS_MEMORY_STAT] = "memory.stat",
+    [STATS_CPU_STAT] = "cpu.stat",
+    [STATS_IO_STAT] = "io.stat",
+    [STATS_PIDS_CURRENT] = "pids.current",
+    [STATS_CPU_PRESSURE] = "cpu.pressure",
+    [STATS_MEMORY_PRESSURE] = "memory.pressure",
+    [STATS_IO_PRESSURE] = "io.pressure",
+};
+
+// Opens the stats files of the cgroup. Those of controllers that aren't
+// enabled are left out, and read as STATS_NONE.
+void stats_open(struct stats_files *files, int cgroup_fd)
+{
+    for (int i = 0; i < STATS_FILE_COUNT; i++)
+    {
+        files->fds[i] = cgroup_fd == -1 ? -1 : openat(cgroup_fd, stats_file_names[i], O_RDONLY | O_CLOEXEC);
+        if (files->fds[i] == -1)
+        {
+            LOG("[STATS] No %s: %s\n", stats_file_names[i], strerror(errno));
+        }
+    }
+}
+
+void stats_close(struct stats_files *files)
+{
+    for (int i = 0; i < STATS_FILE_COUNT; i++)
+    {
+        if (files->fds[i] != -1)
+        {
+            close(files->fds[i]);
+            files->fds[i] = -1;
+        }
+    }
+}
+
+// Reads the file from the start, which has the kernel format it afresh
+static int read_file(int fd, char *buf, size_t size)
+{
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    ssize_t len = pread(fd, buf, size - 1, 0);
+    if (len <= 0)
+    {
+        return -1;
+    }
+
+    buf[len] = '\0';
+    return 0;
+}
+
+// The value of the "key value" line `key`, i.e. "anon 1234" in memory.stat
+static uint64_t line_value(const char *buf, const char *key)
+{
+    size_t len = strlen(key);
+
+    for (const char *line = buf; *line != '\0'; line++)
+    {
+        if (strncmp(line, key, len) == 0 && line[len] == ' ')
+        {
+            return strtoull(line + len + 1, NULL, 10);
+        }
+
+        line = strchrnul(line, '\n');
+        if (*line == '\0')
+        {
+            break;
+        }
+    }
+
+    return STATS_NONE;
+}
+
+// The sum of every "key=value" in the file, i.e. "rbytes=" over all of
+// io.stat's devices
+static uint64_t sum_values(const char *buf, const char *key)
+{
+    size_t len = strlen(key);
+    uint64_t sum = 0;
+
+    for (const char *p = strstr(buf, key); p != NULL; p = strstr(p + len, key))
+    {
+        if (p[len] == '=' && (p == buf || p[-1] == ' '))
+        {
+            sum += strtoull(p + len + 1, NULL, 10);
+        }
+    }
+
+    return sum;
+}
+
+// The total of a pressure file's "some" or "full" line, i.e.
+// some avg10=0.00 avg60=0.00 avg300=0.00 total=1234
+static uint64_t pressure_total(const char *buf, const char *kind)
+{
+    const char *line = strstr(buf, kind);
+    if (line == NULL)
+    {
+        return STATS_NONE;
+    }
+
+    const char *total = strstr(line, "total=");
+    const char *end = strchrnul(line, '\n');
+    return total != NULL && total < end ? strtoull(total + 6, NULL, 10) : STATS_NONE;
+}
+
+// Takes a sample of the cgroup, with one pread() per file
+void stats_sample(const struct stats_files *files, const char *id, struct stats_sample *sample)
+{
+    char buf[STATS_BUF_SIZE];
+    struct timespec now;
+
+    memset(sample, 0, sizeof(*sample));
+    snprintf(sample->id, sizeof(sample->id), "%s", id);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sample->time_usec = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+
+    int ok = read_file(files->fds[STATS_MEMORY_CURRENT], buf, sizeof(buf)) == 0;
+    sample->memory_current = ok ? strtoull(buf, NULL, 10) : STATS_NONE;
+
+    ok = read_file(files->fds[STATS_MEMORY_STAT], buf, sizeof(buf)) == 0;
+    sample->memory_anon = ok ? line_value(buf, "anon") : STATS_NONE;
+    sample->memory_file = ok ? line_value(buf, "file") : STATS_NONE;
+
+    // usage, user and system are there even without the cpu controller
+    ok = read_file(files->fds[STATS_CPU_STAT], buf, sizeof(buf)) == 0;
+    sample->cpu_usage_usec = ok ? line_value(buf, "usage_usec") : STATS_NONE;
+    sample->cpu_user_usec = ok ? line_value(buf, "user_usec") : STATS_NONE;
+    sample->cpu_system_usec = ok ? line_value(buf, "system_usec") : STATS_NONE;
+    sample->cpu_throttled_usec = ok ? line_value(buf, "throttled_usec") : STATS_NONE;
+
+    // empty until the container does I/O
+    ok = files->fds[STATS_IO_STAT] != -1;
+    if (ok && read_file(files->fds[STATS_IO_STAT], buf, sizeof(buf)) != 0)
+    {
+        buf[0] = '\0';
+    }
+    sample->io_rbytes = ok ? sum_values(buf, "rbytes") : STATS_NONE;
+    sample->io_wbytes = ok ? sum_values(buf, "wbytes") : STATS_NONE;
+    sample->io_rios = ok ? sum_values(buf, "rios") : STATS_NONE;
+    sample->io_wios = ok ? sum_values(buf, "wios") : STATS_NONE;
+
+    ok = read_file(files->fds[STATS_PIDS_CURRENT], buf, sizeof(buf)) == 0;
+    sample->pids_current = ok ? strtoull(buf, NULL, 10) : STATS_NONE;
+
+    ok = read_file(files->fds[STATS_CPU_PRESSURE], buf, sizeof(buf)) == 0;
+    sample->cpu_some_usec = ok ? pressure_total(buf, "some") : STATS_NONE;
+
+    ok = read_file(files->fds[STATS_MEMORY_PRESSURE], buf, sizeof(buf)) == 0;
+    sample->memory_some_usec = ok ? pressure_total(buf, "some") : STATS_NONE;
+    sample->memory_full_usec = ok ? pressure_total(buf, "full") : STATS_NONE;
+
+    ok = read_file(files->fds[STATS_IO_PRESSURE], buf, sizeof(buf)) == 0;
+    sample->io_some_usec = ok ? pressure_total(buf, "some") : STATS_NONE;
+}
+
+// i.e. 1.5G
+static void format_bytes(uint64_t bytes, char *buf, size_t size)
+{
+    const char *units = "BKMGT";
+    double value = bytes;
+    int unit = 0;
+
+    if (bytes == STATS_NONE)
+    {
+        snprintf(buf, size, "-");
+        return;
+    }
+
+    while (value >= 1024 && units[unit + 1] != '\0')
+    {
+        value /= 1024;
+        unit++;
+    }
+
+    snprintf(buf, size, unit == 0 ? "%.0f%c" : "%.1f%c", value, units[unit]);
+}
+
+static void format_count(uint64_t value, char *buf, size_t size)
+{
+    if (value == STATS_NONE)
+    {
+        snprintf(buf, size, "-");
+    }
+    else
+    {
+        snprintf(buf, size, "%llu", (unsigned long long)value);
+    }
+}
+
+// How much a counter went up per second between two samples, or -1 if we
+// can't tell
+static double rate(uint64_t prev, uint64_t cur, uint64_t elapsed_usec)
+{
+    if (prev == STATS_NONE || cur == STATS_NONE || cur < prev || elapsed_usec == 0)
+    {
+        return -1;
+    }
+
+    return (cur - prev) * 1000000.0 / elapsed_usec;
+}
+
+static void format_rate(double value, const char *suffix, char *buf, size_t size)
+{
+    if (value < 0)
+    {
+        snprintf(buf, size, "-");
+    }
+    else if (suffix == NULL)
+    {
+        // per second in bytes
+        format_bytes((uint64_t)value, buf, size);
+    }
+    else
+    {
+        snprintf(buf, size, "%.1f%s", value, suffix);
+    }
+}
+
+static void print_json_value(const char *name, uint64_t value, const char *sep)
+{
+    if (value == STATS_NONE)
+    {
+        printf("\"%s\":null%s", name, sep);
+    }
+    else
+    {
+        printf("\"%s\":%llu%s", name, (unsigned long long)value, sep);
+    }
+}
+
+// Prints the sample as one line of JSON, with its init's exit status and
+// rusage if the container has exited
+static void print_json(const struct stats_sample *s)
+{
+    printf("{\"id\":\"%s\",\"time_usec\":%llu,", s->id, (unsigned long long)s->time_usec);
+    if (s->exited)
+    {
+        const struct rusage *ru = &s->rusage;
+
+        // -1 if the daemon couldn't wait for it
+        if (s->status == -1)
+        {
+            printf("\"exit_code\":null,");
+        }
+        else if (WIFEXITED(s->status))
+        {
+            printf("\"exit_code\":%d,", WEXITSTATUS(s->status));
+        }
+        else if (WIFSIGNALED(s->status))
+        {
+            printf("\"signal\":%d,", WTERMSIG(s->status));
+        }
+
+        printf("\"rusage\":{");
+        print_json_value("utime_usec", ru->ru_utime.tv_sec * 1000000ULL + ru->ru_utime.tv_usec, ",");
+        print_json_value("stime_usec", ru->ru_stime.tv_sec * 1000000ULL + ru->ru_stime.tv_usec, ",");
+        print_json_value("maxrss_kb", ru->ru_maxrss, ",");
+        print_json_value("minflt", ru->ru_minflt, ",");
+        print_json_value("majflt", ru->ru_majflt, ",");
+        print_json_value("nvcsw", ru->ru_nvcsw, ",");
+        print_json_value("nivcsw", ru->ru_nivcsw, "},");
+    }
+
+    printf("\"cgroup\":{");
+    print_json_value("memory_current", s->memory_current, ",");
+    print_json_value("memory_anon", s->memory_anon, ",");
+    print_json_value("memory_file", s->memory_file, ",");
+    print_json_value("cpu_usage_usec", s->cpu_usage_usec, ",");
+    print_json_value("cpu_user_usec", s->cpu_user_usec, ",");
+    print_json_value("cpu_system_usec", s->cpu_system_usec, ",");
+    print_json_value("cpu_throttled_usec", s->cpu_throttled_usec, ",");
+    print_json_value("io_rbytes", s->io_rbytes, ",");
+    print_json_value("io_wbytes", s->io_wbytes, ",");
+    print_json_value("io_rios", s->io_rios, ",");
+    print_json_value("io_wios", s->io_wios, ",");
+    print_json_value("pids_current", s->pids_current, ",");
+    print_json_value("cpu_some_usec", s->cpu_some_usec, ",");
+    print_json_value("memory_some_usec", s->memory_some_usec, ",");
+    print_json_value("memory_full_usec", s->memory_full_usec, ",");
+    print_json_value("io_some_usec", s->io_some_usec, "}}\n");
+}
+
+// i.e. mocker stats [id], the totals so far
+static void print_totals(const struct stats_sample *samples, size_t n)
+{
+    printf("%-12s  %-8s  %-10s  %-8s  %-8s  %s\n", "ID", "MEMORY", "CPU", "READ", "WRITTEN", "PIDS");
+    for (size_t i = 0; i < n; i++)
+    {
+        const struct stats_sample *s = &samples[i];
+        char memory[16], cpu[24], read_bytes[16], written[16], pids[24];
+
+        format_bytes(s->memory_current, memory, sizeof(memory));
+        format_bytes(s->io_rbytes, read_bytes, sizeof(read_bytes));
+        format_bytes(s->io_wbytes, written, sizeof(written));
+        format_rate(s->cpu_usage_usec == STATS_NONE ? -1 : s->cpu_usage_usec / 1000000.0, "s", cpu, sizeof(cpu));
+        format_count(s->pids_current, pids, sizeof(pids));
+        printf("%-12s  %-8s  %-10s  %-8s  %-8s  %s\n", s->id, memory, cpu, read_bytes, written, pids);
+    }
+}
+
+// One line of `mocker stats --interval`: what the container used since its
+// last sample, with the share of the time its tasks stalled on CPU, memory
+// and I/O (PSI)
+static void print_delta(const struct stats_sample *prev, const struct stats_sample *cur)
+{
+    uint64_t elapsed = cur->time_usec - prev->time_usec;
+    char cpu[16], memory[16], reads[16], writes[16], pids[24], stall_cpu[16], stall_memory[16], stall_io[16];
+
+    format_rate(rate(prev->cpu_usage_usec, cur->cpu_usage_usec, elapsed) / 10000, "%", cpu, sizeof(cpu));
+    format_bytes(cur->memory_current, memory, sizeof(memory));
+    format_rate(rate(prev->io_rbytes, cur->io_rbytes, elapsed), NULL, reads, sizeof(reads));
+    format_rate(rate(prev->io_wbytes, cur->io_wbytes, elapsed), NULL, writes, sizeof(writes));
+    format_count(cur->pids_current, pids, sizeof(pids));
+    format_rate(rate(prev->cpu_some_usec, cur->cpu_some_usec, elapsed) / 10000, "%", stall_cpu,
+                sizeof(stall_cpu));
+    format_rate(rate(prev->memory_some_usec, cur->memory_some_usec, elapsed) / 10000, "%", stall_memory,
+                sizeof(stall_memory));
+    format_rate(rate(prev->io_some_usec, cur->io_some_usec, elapsed) / 10000, "%", stall_io, sizeof(stall_io));
+
+    printf("%-12s  %-7s  %-8s  %-8s  %-8s  %-6s  %s/%s/%s\n", cur->id, cpu, memory, reads, writes, pids,
+           stall_cpu, stall_memory, stall_io);
+}
+
+// The previous sample of each container we're watching, to take deltas
+struct watched
+{
+    struct stats_sample *samples;
+    size_t count;
+};
+
+static struct stats_sample *find_watched(struct watched *watched, const char *id)
+{
+    for (size_t i = 0; i < watched->count; i++)
+    {
+        if (strcmp(watched->samples[i].id, id) == 0)
+        {
+            return &watched->samples[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Handles one tick's samples, or the last sample of a container that exited
+static int show_samples(struct watched *watched, const struct stats_sample *samples, size_t n, int json)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        const struct stats_sample *s = &samples[i];
+        struct stats_sample *prev = find_watched(watched, s->id);
+
+        // an exited container's summary is always JSON, and the last we see of it
+        if (s->exited)
+        {
+            print_json(s);
+            if (prev != NULL)
+            {
+                *prev = watched->samples[--watched->count];
+            }
+            continue;
+        }
+
+        if (json)
+        {
+            print_json(s);
+        }
+        else if (prev != NULL)
+        {
+            print_delta(prev, s);
+        }
+
+        if (prev == NULL)
+        {
+            struct stats_sample *grown = realloc(watched->samples, (watched->count + 1) * sizeof(*grown));
+            if (grown == NULL)
+            {
+                return -1;
+            }
+            watched->samples = grown;
+            prev = &watched->samples[watched->count++];
+        }
+        *prev = *s;
+    }
+
+    return 0;
+}
+
+// Streams samples from the daemon every `interval_ms` until SIGINT or
+// SIGTERM, or until the daemon goes away, then prints the last sample of
+// every container still running as JSON
+static int watch_samples(int sock, int json)
+{
+    struct watched watched = {0};
+    sigset_t mask;
+    int ret = 0;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (signal_fd == -1)
+    {
+        return -1;
+    }
+
+    if (!json)
+    {
+        printf("%-12s  %-7s  %-8s  %-8s  %-8s  %-6s  %s\n", "ID", "CPU", "MEMORY", "READ/s", "WRITE/s", "PIDS",
+               "STALLED CPU/MEM/IO");
+    }
+
+    for (;;)
+    {
+        struct pollfd fds[2] = {
+            {.fd = sock, .events = POLLIN},
+            {.fd = signal_fd, .events = POLLIN},
+        };
+        uint32_t type;
+        char *payload;
+        size_t len;
+        int recv_fds[IPC_MAX_FDS];
+        int nfds;
+
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ret = -1;
+            break;
+        }
+
+        if (fds[1].revents != 0)
+        {
+            break;
+        }
+
+        if (ipc_recv(sock, &type, &payload, &len, recv_fds, &nfds) != 0)
+        {
+            LOG("[STATS] Daemon went away\n");
+            break;
+        }
+
+        if (type == IPC_ERROR)
+        {
+            fprintf(stderr, "%s\n", payload);
+            free(payload);
+            ret = -1;
+            break;
+        }
+
+        if (type == IPC_EVENT)
+        {
+            printf("%s\n", payload);
+        }
+        else if (type == IPC_SAMPLES)
+        {
+            ret = show_samples(&watched, (struct stats_sample *)payload, len / sizeof(struct stats_sample), json);
+        }
+        free(payload);
+        if (ret != 0)
+        {
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < watched.count; i++)
+    {
+        print_json(&watched.samples[i]);
+    }
+
+    free(watched.samples);
+    close(signal_fd);
+    return ret;
+}
+
+// Shows the resource usage of the daemon's containers, or of the one whose
+// ID starts with `id`. Without an interval, the totals so far. With one, what
+// they use every `interval_ms`, and a JSON summary of each as it exits.
+// i.e. mocker stats [--interval <ms>] [--json] [id]
+int stats_watch(const char *id, int interval_ms, int json)
+{
+    uint32_t type;
+    char *payload;
+    size_t len;
+    int fds[IPC_MAX_FDS];
+    int nfds;
+    char request[64];
+
+    int sock = ipc_connect(DAEMON_SOCKET);
+    if (sock == -1)
+    {
+        fprintf(stderr, "mocker daemon is not running (no %s)\n", DAEMON_SOCKET);
+        return -1;
+    }
+
+    // i.e. "500 3f2a"
+    snprintf(request, sizeof(request), "%d %s", interval_ms, id);
+    if (ipc_send(sock, interval_ms > 0 ? IPC_WATCH : IPC_STATS, interval_ms > 0 ? request : id,
+                 strlen(interval_ms > 0 ? request : id), NULL, 0) != 0)
+    {
+        fprintf(stderr, "Lost connection to mocker daemon\n");
+        close(sock);
+        return -1;
+    }
+
+    if (interval_ms > 0)
+    {
+        int ret = watch_samples(sock, json);
+        close(sock);
+        return ret;
+    }
+
+    if (ipc_recv(sock, &type, &payload, &len, fds, &nfds) != 0)
+    {
+        fprintf(stderr, "Lost connection to mocker daemon\n");
+        close(sock);
+        return -1;
+    }
+    close(sock);
+
+    if (type != IPC_SAMPLES)
+    {
+        fprintf(stderr, "%s\n", payload);
+        free(payload);
+        return -1;
+    }
+
+    const struct stats_sample *samples = (struct stats_sample *)payload;
+    size_t n = len / sizeof(*samples);
+    if (json)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            print_json(&samples[i]);
+        }
+    }
+    else
+    {
+        print_totals(samples, n);
+    }
+
+    free(payload);
+    return 0;
+}
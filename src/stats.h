@@ -0,0 +1,67 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include "common.h"
+
+#include <sys/resource.h>
+
+// The cgroup files a sample is read from. They stay open for as long as the
+// container runs, so a sample is one pread() per file.
+enum stats_file
+{
+    STATS_MEMORY_CURRENT,
+    STATS_MEMORY_STAT,
+    STATS_CPU_STAT,
+    STATS_IO_STAT,
+    STATS_PIDS_CURRENT,
+    STATS_CPU_PRESSURE,
+    STATS_MEMORY_PRESSURE,
+    STATS_IO_PRESSURE,
+    STATS_FILE_COUNT,
+};
+
+// A value whose file isn't there, i.e. its controller isn't enabled
+#define STATS_NONE UINT64_MAX
+
+// Shortest `mocker stats --interval`, in ms
+#define STATS_INTERVAL_MIN 10
+
+struct stats_files
+{
+    int fds[STATS_FILE_COUNT]; // -1 for files that aren't there
+};
+
+// One reading of a container's cgroup, as the daemon sends it to
+// `mocker stats`. Counters only ever go up, so rates are the difference
+// between two samples.
+struct stats_sample
+{
+    char id[16];
+    uint64_t time_usec;          // CLOCK_MONOTONIC
+    uint64_t memory_current;     // memory.current, in bytes
+    uint64_t memory_anon;        // memory.stat anon, in bytes
+    uint64_t memory_file;        // memory.stat file, i.e. page cache
+    uint64_t cpu_usage_usec;     // cpu.stat
+    uint64_t cpu_user_usec;      // cpu.stat
+    uint64_t cpu_system_usec;    // cpu.stat
+    uint64_t cpu_throttled_usec; // cpu.stat, time over the cpu.max quota
+    uint64_t io_rbytes;          // io.stat, over all devices
+    uint64_t io_wbytes;
+    uint64_t io_rios;
+    uint64_t io_wios;
+    uint64_t pids_current;       // pids.current
+    uint64_t cpu_some_usec;      // cpu.pressure, time some tasks stalled
+    uint64_t memory_some_usec;   // memory.pressure
+    uint64_t memory_full_usec;   // memory.pressure, time all tasks stalled
+    uint64_t io_some_usec;       // io.pressure
+    int32_t exited;              // the last sample, taken as the container exited
+    int32_t status;              // its wait status, once exited
+    struct rusage rusage;        // of its init, once exited
+};
+
+void stats_open(struct stats_files *files, int cgroup_fd);
+void stats_close(struct stats_files *files);
+void stats_sample(const struct stats_files *files, const char *id, struct stats_sample *sample);
+int stats_watch(const char *id, int interval_ms, int json);
+
+#endif
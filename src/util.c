@@ -1,6 +1,11 @@
+#define _GNU_SOURCE // for copy_file_range and strerrordesc_np
 #include "util.h"
 #include "common.h"
 
+#include <ftw.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
 void disable_buffering(void)
 {
     setbuf(stdout, NULL);
@@ -11,4 +16,149 @@ void handle_error(const char *msg)
 {
     perror(msg);
     exit(EXIT_FAILURE);
+}
+
+// handle_error() for the container's child before it execs. It was cloned
+// from a parent that may have other threads, and may hold a copy of a lock
+// one of them had, so it sticks to write() and _exit() rather than stdio and
+// exit(), and to the untranslated error text.
+void handle_child_error(const char *msg)
+{
+    const char *error = strerrordesc_np(errno);
+    struct iovec iov[] = {
+        {(void *)msg, strlen(msg)},
+        {": ", 2},
+        {(void *)error, error != NULL ? strlen(error) : 0},
+        {"\n", 1},
+    };
+
+    writev(STDERR_FILENO, iov, sizeof(iov) / sizeof(iov[0]));
+    _exit(EXIT_FAILURE);
+}
+
+// i.e. mkdir -p path
+int mkdir_p(const char *path, mode_t mode)
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+
+    for (char *p = tmp + 1; *p; p++)
+    {
+        if (*p == '/')
+        {
+            *p = '\0';
+            if (mkdir(tmp, mode) == -1 && errno != EEXIST)
+            {
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+
+    if (mkdir(tmp, mode) == -1 && errno != EEXIST)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path) == -1 && errno != ENOENT ? -1 : 0;
+}
+
+// i.e. rm -rf path (without following symlinks or crossing mounts)
+int rm_rf(const char *path)
+{
+    if (nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS | FTW_MOUNT) == -1 && errno != ENOENT)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+// i.e. cp src dst && chmod mode dst
+// The data is copied in the kernel, without a round trip through user space
+int copy_file(const char *src, const char *dst, mode_t mode)
+{
+    struct stat st;
+    int ret = -1;
+
+    int fd_src = open(src, O_RDONLY | O_CLOEXEC);
+    if (fd_src == -1)
+    {
+        return -1;
+    }
+
+    int fd_dst = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if (fd_dst == -1 || fstat(fd_src, &st) == -1)
+    {
+        goto out;
+    }
+
+    int in_kernel_copy = 1;
+    for (off_t left = st.st_size; left > 0;)
+    {
+        ssize_t copied = -1;
+        if (in_kernel_copy)
+        {
+            copied = copy_file_range(fd_src, NULL, fd_dst, NULL, left, 0);
+            // not supported between these two filesystems
+            if (copied == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            {
+                in_kernel_copy = 0;
+                continue;
+            }
+        }
+        else
+        {
+            copied = sendfile(fd_dst, fd_src, NULL, left);
+        }
+
+        if (copied <= 0)
+        {
+            goto out;
+        }
+        left -= copied;
+    }
+
+    ret = fchmod(fd_dst, mode);
+
+out:
+    close(fd_src);
+    if (fd_dst != -1)
+    {
+        close(fd_dst);
+    }
+    return ret;
+}
+
+// Sends a one byte message over a parent/child sync socket
+int sync_send(int fd, char msg)
+{
+    ssize_t ret;
+    do
+    {
+        ret = write(fd, &msg, 1);
+    } while (ret == -1 && errno == EINTR);
+
+    return ret == 1 ? 0 : -1;
+}
+
+// Blocks for a one byte message on a parent/child sync socket. Returns -1 on
+// EOF, i.e. when the other side exited, exec'd or gave up.
+int sync_recv(int fd, char *msg)
+{
+    ssize_t ret;
+    do
+    {
+        ret = read(fd, msg, 1);
+    } while (ret == -1 && errno == EINTR);
+
+    return ret == 1 ? 0 : -1;
 }
\ No newline at end of file
@@ -5,5 +5,11 @@
 
 void disable_buffering(void);
 void handle_error(const char *msg);
+void handle_child_error(const char *msg);
+int mkdir_p(const char *path, mode_t mode);
+int rm_rf(const char *path);
+int copy_file(const char *src, const char *dst, mode_t mode);
+int sync_send(int fd, char msg);
+int sync_recv(int fd, char *msg);
 
 #endif
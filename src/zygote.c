@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+#include "zygote.h"
+#include "container.h"
+#include "ipc.h"
+#include "logging.h"
+#include "util.h"
+#include "image/fsimage.h"
+#include "image/image.h"
+
+#include <sys/socket.h>
+
+// Set by SIGINT/SIGTERM, in the zygote and in its keepers
+static volatile sig_atomic_t stopping;
+
+static void on_stop(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+// No SA_RESTART, so blocking calls return EINTR and we notice `stopping`
+static void handle_stop_signals(void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+// A keeper parks one fully set up container, then competes with the other
+// keepers in accept() on the shared socket. The keeper that gets a connection
+// execs the client's command in its container, reports the wait status back
+// and exits, and the zygote starts a new keeper in its place.
+static void keeper(int listen_fd, const char *image)
+{
+    struct container_proc proc;
+    struct exec_request req;
+    int conn = -1;
+
+    if (container_start(&proc, image, NULL, NULL) != 0)
+    {
+        _exit(EXIT_FAILURE);
+    }
+    LOG("[ZYGOTE] Container %s is parked\n", proc.container.id);
+
+    while (conn == -1)
+    {
+        if (stopping)
+        {
+            container_stop(&proc);
+            _exit(EXIT_SUCCESS);
+        }
+
+        conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1)
+        {
+            continue;
+        }
+
+        if (ipc_recv_exec(conn, &req) != 0)
+        {
+            close(conn);
+            conn = -1;
+        }
+    }
+
+    // The container runs to completion even if we're asked to stop now
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stop_signals, NULL);
+
+    // The container was parked with our default limits
+    if (cgroup_check_limits(&req.limits) != 0)
+    {
+        const char *error = "Invalid limits";
+        ipc_send(conn, IPC_ERROR, error, strlen(error) + 1, NULL, 0);
+        container_stop(&proc);
+        _exit(EXIT_FAILURE);
+    }
+
+    if (cgroup_set_limits(&proc.container, &req.limits) != 0)
+    {
+        const char *error = "Failed to set the container's limits";
+        ipc_send(conn, IPC_ERROR, error, strlen(error) + 1, NULL, 0);
+        container_stop(&proc);
+        _exit(EXIT_FAILURE);
+    }
+
+    if (container_exec(&proc, req.argv, req.envp, req.fds) != 0)
+    {
+        container_stop(&proc);
+        _exit(EXIT_FAILURE);
+    }
+    exec_request_free(&req);
+
+    int status = container_wait_async(&proc);
+    if (status == -1)
+    {
+        const char *error = "Failed to wait for the container to exit";
+        ipc_send(conn, IPC_ERROR, error, strlen(error) + 1, NULL, 0);
+    }
+    else
+    {
+        ipc_send(conn, IPC_STATUS, &status, sizeof(status), NULL, 0);
+    }
+    close(conn);
+    _exit(EXIT_SUCCESS);
+}
+
+static pid_t start_keeper(int listen_fd, const char *image)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        keeper(listen_fd, image);
+    }
+    else if (pid == -1)
+    {
+        LOG("[ZYGOTE] Failed to fork keeper: %s\n", strerror(errno));
+    }
+
+    return pid;
+}
+
+// Whether any zygote for an image file or OCI image is running
+static int image_zygote_running(void)
+{
+    struct dirent *entry;
+    int found = 0;
+
+    DIR *dir = opendir(MOCKER_RUN_DIR);
+    if (dir == NULL)
+    {
+        return 0;
+    }
+
+    while (!found && (entry = readdir(dir)) != NULL)
+    {
+        found = strncmp(entry->d_name, "zygote-", 7) == 0;
+    }
+
+    closedir(dir);
+    return found;
+}
+
+// Every image gets a zygote of its own, listening on a socket named after
+// its manifest digest, or the key of its image file, so a new version of the
+// image never runs in containers parked for the old one
+static int zygote_socket(const char *image, char *path, size_t size)
+{
+    struct image_s resolved;
+    char key[64];
+
+    if (fsimage_type(image) != NULL)
+    {
+        if (fsimage_key(image, key, sizeof(key)) != 0)
+        {
+            return -1;
+        }
+
+        // i.e. zygote-<device>-<inode>-<mtime>.sock
+        snprintf(path, size, "%s/zygote-%s.sock", MOCKER_RUN_DIR, key);
+        return 0;
+    }
+
+    if (!image_is_layout(image))
+    {
+        snprintf(path, size, "%s", ZYGOTE_SOCKET);
+        return 0;
+    }
+
+    if (image_open(image, &resolved) != 0)
+    {
+        return -1;
+    }
+
+    // i.e. zygote-<first 12 characters of the hash>.sock
+    const char *hash = strchr(resolved.digest, ':') + 1;
+    snprintf(path, size, "%s/zygote-%.12s.sock", MOCKER_RUN_DIR, hash);
+    return 0;
+}
+
+// Keeps `size` containers of `image` parked until SIGINT or SIGTERM, and runs
+// the commands sent by `zygote_submit()` in them
+// i.e. mocker zygote <size> [image]
+int zygote_serve(int size, const char *image)
+{
+    char socket_path[PATH_MAX];
+
+    if (zygote_socket(image, socket_path, sizeof(socket_path)) != 0)
+    {
+        return -1;
+    }
+
+    int listen_fd = ipc_listen(socket_path);
+    if (listen_fd == -1)
+    {
+        return -1;
+    }
+
+    pid_t *keepers = calloc(size, sizeof(pid_t));
+    if (keepers == NULL)
+    {
+        handle_error("calloc");
+    }
+
+    handle_stop_signals();
+    for (int i = 0; i < size; i++)
+    {
+        keepers[i] = start_keeper(listen_fd, image);
+    }
+
+    LOG("[ZYGOTE] Listening on %s with %d parked containers\n", socket_path, size);
+    while (!stopping)
+    {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == -1)
+        {
+            if (errno == ECHILD)
+            {
+                break;
+            }
+            continue;
+        }
+
+        for (int i = 0; i < size; i++)
+        {
+            if (keepers[i] != pid)
+            {
+                continue;
+            }
+
+            // A keeper that couldn't set up its container will most likely
+            // fail again right away, so don't spin on it
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+            {
+                LOG("[ZYGOTE] Keeper %d failed\n", pid);
+                sleep(1);
+            }
+
+            keepers[i] = stopping ? -1 : start_keeper(listen_fd, image);
+        }
+    }
+
+    // Stop accepting, then have every keeper tear down its parked container.
+    // Keepers that are running a container wait for it to exit.
+    LOG("[ZYGOTE] Shutting down\n");
+    unlink(socket_path);
+    close(listen_fd);
+    for (int i = 0; i < size; i++)
+    {
+        if (keepers[i] > 0)
+        {
+            kill(keepers[i], SIGTERM);
+        }
+    }
+    while (wait(NULL) != -1 || errno == EINTR)
+    {
+    }
+
+    free(keepers);
+    return 0;
+}
+
+// Runs the command in a parked container of `image` and returns its wait
+// status. Returns -1 if no zygote is listening for the image, so the caller
+// can start a container itself.
+int zygote_submit(const char *image, const struct cgroup_limits *limits, char **cmd)
+{
+    char socket_path[PATH_MAX];
+
+    // Parked containers are in no tenant's group, and a cgroup can't move.
+    // Only the daemon watches pressure. Parked containers have their mounts
+    // and THP policy already, and weren't placed on CPUs.
+    if (limits->tenant[0] != '\0' || cgroup_watches_pressure(limits) || limits->hugetlb_max != CGROUP_UNSET ||
+        limits->thp != THP_SYSTEM || limits->place_cpus != CGROUP_UNSET)
+    {
+        return -1;
+    }
+
+    // Don't resolve the image just to find there's no zygote for it
+    if ((image_is_layout(image) || fsimage_type(image) != NULL) && !image_zygote_running())
+    {
+        return -1;
+    }
+
+    if (zygote_socket(image, socket_path, sizeof(socket_path)) != 0)
+    {
+        return -1;
+    }
+
+    int sock = ipc_connect(socket_path);
+    if (sock == -1)
+    {
+        return -1;
+    }
+
+    LOG("[ZYGOTE] Submitting %s to %s\n", cmd[0], socket_path);
+    int status = ipc_run(sock, NULL, limits, cmd);
+    close(sock);
+    return status;
+}
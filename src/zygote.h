@@ -0,0 +1,15 @@
+#ifndef _ZYGOTE_H_
+#define _ZYGOTE_H_
+
+#include "common.h"
+
+// Where `mocker zygote` listens for commands to run in the built-in busybox
+// root. Zygotes for OCI images listen on zygote-<digest>.sock next to it.
+#define ZYGOTE_SOCKET MOCKER_RUN_DIR "/zygote.sock"
+
+struct cgroup_limits;
+
+int zygote_serve(int size, const char *image);
+int zygote_submit(const char *image, const struct cgroup_limits *limits, char **cmd);
+
+#endif